@@ -1,14 +1,28 @@
 #include "MQTTOTA.h"
+#if MQTT_OTA_FULL_IMAGE
 #include <Update.h>
+#endif
 
-extern "C" {
-    #include "libb64/cdecode.h"
-    #include "libb64/cencode.h"
+#if MQTT_OTA_HEAP_HOOKS && defined(CONFIG_HEAP_USE_HOOKS)
+// Stage currently receiving allocations and the task it belongs to
+static OTAStageHeapStats* s_hookStage = nullptr;
+static TaskHandle_t s_hookTask = NULL;
+
+extern "C" IRAM_ATTR void esp_heap_trace_alloc_hook(void* ptr, size_t size, uint32_t caps) {
+    if (s_hookStage && ptr && xTaskGetCurrentTaskHandle() == s_hookTask) {
+        s_hookStage->allocCount++;
+        s_hookStage->allocBytes += size;
+    }
+}
+
+extern "C" IRAM_ATTR void esp_heap_trace_free_hook(void* ptr) {
 }
+#endif
 
+#if MQTT_OTA_JSON
 String MQTTOTA::base64Decode(const String& encoded) {
     if (ESP.getFreeHeap() < 35000) {
-        Serial.println("Memoria baja antes de decodificar Base64");
+        OTA_LOGLN("Memoria baja antes de decodificar Base64");
         yield();
     }
     
@@ -19,7 +33,7 @@ String MQTTOTA::base64Decode(const String& encoded) {
     int maxDecodedSize = (encodedLength * 3) / 4 + 2;
     
     if (maxDecodedSize > 50000) {
-        Serial.printf("ERROR: Chunk Base64 demasiado grande: %d bytes\n", maxDecodedSize);
+        OTA_LOGF("ERROR: Chunk Base64 demasiado grande: %d bytes\n", maxDecodedSize);
         return "";
     }
     
@@ -28,7 +42,7 @@ String MQTTOTA::base64Decode(const String& encoded) {
     
     char* buffer = (char*)malloc(maxDecodedSize);
     if (!buffer) {
-        Serial.println("ERROR: No se pudo asignar memoria para Base64");
+        OTA_LOGLN("ERROR: No se pudo asignar memoria para Base64");
         return "";
     }
     
@@ -37,38 +51,41 @@ String MQTTOTA::base64Decode(const String& encoded) {
     if (count > 0) {
         decoded = String(buffer, count);
     } else {
-        Serial.println("ERROR: Decodificación Base64 devolvió 0 bytes");
+        OTA_LOGLN("ERROR: Decodificación Base64 devolvió 0 bytes");
     }
     
     free(buffer);
     return decoded;
 } 
+#endif
 
 String MQTTOTA::base64Encode(const String& input) {
     if (input.isEmpty()) return "";
     
     String encoded;
-    const char* inputChars = input.c_str();
-    int inputLength = input.length();
-    
-    int encodedLength = (inputLength + 2) / 3 * 4 + 1;
-    char* buffer = (char*)malloc(encodedLength);
-    if (!buffer) return "";
-    
-    base64_encodestate state;
-    base64_init_encodestate(&state);
+    if (!encoded.reserve(otaBase64EncodedLength(input.length()))) return "";
     
-    int count = base64_encode_block(inputChars, inputLength, buffer, &state);
-    count += base64_encode_blockend(buffer + count, &state);
-    
-    encoded = String(buffer, count);
-    free(buffer);
+    // Encoded through a stack block straight into the result, without a heap
+    // buffer for the whole output; 192 bytes keep padding to the last block
+    const uint8_t* data = (const uint8_t*)input.c_str();
+    size_t length = input.length();
+    char block[257];
+    for (size_t offset = 0; offset < length; offset += 192) {
+        size_t count = otaBase64Encode(data + offset, min((size_t)192, length - offset), block);
+        encoded.concat(block, count);
+    }
     return encoded;
 }
 
+size_t MQTTOTA::base64Encode(const uint8_t* data, size_t length, char* out, size_t outSize) {
+    if (!out || outSize < otaBase64EncodedLength(length) + 1) return 0;
+    return otaBase64Encode(data, length, out);
+}
+
 // Constructor
 MQTTOTA::MQTTOTA() {
     _deviceID = _generateDeviceID();
+    _deviceHash = otaHash32(_deviceID.c_str());
     _otaContext.inProgress = false;
     _otaContext.currentPart = 0;
     _otaContext.totalParts = 0;
@@ -84,6 +101,23 @@ MQTTOTA::MQTTOTA() {
 MQTTOTA::~MQTTOTA() {
     cleanup();
     _cleanupChunkedOTA();
+
+    for (esp_pm_lock_handle_t& lock : _pmLocks) {
+        if (lock != NULL) {
+            esp_pm_lock_delete(lock);
+            lock = NULL;
+        }
+    }
+
+#if MQTT_OTA_STATISTICS
+    disableMetricsEndpoint();
+#endif
+    disableDataClient();
+    _freeEraseMap();
+    _clearPublishQueue();
+#if configUSE_TRACE_FACILITY
+    free(_taskStatus);
+#endif
 }
 
 // SDK Initialization
@@ -91,10 +125,14 @@ void MQTTOTA::begin(const String& deviceName, const String& firmwareVersion) {
     _deviceName = deviceName;
     _firmwareVersion = firmwareVersion;
 
-    Serial.println("MQTTOTA Inicializado");
-    Serial.printf("Dispositivo: %s\n", _deviceName.c_str());
-    Serial.printf("Versión: %s\n", _firmwareVersion.c_str());
-    Serial.printf("ID Dispositivo: %s\n", _deviceID.c_str());
+    OTA_LOGLN("MQTTOTA Inicializado");
+    OTA_LOGF("Dispositivo: %s\n", _deviceName.c_str());
+    OTA_LOGF("Versión: %s\n", _firmwareVersion.c_str());
+    OTA_LOGF("ID Dispositivo: %s\n", _deviceID.c_str());
+
+    _loadHistory();
+    _checkCrashTrace();
+    _promoteDataSlots();
 }
 
 // MQTT Configuration
@@ -107,7 +145,7 @@ void MQTTOTA::setMQTTConfig(
     _isMQTTConnected = isConnectedFunc;
     _otaTopic = otaTopic;
 
-    Serial.printf("MQTT Configurado - Tópico OTA: %s\n", _otaTopic.c_str());
+    OTA_LOGF("MQTT Configurado - Tópico OTA: %s\n", _otaTopic.c_str());
 }
 
 // Callback Configuration
@@ -129,50 +167,135 @@ void MQTTOTA::onStateChange(MQTTOTAStateCallback callback) {
 
 // Main Handling
 void MQTTOTA::handle() {
+    _drainPublishQueue();
+    _sampleWatchdog();
+#if MQTT_OTA_STATISTICS
+    _serveMetrics();
+#endif
+    _pollDataClient();
+
+    if (_historyPublished < _historyNext && !_sessionActive) {
+        _publishHistory();
+    }
+
+    if (_crashTracePending && millis() - _crashTraceTriedAt >= 1000) {
+        _publishCrashTrace();
+    }
+
+    if (_preEraseEnabled && !isUpdateInProgress()) {
+        _stepPreErase();
+    }
+
+#if MQTT_OTA_FULL_IMAGE
     // Check timeout
     if (_otaInProgress && (millis() - _otaStartTime > MQTT_OTA_TIMEOUT_MS)) {
-        _publishError("Timeout en actualización OTA", _currentFirmwareVersion);
+        _publishError("Timeout en actualización OTA", _currentFirmwareVersion, OTA_ERR_TIMEOUT);
         cleanup();
-        Serial.println("OTA Timeout - Actualización cancelada");
+        OTA_LOGLN("OTA Timeout - Actualización cancelada");
+    }
+#endif
+
+    if (_partRequestsEnabled && _otaContext.inProgress &&
+        millis() - _lastChunkTime > MQTT_OTA_REQUEST_INTERVAL_MS) {
+        _requestParts(_otaContext.firmwareVersion, _otaContext.currentPart + 1, OTA_REQUEST_STALL);
+    }
+
+    if (_gapReportsEnabled && _otaContext.inProgress) {
+        _reportGaps(_otaContext.firmwareVersion, false);
+    }
+
+    if (_admissionEnabled) {
+        _checkProbe();
     }
 
     if (_otaContext.inProgress && (millis() - _otaContext.startTime > MQTT_OTA_TIMEOUT_MS)) {
-        _publishError("Timeout en OTA por chunks", _otaContext.firmwareVersion);
+        _publishError("Timeout en OTA por chunks", _otaContext.firmwareVersion, OTA_ERR_TIMEOUT);
         _cleanupChunkedOTA();
-        Serial.println("OTA Chunks Timeout - Actualización cancelada");
+        OTA_LOGLN("OTA Chunks Timeout - Actualización cancelada");
     }
 }
 
 // MQTT Message Processing
 void MQTTOTA::processMessage(const String& topic, const String& message) {
+    _dispatchMessage(topic, (const uint8_t*)message.c_str(), message.length(), &message);
+}
+
+void MQTTOTA::processMessage(const String& topic, const uint8_t* payload, size_t length) {
+    _dispatchMessage(topic, payload, length, nullptr);
+}
+
+void MQTTOTA::_dispatchMessage(const String& topic, const uint8_t* payload, size_t length, const String* message) {
+    _messageReceivedAt = millis();
+    _messageReceivedMicros = micros();
+
+    if (!_diagnosticsTopic.isEmpty() && topic == _diagnosticsTopic) {
+        publishDiagnostics();
+        return;
+    }
+
+    if (!_probeTopic.isEmpty() && topic == _probeTopic) {
+        _probeReturned(payload, length);
+        return;
+    }
+
     if (topic != _otaTopic) return;
 
-    if (isUpdateInProgress()) {
-        Serial.println("OTA en progreso, ignorando nuevo mensaje");
+    // Chunks of the running session must keep flowing; only a full-image update blocks
+    if (_otaInProgress) {
+        OTA_LOGLN("OTA en progreso, ignorando nuevo mensaje");
         return;
     }
 
     if (ESP.getFreeHeap() < 30000) {
-        Serial.println("Memoria insuficiente para procesar OTA");
+        OTA_LOGLN("Memoria insuficiente para procesar OTA");
         return;
     }
 
-    Serial.println("Procesando mensaje OTA...");
+    OTA_LOGLN("Procesando mensaje OTA...");
+
+    if (length > 0 && payload[0] == OTA_CHUNK_MAGIC) {
+        if (_chunkedOTAEnabled) {
+            _processBinaryChunk(payload, length);
+        } else {
+            OTA_LOGLN("Chunk binario ignorado: OTA por chunks deshabilitada");
+        }
+        return;
+    }
+
+#if MQTT_OTA_JSON
+    String copy;
+    if (!message) {
+        copy = String((const char*)payload, length);
+        message = &copy;
+    }
 
     if (_chunkedOTAEnabled) {
-        _processOTAChunk(message);
+        _processOTAChunk(*message);
     } else {
-        _processOTAMessage(message);
-    }
+#if MQTT_OTA_FULL_IMAGE
+        _processOTAMessage(*message);
+#else
+        OTA_LOGLN("Mensaje ignorado: OTA de imagen completa no compilada");
+#endif
+    }
+#else
+    OTA_LOGLN("Mensaje ignorado: solo se aceptan chunks binarios");
+#endif
 }
 
+#if MQTT_OTA_FULL_IMAGE
 // Full OTA Processing
 void MQTTOTA::_processOTAMessage(const String& message) {
     DynamicJsonDocument doc(MQTT_OTA_JSON_SIZE);
     DeserializationError error = deserializeJson(doc, message);
 
     if (error) {
-        Serial.printf("Error parseando JSON: %s\n", error.c_str());
+        OTA_LOGF("Error parseando JSON: %s\n", error.c_str());
+        return;
+    }
+
+    if (doc["EventType"] == "GetDiagnostics") {
+        publishDiagnostics();
         return;
     }
 
@@ -181,7 +304,7 @@ void MQTTOTA::_processOTAMessage(const String& message) {
     }
 
     if (!doc.containsKey("Details")) {
-        Serial.println("No se encontraron Details en el mensaje");
+        OTA_LOGLN("No se encontraron Details en el mensaje");
         return;
     }
 
@@ -190,7 +313,7 @@ void MQTTOTA::_processOTAMessage(const String& message) {
     String base64Data = details["Base64"] | "";
 
     if (firmwareVersion.isEmpty() || base64Data.isEmpty()) {
-        Serial.println("Datos OTA incompletos");
+        OTA_LOGLN("Datos OTA incompletos");
         return;
     }
 
@@ -198,128 +321,258 @@ void MQTTOTA::_processOTAMessage(const String& message) {
         return;
     }
 
-    Serial.printf("Iniciando OTA - Versión: %s, Tamaño: %d bytes\n",
-                 firmwareVersion.c_str(), base64Data.length());
+    OTA_LOGF("Iniciando OTA - Versión: %s, Tamaño: %d bytes\n",
+            firmwareVersion.c_str(), base64Data.length());
 
     _otaInProgress = true;
     _otaStartTime = millis();
     _currentFirmwareVersion = firmwareVersion;
+    _beginSession(firmwareVersion);
 
     _publishProgress(10, firmwareVersion);
 
     if (performUpdate(base64Data, firmwareVersion)) {
         _publishSuccess(firmwareVersion);
-        Serial.println("OTA Completado - Reiniciando...");
-        delay(2000);
+        _finishSession(true);
+        OTA_LOGLN("OTA Completado - Reiniciando...");
+        _flushPublishQueue(2000);
         ESP.restart();
     } else {
-        _otaInProgress = false;
         cleanup();
     }
 }
+#endif
 
+#if MQTT_OTA_JSON
 // Chunked OTA Processing
 void MQTTOTA::_processOTAChunk(const String& message) {
-    DynamicJsonDocument doc(4096);
-    DeserializationError error = deserializeJson(doc, message);
+    OTAChunkData chunk;
+    bool diagnosticsRequest = false;
+    {
+        StageScope scope(this, OTA_STAGE_PARSE);
+        DynamicJsonDocument doc(4096);
+        DeserializationError error = deserializeJson(doc, message);
+
+        if (error) {
+            OTA_LOGF("Error parseando JSON OTA: %s\n", error.c_str());
+            return;
+        }
 
-    if (error) {
-        Serial.printf("Error parseando JSON OTA: %s\n", error.c_str());
+        diagnosticsRequest = doc["EventType"] == "GetDiagnostics";
+
+        if (!diagnosticsRequest && (!doc.containsKey("EventType") || doc["EventType"] != "UpdateFirmwareDevice")) {
+            return;
+        }
+
+        if (!diagnosticsRequest && !doc.containsKey("Details")) {
+            OTA_LOGLN("No se encontraron Details en el mensaje OTA");
+            return;
+        }
+
+        JsonObject details = doc["Details"];
+
+        chunk.firmwareVersion = details["FirmwareVersion"].as<String>();
+        chunk.base64Part = details["Base64Part"].as<String>();
+        chunk.z85Part = details["Z85Part"] | "";
+        chunk.encoding = details["Encoding"] | "";
+        chunk.partIndex = details["PartIndex"].as<int>();
+        chunk.totalParts = details["TotalParts"].as<int>();
+        chunk.isError = details["IsError"] | false;
+        chunk.errorMessage = details["ErrorMessage"] | "";
+        chunk.sentAt = details["SentAt"] | (uint64_t)0;
+        chunk.sequence = details["Seq"] | 0u;
+        chunk.device = details["Device"] | "";
+    }
+
+    if (diagnosticsRequest) {
+        publishDiagnostics();
         return;
     }
 
-    if (!doc.containsKey("EventType") || doc["EventType"] != "UpdateFirmwareDevice") {
+    _handleChunk(chunk);
+}
+#endif
+
+void MQTTOTA::_processBinaryChunk(const uint8_t* payload, size_t length) {
+    OTAChunkData chunk;
+    {
+        StageScope scope(this, OTA_STAGE_PARSE);
+        OTAChunkHeader header;
+        if (!otaChunkHeaderDecode(payload, length, header)) {
+            OTA_LOGLN("Chunk binario inválido");
+            return;
+        }
+
+        // Retransmission for another device
+        if (header.deviceHash != 0 && header.deviceHash != _deviceHash) {
+            return;
+        }
+
+        const uint8_t* version = payload + OTA_CHUNK_HEADER_SIZE;
+        chunk.firmwareVersion = String((const char*)version, header.versionLength);
+        chunk.partIndex = header.part;
+        chunk.totalParts = header.totalParts;
+        chunk.isError = false;
+        chunk.sentAt = header.sentAt;
+        chunk.sequence = header.sequence;
+        chunk.data = version + header.versionLength;
+        chunk.dataLength = payload + length - chunk.data;
+    }
+
+    _handleChunk(chunk);
+}
+
+// Everything after parsing, shared by JSON and binary chunks
+void MQTTOTA::_handleChunk(const OTAChunkData& chunk) {
+    if (!_acceptChunk(chunk)) {
         return;
     }
 
-    if (!doc.containsKey("Details")) {
-        Serial.println("No se encontraron Details en el mensaje OTA");
+    // Process chunk
+    UBaseType_t savedPriority = _throttleBegin();
+    bool processed = _processChunkData(chunk);
+    _throttleEnd(savedPriority);
+
+    if (!processed) {
+        _cleanupChunkedOTA();
         return;
     }
 
-    JsonObject details = doc["Details"];
-    OTAChunkData chunk;
+    _finishChunk(chunk);
+}
+
+// Checks a chunk before its data is written; false if it is dropped or ends the session
+bool MQTTOTA::_acceptChunk(const OTAChunkData& chunk) {
+    // Retransmission for another device
+    if (!chunk.device.isEmpty() && chunk.device != _deviceID) {
+        return false;
+    }
 
-    chunk.firmwareVersion = details["FirmwareVersion"].as<String>();
-    chunk.base64Part = details["Base64Part"].as<String>();
-    chunk.partIndex = details["PartIndex"].as<int>();
-    chunk.totalParts = details["TotalParts"].as<int>();
-    chunk.isError = details["IsError"] | false;
-    chunk.errorMessage = details["ErrorMessage"] | "";
+    _tracePart = chunk.partIndex;
 
     if (chunk.isError) {
-        Serial.printf("Error en chunk OTA: %s\n", chunk.errorMessage.c_str());
-        _publishError(chunk.errorMessage, chunk.firmwareVersion);
+        OTA_LOGF("Error en chunk OTA: %s\n", chunk.errorMessage.c_str());
+        _publishError(chunk.errorMessage, chunk.firmwareVersion, OTA_ERR_SERVER);
         _cleanupChunkedOTA();
-        return;
+        return false;
     }
 
-    if (chunk.base64Part.isEmpty() || chunk.firmwareVersion.isEmpty()) {
-        _publishError("Chunk OTA incompleto", chunk.firmwareVersion);
+    if ((chunk.base64Part.isEmpty() && chunk.z85Part.isEmpty() && chunk.dataLength == 0) ||
+        chunk.firmwareVersion.isEmpty()) {
+        _publishError("Chunk OTA incompleto", chunk.firmwareVersion, OTA_ERR_INVALID_DATA);
         _cleanupChunkedOTA();
-        return;
+        return false;
+    }
+
+    // A declared encoding must be one we decode and match the field the chunk carries
+    bool z85 = !chunk.z85Part.isEmpty();
+    if (!chunk.encoding.isEmpty()) {
+        String error;
+        if (chunk.encoding != OTA_ENCODING_BASE64 && chunk.encoding != OTA_ENCODING_Z85) {
+            error = "Codificación de chunk no soportada: " + chunk.encoding;
+        } else if (chunk.encoding != (z85 ? OTA_ENCODING_Z85 : OTA_ENCODING_BASE64)) {
+            error = "Codificación de chunk distinta a la declarada";
+        }
+        if (!error.isEmpty()) {
+            _publishError(error, chunk.firmwareVersion, OTA_ERR_INVALID_DATA);
+            _cleanupChunkedOTA();
+            return false;
+        }
     }
 
     // First chunk
     if (chunk.partIndex == 1) {
         if (_otaContext.inProgress) {
-            Serial.println("OTA en progreso, ignorando nuevo inicio");
-            return;
+            if (_gapReportsEnabled && _gapChunk(chunk)) {
+                return false;
+            }
+            OTA_LOGLN("OTA en progreso, ignorando nuevo inicio");
+            return false;
+        }
+
+        if (_admissionEnabled && !_admitSession(chunk)) {
+            return false;
         }
 
         if (!_startChunkedOTA(chunk)) {
-            return;
+            return false;
         }
     }
 
     // Verify sequence
     if (!_otaContext.inProgress || chunk.partIndex != _otaContext.currentPart + 1) {
-        Serial.printf("Chunk fuera de secuencia. Esperado: %d, Recibido: %d\n",
-                     _otaContext.currentPart + 1, chunk.partIndex);
-        _publishError("Chunk fuera de secuencia", chunk.firmwareVersion);
+        // Deferred or probing: the rest of the image is not wanted yet
+        if (!_otaContext.inProgress && _admissionEnabled && _admissionHolds(chunk.firmwareVersion)) {
+            return false;
+        }
+        if (_gapReportsEnabled && _gapChunk(chunk)) {
+            return false;
+        }
+        if (_partRequestsEnabled && _requestMissingParts(chunk)) {
+            return false;
+        }
+        OTA_LOGF("Chunk fuera de secuencia. Esperado: %d, Recibido: %d\n",
+                _otaContext.currentPart + 1, chunk.partIndex);
+        _publishError("Chunk fuera de secuencia", chunk.firmwareVersion, OTA_ERR_SEQUENCE);
         _cleanupChunkedOTA();
-        return;
+        return false;
     }
 
-    // Process chunk
-    if (!_processChunkData(chunk)) {
+    // JSON chunks keep the encoding part 1 declared; binary chunks carry raw bytes
+    if (!chunk.data && !chunk.streamed && z85 != _otaContext.z85) {
+        _publishError("Codificación de chunk distinta a la declarada", chunk.firmwareVersion, OTA_ERR_INVALID_DATA);
         _cleanupChunkedOTA();
-        return;
+        return false;
     }
 
+    return true;
+}
+
+// Receipt, progress and, after the last part, completion of a written chunk
+void MQTTOTA::_finishChunk(const OTAChunkData& chunk) {
     _otaContext.currentPart = chunk.partIndex;
+    _lastSequence = chunk.sequence;
+    _gapReportBackoff = 0;
+    _publishReceipt(chunk);
+
     int progress = (chunk.partIndex * 100) / chunk.totalParts;
     _currentProgress = progress;
 
     _publishProgress(progress, chunk.firmwareVersion);
-    Serial.printf("Chunk %d/%d procesado. Progreso: %d%%\n",
-                 chunk.partIndex, chunk.totalParts, progress);
+    OTA_LOGF("Chunk %d/%d procesado. Progreso: %d%%\n",
+            chunk.partIndex, chunk.totalParts, progress);
 
     // Last chunk
     if (chunk.partIndex == chunk.totalParts) {
         _completeChunkedOTA(chunk);
+    } else if (_heldCount > 0) {
+        _writeHeldChunks();
     }
 }
 
 // Start Chunked OTA
 bool MQTTOTA::_startChunkedOTA(const OTAChunkData& chunk) {
-    Serial.printf("Iniciando OTA por chunks. Versión: %s, Partes: %d\n",
-                 chunk.firmwareVersion.c_str(), chunk.totalParts);
+    OTA_LOGF("Iniciando OTA por chunks. Versión: %s, Partes: %d\n",
+            chunk.firmwareVersion.c_str(), chunk.totalParts);
 
     esp_err_t err;
     _otaContext.update_partition = esp_ota_get_next_update_partition(NULL);
     if (_otaContext.update_partition == NULL) {
-        _publishError("No se pudo encontrar partición OTA", chunk.firmwareVersion);
+        _publishError("No se pudo encontrar partición OTA", chunk.firmwareVersion, OTA_ERR_PARTITION);
         return false;
     }
 
+    _trace(OTA_TRACE_OTA_BEGIN);
     err = esp_ota_begin(_otaContext.update_partition, OTA_WITH_SEQUENTIAL_WRITES, &_otaContext.update_handle);
     if (err != ESP_OK) {
         String errorMsg = "Error iniciando OTA: ";
         errorMsg += esp_err_to_name(err);
-        _publishError(errorMsg, chunk.firmwareVersion);
+        _publishError(errorMsg, chunk.firmwareVersion, OTA_ERR_BEGIN, err);
         return false;
     }
+    _otaContext.direct = _takeEraseMap(_otaContext.update_partition);
+    _otaContext.written = 0;
+    _otaContext.preparedSectors = 0;
 
     _otaContext.inProgress = true;
     _otaContext.firmwareVersion = chunk.firmwareVersion;
@@ -327,106 +580,199 @@ bool MQTTOTA::_startChunkedOTA(const OTAChunkData& chunk) {
     _otaContext.totalParts = chunk.totalParts;
     _otaContext.startTime = millis();
     _otaContext.receivedSize = 0;
+    _otaContext.z85 = !chunk.z85Part.isEmpty();
+    _beginSession(chunk.firmwareVersion);
 
     _publishProgress(0, chunk.firmwareVersion);
-    Serial.println("OTA por chunks iniciada");
+    OTA_LOGLN("OTA por chunks iniciada");
     return true;
 }
 
 // Process Chunk Data
 bool MQTTOTA::_processChunkData(const OTAChunkData& chunk) {
     if (!_otaContext.inProgress || _otaContext.update_handle == 0) {
-        Serial.println("ERROR: OTA no iniciada o handle inválido");
-        _publishError("OTA no iniciada correctamente", chunk.firmwareVersion);
+        OTA_LOGLN("ERROR: OTA no iniciada o handle inválido");
+        _publishError("OTA no iniciada correctamente", chunk.firmwareVersion, OTA_ERR_BEGIN);
         return false;
     }
 
-    String decodedData = base64Decode(chunk.base64Part);
-    if (decodedData.length() == 0) {
-        _publishError("Error decodificando chunk Base64", chunk.firmwareVersion);
+#if MQTT_OTA_JSON
+    if (!chunk.z85Part.isEmpty() && !chunk.data) {
+        return _processZ85ChunkData(chunk);
+    }
+#endif
+
+    // Binary chunks carry the image bytes as they are
+    const uint8_t* data = chunk.data;
+    size_t dataLength = chunk.dataLength;
+#if MQTT_OTA_JSON
+    String decodedData;
+    if (!data) {
+        {
+            StageScope scope(this, OTA_STAGE_DECODE);
+            decodedData = base64Decode(chunk.base64Part);
+        }
+        if (decodedData.length() == 0) {
+            _publishError("Error decodificando chunk Base64", chunk.firmwareVersion, OTA_ERR_DECODE);
+            return false;
+        }
+        data = (const uint8_t*)decodedData.c_str();
+        dataLength = decodedData.length();
+    }
+#endif
+
+    if (!_writeChunkBytes(chunk, data, dataLength, chunk.partIndex == 1)) {
         return false;
     }
 
-    // Verify header in first chunk
-    if (chunk.partIndex == 1) {
-        if (!_processImageHeader((const uint8_t*)decodedData.c_str(), decodedData.length())) {
-            _publishError("Encabezado de imagen inválido en primer chunk", chunk.firmwareVersion);
+    _otaContext.receivedSize += dataLength;
+    _updateStatistics(dataLength);
+
+    OTA_LOGF("Chunk %d: %d bytes. Total: %d bytes\n",
+            chunk.partIndex, dataLength, _otaContext.receivedSize);
+
+    return true;
+}
+
+#if MQTT_OTA_JSON
+// Z85 chunks are decoded block by block on the stack and each block is
+// written as soon as it is decoded, with no heap buffer for the chunk
+bool MQTTOTA::_processZ85ChunkData(const OTAChunkData& chunk) {
+    static_assert(MQTT_OTA_Z85_BLOCK % 4 == 0 && MQTT_OTA_Z85_BLOCK >= OTA_IMAGE_MIN_HEADER,
+                  "MQTT_OTA_Z85_BLOCK must be a multiple of 4 and hold the image header");
+    const size_t blockChars = MQTT_OTA_Z85_BLOCK / 4 * 5;
+    const char* text = chunk.z85Part.c_str();
+    size_t length = chunk.z85Part.length();
+    uint8_t block[MQTT_OTA_Z85_BLOCK];
+    size_t written = 0;
+
+    for (size_t offset = 0; offset < length; offset += blockChars) {
+        size_t chars = length - offset < blockChars ? length - offset : blockChars;
+        bool decoded;
+        {
+            StageScope scope(this, OTA_STAGE_DECODE);
+            decoded = otaZ85Decode(text + offset, chars, block);
+        }
+        if (!decoded) {
+            _publishError("Error decodificando chunk Z85", chunk.firmwareVersion, OTA_ERR_DECODE);
+            return false;
+        }
+
+        size_t blockLength = otaZ85DecodedLength(chars);
+        if (!_writeChunkBytes(chunk, block, blockLength, chunk.partIndex == 1 && offset == 0)) {
+            return false;
+        }
+        written += blockLength;
+    }
+
+    _otaContext.receivedSize += written;
+    _updateStatistics(written);
+
+    OTA_LOGF("Chunk %d: %d bytes (Z85). Total: %d bytes\n",
+            chunk.partIndex, written, _otaContext.receivedSize);
+
+    return true;
+}
+#endif
+
+// Writes decoded image bytes; the first bytes of part 1 must hold the image header
+bool MQTTOTA::_writeChunkBytes(const OTAChunkData& chunk, const uint8_t* data, size_t length, bool first) {
+    if (first && length > 0 && data[0] == OTA_BUNDLE_MAGIC && !_beginBundle(chunk)) {
+        return false;
+    }
+    if (_bundle) {
+        return _writeBundleBytes(chunk, data, length);
+    }
+
+    if (first) {
+        if (!_processImageHeader(data, length)) {
+            _publishError("Encabezado de imagen inválido en primer chunk", chunk.firmwareVersion, OTA_ERR_HEADER);
             _cleanupChunkedOTA();
             return false;
         }
-        Serial.println("Encabezado de imagen verificado");
+        OTA_LOGLN("Encabezado de imagen verificado");
     }
 
-    esp_err_t err = esp_ota_write(_otaContext.update_handle,
-                                 (const void *)decodedData.c_str(),
-                                 decodedData.length());
+    esp_err_t err;
+    {
+        StageScope scope(this, OTA_STAGE_WRITE);
+        err = _writeApp(data, length);
+    }
 
     if (err != ESP_OK) {
         String errorMsg = "Error escribiendo chunk OTA: ";
         errorMsg += esp_err_to_name(err);
-        _publishError(errorMsg, chunk.firmwareVersion);
+        _publishError(errorMsg, chunk.firmwareVersion, OTA_ERR_WRITE, err);
         return false;
     }
-
-    _otaContext.receivedSize += decodedData.length();
-
-    Serial.printf("Chunk %d: %d bytes. Total: %d bytes\n",
-                 chunk.partIndex, decodedData.length(), _otaContext.receivedSize);
-
     return true;
 }
 
 // Complete Chunked OTA
 void MQTTOTA::_completeChunkedOTA(const OTAChunkData& chunk) {
-    Serial.println("Completando OTA por chunks...");
+    OTA_LOGLN("Completando OTA por chunks...");
+
+    if (_bundle) {
+        _completeBundle(chunk);
+        return;
+    }
 
     if (_otaContext.receivedSize < 1000) {
-        _publishError("Firmware demasiado pequeño", chunk.firmwareVersion);
+        _publishError("Firmware demasiado pequeño", chunk.firmwareVersion, OTA_ERR_TOO_SMALL);
         _cleanupChunkedOTA();
         return;
     }
 
     _publishProgress(90, chunk.firmwareVersion);
 
-    esp_err_t err = esp_ota_end(_otaContext.update_handle);
+    _trace(OTA_TRACE_OTA_END);
+    esp_err_t err = _endApp();
     if (err != ESP_OK) {
         String errorMsg = "Error finalizando OTA: ";
         errorMsg += esp_err_to_name(err);
         if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
             errorMsg += " - Validación de imagen falló";
         }
-        _publishError(errorMsg, chunk.firmwareVersion);
+        _publishError(errorMsg, chunk.firmwareVersion, OTA_ERR_END, err);
         _cleanupChunkedOTA();
         return;
     }
 
     _publishProgress(95, chunk.firmwareVersion);
 
+    _trace(OTA_TRACE_SET_BOOT);
     err = esp_ota_set_boot_partition(_otaContext.update_partition);
     if (err != ESP_OK) {
         String errorMsg = "Error estableciendo partición de arranque: ";
         errorMsg += esp_err_to_name(err);
-        _publishError(errorMsg, chunk.firmwareVersion);
+        _publishError(errorMsg, chunk.firmwareVersion, OTA_ERR_BOOT, err);
         _cleanupChunkedOTA();
         return;
     }
 
     _publishProgress(100, chunk.firmwareVersion);
-    Serial.println("OTA por chunks completada exitosamente!");
+    OTA_LOGLN("OTA por chunks completada exitosamente!");
 
     _publishSuccess(chunk.firmwareVersion);
+    _finishSession(true);
 
-    Serial.println("Reiniciando en 3 segundos...");
-    delay(3000);
+    OTA_LOGLN("Reiniciando en 3 segundos...");
+    _flushPublishQueue(3000);
     ESP.restart();
 }
 
 // Cleanup Chunked OTA
 void MQTTOTA::_cleanupChunkedOTA() {
+    if (_otaContext.inProgress) {
+        _finishSession(false);
+    }
+
     if (_otaContext.inProgress && _otaContext.update_handle != 0) {
         esp_ota_abort(_otaContext.update_handle);
-        Serial.println("OTA abortada y limpiada");
+        OTA_LOGLN("OTA abortada y limpiada");
     }
+    _returnEraseMap();
+    _dropHeldChunks();
 
     _otaContext.inProgress = false;
     _otaContext.currentPart = 0;
@@ -435,8 +781,12 @@ void MQTTOTA::_cleanupChunkedOTA() {
     _otaContext.startTime = 0;
     _otaContext.update_handle = 0;
     _otaContext.update_partition = NULL;
+    _otaContext.written = 0;
+    _otaContext.preparedSectors = 0;
+    _freeBundle();
 }
 
+#if MQTT_OTA_FULL_IMAGE
 // Execute Full OTA Update
 bool MQTTOTA::performUpdate(const String& base64Data, const String& firmwareVersion) {
     return _performOTAUpdateESPIDF(base64Data, firmwareVersion);
@@ -444,66 +794,95 @@ bool MQTTOTA::performUpdate(const String& base64Data, const String& firmwareVers
 
 // ESP-IDF OTA Implementation
 bool MQTTOTA::_performOTAUpdateESPIDF(const String& base64Data, const String& firmwareVersion) {
-    Serial.println("Iniciando actualización OTA con ESP-IDF...");
+    OTA_LOGLN("Iniciando actualización OTA con ESP-IDF...");
 
     if (ESP.getFreeHeap() < 50000) {
-        _publishError("Memoria insuficiente para OTA", firmwareVersion);
+        _publishError("Memoria insuficiente para OTA", firmwareVersion, OTA_ERR_NO_MEMORY);
         return false;
     }
 
-    String decodedData = base64Decode(base64Data);
-    if (decodedData.length() == 0) {
-        _publishError("Error decodificando Base64", firmwareVersion);
+    // Decoded on both cores while the first segments are already written
+    ParallelDecode decoder;
+    OTAErrorCode decodeError;
+    {
+        StageScope scope(this, OTA_STAGE_DECODE);
+        decodeError = decoder.start(base64Data);
+    }
+    if (decodeError == OTA_ERR_NO_MEMORY) {
+        _publishError("Memoria insuficiente para decodificar el firmware", firmwareVersion, OTA_ERR_NO_MEMORY);
+        return false;
+    }
+    if (decodeError != OTA_ERR_NONE) {
+        _publishError("Error decodificando Base64", firmwareVersion, OTA_ERR_DECODE);
         return false;
     }
 
-    Serial.printf("Firmware decodificado: %d bytes, Memoria libre: %d\n",
-                 decodedData.length(), ESP.getFreeHeap());
+    OTA_LOGF("Firmware: %d bytes en %d segmentos, Memoria libre: %d\n",
+            decoder.length(), decoder.segments(), ESP.getFreeHeap());
 
     esp_err_t err;
     const esp_partition_t* update_partition = esp_ota_get_next_update_partition(NULL);
     if (update_partition == NULL) {
-        _publishError("No se pudo encontrar partición OTA", firmwareVersion);
+        _publishError("No se pudo encontrar partición OTA", firmwareVersion, OTA_ERR_PARTITION);
         return false;
     }
 
     esp_ota_handle_t update_handle;
+    _trace(OTA_TRACE_OTA_BEGIN);
     err = esp_ota_begin(update_partition, OTA_WITH_SEQUENTIAL_WRITES, &update_handle);
     if (err != ESP_OK) {
         String errorMsg = "Error iniciando OTA: ";
         errorMsg += esp_err_to_name(err);
-        _publishError(errorMsg, firmwareVersion);
+        _publishError(errorMsg, firmwareVersion, OTA_ERR_BEGIN, err);
         return false;
     }
+    _takeEraseMap(NULL);
 
     _publishProgress(25, firmwareVersion);
 
-    size_t total_size = decodedData.length();
+    size_t total_size = decoder.length();
     size_t bytes_written = 0;
     size_t chunk_size = _chunkSize;
 
     for (size_t i = 0; i < total_size; i += chunk_size) {
         size_t current_chunk_size = min(chunk_size, total_size - i);
 
-        if (i == 0 && !_processImageHeader((const uint8_t*)decodedData.c_str(), current_chunk_size)) {
+        bool decoded;
+        {
+            StageScope scope(this, OTA_STAGE_DECODE);
+            decoded = decoder.waitFor(i + current_chunk_size);
+        }
+        if (!decoded) {
+            esp_ota_abort(update_handle);
+            _publishError("Error decodificando Base64", firmwareVersion, OTA_ERR_DECODE);
+            return false;
+        }
+
+        if (i == 0 && !_processImageHeader(decoder.data(), current_chunk_size)) {
             esp_ota_abort(update_handle);
-            _publishError("Encabezado de imagen inválido", firmwareVersion);
+            _publishError("Encabezado de imagen inválido", firmwareVersion, OTA_ERR_HEADER);
             return false;
         }
 
-        err = esp_ota_write(update_handle,
-                           (const void *)(decodedData.c_str() + i),
-                           current_chunk_size);
+        UBaseType_t savedPriority = _throttleBegin();
+        {
+            StageScope scope(this, OTA_STAGE_WRITE);
+            err = esp_ota_write(update_handle,
+                               (const void *)(decoder.data() + i),
+                               current_chunk_size);
+        }
+        _throttleEnd(savedPriority);
 
         if (err != ESP_OK) {
             esp_ota_abort(update_handle);
             String errorMsg = "Error escribiendo OTA: ";
             errorMsg += esp_err_to_name(err);
-            _publishError(errorMsg, firmwareVersion);
+            _publishError(errorMsg, firmwareVersion, OTA_ERR_WRITE, err);
             return false;
         }
 
         bytes_written += current_chunk_size;
+        _updateStatistics(current_chunk_size);
 
         int progress = 25 + (bytes_written * 50 / total_size);
         if (progress > 75) progress = 75;
@@ -512,29 +891,33 @@ bool MQTTOTA::_performOTAUpdateESPIDF(const String& base64Data, const String& fi
             _publishProgress(progress, firmwareVersion);
         }
 
-        Serial.printf("Escritos %d bytes de %d (%.1f%%)\n",
-                     bytes_written, total_size, (bytes_written * 100.0 / total_size));
+        OTA_LOGF("Escritos %d bytes de %d (%.1f%%)\n",
+                bytes_written, total_size, (bytes_written * 100.0 / total_size));
     }
 
     _publishProgress(75, firmwareVersion);
+    OTA_LOGF("Base64: %d de %d segmentos decodificados en el otro núcleo\n",
+            decoder.helperSegments(), decoder.segments());
 
+    _trace(OTA_TRACE_OTA_END);
     err = esp_ota_end(update_handle);
     if (err != ESP_OK) {
         String errorMsg = "Error finalizando OTA: ";
         errorMsg += esp_err_to_name(err);
-        _publishError(errorMsg, firmwareVersion);
+        _publishError(errorMsg, firmwareVersion, OTA_ERR_END, err);
         return false;
     }
 
+    _trace(OTA_TRACE_SET_BOOT);
     err = esp_ota_set_boot_partition(update_partition);
     if (err != ESP_OK) {
         String errorMsg = "Error estableciendo partición de arranque: ";
         errorMsg += esp_err_to_name(err);
-        _publishError(errorMsg, firmwareVersion);
+        _publishError(errorMsg, firmwareVersion, OTA_ERR_BOOT, err);
         return false;
     }
 
-    Serial.println("OTA completado exitosamente!");
+    OTA_LOGLN("OTA completado exitosamente!");
     _publishProgress(100, firmwareVersion);
 
     return true;
@@ -543,54 +926,74 @@ bool MQTTOTA::_performOTAUpdateESPIDF(const String& base64Data, const String& fi
 // Validate Firmware Data
 bool MQTTOTA::_validateFirmwareData(const String& base64Data) {
     if (base64Data.isEmpty()) {
-        _publishError("Datos de firmware vacíos");
+        _publishError("Datos de firmware vacíos", "", OTA_ERR_INVALID_DATA);
         return false;
     }
 
     if (base64Data.length() < 100) {
-        _publishError("Datos de firmware demasiado cortos");
+        _publishError("Datos de firmware demasiado cortos", "", OTA_ERR_INVALID_DATA);
         return false;
     }
 
     for (unsigned int i = 0; i < base64Data.length(); i++) {
         char c = base64Data.charAt(i);
         if (!isalnum(c) && c != '+' && c != '/' && c != '=' && c != '\n' && c != '\r') {
-            _publishError("Formato Base64 inválido");
+            _publishError("Formato Base64 inválido", "", OTA_ERR_INVALID_DATA);
             return false;
         }
     }
 
     return true;
 }
+#endif
 
 // Publish Errors
-void MQTTOTA::_publishError(const String& errorMessage, const String& firmwareVersion) {
+void MQTTOTA::_publishError(const String& errorMessage, const String& firmwareVersion,
+                            OTAErrorCode code, esp_err_t espError) {
+    _stats.lastError = errorMessage;
+    _stats.lastErrorCode = code;
+    _stats.lastEspError = espError;
+    _updateStatistics(0, true);
+
     if (_errorCallback) {
+        StageScope scope(this, OTA_STAGE_CALLBACK);
         _errorCallback(errorMessage, firmwareVersion.isEmpty() ? _firmwareVersion : firmwareVersion);
     }
 
-    if (_publishMQTT && _isMQTTConnected && _isMQTTConnected()) {
+    _publishTelemetry(OTA_TELEMETRY_ERROR, firmwareVersion.isEmpty() ? _firmwareVersion : firmwareVersion,
+                      _currentProgress, code, espError);
+
+#if MQTT_OTA_STATUS && MQTT_OTA_JSON
+    if (_jsonTelemetryEnabled() && _publishMQTT && _isMQTTConnected && _isMQTTConnected()) {
+        StageScope scope(this, OTA_STAGE_PUBLISH);
         DynamicJsonDocument doc(2048);
         doc["device"] = _deviceID;
         doc["version"] = firmwareVersion.isEmpty() ? _firmwareVersion : firmwareVersion;
         doc["error"] = errorMessage;
+        doc["code"] = static_cast<int>(code);
         doc["timestamp"] = millis();
 
         String output;
         serializeJson(doc, output);
-        _publishMQTT("ota/error", output);
+        _publishText("ota/error", output, OTA_PUBLISH_CRITICAL);
     }
+#endif
 
-    Serial.printf("Error OTA: %s\n", errorMessage.c_str());
+    OTA_LOGF("Error OTA: %s\n", errorMessage.c_str());
 }
 
 // Publish Success
 void MQTTOTA::_publishSuccess(const String& firmwareVersion) {
     if (_successCallback) {
+        StageScope scope(this, OTA_STAGE_CALLBACK);
         _successCallback(firmwareVersion);
     }
 
-    if (_publishMQTT && _isMQTTConnected && _isMQTTConnected()) {
+    _publishTelemetry(OTA_TELEMETRY_SUCCESS, firmwareVersion, 100);
+
+#if MQTT_OTA_STATUS && MQTT_OTA_JSON
+    if (_jsonTelemetryEnabled() && _publishMQTT && _isMQTTConnected && _isMQTTConnected()) {
+        StageScope scope(this, OTA_STAGE_PUBLISH);
         DynamicJsonDocument doc(2048);
         doc["device"] = _deviceID;
         doc["version"] = firmwareVersion;
@@ -599,10 +1002,11 @@ void MQTTOTA::_publishSuccess(const String& firmwareVersion) {
 
         String output;
         serializeJson(doc, output);
-        _publishMQTT("ota/success", output);
+        _publishText("ota/success", output, OTA_PUBLISH_CRITICAL);
     }
+#endif
 
-    Serial.printf("OTA Exitoso - Versión: %s\n", firmwareVersion.c_str());
+    OTA_LOGF("OTA Exitoso - Versión: %s\n", firmwareVersion.c_str());
 }
 
 // Publish Progress
@@ -610,10 +1014,18 @@ void MQTTOTA::_publishProgress(int progress, const String& firmwareVersion) {
     _currentProgress = progress;
 
     if (_progressCallback) {
+        StageScope scope(this, OTA_STAGE_CALLBACK);
         _progressCallback(progress, firmwareVersion);
     }
 
-    if (_publishMQTT && _isMQTTConnected && _isMQTTConnected() && (progress % 10 == 0 || progress == 100)) {
+    if (progress % 10 == 0 || progress == 100) {
+        _publishTelemetry(OTA_TELEMETRY_PROGRESS, firmwareVersion, progress);
+    }
+
+#if MQTT_OTA_STATUS && MQTT_OTA_JSON
+    if (_jsonTelemetryEnabled() && _publishMQTT && _isMQTTConnected && _isMQTTConnected() &&
+        (progress % 10 == 0 || progress == 100)) {
+        StageScope scope(this, OTA_STAGE_PUBLISH);
         DynamicJsonDocument doc(1024);
         doc["device"] = _deviceID;
         doc["version"] = firmwareVersion;
@@ -622,14 +1034,142 @@ void MQTTOTA::_publishProgress(int progress, const String& firmwareVersion) {
 
         String output;
         serializeJson(doc, output);
-        _publishMQTT("ota/progress", output);
+        _publishText("ota/progress", output, OTA_PUBLISH_STATUS, true);
+    }
+#endif
+
+    OTA_LOGF("Progreso OTA: %d%%\n", progress);
+}
+
+// Publish Binary Telemetry
+void MQTTOTA::_publishReceipt(const OTAChunkData& chunk) {
+#if MQTT_OTA_STATUS
+    if (!_receiptsEnabled || chunk.sentAt == 0 || !_isMQTTConnected || !_isMQTTConnected()) return;
+
+    OTAChunkReceipt receipt;
+    receipt.part = chunk.partIndex;
+    receipt.deviceHash = _deviceHash;
+    receipt.versionHash = otaHash32(chunk.firmwareVersion.c_str());
+    receipt.sequence = chunk.sequence;
+    receipt.sentAt = chunk.sentAt;
+    receipt.receivedAt = _messageReceivedAt;
+    receipt.serviceMicros = micros() - _messageReceivedMicros;
+
+    StageScope scope(this, OTA_STAGE_PUBLISH);
+
+    if ((_telemetryFormat & OTA_TELEMETRY_BINARY) && _publishBinary) {
+        uint8_t payload[OTA_RECEIPT_SIZE];
+        size_t length = otaReceiptEncode(receipt, payload);
+        _publishBytes(OTA_TOPIC_BIN_RECEIPT, payload, length, OTA_PUBLISH_STATUS);
+    }
+
+#if MQTT_OTA_JSON
+    if (_jsonTelemetryEnabled() && _publishMQTT) {
+        char output[192];
+        snprintf(output, sizeof(output),
+                 "{\"d\":\"%s\",\"v\":\"%s\",\"p\":%u,\"q\":%u,\"ts\":%llu,\"rx\":%u,\"svc\":%u}",
+                 _deviceID.c_str(), chunk.firmwareVersion.c_str(), (unsigned)receipt.part,
+                 (unsigned)receipt.sequence, (unsigned long long)receipt.sentAt,
+                 (unsigned)receipt.receivedAt, (unsigned)receipt.serviceMicros);
+        _publishText(OTA_TOPIC_RECEIPT, String(output), OTA_PUBLISH_STATUS);
+    }
+#endif
+#endif
+}
+
+// Out-of-order chunk with part requests enabled; false if it must abort as before
+bool MQTTOTA::_requestMissingParts(const OTAChunkData& chunk) {
+    if (!_otaContext.inProgress) {
+        // Joined mid-stream, e.g. after a reset; the running image needs nothing
+        if (chunk.firmwareVersion != _firmwareVersion) {
+            _requestParts(chunk.firmwareVersion, 1, OTA_REQUEST_JOIN);
+        }
+        return true;
+    }
+
+    if (chunk.firmwareVersion != _otaContext.firmwareVersion) {
+        return false;
     }
 
-    Serial.printf("Progreso OTA: %d%%\n", progress);
+    if (chunk.partIndex <= _otaContext.currentPart) {
+        OTA_LOGF("Chunk %d ya escrito, descartado\n", chunk.partIndex);
+        return true;
+    }
+
+    _requestParts(chunk.firmwareVersion, _otaContext.currentPart + 1, OTA_REQUEST_GAP);
+    return true;
+}
+
+void MQTTOTA::_requestParts(const String& firmwareVersion, int from, OTARequestReason reason) {
+    // One request per interval: the answer to the previous one may still be in flight
+    unsigned long now = millis();
+    if (_lastPartRequestFrom != 0 && now - _lastPartRequestAt < MQTT_OTA_REQUEST_INTERVAL_MS) return;
+    if (!_publishMQTT || !_isMQTTConnected || !_isMQTTConnected()) return;
+
+    _lastPartRequestAt = now;
+    _lastPartRequestFrom = from;
+
+    char output[160];
+    snprintf(output, sizeof(output),
+             "{\"device\":\"%s\",\"version\":\"%s\",\"from\":%d,\"count\":0,\"reason\":\"%s\"}",
+             _deviceID.c_str(), firmwareVersion.c_str(), from, otaRequestReasonName(reason));
+    _publishText(OTA_TOPIC_REQUEST, String(output), OTA_PUBLISH_CRITICAL);
+    OTA_LOGF("Solicitando partes desde %d (%s)\n", from, otaRequestReasonName(reason));
+}
+
+void MQTTOTA::_publishTelemetry(OTATelemetryType type, const String& firmwareVersion, uint8_t progress,
+                                OTAErrorCode code, esp_err_t espError) {
+#if MQTT_OTA_STATUS
+    if (!(_telemetryFormat & OTA_TELEMETRY_BINARY) || !_publishBinary ||
+        !_isMQTTConnected || !_isMQTTConnected()) {
+        return;
+    }
+
+    StageScope scope(this, OTA_STAGE_PUBLISH);
+
+    OTATelemetryRecord record;
+    record.type = type;
+    record.state = static_cast<uint8_t>(_otaContext.state);
+    record.deviceHash = _deviceHash;
+    record.versionHash = otaHash32(firmwareVersion.c_str());
+    record.progress = progress;
+    record.errorCode = code;
+    record.bytes = _stats.receivedBytes;
+    record.throughput = 0;
+    record.espError = espError;
+    record.timestamp = millis();
+
+    if (_sessionActive && _stats.startTime > 0) {
+        unsigned long elapsed = millis() - _stats.startTime;
+        if (elapsed > 0) {
+            record.throughput = (uint32_t)((_stats.receivedBytes * 1000ULL) / elapsed);
+        }
+    } else {
+        record.throughput = (uint32_t)_stats.averageSpeed;
+    }
+
+    uint8_t payload[OTA_TELEMETRY_SIZE];
+    size_t length = otaTelemetryEncode(record, payload);
+
+    const char* topic = OTA_TOPIC_BIN_PROGRESS;
+    switch (type) {
+        case OTA_TELEMETRY_STATE: topic = OTA_TOPIC_BIN_STATE; break;
+        case OTA_TELEMETRY_ERROR: topic = OTA_TOPIC_BIN_ERROR; break;
+        case OTA_TELEMETRY_SUCCESS: topic = OTA_TOPIC_BIN_SUCCESS; break;
+        default: break;
+    }
+    // Only progress is superseded by the next record
+    bool progressOnly = type == OTA_TELEMETRY_PROGRESS;
+    _publishBytes(topic, payload, length, progressOnly ? OTA_PUBLISH_STATUS : OTA_PUBLISH_CRITICAL, progressOnly);
+#endif
 }
 
 // Cleanup
 void MQTTOTA::cleanup() {
+    if (_otaInProgress) {
+        _finishSession(false);
+    }
+
     _otaInProgress = false;
     _currentProgress = 0;
     _otaStartTime = 0;
@@ -652,19 +1192,17 @@ void MQTTOTA::_printSHA256(const uint8_t *image_hash, const char *label) {
     for (int i = 0; i < MQTT_OTA_HASH_LEN; ++i) {
         sprintf(&hash_print[i * 2], "%02x", image_hash[i]);
     }
-    Serial.printf("%s: %s\n", label, hash_print);
+    OTA_LOGF("%s: %s\n", label, hash_print);
 }
 
 bool MQTTOTA::_processImageHeader(const uint8_t *data, size_t data_len) {
-    if (data_len < sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t)) {
-        Serial.println("Paquete recibido no tiene longitud suficiente para encabezado");
+    OTAImageInfo info;
+    if (otaCheckImageHeader(data, data_len, &info) == OTA_IMAGE_TOO_SHORT) {
+        OTA_LOGLN("Paquete recibido no tiene longitud suficiente para encabezado");
         return false;
     }
 
-    esp_app_desc_t new_app_info;
-    memcpy(&new_app_info, &data[sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t)], sizeof(esp_app_desc_t));
-
-    Serial.printf("Nueva versión de firmware: %s\n", new_app_info.version);
+    OTA_LOGF("Nueva versión de firmware: %s\n", info.version);
     return true;
 }
 
@@ -677,7 +1215,10 @@ OTAState MQTTOTA::getCurrentState() {
 }
 
 OTAStatistics MQTTOTA::getStatistics() {
-    return _stats;
+    OTAStatistics stats = _stats;
+    stats.modeThroughput[0] = _modeThroughput[0];
+    stats.modeThroughput[1] = _modeThroughput[1];
+    return stats;
 }
 /*
 size_t MQTTOTA::getFreeOTASpace() {
@@ -696,36 +1237,6 @@ size_t MQTTOTA::getFreeOTASpace() {
 }
 */
 
-void MQTTOTA::printDiagnostics() {
-    Serial.println("=== Diagnósticos MQTTOTA ===");
-    Serial.printf("ID Dispositivo: %s\n", _deviceID.c_str());
-    Serial.printf("Firmware: %s\n", _firmwareVersion.c_str());
-    Serial.printf("Memoria Libre: %d bytes\n", ESP.getFreeHeap());
-    Serial.printf("OTA en progreso: %s\n", isUpdateInProgress() ? "Sí" : "No");
-    Serial.printf("Progreso actual: %d%%\n", _currentProgress);
-    
-    const esp_partition_t* running = esp_ota_get_running_partition();
-    if (running) {
-        Serial.printf("Partición actual: %s (0x%08X)\n", 
-                     running->label, running->address);
-    }
-}
-
-String MQTTOTA::getBootPartitionInfo() {
-    const esp_partition_t* boot_partition = esp_ota_get_boot_partition();
-    if (!boot_partition) return "Desconocido";
-    
-    char buffer[256];
-    snprintf(buffer, sizeof(buffer), 
-             "Etiqueta: %s, Tipo: %d, Subtipo: %d, Dirección: 0x%08X, Tamaño: %d",
-             boot_partition->label,
-             boot_partition->type,
-             boot_partition->subtype,
-             boot_partition->address,
-             boot_partition->size);
-    return String(buffer);
-}
-
 size_t MQTTOTA::calculateBase64DecodedSize(const String& encoded) {
     size_t len = encoded.length();
     size_t padding = 0;
@@ -738,11 +1249,11 @@ size_t MQTTOTA::calculateBase64DecodedSize(const String& encoded) {
 
 void MQTTOTA::abortUpdate() {
     if (isUpdateInProgress()) {
-        _publishError("Actualización abortada por usuario", _currentFirmwareVersion);
+        _publishError("Actualización abortada por usuario", _currentFirmwareVersion, OTA_ERR_ABORTED);
         _cleanupChunkedOTA();
         cleanup();
         _setState(OTA_STATE_ABORTED);
-        Serial.println("Actualización OTA abortada");
+        OTA_LOGLN("Actualización OTA abortada");
     }
 }
 
@@ -751,8 +1262,8 @@ bool MQTTOTA::checkMemory(size_t requiredBytes) {
     bool hasEnoughMemory = (freeHeap >= requiredBytes + MQTT_OTA_MIN_MEMORY);
     
     if (!hasEnoughMemory) {
-        Serial.printf("Memoria insuficiente: %d bytes disponibles, %d bytes requeridos\n",
-                     freeHeap, requiredBytes + MQTT_OTA_MIN_MEMORY);
+        OTA_LOGF("Memoria insuficiente: %d bytes disponibles, %d bytes requeridos\n",
+                freeHeap, requiredBytes + MQTT_OTA_MIN_MEMORY);
     }
     
     return hasEnoughMemory;
@@ -762,20 +1273,22 @@ size_t MQTTOTA::getFreeHeap() {
     return ESP.getFreeHeap();
 }
 
+#if MQTT_OTA_LOG
 void MQTTOTA::logMemoryStatus() {
-    Serial.printf("Estado de Memoria - Libre: %d, Mínimo Libre: %d, Máximo Asignable: %d\n",
-                 ESP.getFreeHeap(),
-                 ESP.getMinFreeHeap(),
-                 ESP.getMaxAllocHeap());
+    OTA_LOGF("Estado de Memoria - Libre: %d, Mínimo Libre: %d, Máximo Asignable: %d\n",
+            ESP.getFreeHeap(),
+            ESP.getMinFreeHeap(),
+            ESP.getMaxAllocHeap());
 }
+#endif
 
 bool MQTTOTA::verifyFirmwareSignature(const String& signature) {
     if (signature.isEmpty()) {
-        Serial.println("Advertencia: No se proporcionó firma para verificación");
+        OTA_LOGLN("Advertencia: No se proporcionó firma para verificación");
         return true; // Permitir sin firma si no se requiere
     }
     
-    Serial.printf("Verificación de firma solicitada: %s\n", signature.c_str());
+    OTA_LOGF("Verificación de firma solicitada: %s\n", signature.c_str());
     return true;
 }
 
@@ -795,31 +1308,37 @@ bool MQTTOTA::checkFirmwareCompatibility(const String& newVersion) {
 bool MQTTOTA::_validateChecksum(const String& data, const String& checksum) {
     if (checksum.isEmpty()) return true;
     
-    Serial.printf("Validación de checksum: Longitud datos=%d, Checksum=%s\n",
-                 data.length(), checksum.c_str());
+    OTA_LOGF("Validación de checksum: Longitud datos=%d, Checksum=%s\n",
+            data.length(), checksum.c_str());
     return true;
 }
 
 void MQTTOTA::_handleChunkError(const OTAChunkData& chunk, const String& error) {
-    Serial.printf("Error en chunk %d: %s\n", chunk.partIndex, error.c_str());
+    OTA_LOGF("Error en chunk %d: %s\n", chunk.partIndex, error.c_str());
     
     _otaContext.retryCount++;
+    _stats.retries++;
     if (_otaContext.retryCount <= _otaContext.maxRetries) {
-        Serial.printf("Reintentando chunk %d (intento %d/%d)\n",
-                     chunk.partIndex, _otaContext.retryCount, _otaContext.maxRetries);
+        OTA_LOGF("Reintentando chunk %d (intento %d/%d)\n",
+                chunk.partIndex, _otaContext.retryCount, _otaContext.maxRetries);
       
     } else {
-        _publishError("Máximo de reintentos excedido para chunk: " + error, chunk.firmwareVersion);
+        _publishError("Máximo de reintentos excedido para chunk: " + error, chunk.firmwareVersion, OTA_ERR_RETRIES);
         _cleanupChunkedOTA();
     }
 }
 
 void MQTTOTA::_publishStateChange(OTAState state) {
     if (_stateChangeCallback) {
+        StageScope scope(this, OTA_STAGE_CALLBACK);
         _stateChangeCallback(static_cast<uint8_t>(state));
     }
+
+    _publishTelemetry(OTA_TELEMETRY_STATE, _sessionActive ? _sessionVersion : _firmwareVersion, _currentProgress);
     
-    if (_publishMQTT && _isMQTTConnected && _isMQTTConnected()) {
+#if MQTT_OTA_STATUS && MQTT_OTA_JSON
+    if (_jsonTelemetryEnabled() && _publishMQTT && _isMQTTConnected && _isMQTTConnected()) {
+        StageScope scope(this, OTA_STAGE_PUBLISH);
         DynamicJsonDocument doc(512);
         doc["device"] = _deviceID;
         doc["state"] = static_cast<uint8_t>(state);
@@ -828,10 +1347,11 @@ void MQTTOTA::_publishStateChange(OTAState state) {
         
         String output;
         serializeJson(doc, output);
-        _publishMQTT("ota/state", output);
+        _publishText("ota/state", output, OTA_PUBLISH_CRITICAL);
     }
+#endif
     
-    Serial.printf("Estado OTA cambiado a: %s\n", _getStateName(state).c_str());
+    OTA_LOGF("Estado OTA cambiado a: %s\n", _getStateName(state).c_str());
 }
 
 String MQTTOTA::_calculateSHA256(const uint8_t* data, size_t length) {
@@ -851,9 +1371,21 @@ void MQTTOTA::_updateStatistics(size_t bytesReceived, bool isError) {
     }
     
     if (bytesReceived > 0) {
+        _lifetimeBytes += bytesReceived;
         _stats.totalBytes += bytesReceived;
         _stats.receivedBytes += bytesReceived;
         _stats.chunkCount++;
+
+        unsigned long now = millis();
+        unsigned long spent = _lastChunkTime ? now - _lastChunkTime : 0;
+        _lastChunkTime = now;
+        if (_throttleLevel > 0) {
+            _stats.throttledBytes += bytesReceived;
+            _stats.throttledTime += spent;
+        } else {
+            _stats.unthrottledBytes += bytesReceived;
+            _stats.unthrottledTime += spent;
+        }
         
         if (_stats.startTime > 0) {
             unsigned long elapsed = millis() - _stats.startTime;
@@ -870,6 +1402,506 @@ void MQTTOTA::_updateStatistics(size_t bytesReceived, bool isError) {
     _stats.lastState = _otaContext.state;
 }
 
+// Session Statistics
+void MQTTOTA::_beginSession(const String& firmwareVersion) {
+    _stats = OTAStatistics();
+    _stats.startTime = millis();
+    _sessionVersion = firmwareVersion;
+    _sessionActive = true;
+    _sessionsStarted++;
+    _tracePart = 0;
+    _traceBegin();
+
+    _lastChunkTime = _stats.startTime;
+    _throttleLevel = 0;
+    _starvedStreak = 0;
+    _healthyStreak = 0;
+
+    _acquirePerformanceMode();
+    _stats.cpuFreqMHz = ESP.getCpuFreqMHz();
+}
+
+void MQTTOTA::_finishSession(bool success) {
+    if (!_sessionActive) return;
+    _sessionActive = false;
+    _traceEnd();
+
+    _stats.endTime = millis();
+    unsigned long elapsed = _stats.endTime - _stats.startTime;
+    if (elapsed > 0) {
+        _stats.averageSpeed = (_stats.receivedBytes * 1000.0) / elapsed;
+    }
+    _stats.lastState = success ? OTA_STATE_SUCCESS : OTA_STATE_ERROR;
+    _throttleLevel = 0;
+    if (success) {
+        _sessionsSucceeded++;
+        OTAModeThroughput& mode = _modeThroughput[_stats.performanceMode ? 1 : 0];
+        mode.sessions++;
+        mode.bytes += _stats.receivedBytes;
+        mode.timeMs += elapsed;
+    } else {
+        _sessionsFailed++;
+    }
+    _releasePerformanceMode();
+    _appendHistory(success);
+
+    OTA_LOGF("Sesión OTA finalizada: %u bytes en %lu ms, heap mínimo: %u bytes\n",
+            _stats.receivedBytes, elapsed,
+            _stats.freeHeapLow == SIZE_MAX ? 0 : _stats.freeHeapLow);
+
+    // What the session would have taken erasing the pre-erased sectors itself
+    if (_stats.preErasedSectors > 0) {
+        _stats.eraseSaved = (uint64_t)_stats.preErasedSectors * _eraseStats.sectorEraseMicros / 1000;
+        OTA_LOGF("Pre-borrado: %u sectores sin borrar, %lu ms con pre-borrado, ~%lu ms sin él\n",
+                _stats.preErasedSectors, elapsed, elapsed + _stats.eraseSaved);
+    }
+
+#if MQTT_OTA_STATISTICS && MQTT_OTA_JSON
+    _publishStatistics();
+#endif
+}
+
+#if MQTT_OTA_STATISTICS && MQTT_OTA_JSON
+void MQTTOTA::_publishStatistics() {
+    if (!_publishMQTT || !_isMQTTConnected || !_isMQTTConnected()) return;
+
+    // Untouched low-water marks are reported as 0
+    auto lowMark = [](size_t value) -> size_t { return value == SIZE_MAX ? 0 : value; };
+
+    DynamicJsonDocument doc(2048);
+    doc["device"] = _deviceID;
+    doc["version"] = _sessionVersion;
+    doc["success"] = _stats.lastState == OTA_STATE_SUCCESS;
+    doc["duration"] = _stats.endTime - _stats.startTime;
+    doc["bytes"] = _stats.receivedBytes;
+    doc["chunks"] = _stats.chunkCount;
+    doc["errors"] = _stats.errorCount;
+    doc["speed"] = _stats.averageSpeed;
+    doc["heap_low"] = lowMark(_stats.freeHeapLow);
+    doc["largest_block_low"] = lowMark(_stats.largestFreeBlockLow);
+
+    JsonObject heap = doc.createNestedObject("heap");
+    for (int i = 0; i < OTA_STAGE_COUNT; i++) {
+        const OTAStageHeapStats& stage = _stats.heapStages[i];
+        JsonObject entry = heap.createNestedObject(_getStageName(static_cast<OTAStage>(i)));
+        entry["runs"] = stage.runs;
+        entry["allocs"] = stage.allocCount;
+        entry["bytes"] = stage.allocBytes;
+        entry["peak"] = stage.peakBytes;
+        entry["peak_psram"] = stage.peakSpiramBytes;
+        entry["largest_block_low"] = lowMark(stage.largestFreeBlockLow);
+        entry["p99_us"] = latencyPercentile(_stats.stageLatency[i], 99.0f);
+    }
+
+    JsonObject perf = doc.createNestedObject("perf");
+    perf["enabled"] = _stats.performanceMode;
+    perf["pm_locks"] = _stats.pmLocksHeld;
+    perf["ps_none"] = _stats.powerSaveDisabled;
+    perf["cpu_mhz"] = _stats.cpuFreqMHz;
+
+    // Since boot, so boards can be compared without collecting every session
+    static const char* modeKeys[2] = { "without", "with" };
+    for (int i = 0; i < 2; i++) {
+        const OTAModeThroughput& mode = _modeThroughput[i];
+        JsonObject total = perf.createNestedObject(modeKeys[i]);
+        total["sessions"] = mode.sessions;
+        total["bytes"] = mode.bytes;
+        total["ms"] = mode.timeMs;
+        total["speed"] = mode.timeMs ? (mode.bytes * 1000.0) / mode.timeMs : 0.0;
+    }
+
+    if (_watchdogEnabled) {
+        JsonObject watchdog = doc.createNestedObject("watchdog");
+        watchdog["samples"] = _stats.watchdogSamples;
+        watchdog["starved"] = _stats.starvedSamples;
+        watchdog["escalations"] = _stats.throttleEscalations;
+        watchdog["relaxations"] = _stats.throttleRelaxations;
+        watchdog["max_level"] = _stats.throttleLevelMax;
+        watchdog["stack_low"] = lowMark(_stats.watchedStackLow);
+        watchdog["throttled_speed"] = _stats.throttledTime ? (_stats.throttledBytes * 1000.0) / _stats.throttledTime : 0.0;
+        watchdog["full_speed"] = _stats.unthrottledTime ? (_stats.unthrottledBytes * 1000.0) / _stats.unthrottledTime : 0.0;
+    }
+
+    if (_stats.preErasedSectors > 0 || _stats.erasedSectors > 0) {
+        JsonObject erase = doc.createNestedObject("erase");
+        erase["pre_erased"] = _stats.preErasedSectors;
+        erase["erased"] = _stats.erasedSectors;
+        erase["erase_ms"] = _stats.eraseTime;
+        erase["saved_ms"] = _stats.eraseSaved;
+        erase["duration_without"] = _stats.endTime - _stats.startTime + _stats.eraseSaved;
+    }
+
+    if (_gapReportsEnabled) {
+        JsonObject gaps = doc.createNestedObject("gaps");
+        gaps["reports"] = _stats.gapReports;
+        gaps["held"] = _stats.heldParts;
+        gaps["unheld"] = _stats.unheldParts;
+        gaps["duplicates"] = _stats.duplicateParts;
+    }
+    doc["timestamp"] = millis();
+
+    String output;
+    serializeJson(doc, output);
+    _publishText("ota/stats", output, OTA_PUBLISH_STATUS);
+}
+#endif
+
+// Resource Watchdog
+bool MQTTOTA::watchTask(TaskHandle_t task, size_t minStackBytes) {
+    if (task == NULL) return false;
+
+    WatchedTask* freeSlot = nullptr;
+    for (WatchedTask& watched : _watchedTasks) {
+        if (watched.handle == task) {
+            watched.minStackBytes = minStackBytes;
+            return true;
+        }
+        if (!freeSlot && watched.handle == NULL) {
+            freeSlot = &watched;
+        }
+    }
+
+    if (!freeSlot) {
+        OTA_LOGLN("Watchdog de recursos: lista de tareas llena");
+        return false;
+    }
+
+    *freeSlot = WatchedTask();
+    freeSlot->handle = task;
+    freeSlot->minStackBytes = minStackBytes;
+    freeSlot->priority = uxTaskPriorityGet(task);
+    strlcpy(freeSlot->name, pcTaskGetName(task), sizeof(freeSlot->name));
+    return true;
+}
+
+void MQTTOTA::unwatchTask(TaskHandle_t task) {
+    for (WatchedTask& watched : _watchedTasks) {
+        if (watched.handle == task) {
+            watched = WatchedTask();
+        }
+    }
+}
+
+void MQTTOTA::_sampleWatchdog() {
+    if (!_watchdogEnabled || !_sessionActive) return;
+
+    unsigned long now = millis();
+    if (now - _lastWatchdogSample < MQTT_OTA_WATCHDOG_INTERVAL_MS) return;
+    _lastWatchdogSample = now;
+
+    // With run-time stats a task that is ready and has not run since the last
+    // sample is starving; without them it has to be seen ready twice in a row
+#if configGENERATE_RUN_TIME_STATS
+    const uint8_t starvedAfter = 1;
+#else
+    const uint8_t starvedAfter = 2;
+#endif
+
+#if configUSE_TRACE_FACILITY
+    // One snapshot of all tasks; the stored handles are only compared with it,
+    // so a task deleted while watched is never dereferenced
+    UBaseType_t slots = uxTaskGetNumberOfTasks() + 2;
+    if (slots > _taskStatusSlots) {
+        TaskStatus_t* grown = (TaskStatus_t*)realloc(_taskStatus, slots * sizeof(TaskStatus_t));
+        if (!grown) return;
+        _taskStatus = grown;
+        _taskStatusSlots = slots;
+    }
+    UBaseType_t taskCount = uxTaskGetSystemState(_taskStatus, _taskStatusSlots, NULL);
+    if (taskCount == 0) return;
+#endif
+
+    bool starved = false;
+    for (WatchedTask& watched : _watchedTasks) {
+        if (watched.handle == NULL) continue;
+
+        eTaskState state = eDeleted;
+        uint32_t runTime = 0;
+        size_t stackFree = 0;
+#if configUSE_TRACE_FACILITY
+        for (UBaseType_t i = 0; i < taskCount; i++) {
+            const TaskStatus_t& status = _taskStatus[i];
+            if (status.xHandle != watched.handle) continue;
+            state = status.eCurrentState;
+            stackFree = status.usStackHighWaterMark;
+            watched.priority = status.uxCurrentPriority;
+#if configGENERATE_RUN_TIME_STATS
+            runTime = status.ulRunTimeCounter;
+#endif
+            break;
+        }
+#else
+        // Without the trace facility the handle is looked up by name first
+        if (xTaskGetHandle(watched.name) == watched.handle) {
+            state = eTaskGetState(watched.handle);
+            stackFree = uxTaskGetStackHighWaterMark(watched.handle);
+            watched.priority = uxTaskPriorityGet(watched.handle);
+#if configGENERATE_RUN_TIME_STATS
+            runTime = ulTaskGetRunTimeCounter(watched.handle);
+#endif
+        }
+#endif
+        if (state == eDeleted || state == eInvalid) {
+            OTA_LOGF("Watchdog de recursos: tarea '%s' eliminada, deja de vigilarse\n", watched.name);
+            watched = WatchedTask();
+            continue;
+        }
+
+        bool ran = false;
+#if configGENERATE_RUN_TIME_STATS
+        ran = (runTime != watched.lastRunTime);
+        watched.lastRunTime = runTime;
+#endif
+        if (state == eReady && !ran) {
+            watched.readyStreak++;
+        } else {
+            watched.readyStreak = 0;
+        }
+        if (watched.readyStreak >= starvedAfter) {
+            starved = true;
+        }
+
+        // ESP-IDF reports the high-water mark in bytes
+        _stats.watchedStackLow = min(_stats.watchedStackLow, stackFree);
+        if (stackFree < watched.minStackBytes && !watched.stackWarned) {
+            watched.stackWarned = true;
+            OTA_LOGF("Watchdog de recursos: pila baja en '%s' (%u bytes libres)\n",
+                    watched.name, stackFree);
+        }
+    }
+
+    _stats.watchdogSamples++;
+    if (starved) {
+        _stats.starvedSamples++;
+        _healthyStreak = 0;
+        if (++_starvedStreak >= 2 && _throttleLevel < MQTT_OTA_THROTTLE_MAX_LEVEL) {
+            _throttleLevel++;
+            _starvedStreak = 0;
+            _stats.throttleEscalations++;
+            _stats.throttleLevelMax = max(_stats.throttleLevelMax, _throttleLevel);
+            OTA_LOGF("Watchdog de recursos: tareas sin CPU, regulación OTA nivel %d\n", _throttleLevel);
+        }
+    } else {
+        _starvedStreak = 0;
+        if (_throttleLevel > 0 && ++_healthyStreak >= 20) {
+            _throttleLevel--;
+            _healthyStreak = 0;
+            _stats.throttleRelaxations++;
+            OTA_LOGF("Watchdog de recursos: regulación OTA reducida a nivel %d\n", _throttleLevel);
+        }
+    }
+}
+
+UBaseType_t MQTTOTA::_throttleBegin() {
+    _sampleWatchdog();
+
+    UBaseType_t current = uxTaskPriorityGet(NULL);
+    if (_throttleLevel < 2) return current;
+
+    // Level 2 shares time slices with the lowest watched task, level 3 yields to it
+    UBaseType_t target = current;
+    for (const WatchedTask& watched : _watchedTasks) {
+        if (watched.handle != NULL) {
+            target = min(target, watched.priority);
+        }
+    }
+    if (_throttleLevel >= 3 && target > 1) {
+        target--;
+    }
+    if (target < 1) {
+        target = 1;
+    }
+
+    if (target < current) {
+        vTaskPrioritySet(NULL, target);
+    }
+    return current;
+}
+
+void MQTTOTA::_throttleEnd(UBaseType_t savedPriority) {
+    if (uxTaskPriorityGet(NULL) != savedPriority) {
+        vTaskPrioritySet(NULL, savedPriority);
+    }
+
+    if (_throttleLevel >= 3) {
+        vTaskDelay(pdMS_TO_TICKS(20));
+    } else if (_throttleLevel >= 1) {
+        vTaskDelay(1);
+    }
+}
+
+// Performance Mode
+void MQTTOTA::_acquirePerformanceMode() {
+    if (!_performanceModeEnabled || _performanceModeActive) return;
+
+    static const esp_pm_lock_type_t lockTypes[3] = {
+        ESP_PM_CPU_FREQ_MAX, ESP_PM_APB_FREQ_MAX, ESP_PM_NO_LIGHT_SLEEP
+    };
+    static const char* lockNames[3] = { "mqttota_cpu", "mqttota_apb", "mqttota_sleep" };
+
+    // Locks only exist with CONFIG_PM_ENABLE; without it the clocks are already fixed
+    int acquired = 0;
+    for (; acquired < 3; acquired++) {
+        if (_pmLocks[acquired] == NULL &&
+            esp_pm_lock_create(lockTypes[acquired], 0, lockNames[acquired], &_pmLocks[acquired]) != ESP_OK) {
+            _pmLocks[acquired] = NULL;
+            break;
+        }
+        if (esp_pm_lock_acquire(_pmLocks[acquired]) != ESP_OK) {
+            break;
+        }
+    }
+    _pmLocksAcquired = (acquired == 3);
+    if (!_pmLocksAcquired) {
+        // All or nothing, so the release path stays symmetric
+        while (acquired > 0) {
+            esp_pm_lock_release(_pmLocks[--acquired]);
+        }
+    }
+
+    _powerSaveChanged = false;
+    if (esp_wifi_get_ps(&_savedPowerSave) == ESP_OK && _savedPowerSave != WIFI_PS_NONE) {
+        _powerSaveChanged = (esp_wifi_set_ps(WIFI_PS_NONE) == ESP_OK);
+    }
+
+    _performanceModeActive = true;
+    _stats.performanceMode = true;
+    _stats.pmLocksHeld = _pmLocksAcquired;
+    _stats.powerSaveDisabled = _powerSaveChanged;
+
+    OTA_LOGF("Modo rendimiento activo (bloqueos PM: %s, ahorro WiFi desactivado: %s)\n",
+            _pmLocksAcquired ? "Sí" : "No", _powerSaveChanged ? "Sí" : "No");
+}
+
+void MQTTOTA::_releasePerformanceMode() {
+    if (!_performanceModeActive) return;
+
+    if (_pmLocksAcquired) {
+        for (esp_pm_lock_handle_t lock : _pmLocks) {
+            esp_pm_lock_release(lock);
+        }
+        _pmLocksAcquired = false;
+    }
+
+    if (_powerSaveChanged) {
+        esp_wifi_set_ps(_savedPowerSave);
+        _powerSaveChanged = false;
+    }
+
+    _performanceModeActive = false;
+    OTA_LOGLN("Modo rendimiento liberado");
+}
+
+#if MQTT_OTA_STATISTICS
+// Stage Accounting Scope
+MQTTOTA::StageScope::StageScope(MQTTOTA* ota, OTAStage stage)
+    : _ota(ota), _stage(stage), _previousStage(-1), _sampleHeap(false), _startMicros(0),
+      _freeBefore(0), _spiramBefore(0), _minFreeBefore(0) {
+    if (!_ota->_sessionActive) {
+        _ota = nullptr;
+        return;
+    }
+
+    _sampleHeap = _ota->_heapAccountingEnabled;
+    if (_sampleHeap) {
+        _freeBefore = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+        _spiramBefore = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+        _minFreeBefore = heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL);
+    }
+
+    _ota->_trace(static_cast<OTATracePoint>(stage), _sampleHeap ? _freeBefore : 0);
+    _previousStage = _ota->_activeStage;
+    _ota->_activeStage = stage;
+#if MQTT_OTA_HEAP_HOOKS && defined(CONFIG_HEAP_USE_HOOKS)
+    if (_sampleHeap) {
+        s_hookTask = xTaskGetCurrentTaskHandle();
+        s_hookStage = &_ota->_stats.heapStages[stage];
+    }
+#endif
+    _startMicros = micros();
+}
+
+MQTTOTA::StageScope::~StageScope() {
+    if (!_ota) return;
+
+    uint32_t elapsedMicros = micros() - _startMicros;
+    _recordLatency(_ota->_stats.stageLatency[_stage], elapsedMicros);
+    _recordLatency(_ota->_lifetimeLatency[_stage], elapsedMicros);
+
+    _ota->_activeStage = _previousStage;
+    if (!_sampleHeap) return;
+
+    size_t freeAfter = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    size_t spiramAfter = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+    size_t minFreeAfter = heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL);
+    size_t largestBlock = heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL);
+
+    OTAStageHeapStats& stats = _ota->_stats.heapStages[_stage];
+    stats.runs++;
+
+    // A new global low-water mark set inside the stage also exposes
+    // transient allocations that were already freed on exit
+    size_t lowest = freeAfter;
+    if (minFreeAfter < _minFreeBefore && minFreeAfter < lowest) {
+        lowest = minFreeAfter;
+    }
+
+    if (_freeBefore > lowest) {
+        stats.peakBytes = max(stats.peakBytes, _freeBefore - lowest);
+    }
+    if (_spiramBefore > spiramAfter) {
+        stats.peakSpiramBytes = max(stats.peakSpiramBytes, _spiramBefore - spiramAfter);
+    }
+#if !(MQTT_OTA_HEAP_HOOKS && defined(CONFIG_HEAP_USE_HOOKS))
+    if (_freeBefore > freeAfter) {
+        stats.allocBytes += _freeBefore - freeAfter;
+    }
+#endif
+    stats.largestFreeBlockLow = min(stats.largestFreeBlockLow, largestBlock);
+
+    _ota->_stats.freeHeapLow = min(_ota->_stats.freeHeapLow, lowest);
+    _ota->_stats.largestFreeBlockLow = min(_ota->_stats.largestFreeBlockLow, largestBlock);
+
+#if MQTT_OTA_HEAP_HOOKS && defined(CONFIG_HEAP_USE_HOOKS)
+    s_hookStage = (_previousStage >= 0) ? &_ota->_stats.heapStages[_previousStage] : nullptr;
+#endif
+}
+#endif
+
+// Latency Histograms
+uint32_t MQTTOTA::latencyBucketBound(int bucket) {
+    static const uint32_t bounds[MQTT_OTA_LATENCY_BUCKETS - 1] = {
+        250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000
+    };
+    return (bucket >= 0 && bucket < MQTT_OTA_LATENCY_BUCKETS - 1) ? bounds[bucket] : UINT32_MAX;
+}
+
+void MQTTOTA::_recordLatency(OTALatencyHistogram& histogram, uint32_t micros) {
+    int bucket = 0;
+    while (bucket < MQTT_OTA_LATENCY_BUCKETS - 1 && micros > latencyBucketBound(bucket)) {
+        bucket++;
+    }
+    histogram.buckets[bucket]++;
+    histogram.count++;
+    histogram.sumMicros += micros;
+    histogram.maxMicros = max(histogram.maxMicros, micros);
+}
+
+uint32_t MQTTOTA::latencyPercentile(const OTALatencyHistogram& histogram, float percentile) {
+    if (histogram.count == 0) return 0;
+
+    // Upper bound of the bucket holding the percentile, capped by the real maximum
+    uint32_t rank = (uint32_t)ceilf(histogram.count * percentile / 100.0f);
+    uint32_t seen = 0;
+    for (int bucket = 0; bucket < MQTT_OTA_LATENCY_BUCKETS; bucket++) {
+        seen += histogram.buckets[bucket];
+        if (seen >= rank) {
+            return min(latencyBucketBound(bucket), histogram.maxMicros);
+        }
+    }
+    return histogram.maxMicros;
+}
+
 bool MQTTOTA::_checkFirmwareVersion(const String& newVersion) {
     if (!_otaContext.versionCheckEnabled) return true;
     
@@ -886,23 +1918,18 @@ bool MQTTOTA::_checkRollbackProtection() {
 }
 
 bool MQTTOTA::_verifyImageIntegrity(const uint8_t* data, size_t length) {
-    if (length < sizeof(esp_image_header_t)) {
-        return false;
-    }
-    
-    const esp_image_header_t* header = (const esp_image_header_t*)data;
-    
-    if (header->magic != ESP_IMAGE_HEADER_MAGIC) {
-        Serial.println("Número mágico de imagen inválido");
-        return false;
-    }
-    
-    if (header->segment_count == 0) {
-        Serial.println("No hay segmentos en la imagen");
-        return false;
+    switch (otaCheckImageHeader(data, length, NULL)) {
+        case OTA_IMAGE_TOO_SHORT:
+            return false;
+        case OTA_IMAGE_BAD_MAGIC:
+            OTA_LOGLN("Número mágico de imagen inválido");
+            return false;
+        case OTA_IMAGE_NO_SEGMENTS:
+            OTA_LOGLN("No hay segmentos en la imagen");
+            return false;
+        default:
+            return true;
     }
-    
-    return true;
 }
 
 bool MQTTOTA::_validatePartitionWrite() {
@@ -912,37 +1939,37 @@ bool MQTTOTA::_validatePartitionWrite() {
     
     // Verifica que la partición sea de tipo APP
     if (_otaContext.update_partition->type != ESP_PARTITION_TYPE_APP) {
-        Serial.println("Tipo de partición inválido para OTA");
+        OTA_LOGLN("Tipo de partición inválido para OTA");
         return false;
     }
     
     // CORREGIDO: Usar propiedad size directamente en lugar de esp_partition_get_info()
     if (_otaContext.update_partition->size < 1024) { // Tamaño mínimo razonable
-        Serial.printf("Partición demasiado pequeña para firmware: %u bytes\n", _otaContext.update_partition->size);
+        OTA_LOGF("Partición demasiado pequeña para firmware: %u bytes\n", _otaContext.update_partition->size);
         return false;
     }
     
-    Serial.printf("Partición válida: %s, dirección: 0x%08X, tamaño: %u bytes\n",
-                  _otaContext.update_partition->label,
-                  _otaContext.update_partition->address,
-                  _otaContext.update_partition->size);
+    OTA_LOGF("Partición válida: %s, dirección: 0x%08X, tamaño: %u bytes\n",
+             _otaContext.update_partition->label,
+             _otaContext.update_partition->address,
+             _otaContext.update_partition->size);
     
     return true;
 }
 
 // Helper para nombres de estado - FUNCIÓN MIEMBRO CORREGIDA
 String MQTTOTA::_getStateName(OTAState state) {
-    switch(state) {
-        case OTA_STATE_IDLE: return "INACTIVO";
-        case OTA_STATE_RECEIVING: return "RECIBIENDO";
-        case OTA_STATE_DECODING: return "DECODIFICANDO";
-        case OTA_STATE_VALIDATING: return "VALIDANDO";
-        case OTA_STATE_WRITING: return "ESCRIBIENDO";
-        case OTA_STATE_COMPLETING: return "FINALIZANDO";
-        case OTA_STATE_SUCCESS: return "EXITOSO";
-        case OTA_STATE_ERROR: return "ERROR";
-        case OTA_STATE_ABORTED: return "ABORTADO";
-        default: return "DESCONOCIDO";
+    return otaStateName(static_cast<uint8_t>(state));
+}
+
+const char* MQTTOTA::_getStageName(OTAStage stage) {
+    switch(stage) {
+        case OTA_STAGE_PARSE: return "parse";
+        case OTA_STAGE_DECODE: return "decode";
+        case OTA_STAGE_WRITE: return "write";
+        case OTA_STAGE_PUBLISH: return "publish";
+        case OTA_STAGE_CALLBACK: return "callback";
+        default: return "unknown";
     }
 }
 
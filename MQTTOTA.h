@@ -4,16 +4,73 @@
 #include <Arduino.h>
 #include <WiFi.h>
 #include <WiFiClientSecure.h>
-#include <ArduinoJson.h>
-#include <Update.h>
 #include "esp_ota_ops.h"
 #include "esp_app_format.h"
 #include "esp_partition.h"
+#include "esp_heap_caps.h"
+#include "esp_pm.h"
+#include "esp_wifi.h"
+#include "lwip/ip_addr.h"
+#include "nvs.h"
+#include "freertos/semphr.h"
+#include "mbedtls/sha256.h"
+#include "MQTTOTAProtocol.h"
+
+// FEATURE SWITCHES
+// Each one compiles a subsystem out when set to 0. They must reach every
+// library file, so set them as build flags (-DMQTT_OTA_JSON=0), not in the
+// sketch. extras/footprint/footprint.sh reports flash and RAM per combination.
+
+// Full-image updates: one JSON message with the whole image in "Base64",
+// performUpdate() and Update.h
+#ifndef MQTT_OTA_FULL_IMAGE
+#define MQTT_OTA_FULL_IMAGE 1
+#endif
+
+// JSON envelope: JSON chunks, JSON status topics, ArduinoJson and libb64.
+// At 0 the device takes binary chunks (OTA_CHUNK_MAGIC) only and reports on
+// the ota/bin/ topics only
+#ifndef MQTT_OTA_JSON
+#define MQTT_OTA_JSON 1
+#endif
+
+// Status publishers: ota/progress, ota/state, ota/error, ota/success and
+// chunk receipts, JSON and binary. Callbacks are kept
+#ifndef MQTT_OTA_STATUS
+#define MQTT_OTA_STATUS 1
+#endif
+
+// Serial log, printDiagnostics() and logMemoryStatus()
+#ifndef MQTT_OTA_LOG
+#define MQTT_OTA_LOG 1
+#endif
+
+// Per-stage heap and latency accounting, ota/stats (JSON) and the metrics endpoint.
+// Session counters used by telemetry, history and diagnostics are kept
+#ifndef MQTT_OTA_STATISTICS
+#define MQTT_OTA_STATISTICS 1
+#endif
+
+#if MQTT_OTA_FULL_IMAGE && !MQTT_OTA_JSON
+#error "MQTT_OTA_FULL_IMAGE needs MQTT_OTA_JSON"
+#endif
 
+#if MQTT_OTA_JSON
+#include <ArduinoJson.h>
 extern "C" {
     #include "libb64/cdecode.h"
     #include "libb64/cencode.h"
 }
+#endif
+
+// Arguments are still type-checked when the log is compiled out
+#if MQTT_OTA_LOG
+#define OTA_LOGF(...) Serial.printf(__VA_ARGS__)
+#define OTA_LOGLN(...) Serial.println(__VA_ARGS__)
+#else
+#define OTA_LOGF(...) do { if (0) Serial.printf(__VA_ARGS__); } while (0)
+#define OTA_LOGLN(...) do { if (0) Serial.println(__VA_ARGS__); } while (0)
+#endif
 
 // Default configuration values
 #ifndef MQTT_OTA_BUFFSIZE
@@ -44,6 +101,129 @@ extern "C" {
 #define MQTT_OTA_MAX_RETRIES 3        // Maximum retries
 #endif
 
+#ifndef MQTT_OTA_WATCHDOG_MAX_TASKS
+#define MQTT_OTA_WATCHDOG_MAX_TASKS 4       // Application tasks the resource watchdog can watch
+#endif
+
+#ifndef MQTT_OTA_WATCHDOG_INTERVAL_MS
+#define MQTT_OTA_WATCHDOG_INTERVAL_MS 100   // Minimum time between watchdog samples
+#endif
+
+#ifndef MQTT_OTA_THROTTLE_MAX_LEVEL
+#define MQTT_OTA_THROTTLE_MAX_LEVEL 3       // Highest throttle level applied to the OTA pipeline
+#endif
+
+#ifndef MQTT_OTA_METRICS_PORT
+#define MQTT_OTA_METRICS_PORT 9100          // Default port of the Prometheus metrics endpoint
+#endif
+
+#ifndef MQTT_OTA_METRICS_BUFFER_SIZE
+#define MQTT_OTA_METRICS_BUFFER_SIZE 8192   // Preallocated buffer the metrics page is rendered into
+#endif
+
+#ifndef MQTT_OTA_METRICS_TIMEOUT_MS
+#define MQTT_OTA_METRICS_TIMEOUT_MS 2000    // A scrape not done by then is dropped
+#endif
+
+#ifndef MQTT_OTA_HISTORY_SIZE
+#define MQTT_OTA_HISTORY_SIZE 8             // Session summaries kept in NVS (ring)
+#endif
+
+#ifndef MQTT_OTA_HISTORY_NAMESPACE
+#define MQTT_OTA_HISTORY_NAMESPACE "mqttota"
+#endif
+
+#ifndef MQTT_OTA_Z85_BLOCK
+#define MQTT_OTA_Z85_BLOCK 1024             // Stack block Z85 chunks are decoded into (multiple of 4, >= 288)
+#endif
+
+#ifndef MQTT_OTA_DECODE_SEGMENTS
+#define MQTT_OTA_DECODE_SEGMENTS 16         // Segments a full image's Base64 is decoded in, on both cores
+#endif
+
+#ifndef MQTT_OTA_DECODE_STACK
+#define MQTT_OTA_DECODE_STACK 2048          // Stack of the decode task on the second core
+#endif
+
+#ifndef MQTT_OTA_REQUEST_INTERVAL_MS
+#define MQTT_OTA_REQUEST_INTERVAL_MS 3000   // Silence before lost chunks are requested again
+#endif
+
+#ifndef MQTT_OTA_DATA_BUFFER
+#define MQTT_OTA_DATA_BUFFER 2048           // Socket receive buffer of the data client
+#endif
+
+#ifndef MQTT_OTA_DATA_MESSAGE_SIZE
+#define MQTT_OTA_DATA_MESSAGE_SIZE 8192     // Largest JSON message the data client passes on
+#endif
+
+#ifndef MQTT_OTA_DATA_OUTPUT
+#define MQTT_OTA_DATA_OUTPUT 256            // Data client packets the socket has not taken yet
+#endif
+
+#ifndef MQTT_OTA_DATA_KEEPALIVE
+#define MQTT_OTA_DATA_KEEPALIVE 30          // Seconds; PINGREQ goes out after half of it idle
+#endif
+
+#ifndef MQTT_OTA_DATA_RECONNECT_MS
+#define MQTT_OTA_DATA_RECONNECT_MS 5000     // Time between reconnection attempts
+#endif
+
+#ifndef MQTT_OTA_PRE_ERASE_INTERVAL_MS
+#define MQTT_OTA_PRE_ERASE_INTERVAL_MS 200  // Time between background sector erases
+#endif
+
+#ifndef MQTT_OTA_PRE_ERASE_SAVE_EVERY
+#define MQTT_OTA_PRE_ERASE_SAVE_EVERY 16    // Erased sectors between writes of the bitmap to NVS
+#endif
+
+#ifndef MQTT_OTA_PUBLISH_QUEUE_SIZE
+#define MQTT_OTA_PUBLISH_QUEUE_SIZE 16      // Messages the outbound queue holds
+#endif
+
+#ifndef MQTT_OTA_PUBLISH_QUEUE_BYTES
+#define MQTT_OTA_PUBLISH_QUEUE_BYTES 8192   // Payload bytes the outbound queue holds
+#endif
+
+#ifndef MQTT_OTA_PUBLISH_DRAIN
+#define MQTT_OTA_PUBLISH_DRAIN 8            // Messages handed to the sender per handle()
+#endif
+
+#ifndef MQTT_OTA_GAP_REPORT_MS
+#define MQTT_OTA_GAP_REPORT_MS 250          // Time between gap reports while chunks arrive
+#endif
+
+#ifndef MQTT_OTA_REORDER_SLOTS
+#define MQTT_OTA_REORDER_SLOTS 8            // Early parts held until the missing ones arrive
+#endif
+
+#ifndef MQTT_OTA_REORDER_BYTES
+#define MQTT_OTA_REORDER_BYTES 32768        // Image bytes the held parts may take
+#endif
+
+#ifndef MQTT_OTA_PROBE_MAX_AGE_MS
+#define MQTT_OTA_PROBE_MAX_AGE_MS 60000     // Admission reuses a probe result this long
+#endif
+
+#ifndef MQTT_OTA_TRACE_EVENTS
+#define MQTT_OTA_TRACE_EVENTS 32            // Events kept in the RTC crash trace ring
+#endif
+
+// Stage latency buckets: 250us .. 1s and +Inf
+#define MQTT_OTA_LATENCY_BUCKETS 13
+
+// Set to 1 when the sketch is built with CONFIG_HEAP_USE_HOOKS so MQTTOTA
+// provides the ESP-IDF heap hooks and counts every allocation per stage.
+// Leave at 0 if the application defines its own heap hooks.
+#ifndef MQTT_OTA_HEAP_HOOKS
+#define MQTT_OTA_HEAP_HOOKS 0
+#endif
+
+#if !MQTT_OTA_STATISTICS
+#undef MQTT_OTA_HEAP_HOOKS
+#define MQTT_OTA_HEAP_HOOKS 0
+#endif
+
 // ENUM AND DATA STRUCTURES
 
 // Callbacks for OTA events
@@ -51,18 +231,60 @@ typedef std::function<void(int progress, const String& version)> MQTTOTACallback
 typedef std::function<void(const String& error, const String& version)> MQTTOTAErrorCallback;
 typedef std::function<void(const String& version)> MQTTOTASuccessCallback;
 typedef std::function<void(uint8_t state)> MQTTOTAStateCallback;
+typedef std::function<void(const char* topic, const uint8_t* data, size_t length)> MQTTOTABinaryPublishFunc;
+// Must not block; false when the client cannot take the message now
+typedef std::function<bool(const char* topic, const uint8_t* data, size_t length)> MQTTOTAQueuedPublishFunc;
+
+// OTA process states (OTAState) and error codes (OTAErrorCode) live in MQTTOTAProtocol.h
 
-// OTA process states
-enum OTAState {
-    OTA_STATE_IDLE = 0,
-    OTA_STATE_RECEIVING = 1,
-    OTA_STATE_DECODING = 2,
-    OTA_STATE_VALIDATING = 3,
-    OTA_STATE_WRITING = 4,
-    OTA_STATE_COMPLETING = 5,
-    OTA_STATE_SUCCESS = 6,
-    OTA_STATE_ERROR = 7,
-    OTA_STATE_ABORTED = 8
+// Encodings used for ota/progress, ota/state, ota/error and ota/success
+enum OTATelemetryFormat {
+    OTA_TELEMETRY_JSON = 1,
+    OTA_TELEMETRY_BINARY = 2,
+    OTA_TELEMETRY_JSON_AND_BINARY = 3
+};
+
+// Classes of the outbound queue, drained in this order
+enum OTAPublishPriority {
+    OTA_PUBLISH_CRITICAL = 0,    // Errors, success, state changes, part requests
+    OTA_PUBLISH_STATUS = 1,      // Progress, receipts, statistics, diagnostics, history
+    OTA_PUBLISH_APP = 2,         // Application telemetry
+    OTA_PUBLISH_CLASSES = 3
+};
+
+// OTA pipeline stages used for per-stage accounting
+enum OTAStage {
+    OTA_STAGE_PARSE = 0,
+    OTA_STAGE_DECODE = 1,
+    OTA_STAGE_WRITE = 2,
+    OTA_STAGE_PUBLISH = 3,
+    OTA_STAGE_CALLBACK = 4,
+    OTA_STAGE_COUNT = 5
+};
+
+// Heap usage of a single pipeline stage during a session
+struct OTAStageHeapStats {
+    uint32_t runs = 0;                    // Times the stage was entered
+    uint32_t allocCount = 0;              // malloc calls inside the stage (MQTT_OTA_HEAP_HOOKS only)
+    size_t allocBytes = 0;                // Bytes requested (hooks) or net bytes retained (sampling)
+    size_t peakBytes = 0;                 // Largest internal heap drop within one run
+    size_t peakSpiramBytes = 0;           // Largest PSRAM drop within one run
+    size_t largestFreeBlockLow = SIZE_MAX; // Lowest largest-free-block seen at stage exit
+};
+
+// Successful sessions since boot run with or without performance mode
+struct OTAModeThroughput {
+    uint32_t sessions = 0;
+    uint64_t bytes = 0;
+    uint64_t timeMs = 0;
+};
+
+// Latency distribution of a pipeline stage (see MQTTOTA::latencyBucketBound)
+struct OTALatencyHistogram {
+    uint32_t buckets[MQTT_OTA_LATENCY_BUCKETS] = {};  // Runs per bucket, not cumulative
+    uint32_t count = 0;
+    uint64_t sumMicros = 0;
+    uint32_t maxMicros = 0;
 };
 
 // OTA Statistics
@@ -75,7 +297,105 @@ struct OTAStatistics {
     int errorCount = 0;
     OTAState lastState = OTA_STATE_IDLE;
     String lastError = "";
+    OTAErrorCode lastErrorCode = OTA_ERR_NONE;
+    esp_err_t lastEspError = ESP_OK;
     float averageSpeed = 0.0;  // bytes/second
+    uint16_t retries = 0;      // Chunk retries during the session
+
+#if MQTT_OTA_STATISTICS
+    // Heap accounting and stage latency
+    OTAStageHeapStats heapStages[OTA_STAGE_COUNT];
+    OTALatencyHistogram stageLatency[OTA_STAGE_COUNT];
+#endif
+    size_t freeHeapLow = SIZE_MAX;           // Lowest internal free heap seen during the session
+    size_t largestFreeBlockLow = SIZE_MAX;   // Lowest internal largest-free-block seen during the session
+
+    // Resource watchdog
+    uint32_t watchdogSamples = 0;            // Samples taken of the watched tasks
+    uint32_t starvedSamples = 0;             // Samples where a watched task was ready but not running
+    uint16_t throttleEscalations = 0;        // Times the throttle level was raised
+    uint16_t throttleRelaxations = 0;        // Times the throttle level was lowered
+    uint8_t throttleLevelMax = 0;            // Highest throttle level reached
+    size_t watchedStackLow = SIZE_MAX;       // Lowest stack high-water mark (bytes) of the watched tasks
+    size_t throttledBytes = 0;               // Bytes written while throttled
+    unsigned long throttledTime = 0;         // ms spent receiving while throttled
+    size_t unthrottledBytes = 0;             // Bytes written at full speed
+    unsigned long unthrottledTime = 0;       // ms spent receiving at full speed
+
+    // Performance mode
+    bool performanceMode = false;            // Performance mode was requested for the session
+    bool pmLocksHeld = false;                // CPU/APB max-frequency and no-light-sleep locks were held
+    bool powerSaveDisabled = false;          // WiFi power save was switched to WIFI_PS_NONE
+    uint32_t cpuFreqMHz = 0;                 // CPU frequency when the session started
+    OTAModeThroughput modeThroughput[2];     // Since boot, without [0] and with [1] performance mode
+
+    // Pre-erase (only sessions that found erased sectors write around esp_ota_write)
+    uint32_t preErasedSectors = 0;           // Sectors written without erasing them first
+    uint32_t erasedSectors = 0;              // Sectors the session erased itself
+    unsigned long eraseTime = 0;             // ms spent erasing those
+    unsigned long eraseSaved = 0;            // ms the pre-erased sectors would have taken to erase
+
+    // Gap reports
+    uint32_t duplicateParts = 0;             // Parts dropped because they were written or held
+    uint32_t heldParts = 0;                  // Parts held until an earlier one arrived
+    uint32_t unheldParts = 0;                // Early parts dropped for lack of room
+    uint32_t gapReports = 0;                 // Reports published
+};
+
+// Outbound queue counters per OTAPublishPriority class
+struct OTAPublishQueueStats {
+    uint32_t queued[OTA_PUBLISH_CLASSES] = {};
+    uint32_t sent[OTA_PUBLISH_CLASSES] = {};
+    uint32_t coalesced[OTA_PUBLISH_CLASSES] = {};  // Replaced by a newer message of the same topic
+    uint32_t dropped[OTA_PUBLISH_CLASSES] = {};    // Rejected or evicted for lack of room
+    uint32_t maxWaitMs[OTA_PUBLISH_CLASSES] = {};  // Longest time a sent message waited
+    uint32_t busy = 0;                             // Drains cut short by the sender
+    uint8_t depth = 0;                             // Messages waiting now
+    uint8_t maxDepth = 0;
+};
+
+// Background erase of the inactive app partition (enablePreErase)
+struct OTAPreEraseStats {
+    uint32_t sectors = 0;                // Sectors in the partition, 0 until the bitmap is loaded
+    uint32_t erasedSectors = 0;          // Sectors known to be erased
+    uint32_t backgroundSectors = 0;      // Sectors erased from handle() since boot
+    uint64_t backgroundMicros = 0;       // Time those erases blocked handle()
+    uint32_t sectorEraseMicros = 0;      // Average time to erase one sector
+};
+
+// Data client counters since enableDataClient()
+struct OTADataClientStats {
+    uint32_t connects = 0;
+    uint32_t messages = 0;          // PUBLISH packets received
+    uint32_t skippedMessages = 0;   // Dropped: busy, too large, not for this device or rejected
+    uint64_t wireBytes = 0;         // Bytes read from the socket
+    uint64_t imageBytes = 0;        // Binary chunk bytes handed to the OTA writer
+    uint64_t copiedBytes = 0;       // Bytes copied before the writer: socket reads, chunk headers, JSON
+};
+
+// Link thresholds checked before a new image is started (enableAdmission); 0 skips a check
+struct OTAAdmissionConfig {
+    int8_t minRssi = -75;                   // dBm, WiFi only
+    uint16_t maxPublishLatencyMs = 1000;    // Average time a publish takes to leave the device
+    uint32_t minProbeBytesPerSecond = 4096; // Probe round trip (setProbeTopic)
+    uint16_t probeBytes = 2048;             // Probe payload size
+    uint16_t probeTimeoutMs = 5000;         // A probe not back by then counts as a refusal
+    uint32_t deferMs = 60000;               // First refusal; doubles with every refusal in a row
+    uint32_t maxDeferMs = 1800000;
+};
+
+// Admission decisions since boot and the link figures of the last one
+struct OTAAdmissionStats {
+    uint32_t admitted = 0;
+    uint32_t deferred = 0;
+    uint32_t ignoredParts = 0;      // Part 1 dropped while deferred or probing
+    uint32_t probes = 0;
+    uint32_t lostProbes = 0;        // Not back within probeTimeoutMs
+    int8_t rssi = 0;                // 0 when not on WiFi
+    uint16_t publishLatencyMs = 0;
+    uint32_t probeBytesPerSecond = 0;
+    uint16_t probeRttMs = 0;
+    uint8_t lastReason = OTA_ADMIT_OK;
 };
 
 // MAIN MQTTOTA CLASS
@@ -113,6 +433,48 @@ public:
      */
     void setPartitionName(const String& partitionName = "");
 
+    /**
+     * @brief Configures the publisher used for binary status messages
+     * @param publishFunc Function publishing raw bytes (payload may contain zeros)
+     */
+    void setBinaryPublisher(MQTTOTABinaryPublishFunc publishFunc);
+
+    /**
+     * @brief Queues every message the library publishes and drains the queue from handle()
+     *
+     * JSON and binary messages go to publishFunc, which must not block (for
+     * example esp_mqtt_client_enqueue()). When it returns false the message
+     * stays queued for the next handle(). setMQTTConfig() and
+     * setBinaryPublisher() still decide which messages are produced.
+     * @param publishFunc Non-blocking send, nullptr to publish directly again
+     */
+    void setQueuedPublisher(MQTTOTAQueuedPublishFunc publishFunc);
+
+    /**
+     * @brief Queues an application message; never blocks
+     *
+     * Critical messages go out first, then status, then application messages,
+     * oldest first within a class. When the queue is full, the oldest message
+     * of a lower class makes room. Without setQueuedPublisher() the queue drains
+     * binary payloads through the binary publisher and text through
+     * setMQTTConfig(), or the binary publisher if there is none. setMQTTConfig()
+     * takes a C string, so a binary payload is refused unless
+     * setQueuedPublisher() or setBinaryPublisher() is set.
+     * @param coalesce Replace a queued message of the same class and topic instead of adding one
+     * @return false if the message was dropped
+     */
+    bool enqueuePublish(const char* topic, const uint8_t* payload, size_t length,
+                        OTAPublishPriority priority = OTA_PUBLISH_APP, bool coalesce = false);
+    bool enqueuePublish(const char* topic, const String& payload,
+                        OTAPublishPriority priority = OTA_PUBLISH_APP, bool coalesce = false);
+    OTAPublishQueueStats getPublishQueueStats() const;
+
+    /**
+     * @brief Selects JSON (default), binary or both status encodings
+     * @param format Binary messages go to the parallel ota/bin/ topics
+     */
+    void setTelemetryFormat(OTATelemetryFormat format);
+
     // CALLBACKS 
     
     void onProgress(MQTTOTACallback callback);
@@ -124,7 +486,15 @@ public:
     
     void handle();
     void processMessage(const String& topic, const String& message);
+
+    /**
+     * @brief Same as above for raw MQTT payloads; JSON messages and binary
+     * chunks (OTA_CHUNK_MAGIC) alike, without cutting the latter at a NUL
+     */
+    void processMessage(const String& topic, const uint8_t* payload, size_t length);
+#if MQTT_OTA_FULL_IMAGE
     bool performUpdate(const String& base64Data, const String& firmwareVersion);
+#endif
     
     // OTA CONFIGURATION 
     
@@ -134,6 +504,169 @@ public:
     void setMaxRetries(int maxRetries);
     void enableRollbackProtection(bool enable = true);
     void enableVersionCheck(bool enable = true);
+    void enableHeapAccounting(bool enable = true);
+
+    /**
+     * @brief Slows the OTA pipeline down when watched application tasks starve
+     * @param enable Enable/disable the resource watchdog
+     */
+    void enableResourceWatchdog(bool enable = true);
+
+    /**
+     * @brief Adds an application task to the resource watchdog
+     * @param task Task handle
+     * @param minStackBytes Stack high-water mark below which a warning is reported
+     * @return false if the watch list is full
+     *
+     * Call unwatchTask() before vTaskDelete() on a watched task. Each sample
+     * looks the stored handles up among the live tasks before reading them
+     * (uxTaskGetSystemState(), or xTaskGetHandle() by name without
+     * configUSE_TRACE_FACILITY) and drops the ones that are gone, but until
+     * then a new task may reuse a deleted task's handle.
+     */
+    bool watchTask(TaskHandle_t task, size_t minStackBytes = 512);
+    void unwatchTask(TaskHandle_t task);
+    uint8_t getThrottleLevel() const;
+
+    /**
+     * @brief Holds max CPU/APB frequency and disables WiFi power save while a session runs
+     * @param enable Enable/disable performance mode
+     */
+    void enablePerformanceMode(bool enable = true);
+
+    /**
+     * @brief Erases the inactive app partition from handle() while no session runs
+     *
+     * One sector every MQTT_OTA_PRE_ERASE_INTERVAL_MS, once the running app is
+     * no longer pending verification. Erased sectors are kept in a bitmap in
+     * NVS, so the next session, even after a reboot, writes them without
+     * erasing. The firmware in that partition is lost: rolling back to it is
+     * no longer possible. Not available with flash encryption.
+     * @param enable Enable/disable pre-erase (disabled by default)
+     */
+    void enablePreErase(bool enable = true);
+    OTAPreEraseStats getPreEraseStats() const;
+
+    /**
+     * @brief Keeps a summary of every session in an NVS ring of MQTT_OTA_HISTORY_SIZE records
+     *
+     * Records are written when a session ends (before the restart that follows a
+     * successful update) and published on ota/history once MQTT is connected.
+     * @param enable Enable/disable session history (enabled by default)
+     */
+    void enableSessionHistory(bool enable = true);
+
+    /**
+     * @brief Reads the stored session summaries, newest first
+     * @return Number of records copied
+     */
+    size_t getSessionHistory(OTASessionRecord* records, size_t maxRecords);
+    void clearSessionHistory();
+
+    /**
+     * @brief True if begin() found the trace of a session cut short by a reset
+     *
+     * The trace is published on ota/crash and ota/bin/crash, in the telemetry
+     * formats enabled, once MQTT is connected.
+     */
+    bool hasCrashTrace() const;
+
+    /**
+     * @brief Echoes "SentAt"/"Seq" of each written chunk on ota/receipt
+     *
+     * Receipts are only sent for chunks that carry "SentAt". Each one adds the
+     * device receive time and the receive-to-written duration.
+     * @param enable Enable/disable receipts (enabled by default)
+     */
+    void enableChunkReceipts(bool enable = true);
+
+    /**
+     * @brief Asks for lost chunks on ota/request instead of aborting the session
+     *
+     * Out-of-order chunks are dropped and the missing parts requested; a stalled
+     * session is re-requested every MQTT_OTA_REQUEST_INTERVAL_MS. Needs a server
+     * or edge cache that answers requests (disabled by default).
+     * @param enable Enable/disable part requests
+     */
+    void enablePartRequests(bool enable = true);
+
+    /**
+     * @brief Reliability for chunks published at QoS 0
+     *
+     * Parts that arrive ahead of a lost one are held (MQTT_OTA_REORDER_SLOTS,
+     * MQTT_OTA_REORDER_BYTES) and written once the gap is filled; parts
+     * already written or held are dropped. Every MQTT_OTA_GAP_REPORT_MS the
+     * device publishes a 24-byte report on ota/bin/gaps with the next part it
+     * needs and the parts it holds, which the server takes as the ack for
+     * everything before it. Needs a binary or queued publisher (disabled by
+     * default).
+     * @param enable Enable/disable gap reports
+     */
+    void enableGapReports(bool enable = true);
+
+    /**
+     * @brief Checks the link before starting a new image
+     *
+     * On part 1 of an image the device compares WiFi RSSI and the average
+     * publish latency with config and, with setProbeTopic(), times a probe
+     * round trip through the broker; the probe drops part 1, which the server
+     * is asked to send again. Each decision is published on ota/admission and
+     * ota/bin/admission with the figures it was based on. A refused device
+     * ignores the image for a randomized retry time that doubles with every
+     * refusal in a row, up to maxDeferMs (disabled by default).
+     */
+    void enableAdmission(const OTAAdmissionConfig& config = OTAAdmissionConfig());
+    void disableAdmission();
+
+    /**
+     * @brief Topic the admission probe is published on and expected back from
+     *
+     * Must be unique to the device and subscribed by the application, which
+     * passes its messages to processMessage() like those of the OTA topic.
+     */
+    void setProbeTopic(const String& topic);
+    OTAAdmissionStats getAdmissionStats() const;
+
+    /**
+     * @brief Partition the application should read for a bundle data target
+     *
+     * When the partition table has <label>_0 and <label>_1, bundles write the
+     * inactive one and switch them together with the app; this returns the
+     * active one. Otherwise it returns the partition named label. Call after
+     * begin(), which applies a switch the last bundle left pending.
+     */
+    const esp_partition_t* getDataPartition(const char* label);
+
+    /**
+     * @brief Lets bundles overwrite data partitions without a _0/_1 pair
+     *
+     * Off by default: such a section is written while the bundle still
+     * streams, before the other sections are verified, so a failed update
+     * leaves it half overwritten under the running app. Bundles that need it
+     * are rejected with OTA_ERR_PARTITION before any byte is written.
+     */
+    void enableInPlaceBundleData(bool enable = true);
+
+    /**
+     * @brief Receives the OTA topic over a connection of its own
+     *
+     * A minimal MQTT 3.1.1 subscriber (plain TCP) polled from handle(). It
+     * reads into a fixed MQTT_OTA_DATA_BUFFER buffer and hands the image bytes
+     * of binary chunks to the OTA writer straight from it, without assembling
+     * the message. JSON messages up to MQTT_OTA_DATA_MESSAGE_SIZE go through
+     * processMessage(). The application must stop passing OTA topic messages
+     * to processMessage(), or every chunk would arrive twice. The lookup,
+     * the TCP connect and the CONNACK are all waited for from handle(), a
+     * step per call, so neither this nor handle() blocks on the broker.
+     * The topic is the one given to setMQTTConfig(), "ota" if it was not called.
+     * @return false if the OTA topic is empty or the receive buffer could not
+     * be allocated
+     */
+    bool enableDataClient(const char* host, uint16_t port = 1883, const char* user = nullptr,
+                          const char* password = nullptr);
+    void disableDataClient();
+    bool isDataClientConnected() const;
+    OTADataClientStats getDataClientStats() const;
 
     // STATUS AND QUERY 
     
@@ -150,10 +683,61 @@ public:
     
     // UTILITIES AND DIAGNOSTICS 
     
+#if MQTT_OTA_LOG
     void printDiagnostics();
+#endif
+
+    /**
+     * @brief Fills a snapshot of device, partition, heap and session state
+     *
+     * Does not allocate; safe to call from handle() or while an update runs.
+     */
+    void getDiagnostics(DiagnosticsSnapshot& snapshot);
+
+    /**
+     * @brief Publishes the snapshot on ota/bin/diagnostics (binary telemetry
+     * enabled) and/or ota/diagnostics (compact JSON)
+     */
+    void publishDiagnostics();
+
+    /**
+     * @brief Topic that triggers publishDiagnostics() when any message arrives on it
+     *
+     * Subscribe every device to the same topic to poll the whole fleet with one
+     * publish. Messages on the OTA topic with EventType "GetDiagnostics" work too.
+     */
+    void setDiagnosticsTopic(const String& topic);
+
+#if MQTT_OTA_STATISTICS
+    /**
+     * @brief Serves Prometheus metrics over HTTP from handle()
+     * @param port TCP port (default MQTT_OTA_METRICS_PORT)
+     * @return false if the listening socket or render buffer could not be created
+     */
+    bool enableMetricsEndpoint(uint16_t port = MQTT_OTA_METRICS_PORT);
+    void disableMetricsEndpoint();
+
+    /**
+     * @brief Renders all metrics in Prometheus text exposition format
+     * @return Bytes written (output is truncated at a line boundary if the buffer is too small)
+     */
+    size_t renderMetrics(char* buffer, size_t size);
+#endif
+
+    static uint32_t latencyBucketBound(int bucket);
+    static uint32_t latencyPercentile(const OTALatencyHistogram& histogram, float percentile);
     String getBootPartitionInfo();
+#if MQTT_OTA_JSON
     static String base64Decode(const String& encoded);
+#endif
     static String base64Encode(const String& input);
+
+    /**
+     * @brief Encodes into a caller buffer, NUL-terminated
+     * @param outSize At least otaBase64EncodedLength(length) + 1
+     * @return Characters written, 0 if the buffer is too small
+     */
+    static size_t base64Encode(const uint8_t* data, size_t length, char* out, size_t outSize);
     static size_t calculateBase64DecodedSize(const String& encoded);
     void cleanup();
     void abortUpdate();
@@ -162,7 +746,9 @@ public:
     
     static bool checkMemory(size_t requiredBytes);
     static size_t getFreeHeap();
+#if MQTT_OTA_LOG
     static void logMemoryStatus();
+#endif
     
     // SECURITY METHODS 
     
@@ -171,6 +757,16 @@ public:
 
 private:
     // Internal structures
+    struct OutboundMessage {
+        char* topic = nullptr;          // One allocation: topic, NUL, payload, NUL
+        const uint8_t* payload = nullptr;
+        size_t length = 0;
+        uint32_t order = 0;             // FIFO position within the class
+        uint32_t queuedAt = 0;
+        uint8_t priority = OTA_PUBLISH_APP;
+        bool binary = false;
+    };
+
     struct OTAContext {
         bool inProgress = false;
         String firmwareVersion;
@@ -186,25 +782,87 @@ private:
         String partitionName;
         bool rollbackEnabled = true;
         bool versionCheckEnabled = true;
+        bool z85 = false;              // JSON chunks carry Z85Part, as declared by part 1
+        bool direct = false;           // App bytes go to the partition directly, over pre-erased sectors
+        size_t written = 0;            // App bytes written directly
+        uint32_t preparedSectors = 0;  // Sectors below this one are erased or were pre-erased
+    };
+
+    // Times and samples the heap around one pipeline stage (RAII, nests safely)
+#if MQTT_OTA_STATISTICS
+    class StageScope {
+    public:
+        StageScope(MQTTOTA* ota, OTAStage stage);
+        ~StageScope();
+    private:
+        MQTTOTA* _ota;
+        OTAStage _stage;
+        int8_t _previousStage;
+        bool _sampleHeap;
+        uint32_t _startMicros;
+        size_t _freeBefore;
+        size_t _spiramBefore;
+        size_t _minFreeBefore;
+    };
+#else
+    // Only the crash trace point is left
+    class StageScope {
+    public:
+        StageScope(MQTTOTA* ota, OTAStage stage) {
+            if (ota->_sessionActive) ota->_trace(static_cast<OTATracePoint>(stage), 0);
+        }
+    };
+#endif
+
+    struct WatchedTask {
+        TaskHandle_t handle = NULL;
+        char name[configMAX_TASK_NAME_LEN] = "";
+        UBaseType_t priority = 0;             // As of the last sample
+        size_t minStackBytes = 0;
+        uint32_t lastRunTime = 0;
+        uint8_t readyStreak = 0;
+        bool stackWarned = false;
+    };
+
+    // Bundle being written (MQTTOTABundle.cpp)
+    struct BundleContext {
+        OTABundleReader reader;
+        mbedtls_sha256_context sha;
+        bool hashing;
+        bool hasApp;
+        const esp_partition_t* targets[OTA_BUNDLE_MAX_SECTIONS];
+        uint8_t slots[OTA_BUNDLE_MAX_SECTIONS];    // Slot of a _0/_1 pair written, 0xFF in place
+        uint32_t erasedUpTo;                       // Current data section, partition offset
     };
 
     struct OTAChunkData {
         String firmwareVersion;
         String base64Part;
+        String z85Part;            // "Z85Part", instead of base64Part
+        String encoding;           // "Encoding" declared by the first chunk, empty if absent
         int partIndex;
         int totalParts;
         bool isError;
         String errorMessage;
         String checksum;
         size_t decodedSize;
+        uint64_t sentAt = 0;       // Server send timestamp ("SentAt"), 0 if absent
+        uint32_t sequence = 0;     // Server sequence number ("Seq")
+        String device;             // Retransmission target ("Device"), empty for broadcast
+        const uint8_t* data = nullptr;  // Image bytes of a binary chunk, instead of base64Part
+        size_t dataLength = 0;
+        bool streamed = false;     // Binary chunk whose dataLength bytes the data client writes
     };
 
     // Member variables
     String _deviceName;
     String _firmwareVersion;
     String _deviceID;
-    String _otaTopic;
+    String _otaTopic = "ota";          // setMQTTConfig() default, for devices that never call it
+    String _diagnosticsTopic;
     OTAContext _otaContext;
+    BundleContext* _bundle = nullptr;
+    bool _inPlaceBundleData = false;
     
     // Callbacks
     MQTTOTACallback _progressCallback = nullptr;
@@ -215,6 +873,10 @@ private:
     // MQTT Callbacks
     std::function<void(const char* topic, const String& message)> _publishMQTT = nullptr;
     std::function<bool()> _isMQTTConnected = nullptr;
+    MQTTOTABinaryPublishFunc _publishBinary = nullptr;
+    MQTTOTAQueuedPublishFunc _queuedPublish = nullptr;
+    OTATelemetryFormat _telemetryFormat = MQTT_OTA_JSON ? OTA_TELEMETRY_JSON : OTA_TELEMETRY_BINARY;
+    uint32_t _deviceHash = 0;
     
     // Configuration
     bool _chunkedOTAEnabled = true;
@@ -227,27 +889,283 @@ private:
     String _currentFirmwareVersion;
     int _currentProgress = 0;
     OTAStatistics _stats;
+    bool _heapAccountingEnabled = true;
+    bool _sessionActive = false;
+    String _sessionVersion;
+    int8_t _activeStage = -1;
+
+    // Resource watchdog
+    bool _watchdogEnabled = false;
+    WatchedTask _watchedTasks[MQTT_OTA_WATCHDOG_MAX_TASKS];
+#if configUSE_TRACE_FACILITY
+    TaskStatus_t* _taskStatus = nullptr;   // uxTaskGetSystemState() buffer, grown as tasks are created
+    UBaseType_t _taskStatusSlots = 0;
+#endif
+    uint8_t _throttleLevel = 0;
+    uint8_t _starvedStreak = 0;
+    uint8_t _healthyStreak = 0;
+    unsigned long _lastWatchdogSample = 0;
+    unsigned long _lastChunkTime = 0;
+
+    // Performance mode
+    bool _performanceModeEnabled = false;
+    bool _performanceModeActive = false;
+    esp_pm_lock_handle_t _pmLocks[3] = { NULL, NULL, NULL };
+    bool _pmLocksAcquired = false;
+    wifi_ps_type_t _savedPowerSave = WIFI_PS_NONE;
+    bool _powerSaveChanged = false;
+
+    // Outbound queue (MQTTOTAPublishQueue.cpp)
+    OutboundMessage _outbound[MQTT_OTA_PUBLISH_QUEUE_SIZE];
+    uint8_t _outboundCount = 0;
+    size_t _outboundBytes = 0;
+    uint32_t _outboundOrder = 0;
+    portMUX_TYPE _outboundLock = portMUX_INITIALIZER_UNLOCKED;
+    OTAPublishQueueStats _queueStats;
+
+    // Pre-erase (MQTTOTAPreErase.cpp)
+    bool _preEraseEnabled = false;
+    uint8_t* _eraseMap = nullptr;       // One bit per sector of _erasePartition known to be erased
+    const esp_partition_t* _erasePartition = nullptr;
+    uint32_t _eraseSectors = 0;
+    uint32_t _erasedCount = 0;          // Bits set in _eraseMap
+    uint32_t _eraseUnsaved = 0;         // Sectors erased since the bitmap was last stored
+    unsigned long _lastEraseStep = 0;
+    OTAPreEraseStats _eraseStats;
+
+    // Lifetime counters and metrics endpoint
+    uint32_t _sessionsStarted = 0;
+    uint32_t _sessionsSucceeded = 0;
+    uint32_t _sessionsFailed = 0;
+    uint64_t _lifetimeBytes = 0;
+    OTAModeThroughput _modeThroughput[2];
+#if MQTT_OTA_STATISTICS
+    OTALatencyHistogram _lifetimeLatency[OTA_STAGE_COUNT];
+    int _metricsSocket = -1;
+    char* _metricsBuffer = nullptr;
+    int _metricsClient = -1;                // Scrape in progress
+    unsigned long _metricsClientAt = 0;
+    size_t _metricsReceived = 0;            // Request bytes at the start of _metricsBuffer
+    char* _metricsResponse = nullptr;       // Head and page inside _metricsBuffer, once rendered
+    size_t _metricsResponseLength = 0;
+    size_t _metricsSent = 0;
+#endif
+
+    // Session history
+    bool _historyEnabled = true;
+    bool _historyLoaded = false;
+    uint32_t _historyNext = 0;        // Sequence of the next record
+    uint32_t _historyPublished = 0;   // Records below this sequence were published
+
+    // Crash trace
+    bool _crashTracePending = false;
+    uint8_t _crashResetReason = 0;
+    unsigned long _crashTraceTriedAt = 0;
+    int16_t _tracePart = 0;
+
+    // Chunk receipts
+    bool _receiptsEnabled = true;
+    uint32_t _messageReceivedAt = 0;      // millis() when the current message arrived
+    uint32_t _messageReceivedMicros = 0;
+
+    // Part requests
+    bool _partRequestsEnabled = false;
+    unsigned long _lastPartRequestAt = 0;
+    int _lastPartRequestFrom = 0;
+
+    // Gap reports
+    struct HeldChunk {
+        uint8_t* data;
+        size_t length;
+        uint16_t part;
+        uint16_t totalParts;
+        uint32_t sequence;
+        uint64_t sentAt;
+    };
+    bool _gapReportsEnabled = false;
+    HeldChunk _held[MQTT_OTA_REORDER_SLOTS];
+    uint8_t _heldCount = 0;
+    size_t _heldBytes = 0;
+    bool _writingHeld = false;
+    uint16_t _highestPart = 0;
+    uint32_t _lastSequence = 0;
+    unsigned long _lastGapReport = 0;
+    uint8_t _gapReportBackoff = 0;      // Unchanged reports double the interval, up to 8x
+    uint32_t _lastGapState = 0;
+
+    // Admission (MQTTOTAAdmission.cpp)
+    bool _admissionEnabled = false;
+    OTAAdmissionConfig _admission;
+    OTAAdmissionStats _admissionStats;
+    String _probeTopic;
+    String _admitVersion;               // Image the last decision was about
+    bool _admitted = false;             // Admitted after a probe; start on its next part 1
+    unsigned long _deferredAt = 0;
+    uint32_t _deferMs = 0;              // Refused: ignore _admitVersion this long after _deferredAt
+    uint8_t _refusals = 0;              // Refusals in a row
+    uint32_t _probeNonce = 0;           // Probe in flight, 0 if none
+    unsigned long _probeSentAt = 0;     // micros()
+    unsigned long _probedAt = 0;        // millis() of the last probe result, 0 if none
+    uint32_t _publishLatencyMicros = 0; // Average, each publish weighing 1/8
+
+    // Data client
+    bool _dataClientEnabled = false;
+    int _dataSocket = -1;
+    uint8_t* _dataBuffer = nullptr;     // MQTT_OTA_DATA_BUFFER receive area, the message area, the output area
+    String _dataHost;
+    uint16_t _dataPort = 0;
+    String _dataUser;
+    String _dataPassword;
+    bool _dataHasUser = false;
+    bool _dataHasPassword = false;
+    OTAMqttReader _dataReader;
+    uint8_t _dataMessage = 0;           // What the PUBLISH being read is (MQTTOTADataClient.cpp)
+    size_t _dataHeld = 0;               // Bytes gathered in the message area
+    OTAChunkData _dataChunk;            // Binary chunk being streamed
+    size_t _dataWritten = 0;            // Image bytes of _dataChunk written so far
+    size_t _dataOutLength = 0;          // Bytes waiting in the output area
+    unsigned long _dataLastSend = 0;
+    unsigned long _dataLastAttempt = 0; // Start of the connection step in progress, or of the wait
+    uint8_t _dataConnection = 0;        // Connection step (MQTTOTADataClient.cpp)
+    volatile uint8_t _dataLookup = 0;   // DNS lookup state, written by the lwIP thread
+    uint32_t _dataAddress = 0;          // IPv4 address the lookup found, network order
+    uint8_t _dataSubscribedQos = 0;
+    OTADataClientStats _dataStats;
     
     // Private methods
     void _initialize();
+    void _dispatchMessage(const String& topic, const uint8_t* payload, size_t length, const String* message);
+#if MQTT_OTA_FULL_IMAGE
     void _processOTAMessage(const String& message);
-    void _processOTAChunk(const String& message);
     bool _validateFirmwareData(const String& base64Data);
-    bool _validateChecksum(const String& data, const String& checksum);
     bool _performOTAUpdateESPIDF(const String& base64Data, const String& firmwareVersion);
+#endif
+
+#if MQTT_OTA_FULL_IMAGE
+    // A full image's Base64, decoded in segments by a task on the other core
+    // and by the caller, which writes what is decoded from the start while the
+    // rest is still being decoded (MQTTOTADecode.cpp)
+    class ParallelDecode {
+    public:
+        ParallelDecode() = default;
+        ~ParallelDecode();
+        ParallelDecode(const ParallelDecode&) = delete;
+        ParallelDecode& operator=(const ParallelDecode&) = delete;
+
+        // Plans the segments and starts the task; text must outlive the decode
+        OTAErrorCode start(const String& text);
+        // Returns once the first bytes are decoded; false on invalid Base64
+        bool waitFor(size_t bytes);
+        const uint8_t* data() const { return _out; }
+        size_t length() const { return _length; }
+        uint8_t segments() const { return _count; }
+        uint8_t helperSegments() const { return _helperSegments; }
+
+    private:
+        static void _task(void* arg);
+        bool _decodeNext(bool helper);
+
+        const char* _text = nullptr;
+        uint8_t* _out = nullptr;
+        size_t _length = 0;
+        OTABase64Segment _segments[MQTT_OTA_DECODE_SEGMENTS];
+        uint8_t _state[MQTT_OTA_DECODE_SEGMENTS] = {};
+        uint8_t _count = 0;
+        uint8_t _next = 0;              // First segment nobody has taken
+        uint8_t _ready = 0;             // Segments from the first one the caller found decoded
+        uint8_t _helperSegments = 0;
+        bool _stop = false;
+        bool _helperRunning = false;
+        SemaphoreHandle_t _progress = NULL;
+        portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+    };
+#endif
+#if MQTT_OTA_JSON
+    void _processOTAChunk(const String& message);
+#endif
+    void _processBinaryChunk(const uint8_t* payload, size_t length);
+    void _handleChunk(const OTAChunkData& chunk);
+    bool _acceptChunk(const OTAChunkData& chunk);
+    void _finishChunk(const OTAChunkData& chunk);
+    bool _validateChecksum(const String& data, const String& checksum);
     
     // Chunks OTA
     bool _startChunkedOTA(const OTAChunkData& chunk);
     bool _processChunkData(const OTAChunkData& chunk);
+#if MQTT_OTA_JSON
+    bool _processZ85ChunkData(const OTAChunkData& chunk);
+#endif
+    bool _writeChunkBytes(const OTAChunkData& chunk, const uint8_t* data, size_t length, bool first);
     void _completeChunkedOTA(const OTAChunkData& chunk);
     void _cleanupChunkedOTA();
     void _handleChunkError(const OTAChunkData& chunk, const String& error);
+
+    // Bundles
+    bool _beginBundle(const OTAChunkData& chunk);
+    bool _prepareBundle(const OTAChunkData& chunk);
+    bool _writeBundleBytes(const OTAChunkData& chunk, const uint8_t* data, size_t length);
+    esp_err_t _writeBundleSection(const uint8_t* data, size_t length);
+    bool _endBundleSection(const OTAChunkData& chunk);
+    void _completeBundle(const OTAChunkData& chunk);
+    void _freeBundle();
+    void _promoteDataSlots();
+
+    // Data client
+    void _connectDataClient();
+    void _openDataSocket();
+    void _awaitDataConnect();
+    void _awaitDataConnack();
+    void _subscribeData();
+    static void _dataResolved(const char* name, const ip_addr_t* address, void* arg);
+    void _closeDataClient(const char* reason);
+    void _pollDataClient();
+    bool _sendData(const uint8_t* data, size_t length);
+    bool _flushData();
+    void _onDataEvent(OTAMqttEvent event);
+    void _beginDataChunk();
+    bool _writeDataChunk(const uint8_t* data, size_t length);
     
     // Communication
-    void _publishError(const String& errorMessage, const String& firmwareVersion = "");
+    void _publishError(const String& errorMessage, const String& firmwareVersion = "",
+                       OTAErrorCode code = OTA_ERR_UNKNOWN, esp_err_t espError = ESP_OK);
     void _publishSuccess(const String& firmwareVersion);
+    void _publishReceipt(const OTAChunkData& chunk);
+    bool _requestMissingParts(const OTAChunkData& chunk);
+    void _requestParts(const String& firmwareVersion, int from, OTARequestReason reason);
+    bool _gapChunk(const OTAChunkData& chunk);
+    bool _holdChunk(const OTAChunkData& chunk);
+    void _writeHeldChunks();
+    void _dropHeldChunks();
+    void _reportGaps(const String& firmwareVersion, bool force);
+    bool _admissionHolds(const String& firmwareVersion);
+    bool _admitSession(const OTAChunkData& chunk);
+    OTAAdmitReason _checkLink();
+    bool _startProbe();
+    void _probeReturned(const uint8_t* payload, size_t length);
+    void _checkProbe();
+    void _decideAdmission(OTAAdmitReason reason, bool resend);
+    void _publishAdmission(OTAAdmitReason reason, uint32_t retryMs, bool resend);
+    void _notePublishLatency(uint32_t elapsedMicros);
     void _publishProgress(int progress, const String& firmwareVersion);
     void _publishStateChange(OTAState state);
+    void _publishTelemetry(OTATelemetryType type, const String& firmwareVersion, uint8_t progress = 0,
+                           OTAErrorCode code = OTA_ERR_NONE, esp_err_t espError = ESP_OK);
+    bool _jsonTelemetryEnabled() const;
+    bool _publishText(const char* topic, const String& message, OTAPublishPriority priority,
+                      bool coalesce = false);
+    bool _publishBytes(const char* topic, const uint8_t* data, size_t length, OTAPublishPriority priority,
+                       bool coalesce = false);
+
+    // Outbound queue
+    bool _enqueue(const char* topic, const uint8_t* payload, size_t length, OTAPublishPriority priority,
+                  bool coalesce, bool binary);
+    char* _evictBelow(uint8_t priority);
+    void _insertOutbound(const OutboundMessage& message);
+    void _requeueOutbound(const OutboundMessage& message);
+    OutboundMessage _detachOutbound(size_t index);
+    void _drainPublishQueue();
+    void _flushPublishQueue(unsigned long waitMs);
+    void _clearPublishQueue();
     
     // Utilities
     static void _printSHA256(const uint8_t* image_hash, const char* label);
@@ -258,6 +1176,50 @@ private:
     // State management
     void _setState(OTAState state);
     void _updateStatistics(size_t bytesReceived = 0, bool isError = false);
+    void _beginSession(const String& firmwareVersion);
+    void _finishSession(bool success);
+#if MQTT_OTA_STATISTICS && MQTT_OTA_JSON
+    void _publishStatistics();
+#endif
+
+    // Session history
+    void _loadHistory();
+    void _appendHistory(bool success);
+    void _publishHistory();
+
+    // Crash trace (RTC memory, survives panics and watchdog resets)
+    void _trace(OTATracePoint point);
+    void _trace(OTATracePoint point, uint32_t freeHeap);
+    void _traceBegin();
+    void _traceEnd();
+    void _checkCrashTrace();
+    bool _publishCrashTrace();
+
+    // Resource watchdog
+    void _sampleWatchdog();
+    UBaseType_t _throttleBegin();
+    void _throttleEnd(UBaseType_t savedPriority);
+
+    // Performance mode
+    void _acquirePerformanceMode();
+    void _releasePerformanceMode();
+
+    // Pre-erase
+    void _stepPreErase();
+    bool _loadEraseMap();
+    void _freeEraseMap();
+    bool _saveEraseMap();
+    bool _takeEraseMap(const esp_partition_t* partition);
+    void _returnEraseMap();
+    esp_err_t _writeApp(const uint8_t* data, size_t length);
+    esp_err_t _endApp();
+
+    // Metrics
+    static void _recordLatency(OTALatencyHistogram& histogram, uint32_t micros);
+#if MQTT_OTA_STATISTICS
+    void _serveMetrics();
+    void _closeMetricsClient();
+#endif
     
     // Security and validation
     bool _checkFirmwareVersion(const String& newVersion);
@@ -267,6 +1229,7 @@ private:
     
     // Helper function for state names
     String _getStateName(OTAState state);
+    static const char* _getStageName(OTAStage stage);
 };
 
 // Inline method implementations
@@ -310,6 +1273,82 @@ inline void MQTTOTA::setMaxRetries(int maxRetries) {
     _otaContext.maxRetries = (maxRetries > 0) ? maxRetries : MQTT_OTA_MAX_RETRIES; 
 }
 
+inline void MQTTOTA::enableHeapAccounting(bool enable) { 
+    _heapAccountingEnabled = enable; 
+}
+
+inline void MQTTOTA::enableResourceWatchdog(bool enable) { 
+    _watchdogEnabled = enable; 
+}
+
+inline uint8_t MQTTOTA::getThrottleLevel() const { 
+    return _throttleLevel; 
+}
+
+inline void MQTTOTA::enablePerformanceMode(bool enable) { 
+    _performanceModeEnabled = enable; 
+}
+
+inline void MQTTOTA::enablePreErase(bool enable) { 
+    _preEraseEnabled = enable; 
+}
+
+inline void MQTTOTA::enableSessionHistory(bool enable) { 
+    _historyEnabled = enable; 
+}
+
+inline void MQTTOTA::enableChunkReceipts(bool enable) { 
+    _receiptsEnabled = enable; 
+}
+
+inline void MQTTOTA::enablePartRequests(bool enable) { 
+    _partRequestsEnabled = enable; 
+}
+
+inline void MQTTOTA::enableGapReports(bool enable) { 
+    _gapReportsEnabled = enable; 
+}
+
+inline void MQTTOTA::enableInPlaceBundleData(bool enable) { 
+    _inPlaceBundleData = enable; 
+}
+
+inline void MQTTOTA::disableAdmission() { 
+    _admissionEnabled = false; 
+}
+
+inline void MQTTOTA::setProbeTopic(const String& topic) { 
+    _probeTopic = topic; 
+}
+
+inline OTAAdmissionStats MQTTOTA::getAdmissionStats() const { 
+    return _admissionStats; 
+}
+
+inline bool MQTTOTA::hasCrashTrace() const { 
+    return _crashTracePending; 
+}
+
+inline void MQTTOTA::setQueuedPublisher(MQTTOTAQueuedPublishFunc publishFunc) { 
+    _queuedPublish = publishFunc; 
+}
+
+inline void MQTTOTA::setBinaryPublisher(MQTTOTABinaryPublishFunc publishFunc) { 
+    _publishBinary = publishFunc; 
+}
+
+inline void MQTTOTA::setTelemetryFormat(OTATelemetryFormat format) { 
+    _telemetryFormat = format; 
+}
+
+inline void MQTTOTA::setDiagnosticsTopic(const String& topic) { 
+    _diagnosticsTopic = topic; 
+}
+
+inline bool MQTTOTA::_jsonTelemetryEnabled() const { 
+    return MQTT_OTA_JSON && (_telemetryFormat & OTA_TELEMETRY_JSON) != 0; 
+}
+
 
 
 
@@ -0,0 +1,223 @@
+#include "MQTTOTA.h"
+
+// Admission control: a session started over a weak link is likely to stall
+// halfway and leave the partition half written, so part 1 of a new image
+// first has to pass the link checks of enableAdmission(). RSSI comes from the
+// WiFi driver and publish latency is a running average kept by every
+// publish, so both cost nothing. The probe is a real round trip: the device
+// publishes probeBytes on its probe topic and times the message until the
+// broker delivers it back, which measures both directions of the path the
+// chunks take. Its result is reused for MQTT_OTA_PROBE_MAX_AGE_MS. A refusal
+// defers the image for a retry time drawn between half and all of deferMs,
+// doubled for every refusal in a row, so that a fleet refused together on a
+// congested site does not come back together.
+
+void MQTTOTA::enableAdmission(const OTAAdmissionConfig& config) {
+    _admission = config;
+    _admissionEnabled = true;
+    _admitVersion = "";
+    _admitted = false;
+    _deferMs = 0;
+    _refusals = 0;
+    _probeNonce = 0;
+}
+
+// True while chunks of the image are to be ignored: refused, or a probe in flight
+bool MQTTOTA::_admissionHolds(const String& firmwareVersion) {
+    if (_probeNonce != 0) return true;
+    return _deferMs != 0 && firmwareVersion == _admitVersion && millis() - _deferredAt < _deferMs;
+}
+
+// Part 1 of an image while no session runs; false drops it
+bool MQTTOTA::_admitSession(const OTAChunkData& chunk) {
+    if (_admissionHolds(chunk.firmwareVersion)) {
+        _admissionStats.ignoredParts++;
+        return false;
+    }
+
+    // Admitted after a probe, which dropped the first part 1
+    if (_admitted && chunk.firmwareVersion == _admitVersion) {
+        _admitted = false;
+        return true;
+    }
+
+    _admitVersion = chunk.firmwareVersion;
+    _admitted = false;
+    _deferMs = 0;
+
+    OTAAdmitReason reason = _checkLink();
+    bool probeFresh = _probedAt != 0 && millis() - _probedAt < MQTT_OTA_PROBE_MAX_AGE_MS;
+    if (reason == OTA_ADMIT_OK && _admission.minProbeBytesPerSecond > 0 && !probeFresh &&
+        !_probeTopic.isEmpty() && _startProbe()) {
+        _admissionStats.ignoredParts++;
+        return false;
+    }
+
+    _decideAdmission(reason, false);
+    return reason == OTA_ADMIT_OK;
+}
+
+// Compares the current figures with the thresholds; the probe only if it is fresh
+OTAAdmitReason MQTTOTA::_checkLink() {
+    _admissionStats.rssi = WiFi.status() == WL_CONNECTED ? WiFi.RSSI() : 0;
+    uint32_t latencyMs = _publishLatencyMicros / 1000;
+    _admissionStats.publishLatencyMs = latencyMs > 0xFFFF ? 0xFFFF : latencyMs;
+
+    if (_admission.minRssi != 0 && _admissionStats.rssi != 0 && _admissionStats.rssi < _admission.minRssi) {
+        return OTA_ADMIT_RSSI;
+    }
+    if (_admission.maxPublishLatencyMs != 0 && latencyMs > _admission.maxPublishLatencyMs) {
+        return OTA_ADMIT_LATENCY;
+    }
+    bool probeFresh = _probedAt != 0 && millis() - _probedAt < MQTT_OTA_PROBE_MAX_AGE_MS;
+    if (_admission.minProbeBytesPerSecond != 0 && probeFresh &&
+        _admissionStats.probeBytesPerSecond < _admission.minProbeBytesPerSecond) {
+        return OTA_ADMIT_PROBE;
+    }
+    return OTA_ADMIT_OK;
+}
+
+bool MQTTOTA::_startProbe() {
+    if (!_isMQTTConnected || !_isMQTTConnected()) return false;
+
+    // Printable, so that JSON-only publishers carry it too
+    size_t length = _admission.probeBytes;
+    if (_queuedPublish && length > MQTT_OTA_PUBLISH_QUEUE_BYTES) length = MQTT_OTA_PUBLISH_QUEUE_BYTES;
+    uint32_t nonce = (uint32_t)random(1, 0x7FFFFFFF);
+    char header[20];
+    int headerLength = snprintf(header, sizeof(header), "OTAPROBE %08x ", (unsigned)nonce);
+    if (length < (size_t)headerLength) length = headerLength;
+
+    String probe;
+    if (!probe.reserve(length)) return false;
+    probe = header;
+    while (probe.length() < length) {
+        probe += (char)('a' + probe.length() % 26);
+    }
+
+    // Set before publishing: the probe may come back before the call returns.
+    // A queued probe is stamped again when _drainPublishQueue() hands it over.
+    _probeNonce = nonce;
+    _probeSentAt = micros();
+    if (!_publishText(_probeTopic.c_str(), probe, OTA_PUBLISH_STATUS)) {
+        // Not sent, so admission goes by RSSI and latency alone
+        _probeNonce = 0;
+        OTA_LOGLN("No se pudo enviar el sondeo");
+        return false;
+    }
+    _admissionStats.probes++;
+    OTA_LOGF("Sondeando enlace con %u bytes antes de %s\n", (unsigned)length, _admitVersion.c_str());
+    return true;
+}
+
+// A message on the probe topic; anything but the probe in flight is ignored
+void MQTTOTA::_probeReturned(const uint8_t* payload, size_t length) {
+    if (_probeNonce == 0) return;
+    char header[20];
+    int headerLength = snprintf(header, sizeof(header), "OTAPROBE %08x ", (unsigned)_probeNonce);
+    if (length < (size_t)headerLength || memcmp(payload, header, headerLength) != 0) return;
+
+    uint32_t rtt = micros() - _probeSentAt;
+    if (rtt == 0) rtt = 1;
+    _probeNonce = 0;
+    _probedAt = millis();
+
+    // The payload crossed the link twice
+    uint64_t rate = (uint64_t)length * 2 * 1000000 / rtt;
+    _admissionStats.probeBytesPerSecond = rate > UINT32_MAX ? UINT32_MAX : (uint32_t)rate;
+    _admissionStats.probeRttMs = rtt / 1000 > 0xFFFF ? 0xFFFF : rtt / 1000;
+    OTA_LOGF("Sondeo: %u ms, %u bytes/s\n", (unsigned)_admissionStats.probeRttMs,
+             (unsigned)_admissionStats.probeBytesPerSecond);
+
+    _decideAdmission(_checkLink(), true);
+}
+
+// From handle(): a probe not back in time refuses the image
+void MQTTOTA::_checkProbe() {
+    if (_probeNonce == 0 || micros() - _probeSentAt < (uint32_t)_admission.probeTimeoutMs * 1000) return;
+
+    _probeNonce = 0;
+    _probedAt = millis();
+    _admissionStats.lostProbes++;
+    _admissionStats.probeBytesPerSecond = 0;
+    _admissionStats.probeRttMs = _admission.probeTimeoutMs;
+    OTA_LOGLN("Sondeo perdido");
+    _decideAdmission(OTA_ADMIT_PROBE, false);
+}
+
+// resend: part 1 was dropped for the probe and the server must send it again
+void MQTTOTA::_decideAdmission(OTAAdmitReason reason, bool resend) {
+    _admissionStats.lastReason = reason;
+    uint32_t retryMs = 0;
+
+    if (reason == OTA_ADMIT_OK) {
+        _admissionStats.admitted++;
+        _refusals = 0;
+        _admitted = resend;
+        OTA_LOGF("Actualización %s admitida\n", _admitVersion.c_str());
+    } else {
+        uint64_t defer = (uint64_t)_admission.deferMs << (_refusals < 16 ? _refusals : 16);
+        if (defer > _admission.maxDeferMs) defer = _admission.maxDeferMs;
+        retryMs = (uint32_t)(defer / 2) + (uint32_t)random(0, (long)(defer - defer / 2) + 1);
+        if (retryMs == 0) retryMs = 1;
+        _deferMs = retryMs;
+        _deferredAt = millis();
+        _admitted = false;
+        if (_refusals < 0xFF) _refusals++;
+        _admissionStats.deferred++;
+        OTA_LOGF("Actualización %s aplazada %u ms (%s)\n", _admitVersion.c_str(), (unsigned)retryMs,
+                 otaAdmitReasonName(reason));
+    }
+
+    _publishAdmission(reason, retryMs, resend && reason == OTA_ADMIT_OK);
+}
+
+void MQTTOTA::_publishAdmission(OTAAdmitReason reason, uint32_t retryMs, bool resend) {
+#if MQTT_OTA_STATUS
+    if (!_isMQTTConnected || !_isMQTTConnected()) return;
+
+    OTAAdmission admission;
+    admission.reason = reason;
+    admission.flags = resend ? OTA_ADMISSION_RESEND : 0;
+    admission.deviceHash = _deviceHash;
+    admission.versionHash = otaHash32(_admitVersion.c_str());
+    admission.retryMs = retryMs;
+    admission.probeBytesPerSecond = _probedAt != 0 ? _admissionStats.probeBytesPerSecond : 0;
+    admission.latencyMs = _admissionStats.publishLatencyMs;
+    admission.probeRttMs = _probedAt != 0 ? _admissionStats.probeRttMs : 0;
+    admission.rssi = _admissionStats.rssi;
+    admission.refusals = _refusals;
+
+    StageScope scope(this, OTA_STAGE_PUBLISH);
+
+    if ((_telemetryFormat & OTA_TELEMETRY_BINARY) && _publishBinary) {
+        uint8_t payload[OTA_ADMISSION_SIZE];
+        size_t length = otaAdmissionEncode(admission, payload);
+        _publishBytes(OTA_TOPIC_BIN_ADMISSION, payload, length, OTA_PUBLISH_CRITICAL);
+    }
+
+#if MQTT_OTA_JSON
+    if (_jsonTelemetryEnabled() && _publishMQTT) {
+        char output[256];
+        snprintf(output, sizeof(output),
+                 "{\"device\":\"%s\",\"version\":\"%s\",\"admit\":%s,\"reason\":\"%s\",\"rssi\":%d,"
+                 "\"latencyMs\":%u,\"probeBps\":%u,\"probeRttMs\":%u,\"retryMs\":%u,\"refusals\":%u,"
+                 "\"resend\":%s}",
+                 _deviceID.c_str(), _admitVersion.c_str(), reason == OTA_ADMIT_OK ? "true" : "false",
+                 otaAdmitReasonName(reason), (int)admission.rssi, (unsigned)admission.latencyMs,
+                 (unsigned)admission.probeBytesPerSecond, (unsigned)admission.probeRttMs,
+                 (unsigned)retryMs, (unsigned)admission.refusals, resend ? "true" : "false");
+        _publishText(OTA_TOPIC_ADMISSION, String(output), OTA_PUBLISH_CRITICAL);
+    }
+#endif
+#endif
+}
+
+// Every publish, direct or drained from the queue, moves the average 1/8 of the way
+void MQTTOTA::_notePublishLatency(uint32_t elapsedMicros) {
+    if (_publishLatencyMicros == 0) {
+        _publishLatencyMicros = elapsedMicros;
+    } else {
+        _publishLatencyMicros = _publishLatencyMicros - _publishLatencyMicros / 8 + elapsedMicros / 8;
+    }
+}
@@ -0,0 +1,388 @@
+#include "MQTTOTA.h"
+
+// A bundle carries several images in one chunked session (OTABundleReader in
+// MQTTOTAProtocol.h). The app section goes through the session's esp_ota
+// handle; data sections are written straight to their partition, erased one
+// sector ahead of the data. Each section's SHA-256 is checked as it ends, and
+// nothing is switched before the last one has been verified.
+//
+// Data partitions with a <label>_0/<label>_1 pair are double-buffered: the
+// bundle writes the inactive slot and the switch is stored in NVS with the app
+// partition it belongs to. begin() makes it active once that app is the one
+// running, so app and data change in the same reboot or not at all. A data
+// partition without a pair could only be overwritten in place, while the
+// running app may have it mounted and before the rest of the bundle has
+// verified; that takes enableInPlaceBundleData().
+
+namespace {
+
+const char* kSlotsKey = "dslots";
+const uint8_t kNoSlot = 0xFF;
+
+// One double-buffered data partition; all of them are stored as one blob
+struct DataSlot {
+    uint32_t labelHash;
+    uint8_t active;            // 0 or 1
+    uint8_t pending;           // Slot waiting for its app to run, kNoSlot if none
+    uint16_t reserved;
+    uint32_t bootAddress;      // App partition the pending slot belongs to
+};
+
+size_t loadSlots(DataSlot* slots) {
+    nvs_handle_t handle;
+    if (nvs_open(MQTT_OTA_HISTORY_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) return 0;
+    size_t length = sizeof(DataSlot) * OTA_BUNDLE_MAX_SECTIONS;
+    if (nvs_get_blob(handle, kSlotsKey, slots, &length) != ESP_OK) length = 0;
+    nvs_close(handle);
+    return length / sizeof(DataSlot);
+}
+
+esp_err_t saveSlots(const DataSlot* slots, size_t count) {
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(MQTT_OTA_HISTORY_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) return err;
+    err = nvs_set_blob(handle, kSlotsKey, slots, count * sizeof(DataSlot));
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    return err;
+}
+
+DataSlot* findSlot(DataSlot* slots, size_t* count, uint32_t labelHash, bool create) {
+    for (size_t i = 0; i < *count; i++) {
+        if (slots[i].labelHash == labelHash) return &slots[i];
+    }
+    if (!create || *count == OTA_BUNDLE_MAX_SECTIONS) return NULL;
+
+    DataSlot& slot = slots[(*count)++];
+    memset(&slot, 0, sizeof(slot));
+    slot.labelHash = labelHash;
+    slot.pending = kNoSlot;
+    return &slot;
+}
+
+// slot < 0 for the partition named label itself
+const esp_partition_t* findPartition(const char* label, int slot) {
+    char name[OTA_BUNDLE_LABEL_SIZE + 1];
+    int length = slot < 0 ? snprintf(name, sizeof(name), "%s", label)
+                          : snprintf(name, sizeof(name), "%s_%d", label, slot);
+    if (length < 0 || length >= (int)sizeof(name)) return NULL;
+    return esp_partition_find_first(ESP_PARTITION_TYPE_ANY, ESP_PARTITION_SUBTYPE_ANY, name);
+}
+
+uint8_t activeSlot(const char* label) {
+    DataSlot slots[OTA_BUNDLE_MAX_SECTIONS];
+    size_t count = loadSlots(slots);
+    DataSlot* slot = findSlot(slots, &count, otaHash32(label), false);
+    return slot ? slot->active : 0;
+}
+
+}
+
+const esp_partition_t* MQTTOTA::getDataPartition(const char* label) {
+    const esp_partition_t* first = findPartition(label, 0);
+    const esp_partition_t* second = findPartition(label, 1);
+    if (!first || !second) {
+        return findPartition(label, -1);
+    }
+    return activeSlot(label) == 1 ? second : first;
+}
+
+void MQTTOTA::_promoteDataSlots() {
+    DataSlot slots[OTA_BUNDLE_MAX_SECTIONS];
+    size_t count = loadSlots(slots);
+    const esp_partition_t* running = esp_ota_get_running_partition();
+
+    bool changed = false;
+    for (size_t i = 0; i < count; i++) {
+        if (slots[i].pending == kNoSlot) continue;
+        if (running && running->address == slots[i].bootAddress) {
+            slots[i].active = slots[i].pending;
+            OTA_LOGF("Bundle: datos del slot %u activos\n", slots[i].active);
+        } else {
+            OTA_LOGLN("Bundle: la app nueva no arrancó, se descartan sus datos");
+        }
+        slots[i].pending = kNoSlot;
+        changed = true;
+    }
+
+    if (changed) {
+        esp_err_t err = saveSlots(slots, count);
+        if (err != ESP_OK) {
+            OTA_LOGF("ERROR: No se pudieron guardar los slots de datos: %s\n", esp_err_to_name(err));
+        }
+    }
+}
+
+bool MQTTOTA::_beginBundle(const OTAChunkData& chunk) {
+    _bundle = (BundleContext*)calloc(1, sizeof(BundleContext));
+    if (!_bundle) {
+        _publishError("Memoria insuficiente para bundle", chunk.firmwareVersion, OTA_ERR_NO_MEMORY);
+        return false;
+    }
+    _bundle->reader.reset();
+    OTA_LOGLN("Bundle detectado");
+    return true;
+}
+
+void MQTTOTA::_freeBundle() {
+    if (!_bundle) return;
+    if (_bundle->hashing) {
+        mbedtls_sha256_free(&_bundle->sha);
+    }
+    free(_bundle);
+    _bundle = nullptr;
+}
+
+// Resolves every section's partition before any byte is written
+bool MQTTOTA::_prepareBundle(const OTAChunkData& chunk) {
+    const OTABundleReader& reader = _bundle->reader;
+
+    for (uint8_t i = 0; i < reader.header.sectionCount; i++) {
+        const OTABundleSection& section = reader.sections[i];
+        const esp_partition_t* target = NULL;
+        uint8_t slot = kNoSlot;
+
+        if (section.target == OTA_BUNDLE_TARGET_APP) {
+            target = _otaContext.update_partition;
+            if (section.label[0] != '\0' && strcmp(section.label, target->label) != 0) {
+                String errorMsg = "Bundle: la app es para ";
+                errorMsg += section.label;
+                errorMsg += ", la partición OTA es ";
+                errorMsg += target->label;
+                _publishError(errorMsg, chunk.firmwareVersion, OTA_ERR_PARTITION);
+                return false;
+            }
+            _bundle->hasApp = true;
+        } else {
+            const esp_partition_t* first = findPartition(section.label, 0);
+            const esp_partition_t* second = findPartition(section.label, 1);
+            bool paired = first && second;
+            int placed = otaBundleDataSlot(paired, paired ? activeSlot(section.label) : 0, _inPlaceBundleData);
+            if (paired) {
+                slot = placed;
+                target = slot == 1 ? second : first;
+            } else {
+                target = findPartition(section.label, -1);
+            }
+
+            if (!target || target->type == ESP_PARTITION_TYPE_APP) {
+                String errorMsg = "Bundle: partición de datos no encontrada: ";
+                errorMsg += section.label;
+                _publishError(errorMsg, chunk.firmwareVersion, OTA_ERR_PARTITION);
+                return false;
+            }
+            if (placed < 0) {
+                String errorMsg = "Bundle: la partición de datos no tiene par _0/_1: ";
+                errorMsg += section.label;
+                _publishError(errorMsg, chunk.firmwareVersion, OTA_ERR_PARTITION);
+                return false;
+            }
+        }
+
+        if ((uint64_t)section.offset + section.length > target->size) {
+            String errorMsg = "Bundle: el segmento no cabe en ";
+            errorMsg += target->label;
+            _publishError(errorMsg, chunk.firmwareVersion, OTA_ERR_PARTITION);
+            return false;
+        }
+
+        _bundle->targets[i] = target;
+        _bundle->slots[i] = slot;
+        OTA_LOGF("Bundle: segmento %u -> %s (%u bytes)%s\n", i, target->label, (unsigned)section.length,
+                 section.target == OTA_BUNDLE_TARGET_DATA && slot == kNoSlot ? " en el sitio" : "");
+    }
+    return true;
+}
+
+bool MQTTOTA::_writeBundleBytes(const OTAChunkData& chunk, const uint8_t* data, size_t length) {
+    OTABundleReader& reader = _bundle->reader;
+
+    while (length > 0) {
+        if (!reader.indexComplete) {
+            size_t used;
+            if (!reader.readIndex(data, length, &used)) {
+                _publishError("Índice de bundle inválido", chunk.firmwareVersion, OTA_ERR_HEADER);
+                return false;
+            }
+            data += used;
+            length -= used;
+            if (reader.indexComplete && !_prepareBundle(chunk)) {
+                return false;
+            }
+            continue;
+        }
+
+        if (reader.done()) {
+            _publishError("Datos después del último segmento del bundle", chunk.firmwareVersion,
+                          OTA_ERR_INVALID_DATA);
+            return false;
+        }
+
+        if (reader.sectionOffset == 0) {
+            mbedtls_sha256_init(&_bundle->sha);
+            mbedtls_sha256_starts(&_bundle->sha, 0);
+            _bundle->hashing = true;
+            _bundle->erasedUpTo = reader.current().offset;
+        }
+
+        size_t count = reader.sectionBytes(length);
+        mbedtls_sha256_update(&_bundle->sha, data, count);
+
+        esp_err_t err;
+        {
+            StageScope scope(this, OTA_STAGE_WRITE);
+            err = _writeBundleSection(data, count);
+        }
+        if (err != ESP_OK) {
+            String errorMsg = "Error escribiendo segmento de bundle: ";
+            errorMsg += esp_err_to_name(err);
+            _publishError(errorMsg, chunk.firmwareVersion, OTA_ERR_WRITE, err);
+            return false;
+        }
+
+        data += count;
+        length -= count;
+        if (reader.advance(count) && !_endBundleSection(chunk)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+esp_err_t MQTTOTA::_writeBundleSection(const uint8_t* data, size_t length) {
+    const OTABundleReader& reader = _bundle->reader;
+    const OTABundleSection& section = reader.current();
+    if (section.target == OTA_BUNDLE_TARGET_APP) {
+        return _writeApp(data, length);
+    }
+
+    // Sectors are erased as the data reaches them, like esp_ota_write() does
+    const esp_partition_t* target = _bundle->targets[reader.section];
+    size_t position = section.offset + reader.sectionOffset;
+    size_t end = position + length;
+    if (end > _bundle->erasedUpTo) {
+        size_t erase = (end + OTA_BUNDLE_SECTOR_SIZE - 1) / OTA_BUNDLE_SECTOR_SIZE * OTA_BUNDLE_SECTOR_SIZE;
+        if (erase > target->size) erase = target->size;
+        esp_err_t err = esp_partition_erase_range(target, _bundle->erasedUpTo, erase - _bundle->erasedUpTo);
+        if (err != ESP_OK) return err;
+        _bundle->erasedUpTo = erase;
+    }
+    return esp_partition_write(target, position, data, length);
+}
+
+// Called once the reader has moved past the section
+bool MQTTOTA::_endBundleSection(const OTAChunkData& chunk) {
+    uint8_t index = _bundle->reader.section - 1;
+    uint8_t digest[32];
+    mbedtls_sha256_finish(&_bundle->sha, digest);
+    mbedtls_sha256_free(&_bundle->sha);
+    _bundle->hashing = false;
+
+    if (memcmp(digest, _bundle->reader.sections[index].sha256, sizeof(digest)) != 0) {
+        String errorMsg = "Bundle: SHA-256 del segmento ";
+        errorMsg += index;
+        errorMsg += " no coincide";
+        _publishError(errorMsg, chunk.firmwareVersion, OTA_ERR_VERIFY);
+        return false;
+    }
+    OTA_LOGF("Bundle: segmento %u verificado\n", index);
+    return true;
+}
+
+void MQTTOTA::_completeBundle(const OTAChunkData& chunk) {
+    const OTABundleReader& reader = _bundle->reader;
+    if (!reader.done()) {
+        _publishError("Bundle incompleto", chunk.firmwareVersion, OTA_ERR_TOO_SMALL);
+        _cleanupChunkedOTA();
+        return;
+    }
+
+    _publishProgress(90, chunk.firmwareVersion);
+
+    // A data-only bundle leaves the app slot untouched
+    esp_err_t err;
+    _trace(OTA_TRACE_OTA_END);
+    if (_bundle->hasApp) {
+        err = _endApp();
+    } else {
+        esp_ota_abort(_otaContext.update_handle);
+        err = ESP_OK;
+    }
+    _otaContext.update_handle = 0;
+    if (err != ESP_OK) {
+        String errorMsg = "Error finalizando OTA: ";
+        errorMsg += esp_err_to_name(err);
+        if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
+            errorMsg += " - Validación de imagen falló";
+        }
+        _publishError(errorMsg, chunk.firmwareVersion, OTA_ERR_END, err);
+        _cleanupChunkedOTA();
+        return;
+    }
+
+    _publishProgress(95, chunk.firmwareVersion);
+
+    // Every double-buffered partition switches in one NVS write; with an app,
+    // only once that app runs (_promoteDataSlots)
+    DataSlot slots[OTA_BUNDLE_MAX_SECTIONS];
+    size_t count = loadSlots(slots);
+    bool switched = false;
+    for (uint8_t i = 0; i < reader.header.sectionCount; i++) {
+        if (_bundle->slots[i] == kNoSlot) continue;
+        DataSlot* slot = findSlot(slots, &count, otaHash32(reader.sections[i].label), true);
+        if (!slot) {
+            _publishError("Bundle: demasiadas particiones de datos con slots", chunk.firmwareVersion,
+                          OTA_ERR_PARTITION);
+            _cleanupChunkedOTA();
+            return;
+        }
+        if (_bundle->hasApp) {
+            slot->pending = _bundle->slots[i];
+            slot->bootAddress = _otaContext.update_partition->address;
+        } else {
+            slot->active = _bundle->slots[i];
+            slot->pending = kNoSlot;
+        }
+        switched = true;
+    }
+
+    if (switched) {
+        err = saveSlots(slots, count);
+        if (err != ESP_OK) {
+            String errorMsg = "Error guardando slots de datos: ";
+            errorMsg += esp_err_to_name(err);
+            _publishError(errorMsg, chunk.firmwareVersion, OTA_ERR_PARTITION, err);
+            _cleanupChunkedOTA();
+            return;
+        }
+    }
+
+    if (_bundle->hasApp) {
+        _trace(OTA_TRACE_SET_BOOT);
+        err = esp_ota_set_boot_partition(_otaContext.update_partition);
+        if (err != ESP_OK) {
+            // The old app keeps running, so its data must not switch either
+            for (size_t i = 0; i < count; i++) slots[i].pending = kNoSlot;
+            if (switched) saveSlots(slots, count);
+
+            String errorMsg = "Error estableciendo partición de arranque: ";
+            errorMsg += esp_err_to_name(err);
+            _publishError(errorMsg, chunk.firmwareVersion, OTA_ERR_BOOT, err);
+            _cleanupChunkedOTA();
+            return;
+        }
+    }
+
+    _publishProgress(100, chunk.firmwareVersion);
+    OTA_LOGF("Bundle completado: %u segmentos verificados\n", reader.header.sectionCount);
+
+    _publishSuccess(chunk.firmwareVersion);
+    _finishSession(true);
+    _freeBundle();
+
+    OTA_LOGLN("Reiniciando en 3 segundos...");
+    _flushPublishQueue(3000);
+    ESP.restart();
+}
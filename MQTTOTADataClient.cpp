@@ -0,0 +1,570 @@
+#include "MQTTOTA.h"
+#include "lwip/sockets.h"
+#include "lwip/dns.h"
+#include "lwip/tcpip.h"
+
+// The data client keeps its own MQTT connection for the OTA topic so image
+// bytes skip the application's MQTT stack. One allocation holds the socket
+// receive area and, behind it, the message area where the few bytes that must
+// be contiguous are gathered: binary chunk headers, the image header at the
+// start of part 1 and JSON messages. Binary chunk data is written from the
+// receive area as each socket read delivers it. Connecting is a sequence of
+// steps polled from handle(): the lwIP DNS lookup answers by callback, the
+// socket connects non-blocking and CONNACK is read when it is there, so a
+// slow or unreachable broker never holds up the loop. Sending does not wait
+// either: what the socket does not take at once stays in the output area at
+// the end of the allocation and goes out from later polls.
+
+namespace {
+
+enum DataMessage {
+    DATA_SKIP = 0,             // Ignored up to its last byte
+    DATA_PENDING,              // First payload byte not seen yet
+    DATA_JSON,
+    DATA_CHUNK_HEADER,         // Gathering OTAChunkHeader and the version
+    DATA_CHUNK                 // Streaming image bytes
+};
+
+// Steps of a connection, polled from handle()
+enum DataConnection {
+    CONNECTION_CLOSED = 0,     // Waiting MQTT_OTA_DATA_RECONNECT_MS to try again
+    CONNECTION_RESOLVING,      // DNS lookup in the lwIP thread
+    CONNECTION_CONNECTING,     // TCP connect in progress
+    CONNECTION_HANDSHAKE,      // CONNECT sent, waiting for CONNACK
+    CONNECTION_OPEN            // Subscribed to the OTA topic
+};
+
+enum DataLookup {
+    LOOKUP_IDLE = 0,
+    LOOKUP_PENDING,
+    LOOKUP_FOUND,
+    LOOKUP_FAILED
+};
+
+const uint16_t kSubscribePacketId = 1;
+const int kMaxReadsPerPoll = 32;           // handle() returns at least every 32 reads
+const unsigned long kHandshakeTimeoutMs = 5000;     // TCP connect and CONNACK together
+
+static_assert(MQTT_OTA_DATA_MESSAGE_SIZE >= OTA_CHUNK_HEADER_SIZE + 255 &&
+              MQTT_OTA_DATA_MESSAGE_SIZE >= OTA_IMAGE_MIN_HEADER,
+              "MQTT_OTA_DATA_MESSAGE_SIZE must hold a chunk header and an image header");
+
+}
+
+bool MQTTOTA::enableDataClient(const char* host, uint16_t port, const char* user, const char* password) {
+    disableDataClient();
+
+    if (_otaTopic.length() == 0) {
+        OTA_LOGLN("ERROR: Cliente de datos sin tópico OTA");
+        return false;
+    }
+
+    _dataBuffer = (uint8_t*)malloc(MQTT_OTA_DATA_BUFFER + MQTT_OTA_DATA_MESSAGE_SIZE + MQTT_OTA_DATA_OUTPUT);
+    if (!_dataBuffer) {
+        OTA_LOGLN("ERROR: No se pudo asignar buffer del cliente de datos");
+        return false;
+    }
+
+    _dataHost = host;
+    _dataPort = port;
+    _dataHasUser = user != nullptr;
+    _dataHasPassword = password != nullptr;
+    _dataUser = user ? user : "";
+    _dataPassword = password ? password : "";
+    _dataStats = OTADataClientStats();
+    _dataClientEnabled = true;
+    _connectDataClient();
+    return true;
+}
+
+void MQTTOTA::disableDataClient() {
+    if (_dataConnection == CONNECTION_OPEN) {
+        static const uint8_t disconnect[2] = { OTA_MQTT_DISCONNECT << 4, 0 };
+        _sendData(disconnect, sizeof(disconnect));
+    }
+    _closeDataClient(NULL);
+    _dataConnection = CONNECTION_CLOSED;
+    _dataClientEnabled = false;
+    if (_dataBuffer) {
+        free(_dataBuffer);
+        _dataBuffer = nullptr;
+    }
+}
+
+bool MQTTOTA::isDataClientConnected() const {
+    return _dataConnection == CONNECTION_OPEN;
+}
+
+OTADataClientStats MQTTOTA::getDataClientStats() const {
+    return _dataStats;
+}
+
+// Starts an attempt: looks the broker up, or connects if the answer is at hand
+void MQTTOTA::_connectDataClient() {
+    _dataLastAttempt = millis();
+
+    // setMQTTConfig() may have cleared the topic since enableDataClient()
+    if (_otaTopic.length() == 0) {
+        OTA_LOGLN("ERROR: Cliente de datos sin tópico OTA");
+        return;
+    }
+    _dataConnection = CONNECTION_RESOLVING;
+
+    // A lookup of an earlier attempt is still out; its answer serves this one
+    if (_dataLookup == LOOKUP_PENDING) return;
+
+    ip_addr_t address;
+    _dataLookup = LOOKUP_PENDING;
+#if LWIP_TCPIP_CORE_LOCKING
+    LOCK_TCPIP_CORE();
+#endif
+    err_t result = dns_gethostbyname_addrtype(_dataHost.c_str(), &address, &MQTTOTA::_dataResolved, this,
+                                              LWIP_DNS_ADDRTYPE_IPV4);
+#if LWIP_TCPIP_CORE_LOCKING
+    UNLOCK_TCPIP_CORE();
+#endif
+    if (result == ERR_OK) {
+        _dataResolved(_dataHost.c_str(), &address, this);
+    } else if (result != ERR_INPROGRESS) {
+        _dataLookup = LOOKUP_FAILED;
+    }
+}
+
+// In the lwIP thread, unless the answer was cached. lwIP cannot cancel a
+// lookup, so it always ends here, found or not, even after disableDataClient().
+void MQTTOTA::_dataResolved(const char* name, const ip_addr_t* address, void* arg) {
+    MQTTOTA* ota = (MQTTOTA*)arg;
+    if (address && IP_IS_V4(address)) {
+        ota->_dataAddress = ip4_addr_get_u32(ip_2_ip4(address));
+        ota->_dataLookup = LOOKUP_FOUND;
+    } else {
+        ota->_dataLookup = LOOKUP_FAILED;
+    }
+}
+
+void MQTTOTA::_openDataSocket() {
+    if (_dataLookup == LOOKUP_PENDING) return;
+    if (_dataLookup != LOOKUP_FOUND) {
+        OTA_LOGF("ERROR: Cliente de datos no pudo resolver %s\n", _dataHost.c_str());
+        _dataConnection = CONNECTION_CLOSED;
+        _dataLastAttempt = millis();
+        return;
+    }
+
+    int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock < 0) {
+        OTA_LOGLN("ERROR: No se pudo crear socket del cliente de datos");
+        _dataConnection = CONNECTION_CLOSED;
+        _dataLastAttempt = millis();
+        return;
+    }
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    int noDelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(_dataPort);
+    address.sin_addr.s_addr = _dataAddress;
+
+    _dataSocket = sock;
+    _dataOutLength = 0;
+    _dataReader.reset();
+    _dataMessage = DATA_SKIP;
+    _dataHeld = 0;
+    _dataLastAttempt = millis();
+    _dataConnection = CONNECTION_CONNECTING;
+    if (connect(sock, (struct sockaddr*)&address, sizeof(address)) != 0 && errno != EINPROGRESS) {
+        OTA_LOGF("ERROR: Cliente de datos no pudo conectar a %s:%u\n", _dataHost.c_str(), _dataPort);
+        _closeDataClient(NULL);
+    }
+}
+
+// The connect is done once the socket is writable; then CONNECT goes out
+void MQTTOTA::_awaitDataConnect() {
+    fd_set writable;
+    FD_ZERO(&writable);
+    FD_SET(_dataSocket, &writable);
+    struct timeval now = { 0, 0 };
+    int ready = select(_dataSocket + 1, NULL, &writable, NULL, &now);
+    if (ready == 0) {
+        if (millis() - _dataLastAttempt >= kHandshakeTimeoutMs) {
+            OTA_LOGF("ERROR: Cliente de datos no pudo conectar a %s:%u\n", _dataHost.c_str(), _dataPort);
+            _closeDataClient(NULL);
+        }
+        return;
+    }
+
+    int error = 0;
+    socklen_t errorLength = sizeof(error);
+    if (ready < 0 || getsockopt(_dataSocket, SOL_SOCKET, SO_ERROR, &error, &errorLength) != 0 || error != 0) {
+        OTA_LOGF("ERROR: Cliente de datos no pudo conectar a %s:%u\n", _dataHost.c_str(), _dataPort);
+        _closeDataClient(NULL);
+        return;
+    }
+
+    String clientId = _deviceID + "-data";
+    size_t length = otaMqttConnectEncode(_dataBuffer, MQTT_OTA_DATA_BUFFER, clientId.c_str(),
+                                         _dataHasUser ? _dataUser.c_str() : NULL,
+                                         _dataHasPassword ? _dataPassword.c_str() : NULL, MQTT_OTA_DATA_KEEPALIVE);
+    if (length == 0 || !_sendData(_dataBuffer, length)) {
+        _closeDataClient("no se pudo enviar CONNECT");
+        return;
+    }
+    _dataConnection = CONNECTION_HANDSHAKE;
+}
+
+// CONNACK is the first packet a broker sends
+void MQTTOTA::_awaitDataConnack() {
+    int received = recv(_dataSocket, _dataBuffer, MQTT_OTA_DATA_BUFFER, 0);
+    if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        if (millis() - _dataLastAttempt >= kHandshakeTimeoutMs) {
+            _closeDataClient("sin CONNACK");
+        }
+        return;
+    }
+    if (received <= 0) {
+        _closeDataClient("sin CONNACK");
+        return;
+    }
+
+    size_t used;
+    OTAMqttEvent event = _dataReader.next(_dataBuffer, received, &used);
+    if (event == OTA_MQTT_NEED_MORE) return;
+    if (event != OTA_MQTT_PACKET || _dataReader.type != OTA_MQTT_CONNACK || _dataReader.body[1] != 0 ||
+        used != (size_t)received) {
+        OTA_LOGF("ERROR: Broker rechazó cliente de datos (código %u)\n", _dataReader.body[1]);
+        _closeDataClient(NULL);
+        return;
+    }
+
+    _dataConnection = CONNECTION_OPEN;
+    _subscribeData();
+    if (_dataSocket < 0) return;
+    _dataStats.connects++;
+    OTA_LOGF("Cliente de datos conectado a %s:%u, tema %s\n", _dataHost.c_str(), _dataPort, _otaTopic.c_str());
+}
+
+// At QoS 1 a busy broker queues chunks instead of dropping them. With part
+// requests or gap reports the library asks for lost chunks itself, and QoS 0
+// spares the PUBACKs. Subscribing again replaces the QoS, so a change of
+// either is picked up.
+void MQTTOTA::_subscribeData() {
+    uint8_t qos = _partRequestsEnabled || _gapReportsEnabled ? 0 : 1;
+    size_t length = otaMqttSubscribeEncode(_dataBuffer, MQTT_OTA_DATA_BUFFER, kSubscribePacketId,
+                                           _otaTopic.c_str(), qos);
+    if (length == 0 || !_sendData(_dataBuffer, length)) {
+        _closeDataClient("no se pudo suscribir");
+        return;
+    }
+    _dataSubscribedQos = qos;
+}
+
+void MQTTOTA::_closeDataClient(const char* reason) {
+    if (_dataSocket < 0) return;
+    close(_dataSocket);
+    _dataSocket = -1;
+    _dataOutLength = 0;
+    _dataConnection = CONNECTION_CLOSED;
+    _dataLastAttempt = millis();
+    if (reason) {
+        OTA_LOGF("Cliente de datos desconectado: %s\n", reason);
+    }
+
+    // Part of the chunk is already written; a resend could not be told apart
+    if (_dataMessage == DATA_CHUNK && _otaContext.inProgress) {
+        _publishError("Conexión de datos perdida a mitad de chunk", _dataChunk.firmwareVersion, OTA_ERR_ABORTED);
+        _cleanupChunkedOTA();
+    }
+    _dataMessage = DATA_SKIP;
+}
+
+// Sends what the socket takes now and keeps the rest, after any bytes already
+// waiting; false if the socket failed or the output area cannot hold the rest
+bool MQTTOTA::_sendData(const uint8_t* data, size_t length) {
+    if (!_flushData()) return false;
+    if (_dataOutLength == 0) {
+        int sent = send(_dataSocket, data, length, 0);
+        if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) return false;
+        if (sent > 0) {
+            data += sent;
+            length -= sent;
+            _dataLastSend = millis();
+        }
+    }
+    if (length == 0) return true;
+    if (length > MQTT_OTA_DATA_OUTPUT - _dataOutLength) return false;
+    memcpy(_dataBuffer + MQTT_OTA_DATA_BUFFER + MQTT_OTA_DATA_MESSAGE_SIZE + _dataOutLength, data, length);
+    _dataOutLength += length;
+    return true;
+}
+
+// Passes waiting bytes to the socket as far as it takes them; false if it failed
+bool MQTTOTA::_flushData() {
+    if (_dataOutLength == 0) return true;
+    uint8_t* output = _dataBuffer + MQTT_OTA_DATA_BUFFER + MQTT_OTA_DATA_MESSAGE_SIZE;
+    int sent = send(_dataSocket, output, _dataOutLength, 0);
+    if (sent < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+    memmove(output, output + sent, _dataOutLength - sent);
+    _dataOutLength -= sent;
+    _dataLastSend = millis();
+    return true;
+}
+
+void MQTTOTA::_pollDataClient() {
+    if (!_dataClientEnabled) return;
+
+    switch (_dataConnection) {
+    case CONNECTION_CLOSED:
+        if (millis() - _dataLastAttempt >= MQTT_OTA_DATA_RECONNECT_MS) {
+            _connectDataClient();
+        }
+        return;
+    case CONNECTION_RESOLVING:
+        _openDataSocket();
+        return;
+    case CONNECTION_CONNECTING:
+        _awaitDataConnect();
+        return;
+    case CONNECTION_HANDSHAKE:
+        if (!_flushData()) {
+            _closeDataClient("no se pudo enviar CONNECT");
+            return;
+        }
+        _awaitDataConnack();
+        return;
+    }
+
+    if (!_flushData()) {
+        _closeDataClient("error de escritura");
+        return;
+    }
+
+    if (_dataSubscribedQos != (_partRequestsEnabled || _gapReportsEnabled ? 0 : 1)) {
+        _subscribeData();
+        if (_dataSocket < 0) return;
+    }
+
+    if (millis() - _dataLastSend >= MQTT_OTA_DATA_KEEPALIVE * 500UL) {
+        uint8_t ping[OTA_MQTT_PINGREQ_SIZE];
+        if (!_sendData(ping, otaMqttPingEncode(ping, sizeof(ping)))) {
+            _closeDataClient("no se pudo enviar PINGREQ");
+            return;
+        }
+    }
+
+    for (int reads = 0; reads < kMaxReadsPerPoll; reads++) {
+        int received = recv(_dataSocket, _dataBuffer, MQTT_OTA_DATA_BUFFER, 0);
+        if (received < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                _closeDataClient("error de lectura");
+            }
+            return;
+        }
+        if (received == 0) {
+            _closeDataClient("conexión cerrada por el broker");
+            return;
+        }
+        _dataStats.wireBytes += received;
+        _dataStats.copiedBytes += received;
+
+        const uint8_t* data = _dataBuffer;
+        size_t length = received;
+        for (;;) {
+            size_t used;
+            OTAMqttEvent event = _dataReader.next(data, length, &used);
+            data += used;
+            length -= used;
+            if (event == OTA_MQTT_NEED_MORE) break;
+            if (event == OTA_MQTT_MALFORMED) {
+                _closeDataClient("flujo MQTT inválido");
+                return;
+            }
+            _onDataEvent(event);
+            if (_dataSocket < 0) return;
+        }
+    }
+}
+
+void MQTTOTA::_onDataEvent(OTAMqttEvent event) {
+    OTAMqttReader& reader = _dataReader;
+    uint8_t* message = _dataBuffer + MQTT_OTA_DATA_BUFFER;
+
+    if (event == OTA_MQTT_PACKET) {
+        if (reader.type == OTA_MQTT_SUBACK && reader.body[2] == 0x80) {
+            OTA_LOGF("ERROR: Broker rechazó la suscripción a %s\n", _otaTopic.c_str());
+        }
+        return;
+    }
+
+    if (event == OTA_MQTT_PUBLISH_BEGIN) {
+        _dataStats.messages++;
+        _dataHeld = 0;
+        _dataMessage = DATA_PENDING;
+        if (reader.topicTruncated || _otaTopic != reader.topic || reader.payloadLength == 0) {
+            _dataMessage = DATA_SKIP;
+            _dataStats.skippedMessages++;
+        }
+        _messageReceivedAt = millis();
+        _messageReceivedMicros = micros();
+        return;
+    }
+
+    // OTA_MQTT_PAYLOAD or OTA_MQTT_PUBLISH_END
+    const uint8_t* data = reader.piece;
+    size_t length = reader.pieceLength;
+
+    if (_dataMessage == DATA_PENDING && length > 0) {
+        if (data[0] == OTA_CHUNK_MAGIC) {
+            _dataMessage = DATA_CHUNK_HEADER;
+        } else if (!MQTT_OTA_JSON) {
+            _dataMessage = DATA_SKIP;
+            _dataStats.skippedMessages++;
+        } else if (reader.payloadLength <= MQTT_OTA_DATA_MESSAGE_SIZE) {
+            _dataMessage = DATA_JSON;
+        } else {
+            OTA_LOGF("Mensaje de %u bytes excede MQTT_OTA_DATA_MESSAGE_SIZE, ignorado\n",
+                     (unsigned)reader.payloadLength);
+            _dataMessage = DATA_SKIP;
+            _dataStats.skippedMessages++;
+        }
+    }
+
+    if (_dataMessage == DATA_JSON && length > 0) {
+        memcpy(message + _dataHeld, data, length);
+        _dataHeld += length;
+        _dataStats.copiedBytes += length;
+    }
+
+    if (_dataMessage == DATA_CHUNK_HEADER) {
+        size_t needed = _dataHeld < OTA_CHUNK_HEADER_SIZE ? OTA_CHUNK_HEADER_SIZE
+                                                          : OTA_CHUNK_HEADER_SIZE + message[6];
+        while (length > 0 && _dataHeld < needed) {
+            size_t take = needed - _dataHeld < length ? needed - _dataHeld : length;
+            memcpy(message + _dataHeld, data, take);
+            _dataHeld += take;
+            _dataStats.copiedBytes += take;
+            data += take;
+            length -= take;
+            if (_dataHeld == OTA_CHUNK_HEADER_SIZE) needed += message[6];
+        }
+        if (_dataHeld == needed) {
+            _beginDataChunk();
+        }
+    }
+
+    if (_dataMessage == DATA_CHUNK && length > 0 && !_writeDataChunk(data, length)) {
+        _dataMessage = DATA_SKIP;
+    }
+
+    if (event != OTA_MQTT_PUBLISH_END) return;
+
+    uint8_t ack[4];
+    if (reader.qos() > 0 && !_sendData(ack, otaMqttPubackEncode(ack, sizeof(ack), reader.packetId))) {
+        _closeDataClient("no se pudo enviar PUBACK");
+        return;
+    }
+
+    uint8_t finished = _dataMessage;
+    _dataMessage = DATA_SKIP;
+    if (finished == DATA_JSON) {
+        processMessage(_otaTopic, message, _dataHeld);
+    } else if (finished == DATA_CHUNK_HEADER) {
+        OTA_LOGLN("Chunk binario inválido");
+        _dataStats.skippedMessages++;
+    } else if (finished == DATA_CHUNK) {
+        _otaContext.receivedSize += _dataChunk.dataLength;
+        _updateStatistics(_dataChunk.dataLength);
+        OTA_LOGF("Chunk %d: %d bytes (cliente de datos). Total: %d bytes\n",
+                 _dataChunk.partIndex, _dataChunk.dataLength, _otaContext.receivedSize);
+        _finishChunk(_dataChunk);
+    }
+}
+
+// Same checks as processMessage() and _processBinaryChunk(), once the header is in
+void MQTTOTA::_beginDataChunk() {
+    const uint8_t* message = _dataBuffer + MQTT_OTA_DATA_BUFFER;
+    _dataMessage = DATA_SKIP;
+
+    OTAChunkHeader header;
+    if (!otaChunkHeaderDecode(message, _dataHeld, header)) {
+        OTA_LOGLN("Chunk binario inválido");
+        _dataStats.skippedMessages++;
+        return;
+    }
+    if ((header.deviceHash != 0 && header.deviceHash != _deviceHash) || _otaInProgress || !_chunkedOTAEnabled) {
+        _dataStats.skippedMessages++;
+        return;
+    }
+    // Skipped like in _dispatchMessage(); the session goes on without the chunk
+    if (ESP.getFreeHeap() < 30000) {
+        OTA_LOGLN("Memoria insuficiente para procesar OTA");
+        _dataStats.skippedMessages++;
+        return;
+    }
+
+    OTAChunkData& chunk = _dataChunk;
+    {
+        StageScope scope(this, OTA_STAGE_PARSE);
+        chunk = OTAChunkData();
+        chunk.firmwareVersion = String((const char*)message + OTA_CHUNK_HEADER_SIZE, header.versionLength);
+        chunk.partIndex = header.part;
+        chunk.totalParts = header.totalParts;
+        chunk.isError = false;
+        chunk.sentAt = header.sentAt;
+        chunk.sequence = header.sequence;
+        chunk.dataLength = _dataReader.payloadLength - _dataHeld;
+        chunk.streamed = true;
+    }
+
+    if (!_acceptChunk(chunk)) {
+        _dataStats.skippedMessages++;
+        return;
+    }
+    _dataHeld = 0;
+    _dataWritten = 0;
+    _dataMessage = DATA_CHUNK;
+}
+
+// Writes image bytes of the streamed chunk; on failure the session is over
+bool MQTTOTA::_writeDataChunk(const uint8_t* data, size_t length) {
+    uint8_t* message = _dataBuffer + MQTT_OTA_DATA_BUFFER;
+
+    // The image header check needs the start of part 1 in one piece
+    if (_dataChunk.partIndex == 1 && _dataWritten == 0) {
+        size_t needed = _dataChunk.dataLength < OTA_IMAGE_MIN_HEADER ? _dataChunk.dataLength : OTA_IMAGE_MIN_HEADER;
+        size_t take = needed - _dataHeld < length ? needed - _dataHeld : length;
+        if (_dataHeld > 0 || take < needed) {
+            memcpy(message + _dataHeld, data, take);
+            _dataHeld += take;
+            _dataStats.copiedBytes += take;
+            data += take;
+            length -= take;
+            if (_dataHeld < needed) return true;
+
+            UBaseType_t savedPriority = _throttleBegin();
+            bool written = _writeChunkBytes(_dataChunk, message, _dataHeld, true);
+            _throttleEnd(savedPriority);
+            if (!written) {
+                _cleanupChunkedOTA();
+                return false;
+            }
+            _dataWritten = _dataHeld;
+            _dataStats.imageBytes += _dataHeld;
+            _dataHeld = 0;
+        }
+    }
+    if (length == 0) return true;
+
+    UBaseType_t savedPriority = _throttleBegin();
+    bool written = _writeChunkBytes(_dataChunk, data, length, _dataChunk.partIndex == 1 && _dataWritten == 0);
+    _throttleEnd(savedPriority);
+    if (!written) {
+        _cleanupChunkedOTA();
+        return false;
+    }
+    _dataWritten += length;
+    _dataStats.imageBytes += length;
+    return true;
+}
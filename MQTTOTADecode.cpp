@@ -0,0 +1,114 @@
+#include "MQTTOTA.h"
+
+// A full image arrives as one Base64 string. Rather than decoding all of it
+// before the first flash write, otaBase64Plan() cuts it into
+// MQTT_OTA_DECODE_SEGMENTS segments that start on a 4-character group and
+// decode into their own part of one output buffer. A task pinned to the other
+// core and the caller take the segments in order; the caller writes the image
+// as far as the segments from the first one are decoded, and decodes the next
+// free segment while it waits. On single-core chips the caller decodes every
+// segment itself, just ahead of the writes.
+#if MQTT_OTA_FULL_IMAGE
+
+namespace {
+
+enum SegmentState : uint8_t {
+    SEGMENT_PENDING = 0,
+    SEGMENT_DONE = 1,
+    SEGMENT_FAILED = 2
+};
+
+}  // namespace
+
+MQTTOTA::ParallelDecode::~ParallelDecode() {
+    // The task reads the text and writes the output until it sees _stop
+    portENTER_CRITICAL(&_lock);
+    _stop = true;
+    bool running = _helperRunning;
+    portEXIT_CRITICAL(&_lock);
+    while (running) {
+        xSemaphoreTake(_progress, pdMS_TO_TICKS(10));
+        portENTER_CRITICAL(&_lock);
+        running = _helperRunning;
+        portEXIT_CRITICAL(&_lock);
+    }
+    if (_progress) vSemaphoreDelete(_progress);
+    free(_out);
+}
+
+OTAErrorCode MQTTOTA::ParallelDecode::start(const String& text) {
+    _text = text.c_str();
+    _count = otaBase64Plan(_text, text.length(), _segments, MQTT_OTA_DECODE_SEGMENTS, &_length);
+    if (_count == 0) return OTA_ERR_DECODE;
+
+    _out = (uint8_t*)malloc(_length);
+    if (!_out) return OTA_ERR_NO_MEMORY;
+
+#if portNUM_PROCESSORS > 1
+    // Without the task the caller decodes alone, which is still correct
+    if (_count > 1) {
+        _progress = xSemaphoreCreateBinary();
+        _helperRunning = _progress != NULL;
+        if (_helperRunning && xTaskCreatePinnedToCore(_task, "ota_decode", MQTT_OTA_DECODE_STACK, this,
+                                                      uxTaskPriorityGet(NULL), NULL,
+                                                      xPortGetCoreID() ^ 1) != pdPASS) {
+            _helperRunning = false;
+        }
+    }
+#endif
+    return OTA_ERR_NONE;
+}
+
+bool MQTTOTA::ParallelDecode::waitFor(size_t bytes) {
+    while (_ready < _count && _segments[_ready].offset < bytes) {
+        portENTER_CRITICAL(&_lock);
+        uint8_t state = _state[_ready];
+        bool failed = _stop;
+        portEXIT_CRITICAL(&_lock);
+
+        // Any failed segment ends the decode, the ones left are not taken
+        if (failed) return false;
+        if (state == SEGMENT_DONE) {
+            _ready++;
+        } else if (!_decodeNext(false)) {
+            // The task has the segment
+            xSemaphoreTake(_progress, pdMS_TO_TICKS(10));
+        }
+    }
+    return true;
+}
+
+// Takes the first free segment and decodes it; false when none is left
+bool MQTTOTA::ParallelDecode::_decodeNext(bool helper) {
+    portENTER_CRITICAL(&_lock);
+    uint8_t index = _next;
+    bool taken = !_stop && index < _count;
+    if (taken) _next++;
+    portEXIT_CRITICAL(&_lock);
+    if (!taken) return false;
+
+    bool decoded = otaBase64DecodeSegment(_text, _segments[index], _out);
+
+    portENTER_CRITICAL(&_lock);
+    _state[index] = decoded ? SEGMENT_DONE : SEGMENT_FAILED;
+    if (!decoded) _stop = true;
+    if (helper) _helperSegments++;
+    portEXIT_CRITICAL(&_lock);
+    return true;
+}
+
+void MQTTOTA::ParallelDecode::_task(void* arg) {
+    ParallelDecode* decode = static_cast<ParallelDecode*>(arg);
+    while (decode->_decodeNext(true)) {
+        xSemaphoreGive(decode->_progress);
+    }
+
+    // The destructor may free the object as soon as _helperRunning is clear
+    xSemaphoreGive(decode->_progress);
+    portENTER_CRITICAL(&decode->_lock);
+    decode->_helperRunning = false;
+    portEXIT_CRITICAL(&decode->_lock);
+    vTaskDelete(NULL);
+}
+
+#endif
@@ -0,0 +1,216 @@
+#include "MQTTOTA.h"
+
+namespace {
+
+void fillPartition(const esp_partition_t* partition, OTAPartitionSnapshot& out) {
+    memset(&out, 0, sizeof(out));
+    out.imageState = 0xFF;
+    if (!partition) {
+        strlcpy(out.label, "none", sizeof(out.label));
+        return;
+    }
+
+    strlcpy(out.label, partition->label, sizeof(out.label));
+    out.address = partition->address;
+    out.size = partition->size;
+    out.type = partition->type;
+    out.subtype = partition->subtype;
+
+    esp_ota_img_states_t state;
+    if (esp_ota_get_state_partition(partition, &state) == ESP_OK) {
+        out.imageState = (uint8_t)state;
+    }
+
+    esp_app_desc_t app;
+    if (esp_ota_get_partition_description(partition, &app) == ESP_OK) {
+        out.hasApp = true;
+        strlcpy(out.version, app.version, sizeof(out.version));
+        strlcpy(out.projectName, app.project_name, sizeof(out.projectName));
+        strlcpy(out.date, app.date, sizeof(out.date));
+        strlcpy(out.time, app.time, sizeof(out.time));
+    }
+}
+
+#if MQTT_OTA_JSON
+void addPartition(JsonObject object, const OTAPartitionSnapshot& partition) {
+    object["l"] = partition.label;
+    object["a"] = partition.address;
+    object["s"] = partition.size;
+    if (partition.imageState != 0xFF) object["st"] = partition.imageState;
+    if (partition.hasApp) {
+        object["v"] = partition.version;
+        object["p"] = partition.projectName;
+        object["d"] = partition.date;
+        object["t"] = partition.time;
+    }
+}
+#endif
+
+}
+
+// Diagnostics Snapshot
+void MQTTOTA::getDiagnostics(DiagnosticsSnapshot& snapshot) {
+    memset(&snapshot, 0, sizeof(snapshot));
+
+    strlcpy(snapshot.deviceId, _deviceID.c_str(), sizeof(snapshot.deviceId));
+    strlcpy(snapshot.firmwareVersion, _firmwareVersion.c_str(), sizeof(snapshot.firmwareVersion));
+    snapshot.deviceHash = _deviceHash;
+    snapshot.uptimeMs = millis();
+
+    fillPartition(esp_ota_get_running_partition(), snapshot.running);
+    fillPartition(esp_ota_get_boot_partition(), snapshot.boot);
+    fillPartition(esp_ota_get_next_update_partition(NULL), snapshot.next);
+
+    snapshot.freeHeap = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    snapshot.minFreeHeap = heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL);
+    snapshot.largestFreeBlock = heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL);
+    snapshot.psramSize = heap_caps_get_total_size(MALLOC_CAP_SPIRAM);
+    snapshot.freePsram = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+    snapshot.minFreePsram = heap_caps_get_minimum_free_size(MALLOC_CAP_SPIRAM);
+
+    snapshot.state = static_cast<uint8_t>(_otaContext.state);
+    snapshot.progress = _currentProgress;
+    snapshot.updateInProgress = isUpdateInProgress();
+    snapshot.throttleLevel = _throttleLevel;
+
+    snapshot.sessionsStarted = _sessionsStarted;
+    snapshot.sessionsSucceeded = _sessionsSucceeded;
+    snapshot.sessionsFailed = _sessionsFailed;
+
+    unsigned long sessionEnd = _sessionActive ? millis() : _stats.endTime;
+    unsigned long duration = _stats.startTime ? sessionEnd - _stats.startTime : 0;
+    snapshot.sessionBytes = _stats.receivedBytes;
+    snapshot.sessionChunks = _stats.chunkCount;
+    snapshot.sessionErrors = _stats.errorCount;
+    snapshot.sessionDurationMs = duration;
+    snapshot.sessionSpeed = _sessionActive && duration
+        ? (uint32_t)((_stats.receivedBytes * 1000ULL) / duration)
+        : (uint32_t)_stats.averageSpeed;
+    snapshot.sessionHeapLow = _stats.freeHeapLow == SIZE_MAX ? 0 : _stats.freeHeapLow;
+    snapshot.lastErrorCode = _stats.lastErrorCode;
+    snapshot.lastEspError = _stats.lastEspError;
+}
+
+void MQTTOTA::publishDiagnostics() {
+    if (!_isMQTTConnected || !_isMQTTConnected()) return;
+
+    DiagnosticsSnapshot snapshot;
+    getDiagnostics(snapshot);
+
+    if ((_telemetryFormat & OTA_TELEMETRY_BINARY) && _publishBinary) {
+        uint8_t payload[OTA_DIAGNOSTICS_SIZE];
+        size_t length = otaDiagnosticsEncode(snapshot, payload);
+        _publishBytes(OTA_TOPIC_BIN_DIAGNOSTICS, payload, length, OTA_PUBLISH_STATUS);
+    }
+
+#if MQTT_OTA_JSON
+    if (!_jsonTelemetryEnabled() || !_publishMQTT) return;
+
+    // Short keys keep the message small enough for one MQTT packet
+    StaticJsonDocument<1536> doc;
+    doc["id"] = snapshot.deviceId;
+    doc["fw"] = snapshot.firmwareVersion;
+    doc["up"] = snapshot.uptimeMs;
+    addPartition(doc.createNestedObject("run"), snapshot.running);
+    addPartition(doc.createNestedObject("boot"), snapshot.boot);
+    addPartition(doc.createNestedObject("next"), snapshot.next);
+
+    JsonArray heap = doc.createNestedArray("heap");
+    heap.add(snapshot.freeHeap);
+    heap.add(snapshot.minFreeHeap);
+    heap.add(snapshot.largestFreeBlock);
+    if (snapshot.psramSize) {
+        JsonArray psram = doc.createNestedArray("psram");
+        psram.add(snapshot.psramSize);
+        psram.add(snapshot.freePsram);
+        psram.add(snapshot.minFreePsram);
+    }
+
+    doc["st"] = snapshot.state;
+    doc["pr"] = snapshot.progress;
+    doc["busy"] = snapshot.updateInProgress;
+    doc["thr"] = snapshot.throttleLevel;
+
+    JsonArray sessions = doc.createNestedArray("ses");
+    sessions.add(snapshot.sessionsStarted);
+    sessions.add(snapshot.sessionsSucceeded);
+    sessions.add(snapshot.sessionsFailed);
+
+    JsonObject last = doc.createNestedObject("last");
+    last["b"] = snapshot.sessionBytes;
+    last["c"] = snapshot.sessionChunks;
+    last["e"] = snapshot.sessionErrors;
+    last["ms"] = snapshot.sessionDurationMs;
+    last["bps"] = snapshot.sessionSpeed;
+    last["hl"] = snapshot.sessionHeapLow;
+    if (snapshot.lastErrorCode != OTA_ERR_NONE) {
+        last["err"] = otaErrorCodeName(snapshot.lastErrorCode);
+        last["esp"] = snapshot.lastEspError;
+    }
+
+    char output[1024];
+    size_t length = serializeJson(doc, output, sizeof(output));
+    if (length >= sizeof(output) - 1) {
+        OTA_LOGLN("Buffer de diagnósticos insuficiente");
+        return;
+    }
+    _publishText(OTA_TOPIC_DIAGNOSTICS, String(output), OTA_PUBLISH_STATUS);
+#endif
+}
+
+#if MQTT_OTA_LOG
+void MQTTOTA::printDiagnostics() {
+    DiagnosticsSnapshot snapshot;
+    getDiagnostics(snapshot);
+
+    OTA_LOGLN("=== Diagnósticos MQTTOTA ===");
+    OTA_LOGF("ID Dispositivo: %s\n", snapshot.deviceId);
+    OTA_LOGF("Firmware: %s\n", snapshot.firmwareVersion);
+    OTA_LOGF("Memoria Libre: %u bytes (mínimo %u, bloque mayor %u)\n",
+             (unsigned)snapshot.freeHeap, (unsigned)snapshot.minFreeHeap,
+             (unsigned)snapshot.largestFreeBlock);
+    if (snapshot.psramSize) {
+        OTA_LOGF("PSRAM Libre: %u de %u bytes\n",
+                 (unsigned)snapshot.freePsram, (unsigned)snapshot.psramSize);
+    }
+    OTA_LOGF("OTA en progreso: %s\n", snapshot.updateInProgress ? "Sí" : "No");
+    OTA_LOGF("Estado: %s\n", otaStateName(snapshot.state));
+    OTA_LOGF("Progreso actual: %d%%\n", snapshot.progress);
+    OTA_LOGF("Sesiones: %u iniciadas, %u exitosas, %u fallidas\n",
+             (unsigned)snapshot.sessionsStarted, (unsigned)snapshot.sessionsSucceeded,
+             (unsigned)snapshot.sessionsFailed);
+
+    const OTAPartitionSnapshot* partitions[3] = { &snapshot.running, &snapshot.boot, &snapshot.next };
+    const char* roles[3] = { "actual", "de arranque", "siguiente" };
+    for (int i = 0; i < 3; i++) {
+        const OTAPartitionSnapshot& partition = *partitions[i];
+        OTA_LOGF("Partición %s: %s (0x%08X)", roles[i], partition.label, (unsigned)partition.address);
+        if (partition.hasApp) {
+            OTA_LOGF(" - %s %s", partition.projectName, partition.version);
+        }
+        OTA_LOGLN();
+    }
+}
+#endif
+
+String MQTTOTA::getBootPartitionInfo() {
+    const esp_partition_t* boot_partition = esp_ota_get_boot_partition();
+    if (!boot_partition) return "Desconocido";
+
+    OTAPartitionSnapshot partition;
+    fillPartition(boot_partition, partition);
+
+    char buffer[256];
+    int length = snprintf(buffer, sizeof(buffer),
+                          "Etiqueta: %s, Tipo: %d, Subtipo: %d, Dirección: 0x%08X, Tamaño: %u",
+                          partition.label,
+                          partition.type,
+                          partition.subtype,
+                          (unsigned)partition.address,
+                          (unsigned)partition.size);
+    if (partition.hasApp && length > 0 && (size_t)length < sizeof(buffer)) {
+        snprintf(buffer + length, sizeof(buffer) - length, ", App: %s %s",
+                 partition.projectName, partition.version);
+    }
+    return String(buffer);
+}
@@ -0,0 +1,218 @@
+#include "MQTTOTA.h"
+
+// Gap reports make a session reliable when the server publishes its chunks at
+// QoS 0: no PUBACK per chunk and no inflight state at the broker. A part that
+// arrives ahead of a missing one is decoded and held in RAM, up to
+// MQTT_OTA_REORDER_SLOTS parts and MQTT_OTA_REORDER_BYTES bytes; once the
+// missing part is written the held ones follow in order, so the image is
+// still written sequentially. Parts already written or held are dropped as
+// duplicates. Every MQTT_OTA_GAP_REPORT_MS the device publishes the next part
+// it needs and a bitmap of the parts it holds; the server takes it as the ack
+// for everything before, and resends only what the report shows missing.
+
+bool MQTTOTA::_gapChunk(const OTAChunkData& chunk) {
+    _lastSequence = chunk.sequence;
+    if (!_otaContext.inProgress) {
+        // Joined mid-stream, e.g. after a reset; the running image needs nothing
+        if (chunk.firmwareVersion != _firmwareVersion) {
+            _reportGaps(chunk.firmwareVersion, false);
+        }
+        return true;
+    }
+
+    if (chunk.firmwareVersion != _otaContext.firmwareVersion) {
+        return false;
+    }
+
+    bool duplicate = chunk.partIndex <= _otaContext.currentPart;
+    for (uint8_t i = 0; i < _heldCount && !duplicate; i++) {
+        duplicate = _held[i].part == chunk.partIndex;
+    }
+    if (duplicate) {
+        _stats.duplicateParts++;
+        return true;
+    }
+
+    // A part past the highest one seen leaves the parts between it missing
+    bool newGap = chunk.partIndex > (int)_highestPart + 1 &&
+                  chunk.partIndex > _otaContext.currentPart + 1;
+    if (chunk.partIndex > (int)_highestPart) {
+        _highestPart = chunk.partIndex;
+    }
+
+    _holdChunk(chunk);
+    if (newGap) {
+        OTA_LOGF("Parte %d antes de la %d, reteniendo\n", chunk.partIndex, _otaContext.currentPart + 1);
+        _reportGaps(chunk.firmwareVersion, true);
+    }
+    return true;
+}
+
+// Copies the image bytes of an early part; false if it was dropped instead
+bool MQTTOTA::_holdChunk(const OTAChunkData& chunk) {
+    uint32_t ahead = chunk.partIndex - _otaContext.currentPart - 1;
+
+    // Streamed parts are written as they are read and cannot wait
+    if (chunk.streamed || ahead > OTA_GAPS_WINDOW) {
+        _stats.unheldParts++;
+        return false;
+    }
+
+    const uint8_t* bytes = chunk.data;
+    size_t length = chunk.dataLength;
+#if MQTT_OTA_JSON
+    String decodedData;
+    if (!bytes && chunk.z85Part.isEmpty()) {
+        {
+            StageScope scope(this, OTA_STAGE_DECODE);
+            decodedData = base64Decode(chunk.base64Part);
+        }
+        bytes = (const uint8_t*)decodedData.c_str();
+        length = decodedData.length();
+    } else if (!bytes) {
+        length = chunk.z85Part.length() % 5 == 1 ? 0 : otaZ85DecodedLength(chunk.z85Part.length());
+    }
+#endif
+    if (length == 0 || length > MQTT_OTA_REORDER_BYTES) {
+        _stats.unheldParts++;
+        return false;
+    }
+
+    // Full: the farthest part gives way to a nearer one, which is needed sooner
+    while (_heldCount == MQTT_OTA_REORDER_SLOTS || _heldBytes + length > MQTT_OTA_REORDER_BYTES) {
+        uint8_t farthest = 0;
+        for (uint8_t i = 1; i < _heldCount; i++) {
+            if (_held[i].part > _held[farthest].part) farthest = i;
+        }
+        if (_heldCount == 0 || _held[farthest].part < chunk.partIndex) {
+            _stats.unheldParts++;
+            return false;
+        }
+        _heldBytes -= _held[farthest].length;
+        free(_held[farthest].data);
+        _held[farthest] = _held[--_heldCount];
+        _stats.unheldParts++;
+    }
+
+    uint8_t* data = (uint8_t*)malloc(length);
+    if (!data) {
+        _stats.unheldParts++;
+        return false;
+    }
+#if MQTT_OTA_JSON
+    if (!bytes) {
+        bool decoded;
+        {
+            StageScope scope(this, OTA_STAGE_DECODE);
+            decoded = otaZ85Decode(chunk.z85Part.c_str(), chunk.z85Part.length(), data);
+        }
+        if (!decoded) {
+            OTA_LOGF("Parte %d: error decodificando, descartada\n", chunk.partIndex);
+            free(data);
+            _stats.unheldParts++;
+            return false;
+        }
+    } else
+#endif
+    {
+        memcpy(data, bytes, length);
+    }
+
+    HeldChunk& held = _held[_heldCount++];
+    held.data = data;
+    held.length = length;
+    held.part = chunk.partIndex;
+    held.totalParts = chunk.totalParts;
+    held.sequence = chunk.sequence;
+    held.sentAt = chunk.sentAt;
+    _heldBytes += length;
+    _stats.heldParts++;
+    return true;
+}
+
+// Writes the held parts that follow the last written one. Called after every
+// written part; the parts it writes end up here again, hence the guard.
+void MQTTOTA::_writeHeldChunks() {
+    if (_writingHeld) return;
+    _writingHeld = true;
+
+    while (_otaContext.inProgress && _heldCount > 0) {
+        uint8_t slot = _heldCount;
+        for (uint8_t i = 0; i < _heldCount; i++) {
+            if (_held[i].part == _otaContext.currentPart + 1) slot = i;
+        }
+        if (slot == _heldCount) break;
+
+        HeldChunk held = _held[slot];
+        _held[slot] = _held[--_heldCount];
+        _heldBytes -= held.length;
+
+        OTAChunkData chunk;
+        chunk.firmwareVersion = _otaContext.firmwareVersion;
+        chunk.partIndex = held.part;
+        chunk.totalParts = held.totalParts;
+        chunk.isError = false;
+        chunk.sentAt = held.sentAt;
+        chunk.sequence = held.sequence;
+        chunk.data = held.data;
+        chunk.dataLength = held.length;
+        _handleChunk(chunk);
+        free(held.data);
+    }
+
+    _writingHeld = false;
+}
+
+void MQTTOTA::_dropHeldChunks() {
+    while (_heldCount > 0) {
+        free(_held[--_heldCount].data);
+    }
+    _heldBytes = 0;
+    _highestPart = 0;
+    _lastSequence = 0;
+    _gapReportBackoff = 0;
+}
+
+// early: a new gap, reported ahead of the period but not more than four
+// times per period. A report that repeats the last one is sent only while
+// parts are missing, at a doubling interval, or every eighth period to show
+// the device is still there.
+void MQTTOTA::_reportGaps(const String& firmwareVersion, bool early) {
+    unsigned long interval = early ? MQTT_OTA_GAP_REPORT_MS / 4
+                                   : (unsigned long)MQTT_OTA_GAP_REPORT_MS << _gapReportBackoff;
+    unsigned long now = millis();
+    if (_lastGapReport != 0 && now - _lastGapReport < interval) return;
+    if (!_isMQTTConnected || !_isMQTTConnected()) return;
+
+    OTAGapReport report = {};
+    report.deviceHash = _deviceHash;
+    report.versionHash = otaHash32(firmwareVersion.c_str());
+    report.next = 1;
+    report.sequence = _lastSequence;
+    if (_otaContext.inProgress) {
+        report.next = _otaContext.currentPart + 1;
+        report.highest = _highestPart > _otaContext.currentPart ? _highestPart : _otaContext.currentPart;
+        for (uint8_t i = 0; i < _heldCount; i++) {
+            uint32_t bit = _held[i].part - report.next - 1;
+            if (bit < OTA_GAPS_WINDOW) report.held |= 1u << bit;
+        }
+        report.duplicates = _stats.duplicateParts > 0xFFFF ? 0xFFFF : _stats.duplicateParts;
+    }
+
+    uint32_t state = ((uint32_t)report.next << 16 | report.highest) ^ report.held;
+    bool missing = !_otaContext.inProgress || report.highest >= report.next;
+    if (!early && state == _lastGapState) {
+        if (!missing && now - _lastGapReport < (unsigned long)MQTT_OTA_GAP_REPORT_MS << 3) return;
+        if (_gapReportBackoff < 3) _gapReportBackoff++;
+    } else {
+        _gapReportBackoff = 0;
+    }
+    _lastGapState = state;
+    _lastGapReport = now;
+
+    StageScope scope(this, OTA_STAGE_PUBLISH);
+    uint8_t payload[OTA_GAPS_SIZE];
+    size_t length = otaGapReportEncode(report, payload);
+    _publishBytes(OTA_TOPIC_BIN_GAPS, payload, length, OTA_PUBLISH_CRITICAL, true);
+    _stats.gapReports++;
+}
@@ -0,0 +1,208 @@
+#include "MQTTOTA.h"
+
+// Each record has its own NVS key (slot = sequence % MQTT_OTA_HISTORY_SIZE), so
+// a session costs one blob write and NVS spreads it over its pages. The next
+// sequence is recovered from the records themselves; only the published
+// marker is stored separately, once per publish sweep.
+
+namespace {
+
+const char* kPublishedKey = "hpub";
+
+void slotKey(uint32_t sequence, char* key, size_t size) {
+    snprintf(key, size, "h%u", (unsigned)(sequence % MQTT_OTA_HISTORY_SIZE));
+}
+
+bool readRecord(nvs_handle_t handle, uint32_t sequence, OTASessionRecord& record) {
+    char key[8];
+    slotKey(sequence, key, sizeof(key));
+
+    uint8_t data[OTA_HISTORY_SIZE];
+    size_t length = sizeof(data);
+    if (nvs_get_blob(handle, key, data, &length) != ESP_OK) return false;
+    return otaSessionRecordDecode(data, length, record);
+}
+
+}
+
+void MQTTOTA::_loadHistory() {
+    if (!_historyEnabled || _historyLoaded || MQTT_OTA_HISTORY_SIZE == 0) return;
+
+    nvs_handle_t handle;
+    if (nvs_open(MQTT_OTA_HISTORY_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+        OTA_LOGLN("Historial OTA no disponible (NVS)");
+        return;
+    }
+
+    uint32_t next = 0;
+    for (uint32_t slot = 0; slot < MQTT_OTA_HISTORY_SIZE; slot++) {
+        OTASessionRecord record;
+        if (readRecord(handle, slot, record) && record.sequence + 1 > next) {
+            next = record.sequence + 1;
+        }
+    }
+
+    uint32_t published = 0;
+    nvs_get_u32(handle, kPublishedKey, &published);
+    nvs_close(handle);
+
+    _historyNext = next;
+    _historyPublished = published > next ? next : published;
+    _historyLoaded = true;
+
+    if (_historyPublished < _historyNext) {
+        OTA_LOGF("Historial OTA: %u sesiones pendientes de publicar\n",
+                 (unsigned)(_historyNext - _historyPublished));
+    }
+}
+
+void MQTTOTA::_appendHistory(bool success) {
+    if (!_historyEnabled || MQTT_OTA_HISTORY_SIZE == 0) return;
+    _loadHistory();
+    if (!_historyLoaded) return;
+
+    OTASessionRecord record;
+    memset(&record, 0, sizeof(record));
+    record.sequence = _historyNext;
+    strlcpy(record.versionFrom, _firmwareVersion.c_str(), sizeof(record.versionFrom));
+    strlcpy(record.versionTo, _sessionVersion.c_str(), sizeof(record.versionTo));
+    record.success = success;
+    record.throttleLevelMax = _stats.throttleLevelMax;
+    record.errorCode = success ? OTA_ERR_NONE : _stats.lastErrorCode;
+    record.retries = _stats.retries;
+    record.espError = success ? ESP_OK : _stats.lastEspError;
+    record.durationMs = _stats.endTime - _stats.startTime;
+    record.bytes = _stats.receivedBytes;
+    record.throughput = (uint32_t)_stats.averageSpeed;
+    record.chunks = _stats.chunkCount;
+    record.errors = _stats.errorCount;
+    record.heapLow = _stats.freeHeapLow == SIZE_MAX ? 0 : _stats.freeHeapLow;
+    record.largestBlockLow = _stats.largestFreeBlockLow == SIZE_MAX ? 0 : _stats.largestFreeBlockLow;
+#if MQTT_OTA_STATISTICS
+    for (int i = 0; i < OTA_STAGE_COUNT && i < OTA_HISTORY_STAGES; i++) {
+        record.stageP99Micros[i] = latencyPercentile(_stats.stageLatency[i], 99.0f);
+    }
+#endif
+
+    uint8_t data[OTA_HISTORY_SIZE];
+    otaSessionRecordEncode(record, data);
+
+    char key[8];
+    slotKey(record.sequence, key, sizeof(key));
+
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(MQTT_OTA_HISTORY_NAMESPACE, NVS_READWRITE, &handle);
+    if (err == ESP_OK) {
+        err = nvs_set_blob(handle, key, data, sizeof(data));
+        if (err == ESP_OK) {
+            err = nvs_commit(handle);
+        }
+        nvs_close(handle);
+    }
+
+    if (err != ESP_OK) {
+        OTA_LOGF("ERROR: No se pudo guardar historial OTA: %s\n", esp_err_to_name(err));
+        return;
+    }
+    _historyNext++;
+}
+
+void MQTTOTA::_publishHistory() {
+    if (!_isMQTTConnected || !_isMQTTConnected()) return;
+    bool json = _jsonTelemetryEnabled() && _publishMQTT;
+    bool binary = (_telemetryFormat & OTA_TELEMETRY_BINARY) && _publishBinary;
+    if (!json && !binary) return;
+
+    nvs_handle_t handle;
+    if (nvs_open(MQTT_OTA_HISTORY_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) return;
+
+    // Records older than the ring were overwritten before they could be sent
+    uint32_t first = _historyPublished;
+    if (_historyNext - first > MQTT_OTA_HISTORY_SIZE) {
+        first = _historyNext - MQTT_OTA_HISTORY_SIZE;
+    }
+
+    for (uint32_t sequence = first; sequence < _historyNext; sequence++) {
+        OTASessionRecord record;
+        if (!readRecord(handle, sequence, record) || record.sequence != sequence) continue;
+
+        if (binary) {
+            uint8_t data[OTA_HISTORY_SIZE];
+            otaSessionRecordEncode(record, data);
+            _publishBytes(OTA_TOPIC_BIN_HISTORY, data, sizeof(data), OTA_PUBLISH_STATUS);
+        }
+
+#if MQTT_OTA_JSON
+        if (json) {
+            StaticJsonDocument<768> doc;
+            doc["device"] = _deviceID;
+            doc["seq"] = record.sequence;
+            doc["from"] = record.versionFrom;
+            doc["to"] = record.versionTo;
+            doc["success"] = record.success;
+            doc["duration"] = record.durationMs;
+            doc["bytes"] = record.bytes;
+            doc["speed"] = record.throughput;
+            doc["chunks"] = record.chunks;
+            doc["errors"] = record.errors;
+            doc["retries"] = record.retries;
+            doc["heap_low"] = record.heapLow;
+            doc["largest_block_low"] = record.largestBlockLow;
+            doc["max_throttle"] = record.throttleLevelMax;
+            if (!record.success) {
+                doc["code"] = otaErrorCodeName(record.errorCode);
+                doc["esp_error"] = record.espError;
+            }
+            JsonObject p99 = doc.createNestedObject("p99_us");
+            for (int i = 0; i < OTA_STAGE_COUNT && i < OTA_HISTORY_STAGES; i++) {
+                p99[_getStageName(static_cast<OTAStage>(i))] = record.stageP99Micros[i];
+            }
+
+            char output[512];
+            serializeJson(doc, output, sizeof(output));
+            _publishText(OTA_TOPIC_HISTORY, String(output), OTA_PUBLISH_STATUS);
+        }
+#endif
+    }
+
+    _historyPublished = _historyNext;
+    nvs_set_u32(handle, kPublishedKey, _historyPublished);
+    nvs_commit(handle);
+    nvs_close(handle);
+}
+
+size_t MQTTOTA::getSessionHistory(OTASessionRecord* records, size_t maxRecords) {
+    _loadHistory();
+    if (!records || !_historyLoaded) return 0;
+
+    nvs_handle_t handle;
+    if (nvs_open(MQTT_OTA_HISTORY_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) return 0;
+
+    size_t count = 0;
+    uint32_t oldest = _historyNext > MQTT_OTA_HISTORY_SIZE ? _historyNext - MQTT_OTA_HISTORY_SIZE : 0;
+    for (uint32_t sequence = _historyNext; sequence > oldest && count < maxRecords; sequence--) {
+        OTASessionRecord& record = records[count];
+        if (readRecord(handle, sequence - 1, record) && record.sequence == sequence - 1) {
+            count++;
+        }
+    }
+    nvs_close(handle);
+    return count;
+}
+
+void MQTTOTA::clearSessionHistory() {
+    nvs_handle_t handle;
+    if (nvs_open(MQTT_OTA_HISTORY_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) return;
+
+    char key[8];
+    for (uint32_t slot = 0; slot < MQTT_OTA_HISTORY_SIZE; slot++) {
+        slotKey(slot, key, sizeof(key));
+        nvs_erase_key(handle, key);
+    }
+    nvs_erase_key(handle, kPublishedKey);
+    nvs_commit(handle);
+    nvs_close(handle);
+
+    _historyNext = 0;
+    _historyPublished = 0;
+}
@@ -0,0 +1,258 @@
+#include "MQTTOTA.h"
+
+// The whole endpoint renders the stage histograms
+#if MQTT_OTA_STATISTICS
+#include "lwip/sockets.h"
+
+static_assert(MQTT_OTA_METRICS_BUFFER_SIZE > OTA_METRICS_HEAD_ROOM + OTA_METRICS_REQUEST_SIZE,
+              "MQTT_OTA_METRICS_BUFFER_SIZE must hold the request and the response head");
+
+namespace {
+
+const char* partitionLabel(const esp_partition_t* partition) {
+    return partition ? partition->label : "none";
+}
+
+}
+
+// Prometheus Text Rendering
+size_t MQTTOTA::renderMetrics(char* buffer, size_t size) {
+    if (!buffer || size == 0) return 0;
+
+    OTAMetricsWriter out = { buffer, size, 0, false };
+    buffer[0] = '\0';
+
+    const esp_partition_t* running = esp_ota_get_running_partition();
+    const esp_partition_t* boot = esp_ota_get_boot_partition();
+    const esp_partition_t* next = esp_ota_get_next_update_partition(NULL);
+
+    out.line("# TYPE mqttota_info gauge\n");
+    out.line("mqttota_info{device=\"%s\",version=\"%s\",running=\"%s\",boot=\"%s\",next=\"%s\"} 1\n",
+             _deviceID.c_str(), _firmwareVersion.c_str(),
+             partitionLabel(running), partitionLabel(boot), partitionLabel(next));
+
+    out.line("# TYPE mqttota_partition_size_bytes gauge\n");
+    const esp_partition_t* partitions[3] = { running, boot, next };
+    const char* roles[3] = { "running", "boot", "next" };
+    for (int i = 0; i < 3; i++) {
+        if (partitions[i]) {
+            out.line("mqttota_partition_size_bytes{role=\"%s\",label=\"%s\",address=\"0x%08x\"} %u\n",
+                     roles[i], partitions[i]->label, (unsigned)partitions[i]->address,
+                     (unsigned)partitions[i]->size);
+        }
+    }
+
+    // Current status
+    out.line("# TYPE mqttota_update_in_progress gauge\nmqttota_update_in_progress %d\n",
+             isUpdateInProgress() ? 1 : 0);
+    out.line("# TYPE mqttota_progress_percent gauge\nmqttota_progress_percent %d\n", _currentProgress);
+    out.line("# TYPE mqttota_state gauge\nmqttota_state %d\n", static_cast<int>(_otaContext.state));
+    out.line("# TYPE mqttota_throttle_level gauge\nmqttota_throttle_level %u\n", _throttleLevel);
+
+    // Lifetime counters
+    out.line("# TYPE mqttota_sessions_total counter\n");
+    out.line("mqttota_sessions_total{result=\"started\"} %u\n", (unsigned)_sessionsStarted);
+    out.line("mqttota_sessions_total{result=\"success\"} %u\n", (unsigned)_sessionsSucceeded);
+    out.line("mqttota_sessions_total{result=\"failed\"} %u\n", (unsigned)_sessionsFailed);
+    out.line("# TYPE mqttota_written_bytes_total counter\nmqttota_written_bytes_total %llu\n",
+             (unsigned long long)_lifetimeBytes);
+
+    // Successful sessions by performance mode, for throughput against power cost
+    static const char* modes[2] = { "off", "on" };
+    out.line("# TYPE mqttota_mode_sessions_total counter\n");
+    for (int i = 0; i < 2; i++) {
+        out.line("mqttota_mode_sessions_total{performance_mode=\"%s\"} %u\n",
+                 modes[i], (unsigned)_modeThroughput[i].sessions);
+    }
+    out.line("# TYPE mqttota_mode_bytes_total counter\n");
+    for (int i = 0; i < 2; i++) {
+        out.line("mqttota_mode_bytes_total{performance_mode=\"%s\"} %llu\n",
+                 modes[i], (unsigned long long)_modeThroughput[i].bytes);
+    }
+    out.line("# TYPE mqttota_mode_seconds_total counter\n");
+    for (int i = 0; i < 2; i++) {
+        out.line("mqttota_mode_seconds_total{performance_mode=\"%s\"} %.3f\n",
+                 modes[i], _modeThroughput[i].timeMs / 1000.0);
+    }
+
+    // Current or last session
+    unsigned long sessionEnd = _sessionActive ? millis() : _stats.endTime;
+    unsigned long duration = _stats.startTime ? sessionEnd - _stats.startTime : 0;
+    size_t heapLow = _stats.freeHeapLow == SIZE_MAX ? 0 : _stats.freeHeapLow;
+    size_t blockLow = _stats.largestFreeBlockLow == SIZE_MAX ? 0 : _stats.largestFreeBlockLow;
+
+    out.line("# TYPE mqttota_session_bytes gauge\nmqttota_session_bytes %u\n", (unsigned)_stats.receivedBytes);
+    out.line("# TYPE mqttota_session_chunks gauge\nmqttota_session_chunks %d\n", _stats.chunkCount);
+    out.line("# TYPE mqttota_session_errors gauge\nmqttota_session_errors %d\n", _stats.errorCount);
+    out.line("# TYPE mqttota_session_duration_seconds gauge\nmqttota_session_duration_seconds %.3f\n",
+             duration / 1000.0);
+    out.line("# TYPE mqttota_session_speed_bytes_per_second gauge\nmqttota_session_speed_bytes_per_second %.1f\n",
+             _sessionActive && duration ? (_stats.receivedBytes * 1000.0) / duration : _stats.averageSpeed);
+    out.line("# TYPE mqttota_session_heap_low_bytes gauge\nmqttota_session_heap_low_bytes %u\n",
+             (unsigned)heapLow);
+    out.line("# TYPE mqttota_session_largest_free_block_low_bytes gauge\n"
+             "mqttota_session_largest_free_block_low_bytes %u\n", (unsigned)blockLow);
+
+    out.line("# TYPE mqttota_stage_heap_peak_bytes gauge\n");
+    for (int i = 0; i < OTA_STAGE_COUNT; i++) {
+        out.line("mqttota_stage_heap_peak_bytes{stage=\"%s\"} %u\n",
+                 _getStageName(static_cast<OTAStage>(i)), (unsigned)_stats.heapStages[i].peakBytes);
+    }
+
+    // Heap right now
+    out.line("# TYPE mqttota_heap_free_bytes gauge\n");
+    out.line("mqttota_heap_free_bytes{caps=\"internal\"} %u\n",
+             (unsigned)heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+    out.line("mqttota_heap_free_bytes{caps=\"spiram\"} %u\n",
+             (unsigned)heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
+    out.line("# TYPE mqttota_heap_min_free_bytes gauge\nmqttota_heap_min_free_bytes{caps=\"internal\"} %u\n",
+             (unsigned)heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL));
+    out.line("# TYPE mqttota_heap_largest_free_block_bytes gauge\n"
+             "mqttota_heap_largest_free_block_bytes{caps=\"internal\"} %u\n",
+             (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL));
+
+    // Stage latency since boot
+    out.line("# TYPE mqttota_stage_latency_seconds histogram\n");
+    for (int i = 0; i < OTA_STAGE_COUNT; i++) {
+        const char* stage = _getStageName(static_cast<OTAStage>(i));
+        const OTALatencyHistogram& histogram = _lifetimeLatency[i];
+        uint32_t cumulative = 0;
+        for (int bucket = 0; bucket < MQTT_OTA_LATENCY_BUCKETS - 1; bucket++) {
+            cumulative += histogram.buckets[bucket];
+            out.line("mqttota_stage_latency_seconds_bucket{stage=\"%s\",le=\"%g\"} %u\n",
+                     stage, latencyBucketBound(bucket) / 1000000.0, (unsigned)cumulative);
+        }
+        out.line("mqttota_stage_latency_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %u\n",
+                 stage, (unsigned)histogram.count);
+        out.line("mqttota_stage_latency_seconds_sum{stage=\"%s\"} %.6f\n",
+                 stage, histogram.sumMicros / 1000000.0);
+        out.line("mqttota_stage_latency_seconds_count{stage=\"%s\"} %u\n",
+                 stage, (unsigned)histogram.count);
+    }
+
+    if (out.full) {
+        OTA_LOGLN("Buffer de métricas insuficiente, salida truncada");
+    }
+    return out.length;
+}
+
+// Metrics HTTP Endpoint
+bool MQTTOTA::enableMetricsEndpoint(uint16_t port) {
+    if (_metricsSocket >= 0) return true;
+
+    if (!_metricsBuffer) {
+        _metricsBuffer = (char*)malloc(MQTT_OTA_METRICS_BUFFER_SIZE);
+        if (!_metricsBuffer) {
+            OTA_LOGLN("ERROR: No se pudo asignar buffer de métricas");
+            return false;
+        }
+    }
+
+    int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock < 0) {
+        OTA_LOGLN("ERROR: No se pudo crear socket de métricas");
+        return false;
+    }
+
+    int reuse = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if (bind(sock, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(sock, 2) != 0) {
+        OTA_LOGF("ERROR: No se pudo escuchar en puerto de métricas %u\n", port);
+        close(sock);
+        return false;
+    }
+
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    _metricsSocket = sock;
+
+    OTA_LOGF("Métricas Prometheus disponibles en puerto %u\n", port);
+    return true;
+}
+
+void MQTTOTA::disableMetricsEndpoint() {
+    _closeMetricsClient();
+    if (_metricsSocket >= 0) {
+        close(_metricsSocket);
+        _metricsSocket = -1;
+    }
+    if (_metricsBuffer) {
+        free(_metricsBuffer);
+        _metricsBuffer = nullptr;
+    }
+}
+
+void MQTTOTA::_closeMetricsClient() {
+    if (_metricsClient >= 0) {
+        close(_metricsClient);
+        _metricsClient = -1;
+    }
+}
+
+// One scrape at a time, advanced by every handle() without waiting on the
+// socket: the request is read into _metricsBuffer as it arrives, then the
+// page is rendered behind room for the response head and sent as far as the
+// socket takes it. A scraper that stalls is dropped after MQTT_OTA_METRICS_TIMEOUT_MS.
+void MQTTOTA::_serveMetrics() {
+    if (_metricsSocket < 0) return;
+
+    if (_metricsClient < 0) {
+        int client = accept(_metricsSocket, NULL, NULL);
+        if (client < 0) return;
+        fcntl(client, F_SETFL, fcntl(client, F_GETFL, 0) | O_NONBLOCK);
+        _metricsClient = client;
+        _metricsClientAt = millis();
+        _metricsReceived = 0;
+        _metricsResponse = nullptr;
+    }
+
+    if (millis() - _metricsClientAt > MQTT_OTA_METRICS_TIMEOUT_MS) {
+        OTA_LOGLN("Cliente de métricas sin respuesta, conexión cerrada");
+        _closeMetricsClient();
+        return;
+    }
+
+    if (!_metricsResponse) {
+        int received = recv(_metricsClient, _metricsBuffer + _metricsReceived,
+                            OTA_METRICS_REQUEST_SIZE - _metricsReceived, 0);
+        if (received == 0 || (received < 0 && errno != EWOULDBLOCK && errno != EAGAIN)) {
+            _closeMetricsClient();
+            return;
+        }
+        if (received > 0) _metricsReceived += received;
+
+        OTAMetricsRequest request = otaMetricsRequest(_metricsBuffer, _metricsReceived);
+        if (request == OTA_METRICS_INCOMPLETE) return;
+
+        char* page = _metricsBuffer + OTA_METRICS_HEAD_ROOM;
+        size_t length = 0;
+        if (request == OTA_METRICS_PAGE) {
+            length = renderMetrics(page, MQTT_OTA_METRICS_BUFFER_SIZE - OTA_METRICS_HEAD_ROOM);
+        }
+
+        char head[OTA_METRICS_HEAD_ROOM];
+        size_t headLength = otaMetricsHead(request, length, head, sizeof(head));
+        _metricsResponse = page - headLength;
+        memcpy(_metricsResponse, head, headLength);
+        _metricsResponseLength = headLength + length;
+        _metricsSent = 0;
+    }
+
+    int sent = send(_metricsClient, _metricsResponse + _metricsSent, _metricsResponseLength - _metricsSent, 0);
+    if (sent < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) return;
+    if (sent <= 0) {
+        _closeMetricsClient();
+        return;
+    }
+    _metricsSent += sent;
+    if (_metricsSent == _metricsResponseLength) {
+        _closeMetricsClient();
+    }
+}
+#endif
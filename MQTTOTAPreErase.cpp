@@ -0,0 +1,258 @@
+#include "MQTTOTA.h"
+#include "esp_flash_encrypt.h"
+
+// Pre-erase moves the flash erase of the next update off the transfer: while
+// no session runs, handle() erases one sector of the inactive app partition
+// at a time. Which sectors are erased is kept as a bitmap in NVS with the
+// address of the partition it describes, so it survives reboots and is
+// dropped once the partitions swap. A bit is stored only after its sector was
+// erased, and the stored bitmap is deleted before a session writes anything,
+// so a stored bit never covers written data.
+//
+// esp_ota_write() erases every sector it reaches, so a session that finds
+// erased sectors writes the app with esp_partition_write() instead, erasing
+// only the sectors that are not marked. esp_ota_begin() still checks the
+// partition and the rollback state, and esp_ota_set_boot_partition() verifies
+// the image as esp_ota_end() would have.
+
+namespace {
+
+const char* kEraseKey = "perase";
+const size_t kSectorSize = 4096;
+
+// Stored in front of the bitmap
+struct EraseHeader {
+    uint32_t address;          // Partition the bitmap belongs to
+    uint32_t sectors;
+    uint32_t sectorMicros;     // Average erase time of one sector
+};
+
+inline bool testBit(const uint8_t* map, uint32_t bit) {
+    return map[bit >> 3] & (1 << (bit & 7));
+}
+
+}  // namespace
+
+OTAPreEraseStats MQTTOTA::getPreEraseStats() const {
+    return _eraseStats;
+}
+
+void MQTTOTA::_freeEraseMap() {
+    if (_eraseMap) {
+        free(_eraseMap - sizeof(EraseHeader));
+        _eraseMap = nullptr;
+    }
+}
+
+void MQTTOTA::_stepPreErase() {
+    if (millis() - _lastEraseStep < MQTT_OTA_PRE_ERASE_INTERVAL_MS) return;
+    _lastEraseStep = millis();
+
+    if (!_eraseMap && !_loadEraseMap()) return;
+    if (_erasedCount == _eraseSectors) return;
+
+    uint32_t sector = 0;
+    while (testBit(_eraseMap, sector)) sector++;
+
+    uint32_t start = micros();
+    esp_err_t err = esp_partition_erase_range(_erasePartition, sector * kSectorSize, kSectorSize);
+    uint32_t elapsed = micros() - start;
+    if (err != ESP_OK) {
+        OTA_LOGF("Pre-borrado: error borrando sector %u: %s\n", sector, esp_err_to_name(err));
+        _preEraseEnabled = false;
+        return;
+    }
+
+    _eraseMap[sector >> 3] |= 1 << (sector & 7);
+    _erasedCount++;
+    _eraseUnsaved++;
+    _eraseStats.erasedSectors = _erasedCount;
+    _eraseStats.backgroundSectors++;
+    _eraseStats.backgroundMicros += elapsed;
+    _eraseStats.sectorEraseMicros = _eraseStats.backgroundMicros / _eraseStats.backgroundSectors;
+
+    if (_eraseUnsaved >= MQTT_OTA_PRE_ERASE_SAVE_EVERY || _erasedCount == _eraseSectors) {
+        _saveEraseMap();
+        if (_erasedCount == _eraseSectors) {
+            OTA_LOGF("Pre-borrado completo: %u sectores, %lu ms\n",
+                    _eraseSectors, (unsigned long)(_eraseStats.backgroundMicros / 1000));
+        }
+    }
+}
+
+// Loads the bitmap once the running app is validated, the previous one is no
+// longer needed for a rollback
+bool MQTTOTA::_loadEraseMap() {
+    const esp_partition_t* running = esp_ota_get_running_partition();
+    esp_ota_img_states_t state;
+    if (running && esp_ota_get_state_partition(running, &state) == ESP_OK &&
+        state == ESP_OTA_IMG_PENDING_VERIFY) {
+        return false;
+    }
+
+    if (esp_flash_encryption_enabled()) {
+        OTA_LOGLN("Pre-borrado no disponible con cifrado de flash");
+        _preEraseEnabled = false;
+        return false;
+    }
+
+    const esp_partition_t* partition = esp_ota_get_next_update_partition(NULL);
+    if (partition == NULL) {
+        OTA_LOGLN("Pre-borrado: no hay partición OTA inactiva");
+        _preEraseEnabled = false;
+        return false;
+    }
+
+    uint32_t sectors = partition->size / kSectorSize;
+    size_t mapBytes = (sectors + 7) / 8;
+    uint8_t* blob = (uint8_t*)malloc(sizeof(EraseHeader) + mapBytes);
+    if (!blob) return false;
+
+    EraseHeader header = {};
+    nvs_handle_t handle;
+    if (nvs_open(MQTT_OTA_HISTORY_NAMESPACE, NVS_READONLY, &handle) == ESP_OK) {
+        size_t length = sizeof(EraseHeader) + mapBytes;
+        if (nvs_get_blob(handle, kEraseKey, blob, &length) == ESP_OK &&
+            length == sizeof(EraseHeader) + mapBytes) {
+            memcpy(&header, blob, sizeof(header));
+        }
+        nvs_close(handle);
+    }
+
+    // A bitmap of the other partition (before the last update) is worthless
+    if (header.address != partition->address || header.sectors != sectors) {
+        memset(blob + sizeof(EraseHeader), 0, mapBytes);
+    }
+
+    _eraseMap = blob + sizeof(EraseHeader);
+    _erasePartition = partition;
+    _eraseSectors = sectors;
+    _erasedCount = 0;
+    for (uint32_t i = 0; i < sectors; i++) {
+        if (testBit(_eraseMap, i)) _erasedCount++;
+    }
+    _eraseUnsaved = 0;
+    _eraseStats.sectors = sectors;
+    _eraseStats.erasedSectors = _erasedCount;
+    if (_eraseStats.sectorEraseMicros == 0) {
+        _eraseStats.sectorEraseMicros = header.sectorMicros;
+    }
+
+    OTA_LOGF("Pre-borrado: %s, %u/%u sectores borrados\n",
+            partition->label, _erasedCount, sectors);
+    return true;
+}
+
+bool MQTTOTA::_saveEraseMap() {
+    EraseHeader* header = (EraseHeader*)(_eraseMap - sizeof(EraseHeader));
+    header->address = _erasePartition->address;
+    header->sectors = _eraseSectors;
+    header->sectorMicros = _eraseStats.sectorEraseMicros;
+
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(MQTT_OTA_HISTORY_NAMESPACE, NVS_READWRITE, &handle);
+    if (err == ESP_OK) {
+        err = nvs_set_blob(handle, kEraseKey, header, sizeof(EraseHeader) + (_eraseSectors + 7) / 8);
+        if (err == ESP_OK) {
+            err = nvs_commit(handle);
+        }
+        nvs_close(handle);
+    }
+    if (err != ESP_OK) {
+        OTA_LOGF("Pre-borrado: no se pudo guardar el mapa: %s\n", esp_err_to_name(err));
+        return false;
+    }
+    _eraseUnsaved = 0;
+    return true;
+}
+
+// Called before a session writes to partition. The stored bitmap is deleted
+// whether or not pre-erase is enabled, since the session is about to write
+// over it. Returns true if the session can skip the sectors in _eraseMap.
+bool MQTTOTA::_takeEraseMap(const esp_partition_t* partition) {
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(MQTT_OTA_HISTORY_NAMESPACE, NVS_READWRITE, &handle);
+    if (err == ESP_OK) {
+        err = nvs_erase_key(handle, kEraseKey);
+        if (err == ESP_OK) {
+            err = nvs_commit(handle);
+        } else if (err == ESP_ERR_NVS_NOT_FOUND) {
+            err = ESP_OK;
+        }
+        nvs_close(handle);
+    }
+
+    if (!_eraseMap) return false;
+
+    bool usable = err == ESP_OK && _erasedCount > 0 && partition != NULL &&
+                  partition->address == _erasePartition->address;
+    if (!usable) {
+        memset(_eraseMap, 0, (_eraseSectors + 7) / 8);
+        _erasedCount = 0;
+        _eraseStats.erasedSectors = 0;
+        return false;
+    }
+
+    OTA_LOGF("Escribiendo sobre %u sectores pre-borrados\n", _erasedCount);
+    return true;
+}
+
+// After a session that did not restart: sectors it reached hold data now, the
+// ones past them are still erased and go back to the store
+void MQTTOTA::_returnEraseMap() {
+    if (!_otaContext.direct) return;
+    _otaContext.direct = false;
+
+    for (uint32_t i = 0; i < _otaContext.preparedSectors && i < _eraseSectors; i++) {
+        if (testBit(_eraseMap, i)) {
+            _eraseMap[i >> 3] &= ~(1 << (i & 7));
+            _erasedCount--;
+        }
+    }
+    _eraseStats.erasedSectors = _erasedCount;
+    _saveEraseMap();
+}
+
+// Writes app bytes of the session; unmarked sectors are erased as the data
+// reaches them, like esp_ota_write() does
+esp_err_t MQTTOTA::_writeApp(const uint8_t* data, size_t length) {
+    if (!_otaContext.direct) {
+        return esp_ota_write(_otaContext.update_handle, data, length);
+    }
+
+    const esp_partition_t* partition = _otaContext.update_partition;
+    size_t end = _otaContext.written + length;
+    if (end > partition->size) return ESP_ERR_INVALID_SIZE;
+
+    uint32_t lastSector = (end + kSectorSize - 1) / kSectorSize;
+    while (_otaContext.preparedSectors < lastSector) {
+        uint32_t sector = _otaContext.preparedSectors;
+        if (testBit(_eraseMap, sector)) {
+            _stats.preErasedSectors++;
+        } else {
+            uint32_t start = micros();
+            esp_err_t err = esp_partition_erase_range(partition, sector * kSectorSize, kSectorSize);
+            if (err != ESP_OK) return err;
+            _stats.eraseTime += (micros() - start) / 1000;
+            _stats.erasedSectors++;
+        }
+        _otaContext.preparedSectors++;
+    }
+
+    esp_err_t err = esp_partition_write(partition, _otaContext.written, data, length);
+    if (err == ESP_OK) {
+        _otaContext.written = end;
+    }
+    return err;
+}
+
+// esp_ota_end() only accepts a handle esp_ota_write() was used on; after a
+// direct write the handle is released and the image is left to the check in
+// esp_ota_set_boot_partition()
+esp_err_t MQTTOTA::_endApp() {
+    if (!_otaContext.direct) {
+        return esp_ota_end(_otaContext.update_handle);
+    }
+    esp_ota_abort(_otaContext.update_handle);
+    return _otaContext.written > 0 ? ESP_OK : ESP_ERR_INVALID_SIZE;
+}
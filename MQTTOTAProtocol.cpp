@@ -0,0 +1,1182 @@
+#include "MQTTOTAProtocol.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+uint32_t otaHash32(const void* data, size_t length) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+uint32_t otaHash32(const char* text) {
+    return otaHash32(text, text ? strlen(text) : 0);
+}
+
+// Fixed-width string fields: zero padded, terminated only if shorter than the field
+static void putText(uint8_t* out, const char* text, size_t width) {
+    size_t length = strnlen(text, width);
+    memcpy(out, text, length);
+    memset(out + length, 0, width - length);
+}
+
+static void getText(char* text, const uint8_t* in, size_t width) {
+    memcpy(text, in, width);
+    text[width] = '\0';
+}
+
+OTAImageCheck otaCheckImageHeader(const uint8_t* data, size_t length, OTAImageInfo* info) {
+    OTAImageInfo local;
+    if (!info) info = &local;
+    memset(info, 0, sizeof(*info));
+
+    if (length >= OTA_IMAGE_HEADER_SIZE) {
+        info->segmentCount = data[1];
+        info->entryAddress = otaGetU32(data + 4);
+        info->chipId = otaGetU16(data + 12);
+        info->hashAppended = data[23] == 1;
+    }
+
+    if (length < OTA_IMAGE_MIN_HEADER) return OTA_IMAGE_TOO_SHORT;
+
+    const uint8_t* app = data + OTA_IMAGE_HEADER_SIZE + OTA_IMAGE_SEGMENT_HEADER_SIZE;
+    getText(info->version, app + 16, 32);
+    getText(info->projectName, app + 48, 32);
+    getText(info->time, app + 80, 16);
+    getText(info->date, app + 96, 16);
+    getText(info->idfVersion, app + 112, 32);
+
+    if (data[0] != OTA_IMAGE_MAGIC) return OTA_IMAGE_BAD_MAGIC;
+    if (info->segmentCount == 0) return OTA_IMAGE_NO_SEGMENTS;
+    if (otaGetU32(app) != OTA_APP_DESC_MAGIC) return OTA_IMAGE_BAD_APP_DESC;
+    return OTA_IMAGE_OK;
+}
+
+size_t otaTelemetryEncode(const OTATelemetryRecord& record, uint8_t* out) {
+    out[0] = OTA_TELEMETRY_MAGIC;
+    out[1] = OTA_TELEMETRY_VERSION;
+    out[2] = record.type;
+    out[3] = record.state;
+    otaPutU32(out + 4, record.deviceHash);
+    otaPutU32(out + 8, record.versionHash);
+    out[12] = record.progress;
+    out[13] = 0;
+    otaPutU16(out + 14, record.errorCode);
+    otaPutU32(out + 16, record.bytes);
+    otaPutU32(out + 20, record.throughput);
+    otaPutU32(out + 24, (uint32_t)record.espError);
+    otaPutU32(out + 28, record.timestamp);
+    return OTA_TELEMETRY_SIZE;
+}
+
+bool otaTelemetryDecode(const uint8_t* data, size_t length, OTATelemetryRecord& record) {
+    if (length < OTA_TELEMETRY_SIZE || data[0] != OTA_TELEMETRY_MAGIC ||
+        data[1] != OTA_TELEMETRY_VERSION) {
+        return false;
+    }
+
+    record.type = data[2];
+    record.state = data[3];
+    record.deviceHash = otaGetU32(data + 4);
+    record.versionHash = otaGetU32(data + 8);
+    record.progress = data[12];
+    record.errorCode = otaGetU16(data + 14);
+    record.bytes = otaGetU32(data + 16);
+    record.throughput = otaGetU32(data + 20);
+    record.espError = (int32_t)otaGetU32(data + 24);
+    record.timestamp = otaGetU32(data + 28);
+    return true;
+}
+
+static void encodePartition(const OTAPartitionSnapshot& partition, uint8_t* out) {
+    putText(out, partition.label, 16);
+    otaPutU32(out + 16, partition.address);
+    otaPutU32(out + 20, partition.size);
+    out[24] = partition.type;
+    out[25] = partition.subtype;
+    out[26] = partition.imageState;
+    out[27] = partition.hasApp ? 1 : 0;
+    putText(out + 28, partition.version, 32);
+    putText(out + 60, partition.projectName, 32);
+    putText(out + 92, partition.date, 16);
+    putText(out + 108, partition.time, 16);
+}
+
+static void decodePartition(const uint8_t* in, OTAPartitionSnapshot& partition) {
+    getText(partition.label, in, 16);
+    partition.address = otaGetU32(in + 16);
+    partition.size = otaGetU32(in + 20);
+    partition.type = in[24];
+    partition.subtype = in[25];
+    partition.imageState = in[26];
+    partition.hasApp = in[27] != 0;
+    getText(partition.version, in + 28, 32);
+    getText(partition.projectName, in + 60, 32);
+    getText(partition.date, in + 92, 16);
+    getText(partition.time, in + 108, 16);
+}
+
+size_t otaDiagnosticsEncode(const DiagnosticsSnapshot& snapshot, uint8_t* out) {
+    out[0] = OTA_DIAGNOSTICS_MAGIC;
+    out[1] = OTA_DIAGNOSTICS_VERSION;
+    out[2] = snapshot.state;
+    out[3] = snapshot.progress;
+    out[4] = snapshot.updateInProgress ? 1 : 0;
+    out[5] = snapshot.throttleLevel;
+    otaPutU16(out + 6, snapshot.lastErrorCode);
+    otaPutU32(out + 8, snapshot.deviceHash);
+    putText(out + 12, snapshot.deviceId, 16);
+    putText(out + 28, snapshot.firmwareVersion, 32);
+
+    const uint32_t counters[16] = {
+        snapshot.uptimeMs, snapshot.freeHeap, snapshot.minFreeHeap, snapshot.largestFreeBlock,
+        snapshot.psramSize, snapshot.freePsram, snapshot.minFreePsram,
+        snapshot.sessionsStarted, snapshot.sessionsSucceeded, snapshot.sessionsFailed,
+        snapshot.sessionBytes, snapshot.sessionChunks, snapshot.sessionErrors,
+        snapshot.sessionDurationMs, snapshot.sessionSpeed, snapshot.sessionHeapLow
+    };
+    for (int i = 0; i < 16; i++) {
+        otaPutU32(out + 60 + i * 4, counters[i]);
+    }
+    otaPutU32(out + 124, (uint32_t)snapshot.lastEspError);
+
+    encodePartition(snapshot.running, out + 128);
+    encodePartition(snapshot.boot, out + 252);
+    encodePartition(snapshot.next, out + 376);
+    return OTA_DIAGNOSTICS_SIZE;
+}
+
+bool otaDiagnosticsDecode(const uint8_t* data, size_t length, DiagnosticsSnapshot& snapshot) {
+    if (length < OTA_DIAGNOSTICS_SIZE || data[0] != OTA_DIAGNOSTICS_MAGIC ||
+        data[1] != OTA_DIAGNOSTICS_VERSION) {
+        return false;
+    }
+
+    snapshot.state = data[2];
+    snapshot.progress = data[3];
+    snapshot.updateInProgress = (data[4] & 1) != 0;
+    snapshot.throttleLevel = data[5];
+    snapshot.lastErrorCode = otaGetU16(data + 6);
+    snapshot.deviceHash = otaGetU32(data + 8);
+    getText(snapshot.deviceId, data + 12, 16);
+    getText(snapshot.firmwareVersion, data + 28, 32);
+
+    uint32_t* counters[16] = {
+        &snapshot.uptimeMs, &snapshot.freeHeap, &snapshot.minFreeHeap, &snapshot.largestFreeBlock,
+        &snapshot.psramSize, &snapshot.freePsram, &snapshot.minFreePsram,
+        &snapshot.sessionsStarted, &snapshot.sessionsSucceeded, &snapshot.sessionsFailed,
+        &snapshot.sessionBytes, &snapshot.sessionChunks, &snapshot.sessionErrors,
+        &snapshot.sessionDurationMs, &snapshot.sessionSpeed, &snapshot.sessionHeapLow
+    };
+    for (int i = 0; i < 16; i++) {
+        *counters[i] = otaGetU32(data + 60 + i * 4);
+    }
+    snapshot.lastEspError = (int32_t)otaGetU32(data + 124);
+
+    decodePartition(data + 128, snapshot.running);
+    decodePartition(data + 252, snapshot.boot);
+    decodePartition(data + 376, snapshot.next);
+    return true;
+}
+
+size_t otaSessionRecordEncode(const OTASessionRecord& record, uint8_t* out) {
+    out[0] = OTA_HISTORY_MAGIC;
+    out[1] = OTA_HISTORY_VERSION;
+    out[2] = record.success ? 1 : 0;
+    out[3] = record.throttleLevelMax;
+    otaPutU32(out + 4, record.sequence);
+    putText(out + 8, record.versionFrom, 24);
+    putText(out + 32, record.versionTo, 24);
+    otaPutU16(out + 56, record.errorCode);
+    otaPutU16(out + 58, record.retries);
+    otaPutU32(out + 60, (uint32_t)record.espError);
+
+    const uint32_t counters[7] = {
+        record.durationMs, record.bytes, record.throughput, record.chunks,
+        record.errors, record.heapLow, record.largestBlockLow
+    };
+    for (int i = 0; i < 7; i++) {
+        otaPutU32(out + 64 + i * 4, counters[i]);
+    }
+    for (int i = 0; i < OTA_HISTORY_STAGES; i++) {
+        otaPutU32(out + 92 + i * 4, record.stageP99Micros[i]);
+    }
+    return OTA_HISTORY_SIZE;
+}
+
+bool otaSessionRecordDecode(const uint8_t* data, size_t length, OTASessionRecord& record) {
+    if (length < OTA_HISTORY_SIZE || data[0] != OTA_HISTORY_MAGIC ||
+        data[1] != OTA_HISTORY_VERSION) {
+        return false;
+    }
+
+    record.success = (data[2] & 1) != 0;
+    record.throttleLevelMax = data[3];
+    record.sequence = otaGetU32(data + 4);
+    getText(record.versionFrom, data + 8, 24);
+    getText(record.versionTo, data + 32, 24);
+    record.errorCode = otaGetU16(data + 56);
+    record.retries = otaGetU16(data + 58);
+    record.espError = (int32_t)otaGetU32(data + 60);
+
+    uint32_t* counters[7] = {
+        &record.durationMs, &record.bytes, &record.throughput, &record.chunks,
+        &record.errors, &record.heapLow, &record.largestBlockLow
+    };
+    for (int i = 0; i < 7; i++) {
+        *counters[i] = otaGetU32(data + 64 + i * 4);
+    }
+    for (int i = 0; i < OTA_HISTORY_STAGES; i++) {
+        record.stageP99Micros[i] = otaGetU32(data + 92 + i * 4);
+    }
+    return true;
+}
+
+const char* otaStateName(uint8_t state) {
+    switch (state) {
+        case OTA_STATE_IDLE: return "INACTIVO";
+        case OTA_STATE_RECEIVING: return "RECIBIENDO";
+        case OTA_STATE_DECODING: return "DECODIFICANDO";
+        case OTA_STATE_VALIDATING: return "VALIDANDO";
+        case OTA_STATE_WRITING: return "ESCRIBIENDO";
+        case OTA_STATE_COMPLETING: return "FINALIZANDO";
+        case OTA_STATE_SUCCESS: return "EXITOSO";
+        case OTA_STATE_ERROR: return "ERROR";
+        case OTA_STATE_ABORTED: return "ABORTADO";
+        default: return "DESCONOCIDO";
+    }
+}
+
+const char* otaErrorCodeName(uint16_t code) {
+    switch (code) {
+        case OTA_ERR_NONE: return "none";
+        case OTA_ERR_UNKNOWN: return "unknown";
+        case OTA_ERR_TIMEOUT: return "timeout";
+        case OTA_ERR_NO_MEMORY: return "no_memory";
+        case OTA_ERR_SERVER: return "server";
+        case OTA_ERR_INVALID_DATA: return "invalid_data";
+        case OTA_ERR_SEQUENCE: return "sequence";
+        case OTA_ERR_DECODE: return "decode";
+        case OTA_ERR_HEADER: return "header";
+        case OTA_ERR_PARTITION: return "partition";
+        case OTA_ERR_BEGIN: return "begin";
+        case OTA_ERR_WRITE: return "write";
+        case OTA_ERR_END: return "end";
+        case OTA_ERR_BOOT: return "boot";
+        case OTA_ERR_TOO_SMALL: return "too_small";
+        case OTA_ERR_ABORTED: return "aborted";
+        case OTA_ERR_RETRIES: return "retries";
+        case OTA_ERR_VERIFY: return "verify";
+        default: return "unknown";
+    }
+}
+
+size_t otaReceiptEncode(const OTAChunkReceipt& receipt, uint8_t* out) {
+    out[0] = OTA_RECEIPT_MAGIC;
+    out[1] = OTA_RECEIPT_VERSION;
+    otaPutU16(out + 2, receipt.part);
+    otaPutU32(out + 4, receipt.deviceHash);
+    otaPutU32(out + 8, receipt.versionHash);
+    otaPutU32(out + 12, receipt.sequence);
+    otaPutU32(out + 16, (uint32_t)receipt.sentAt);
+    otaPutU32(out + 20, (uint32_t)(receipt.sentAt >> 32));
+    otaPutU32(out + 24, receipt.receivedAt);
+    otaPutU32(out + 28, receipt.serviceMicros);
+    return OTA_RECEIPT_SIZE;
+}
+
+bool otaReceiptDecode(const uint8_t* data, size_t length, OTAChunkReceipt& receipt) {
+    if (length < OTA_RECEIPT_SIZE || data[0] != OTA_RECEIPT_MAGIC ||
+        data[1] != OTA_RECEIPT_VERSION) {
+        return false;
+    }
+
+    receipt.part = otaGetU16(data + 2);
+    receipt.deviceHash = otaGetU32(data + 4);
+    receipt.versionHash = otaGetU32(data + 8);
+    receipt.sequence = otaGetU32(data + 12);
+    receipt.sentAt = otaGetU32(data + 16) | ((uint64_t)otaGetU32(data + 20) << 32);
+    receipt.receivedAt = otaGetU32(data + 24);
+    receipt.serviceMicros = otaGetU32(data + 28);
+    return true;
+}
+
+size_t otaGapReportEncode(const OTAGapReport& report, uint8_t* out) {
+    out[0] = OTA_GAPS_MAGIC;
+    out[1] = OTA_GAPS_VERSION;
+    otaPutU16(out + 2, report.next);
+    otaPutU32(out + 4, report.deviceHash);
+    otaPutU32(out + 8, report.versionHash);
+    otaPutU16(out + 12, report.highest);
+    otaPutU16(out + 14, report.duplicates);
+    otaPutU32(out + 16, report.held);
+    otaPutU32(out + 20, report.sequence);
+    return OTA_GAPS_SIZE;
+}
+
+bool otaGapReportDecode(const uint8_t* data, size_t length, OTAGapReport& report) {
+    if (length < OTA_GAPS_SIZE || data[0] != OTA_GAPS_MAGIC || data[1] != OTA_GAPS_VERSION) {
+        return false;
+    }
+
+    report.next = otaGetU16(data + 2);
+    report.deviceHash = otaGetU32(data + 4);
+    report.versionHash = otaGetU32(data + 8);
+    report.highest = otaGetU16(data + 12);
+    report.duplicates = otaGetU16(data + 14);
+    report.held = otaGetU32(data + 16);
+    report.sequence = otaGetU32(data + 20);
+    return report.next > 0;
+}
+
+size_t otaAdmissionEncode(const OTAAdmission& admission, uint8_t* out) {
+    out[0] = OTA_ADMISSION_MAGIC;
+    out[1] = OTA_ADMISSION_VERSION;
+    out[2] = admission.reason;
+    out[3] = admission.flags;
+    otaPutU32(out + 4, admission.deviceHash);
+    otaPutU32(out + 8, admission.versionHash);
+    otaPutU32(out + 12, admission.retryMs);
+    otaPutU32(out + 16, admission.probeBytesPerSecond);
+    otaPutU16(out + 20, admission.latencyMs);
+    otaPutU16(out + 22, admission.probeRttMs);
+    out[24] = (uint8_t)admission.rssi;
+    out[25] = admission.refusals;
+    return OTA_ADMISSION_SIZE;
+}
+
+bool otaAdmissionDecode(const uint8_t* data, size_t length, OTAAdmission& admission) {
+    if (length < OTA_ADMISSION_SIZE || data[0] != OTA_ADMISSION_MAGIC ||
+        data[1] != OTA_ADMISSION_VERSION) {
+        return false;
+    }
+
+    admission.reason = data[2];
+    admission.flags = data[3];
+    admission.deviceHash = otaGetU32(data + 4);
+    admission.versionHash = otaGetU32(data + 8);
+    admission.retryMs = otaGetU32(data + 12);
+    admission.probeBytesPerSecond = otaGetU32(data + 16);
+    admission.latencyMs = otaGetU16(data + 20);
+    admission.probeRttMs = otaGetU16(data + 22);
+    admission.rssi = (int8_t)data[24];
+    admission.refusals = data[25];
+    return true;
+}
+
+size_t otaCrashTraceEncode(const OTACrashTrace& trace, uint8_t* out) {
+    out[0] = OTA_CRASH_MAGIC;
+    out[1] = OTA_CRASH_VERSION;
+    out[2] = trace.resetReason;
+    out[3] = trace.eventCount;
+    otaPutU32(out + 4, trace.deviceHash);
+    otaPutU32(out + 8, trace.eventsTotal);
+    putText(out + 12, trace.targetVersion, 24);
+    putText(out + 36, trace.runningVersion, 24);
+    return OTA_CRASH_HEADER_SIZE;
+}
+
+size_t otaTraceEventEncode(const OTATraceEvent& event, uint8_t* out) {
+    otaPutU32(out, event.timestampMs);
+    otaPutU32(out + 4, event.bytes);
+    otaPutU32(out + 8, event.freeHeap);
+    otaPutU16(out + 12, (uint16_t)event.part);
+    out[14] = event.point;
+    out[15] = 0;
+    return OTA_CRASH_EVENT_SIZE;
+}
+
+bool otaCrashTraceDecode(const uint8_t* data, size_t length, OTACrashTrace& trace) {
+    if (length < OTA_CRASH_HEADER_SIZE || data[0] != OTA_CRASH_MAGIC || data[1] != OTA_CRASH_VERSION ||
+        length < otaCrashTraceSize(data[3])) {
+        return false;
+    }
+
+    trace.resetReason = data[2];
+    trace.eventCount = data[3];
+    trace.deviceHash = otaGetU32(data + 4);
+    trace.eventsTotal = otaGetU32(data + 8);
+    getText(trace.targetVersion, data + 12, 24);
+    getText(trace.runningVersion, data + 36, 24);
+    return true;
+}
+
+void otaTraceEventDecode(const uint8_t* data, uint8_t index, OTATraceEvent& event) {
+    const uint8_t* in = data + otaCrashTraceSize(index);
+    event.timestampMs = otaGetU32(in);
+    event.bytes = otaGetU32(in + 4);
+    event.freeHeap = otaGetU32(in + 8);
+    event.part = (int16_t)otaGetU16(in + 12);
+    event.point = in[14];
+    event.reserved = 0;
+}
+
+size_t otaChunkHeaderEncode(const OTAChunkHeader& header, uint8_t* out) {
+    out[0] = OTA_CHUNK_MAGIC;
+    out[1] = OTA_CHUNK_VERSION;
+    otaPutU16(out + 2, header.part);
+    otaPutU16(out + 4, header.totalParts);
+    out[6] = header.versionLength;
+    out[7] = header.flags;
+    otaPutU32(out + 8, header.deviceHash);
+    otaPutU32(out + 12, header.sequence);
+    otaPutU32(out + 16, (uint32_t)header.sentAt);
+    otaPutU32(out + 20, (uint32_t)(header.sentAt >> 32));
+    return OTA_CHUNK_HEADER_SIZE;
+}
+
+bool otaChunkHeaderDecode(const uint8_t* data, size_t length, OTAChunkHeader& header) {
+    if (length < OTA_CHUNK_HEADER_SIZE || data[0] != OTA_CHUNK_MAGIC ||
+        data[1] != OTA_CHUNK_VERSION || length < (size_t)OTA_CHUNK_HEADER_SIZE + data[6]) {
+        return false;
+    }
+
+    header.part = otaGetU16(data + 2);
+    header.totalParts = otaGetU16(data + 4);
+    header.versionLength = data[6];
+    header.flags = data[7];
+    header.deviceHash = otaGetU32(data + 8);
+    header.sequence = otaGetU32(data + 12);
+    header.sentAt = otaGetU32(data + 16) | ((uint64_t)otaGetU32(data + 20) << 32);
+    return true;
+}
+
+// Base64 for one 24-bit group: four lookups in the 64-character alphabet,
+// packed into one word so that the group is written with a single store
+static const char kBase64Alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static inline uint32_t base64Quad(uint32_t group) {
+    return (uint32_t)(uint8_t)kBase64Alphabet[group >> 18] |
+           ((uint32_t)(uint8_t)kBase64Alphabet[(group >> 12) & 63] << 8) |
+           ((uint32_t)(uint8_t)kBase64Alphabet[(group >> 6) & 63] << 16) |
+           ((uint32_t)(uint8_t)kBase64Alphabet[group & 63] << 24);
+}
+
+static inline void storeQuad(char* out, uint32_t quad) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    quad = __builtin_bswap32(quad);
+#endif
+    memcpy(out, &quad, 4);
+}
+
+static inline uint32_t loadGroup(const uint8_t* p) {
+    return ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+}
+
+size_t otaBase64Encode(const uint8_t* data, size_t length, char* out) {
+    char* o = out;
+    size_t i = 0;
+    for (; i + 12 <= length; i += 12, o += 16) {
+        storeQuad(o, base64Quad(loadGroup(data + i)));
+        storeQuad(o + 4, base64Quad(loadGroup(data + i + 3)));
+        storeQuad(o + 8, base64Quad(loadGroup(data + i + 6)));
+        storeQuad(o + 12, base64Quad(loadGroup(data + i + 9)));
+    }
+    for (; i + 3 <= length; i += 3, o += 4) {
+        storeQuad(o, base64Quad(loadGroup(data + i)));
+    }
+    if (i < length) {
+        uint32_t group = (uint32_t)data[i] << 16;
+        if (i + 1 < length) group |= (uint32_t)data[i + 1] << 8;
+        storeQuad(o, base64Quad(group));
+        if (i + 1 == length) o[2] = '=';
+        o[3] = '=';
+        o += 4;
+    }
+    *o = '\0';
+    return o - out;
+}
+
+// Character -> 6-bit value; 0x40 marks whitespace, 0x80 anything else
+static const uint8_t kBase64Space = 0x40;
+static const uint8_t kBase64Invalid = 0x80;
+static const uint8_t kBase64Digits[256] = {
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x40, 0x40, 0x80, 0x80, 0x40, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x40, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 62,   0x80, 0x80, 0x80, 63,
+    52,   53,   54,   55,   56,   57,   58,   59,   60,   61,   0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0,    1,    2,    3,    4,    5,    6,    7,    8,    9,    10,   11,   12,   13,   14,
+    15,   16,   17,   18,   19,   20,   21,   22,   23,   24,   25,   0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 26,   27,   28,   29,   30,   31,   32,   33,   34,   35,   36,   37,   38,   39,   40,
+    41,   42,   43,   44,   45,   46,   47,   48,   49,   50,   51,   0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+};
+
+// Top bit of each byte set when, with its own top bit cleared, the byte is
+// above ' ': not whitespace. Bytes that pass without being in the alphabet
+// are counted as the decoder counts them, and rejected there.
+static inline uint32_t base64Word(const char* p) {
+    uint32_t word;
+    memcpy(&word, p, 4);
+    return (word & 0x7F7F7F7Fu) + 0x5F5F5F5Fu;
+}
+
+// True when none of the sixteen characters is whitespace
+static inline bool base64Block(const char* p) {
+    return (base64Word(p) & base64Word(p + 4) & base64Word(p + 8) & base64Word(p + 12) & 0x80808080u) ==
+           0x80808080u;
+}
+
+size_t otaBase64Plan(const char* text, size_t length, OTABase64Segment* segments, size_t count,
+                     size_t* decodedLength) {
+    if (!text || !segments || count == 0) return 0;
+
+    size_t end = length;
+    while (end > 0 && (text[end - 1] == '=' || kBase64Digits[(uint8_t)text[end - 1]] == kBase64Space)) {
+        end--;
+    }
+
+    // A segment starts at the first group boundary past its share of the text
+    size_t made = 0;
+    size_t characters = 0;
+    size_t i = 0;
+    while (i < end) {
+        size_t target = made < count ? end / count * made : end;
+        while (i + 16 <= target && base64Block(text + i)) {
+            i += 16;
+            characters += 16;
+        }
+        if (i == end) break;
+
+        bool space = kBase64Digits[(uint8_t)text[i]] == kBase64Space;
+        if (!space && i >= target && made < count && characters % 4 == 0) {
+            if (made > 0) segments[made - 1].end = i;
+            segments[made].start = i;
+            segments[made].offset = characters / 4 * 3;
+            made++;
+        }
+        if (!space) characters++;
+        i++;
+    }
+    if (made == 0 || characters % 4 == 1) return 0;
+
+    size_t decoded = characters / 4 * 3 + (characters % 4 ? characters % 4 - 1 : 0);
+    segments[made - 1].end = end;
+    for (size_t k = 0; k < made; k++) {
+        segments[k].size = (k + 1 < made ? segments[k + 1].offset : decoded) - segments[k].offset;
+    }
+    if (decodedLength) *decodedLength = decoded;
+    return made;
+}
+
+bool otaBase64DecodeSegment(const char* text, const OTABase64Segment& segment, uint8_t* out) {
+    const uint8_t* p = (const uint8_t*)text + segment.start;
+    const uint8_t* const end = (const uint8_t*)text + segment.end;
+    uint8_t* o = out + segment.offset;
+    uint32_t group = 0;
+    int have = 0;
+
+    while (p < end) {
+        // Whole groups while no whitespace turns up
+        if (have == 0) {
+            while (p + 4 <= end) {
+                uint32_t a = kBase64Digits[p[0]];
+                uint32_t b = kBase64Digits[p[1]];
+                uint32_t c = kBase64Digits[p[2]];
+                uint32_t d = kBase64Digits[p[3]];
+                if ((a | b | c | d) & (kBase64Space | kBase64Invalid)) break;
+                uint32_t value = a << 18 | b << 12 | c << 6 | d;
+                o[0] = value >> 16;
+                o[1] = value >> 8;
+                o[2] = value;
+                o += 3;
+                p += 4;
+            }
+            if (p == end) break;
+        }
+
+        uint8_t digit = kBase64Digits[*p++];
+        if (digit == kBase64Space) continue;
+        if (digit & kBase64Invalid) return false;
+        group = group << 6 | digit;
+        if (++have == 4) {
+            o[0] = group >> 16;
+            o[1] = group >> 8;
+            o[2] = group;
+            o += 3;
+            group = 0;
+            have = 0;
+        }
+    }
+
+    // The text's last group may be short: 2 characters for 1 byte, 3 for 2
+    if (have == 1) return false;
+    if (have == 2) {
+        *o++ = group >> 4;
+    } else if (have == 3) {
+        o[0] = group >> 10;
+        o[1] = group >> 2;
+        o += 2;
+    }
+    return o == out + segment.offset + segment.size;
+}
+
+static const char kZ85Alphabet[] =
+    "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ.-:+=^!/*?&<>()[]{}@%$#";
+
+// Character -> digit; 0x80 marks characters outside the alphabet
+static const uint8_t kZ85Digits[256] = {
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 68,   0x80, 84,   83,   82,   72,   0x80, 75,   76,   70,   65,   0x80, 63,   62,   69,
+    0,    1,    2,    3,    4,    5,    6,    7,    8,    9,    64,   0x80, 73,   66,   74,   71,
+    81,   36,   37,   38,   39,   40,   41,   42,   43,   44,   45,   46,   47,   48,   49,   50,
+    51,   52,   53,   54,   55,   56,   57,   58,   59,   60,   61,   77,   0x80, 78,   67,   0x80,
+    0x80, 10,   11,   12,   13,   14,   15,   16,   17,   18,   19,   20,   21,   22,   23,   24,
+    25,   26,   27,   28,   29,   30,   31,   32,   33,   34,   35,   79,   0x80, 80,   0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+};
+
+static inline void z85Group(uint32_t value, char* out) {
+    out[4] = kZ85Alphabet[value % 85];
+    value /= 85;
+    out[3] = kZ85Alphabet[value % 85];
+    value /= 85;
+    out[2] = kZ85Alphabet[value % 85];
+    value /= 85;
+    out[1] = kZ85Alphabet[value % 85];
+    out[0] = kZ85Alphabet[value / 85];
+}
+
+static inline void storeBigEndian(uint8_t* out, uint32_t value) {
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+}
+
+// Horner over the first four digits fits 32 bits (85^4 < 2^32); the fifth
+// step overflows exactly when the four-digit prefix is above 0xFFFFFFFF / 85,
+// or equal to it with a non-zero last digit
+static const uint32_t kZ85MaxPrefix = 0xFFFFFFFFu / 85;
+
+static inline bool z85Value(const uint8_t* digits, uint32_t* value) {
+    uint32_t prefix = (((uint32_t)digits[0] * 85 + digits[1]) * 85 + digits[2]) * 85 + digits[3];
+    if (prefix > kZ85MaxPrefix || (prefix == kZ85MaxPrefix && digits[4] != 0)) return false;
+    *value = prefix * 85 + digits[4];
+    return true;
+}
+
+size_t otaZ85Encode(const uint8_t* data, size_t length, char* out) {
+    char* o = out;
+    size_t i = 0;
+    for (; i + 4 <= length; i += 4, o += 5) {
+        z85Group(((uint32_t)data[i] << 24) | ((uint32_t)data[i + 1] << 16) |
+                 ((uint32_t)data[i + 2] << 8) | data[i + 3], o);
+    }
+    size_t tail = length - i;
+    if (tail > 0) {
+        uint32_t value = 0;
+        for (size_t k = 0; k < 4; k++) value = (value << 8) | (k < tail ? data[i + k] : 0);
+        char group[5];
+        z85Group(value, group);
+        memcpy(o, group, tail + 1);
+        o += tail + 1;
+    }
+    *o = '\0';
+    return o - out;
+}
+
+bool otaZ85Decode(const char* text, size_t length, uint8_t* out) {
+    const uint8_t* p = (const uint8_t*)text;
+    size_t tail = length % 5;
+    if (tail == 1) return false;
+
+    const uint8_t* end = p + (length - tail);
+    for (; p < end; p += 5, out += 4) {
+        uint8_t digits[5] = { kZ85Digits[p[0]], kZ85Digits[p[1]], kZ85Digits[p[2]],
+                              kZ85Digits[p[3]], kZ85Digits[p[4]] };
+        uint32_t value;
+        if (((digits[0] | digits[1] | digits[2] | digits[3] | digits[4]) & 0x80) || !z85Value(digits, &value)) {
+            return false;
+        }
+        storeBigEndian(out, value);
+    }
+
+    // A partial group is padded with the highest digit, which rounds the
+    // truncated value back up to the bytes that were encoded
+    if (tail > 0) {
+        uint8_t digits[5] = { 84, 84, 84, 84, 84 };
+        uint8_t invalid = 0;
+        for (size_t k = 0; k < tail; k++) {
+            digits[k] = kZ85Digits[p[k]];
+            invalid |= digits[k];
+        }
+        uint32_t value;
+        if ((invalid & 0x80) || !z85Value(digits, &value)) return false;
+        uint8_t bytes[4];
+        storeBigEndian(bytes, value);
+        memcpy(out, bytes, tail - 1);
+    }
+    return true;
+}
+
+size_t otaBundleHeaderEncode(const OTABundleHeader& header, uint8_t* out) {
+    out[0] = OTA_BUNDLE_MAGIC;
+    out[1] = OTA_BUNDLE_VERSION;
+    out[2] = header.sectionCount;
+    out[3] = header.flags;
+    otaPutU32(out + 4, header.totalLength);
+    return OTA_BUNDLE_HEADER_SIZE;
+}
+
+bool otaBundleHeaderDecode(const uint8_t* data, size_t length, OTABundleHeader& header) {
+    if (length < OTA_BUNDLE_HEADER_SIZE || data[0] != OTA_BUNDLE_MAGIC || data[1] != OTA_BUNDLE_VERSION) {
+        return false;
+    }
+    header.sectionCount = data[2];
+    header.flags = data[3];
+    header.totalLength = otaGetU32(data + 4);
+    return header.sectionCount > 0 && header.sectionCount <= OTA_BUNDLE_MAX_SECTIONS;
+}
+
+size_t otaBundleSectionEncode(const OTABundleSection& section, uint8_t* out) {
+    out[0] = section.target;
+    out[1] = section.codec;
+    otaPutU16(out + 2, 0);
+    otaPutU32(out + 4, section.offset);
+    otaPutU32(out + 8, section.length);
+    putText(out + 12, section.label, OTA_BUNDLE_LABEL_SIZE);
+    otaPutU32(out + 28, 0);
+    memcpy(out + 32, section.sha256, 32);
+    return OTA_BUNDLE_SECTION_SIZE;
+}
+
+bool otaBundleSectionDecode(const uint8_t* data, size_t length, OTABundleSection& section) {
+    if (length < OTA_BUNDLE_SECTION_SIZE) return false;
+    section.target = data[0];
+    section.codec = data[1];
+    section.offset = otaGetU32(data + 4);
+    section.length = otaGetU32(data + 8);
+    getText(section.label, data + 12, OTA_BUNDLE_LABEL_SIZE);
+    memcpy(section.sha256, data + 32, 32);
+    return (section.target == OTA_BUNDLE_TARGET_APP || section.target == OTA_BUNDLE_TARGET_DATA) &&
+           section.codec == OTA_BUNDLE_CODEC_RAW;
+}
+
+int otaBundleDataSlot(bool paired, uint8_t activeSlot, bool inPlaceAllowed) {
+    if (paired) return activeSlot == 1 ? 0 : 1;
+    return inPlaceAllowed ? OTA_BUNDLE_IN_PLACE : -1;
+}
+
+void OTABundleReader::reset() {
+    memset(this, 0, sizeof(*this));
+}
+
+bool OTABundleReader::readIndex(const uint8_t* data, size_t length, size_t* used) {
+    *used = 0;
+    while (!indexComplete && *used < length) {
+        // The header says how long the rest of the index is
+        size_t needed = indexLength < OTA_BUNDLE_HEADER_SIZE ? OTA_BUNDLE_HEADER_SIZE
+                                                             : otaBundleIndexSize(header.sectionCount);
+        size_t take = needed - indexLength < length - *used ? needed - indexLength : length - *used;
+        memcpy(index + indexLength, data + *used, take);
+        indexLength += take;
+        *used += take;
+        if (indexLength < needed) break;
+
+        if (needed == OTA_BUNDLE_HEADER_SIZE) {
+            if (!otaBundleHeaderDecode(index, indexLength, header)) return false;
+            continue;
+        }
+
+        uint64_t total = indexLength;
+        int apps = 0;
+        for (uint8_t i = 0; i < header.sectionCount; i++) {
+            OTABundleSection& entry = sections[i];
+            if (!otaBundleSectionDecode(index + otaBundleIndexSize(i), OTA_BUNDLE_SECTION_SIZE, entry) ||
+                entry.length == 0) {
+                return false;
+            }
+            if (entry.target == OTA_BUNDLE_TARGET_APP && (entry.offset != 0 || ++apps > 1)) return false;
+            if (entry.target == OTA_BUNDLE_TARGET_DATA &&
+                (entry.label[0] == '\0' || entry.offset % OTA_BUNDLE_SECTOR_SIZE != 0)) {
+                return false;
+            }
+            total += entry.length;
+        }
+        if (total != header.totalLength) return false;
+        indexComplete = true;
+    }
+    return true;
+}
+
+bool OTABundleReader::advance(size_t length) {
+    sectionOffset += length;
+    if (sectionOffset < sections[section].length) return false;
+    section++;
+    sectionOffset = 0;
+    return true;
+}
+
+// MQTT integers are big-endian
+static void putMqttU16(uint8_t* out, uint16_t value) {
+    out[0] = (uint8_t)(value >> 8);
+    out[1] = (uint8_t)value;
+}
+
+// Fixed header: type and flags, then the remaining length in 1-4 bytes
+static size_t putMqttHeader(uint8_t* out, uint8_t typeAndFlags, size_t remaining) {
+    size_t n = 0;
+    out[n++] = typeAndFlags;
+    do {
+        uint8_t digit = remaining & 0x7F;
+        remaining >>= 7;
+        out[n++] = remaining ? (digit | 0x80) : digit;
+    } while (remaining);
+    return n;
+}
+
+static size_t mqttHeaderSize(size_t remaining) {
+    return remaining < 128 ? 2 : remaining < 16384 ? 3 : remaining < 2097152 ? 4 : 5;
+}
+
+static size_t putMqttString(uint8_t* out, const char* text, size_t length) {
+    putMqttU16(out, length);
+    memcpy(out + 2, text, length);
+    return length + 2;
+}
+
+size_t otaMqttConnectEncode(uint8_t* out, size_t size, const char* clientId, const char* user,
+                            const char* password, uint16_t keepAlive) {
+    size_t idLength = strlen(clientId);
+    size_t userLength = user ? strlen(user) : 0;
+    size_t passwordLength = password ? strlen(password) : 0;
+    if (idLength > 0xFFFF || userLength > 0xFFFF || passwordLength > 0xFFFF) return 0;
+
+    // Clean session; password only together with a user name
+    uint8_t connectFlags = 0x02;
+    size_t remaining = 10 + 2 + idLength;
+    if (user) {
+        connectFlags |= 0x80;
+        remaining += 2 + userLength;
+        if (password) {
+            connectFlags |= 0x40;
+            remaining += 2 + passwordLength;
+        }
+    }
+    if (mqttHeaderSize(remaining) + remaining > size) return 0;
+
+    size_t n = putMqttHeader(out, OTA_MQTT_CONNECT << 4, remaining);
+    n += putMqttString(out + n, "MQTT", 4);
+    out[n++] = 4;                          // Protocol level 3.1.1
+    out[n++] = connectFlags;
+    putMqttU16(out + n, keepAlive);
+    n += 2;
+    n += putMqttString(out + n, clientId, idLength);
+    if (connectFlags & 0x80) n += putMqttString(out + n, user, userLength);
+    if (connectFlags & 0x40) n += putMqttString(out + n, password, passwordLength);
+    return n;
+}
+
+size_t otaMqttSubscribeEncode(uint8_t* out, size_t size, uint16_t packetId, const char* topic, uint8_t qos) {
+    size_t topicLength = strlen(topic);
+    size_t remaining = 2 + 2 + topicLength + 1;
+    if (topicLength == 0 || topicLength > 0xFFFF || mqttHeaderSize(remaining) + remaining > size) return 0;
+
+    size_t n = putMqttHeader(out, (OTA_MQTT_SUBSCRIBE << 4) | 0x02, remaining);
+    putMqttU16(out + n, packetId);
+    n += 2;
+    n += putMqttString(out + n, topic, topicLength);
+    out[n++] = qos;
+    return n;
+}
+
+size_t otaMqttPubackEncode(uint8_t* out, size_t size, uint16_t packetId) {
+    if (size < 4) return 0;
+    out[0] = OTA_MQTT_PUBACK << 4;
+    out[1] = 2;
+    putMqttU16(out + 2, packetId);
+    return 4;
+}
+
+size_t otaMqttPingEncode(uint8_t* out, size_t size) {
+    if (size < OTA_MQTT_PINGREQ_SIZE) return 0;
+    out[0] = OTA_MQTT_PINGREQ << 4;
+    out[1] = 0;
+    return OTA_MQTT_PINGREQ_SIZE;
+}
+
+enum MqttReaderState {
+    MQTT_READ_FIXED = 0,
+    MQTT_READ_LENGTH,
+    MQTT_READ_TOPIC_LENGTH,
+    MQTT_READ_TOPIC,
+    MQTT_READ_PACKET_ID,
+    MQTT_READ_BEGIN,
+    MQTT_READ_PAYLOAD,
+    MQTT_READ_BODY
+};
+
+void OTAMqttReader::reset() {
+    memset(this, 0, sizeof(*this));
+}
+
+OTAMqttEvent OTAMqttReader::next(const uint8_t* data, size_t length, size_t* used) {
+    size_t i = 0;
+    piece = NULL;
+    pieceLength = 0;
+
+    for (;;) {
+        // Steps that consume no input: announce a PUBLISH before its payload,
+        // and end it even when the payload is empty
+        if (state == MQTT_READ_BEGIN) {
+            payloadLength = remaining;
+            payloadOffset = 0;
+            state = MQTT_READ_PAYLOAD;
+            *used = i;
+            return OTA_MQTT_PUBLISH_BEGIN;
+        }
+        if (state == MQTT_READ_PAYLOAD && remaining == 0) {
+            state = MQTT_READ_FIXED;
+            *used = i;
+            return OTA_MQTT_PUBLISH_END;
+        }
+        if (i == length) break;
+
+        switch (state) {
+            case MQTT_READ_FIXED:
+                type = data[i] >> 4;
+                flags = data[i] & 0x0F;
+                i++;
+                if (type == 0 || type == 15) return OTA_MQTT_MALFORMED;
+                remaining = 0;
+                lengthShift = 0;
+                state = MQTT_READ_LENGTH;
+                break;
+
+            case MQTT_READ_LENGTH: {
+                uint8_t digit = data[i++];
+                remaining |= (uint32_t)(digit & 0x7F) << lengthShift;
+                lengthShift += 7;
+                if (digit & 0x80) {
+                    if (lengthShift > 21) return OTA_MQTT_MALFORMED;
+                    break;
+                }
+                fieldLength = 0;
+                fieldRead = 0;
+                if (type == OTA_MQTT_PUBLISH) {
+                    if (qos() == 3 || remaining < 2) return OTA_MQTT_MALFORMED;
+                    topic[0] = '\0';
+                    topicTruncated = false;
+                    packetId = 0;
+                    state = MQTT_READ_TOPIC_LENGTH;
+                    break;
+                }
+                memset(body, 0, sizeof(body));
+                state = MQTT_READ_BODY;
+                if (remaining == 0) {
+                    state = MQTT_READ_FIXED;
+                    *used = i;
+                    return OTA_MQTT_PACKET;
+                }
+                break;
+            }
+
+            case MQTT_READ_TOPIC_LENGTH:
+                fieldLength = (fieldLength << 8) | data[i++];
+                remaining--;
+                if (++fieldRead < 2) break;
+                if (fieldLength + (qos() ? 2u : 0u) > remaining) return OTA_MQTT_MALFORMED;
+                fieldRead = 0;
+                state = fieldLength ? MQTT_READ_TOPIC : qos() ? MQTT_READ_PACKET_ID : MQTT_READ_BEGIN;
+                break;
+
+            case MQTT_READ_TOPIC: {
+                size_t left = fieldLength - fieldRead;
+                size_t take = left < length - i ? left : length - i;
+                for (size_t k = 0; k < take; k++, fieldRead++) {
+                    if (fieldRead < OTA_MQTT_TOPIC_SIZE) {
+                        topic[fieldRead] = (char)data[i + k];
+                    } else {
+                        topicTruncated = true;
+                    }
+                }
+                i += take;
+                remaining -= take;
+                if (fieldRead < fieldLength) break;
+                topic[fieldLength < OTA_MQTT_TOPIC_SIZE ? fieldLength : OTA_MQTT_TOPIC_SIZE] = '\0';
+                fieldRead = 0;
+                state = qos() ? MQTT_READ_PACKET_ID : MQTT_READ_BEGIN;
+                break;
+            }
+
+            case MQTT_READ_PACKET_ID:
+                packetId = (packetId << 8) | data[i++];
+                remaining--;
+                if (++fieldRead < 2) break;
+                state = MQTT_READ_BEGIN;
+                break;
+
+            case MQTT_READ_BEGIN:
+                break;
+
+            case MQTT_READ_PAYLOAD: {
+                size_t take = remaining < length - i ? remaining : length - i;
+                piece = data + i;
+                pieceLength = take;
+                payloadOffset += take;
+                remaining -= take;
+                *used = i + take;
+                if (remaining == 0) {
+                    state = MQTT_READ_FIXED;
+                    return OTA_MQTT_PUBLISH_END;
+                }
+                return OTA_MQTT_PAYLOAD;
+            }
+
+            case MQTT_READ_BODY: {
+                size_t take = remaining < length - i ? remaining : length - i;
+                for (size_t k = 0; k < take && fieldRead < sizeof(body); k++) body[fieldRead++] = data[i + k];
+                i += take;
+                remaining -= take;
+                if (remaining == 0) {
+                    state = MQTT_READ_FIXED;
+                    *used = i;
+                    return OTA_MQTT_PACKET;
+                }
+                break;
+            }
+        }
+    }
+
+    *used = i;
+    return OTA_MQTT_NEED_MORE;
+}
+
+void OTAMetricsWriter::line(const char* format, ...) {
+    if (full) return;
+
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(buffer + length, size - length, format, args);
+    va_end(args);
+
+    if (written < 0 || (size_t)written >= size - length) {
+        buffer[length] = '\0';
+        full = true;
+        return;
+    }
+    length += written;
+}
+
+OTAMetricsRequest otaMetricsRequest(const char* request, size_t length) {
+    bool ended = false;
+    for (size_t i = 3; i < length && !ended; i++) {
+        ended = memcmp(request + i - 3, "\r\n\r\n", 4) == 0;
+    }
+    if (!ended && length < OTA_METRICS_REQUEST_SIZE) return OTA_METRICS_INCOMPLETE;
+
+    if ((length >= 12 && memcmp(request, "GET /metrics", 12) == 0 &&
+         (length == 12 || request[12] == ' ' || request[12] == '?')) ||
+        (length >= 6 && memcmp(request, "GET / ", 6) == 0)) {
+        return OTA_METRICS_PAGE;
+    }
+    return OTA_METRICS_NOT_FOUND;
+}
+
+size_t otaMetricsHead(OTAMetricsRequest request, size_t contentLength, char* out, size_t size) {
+    int written;
+    if (request == OTA_METRICS_PAGE) {
+        written = snprintf(out, size,
+                           "HTTP/1.0 200 OK\r\n"
+                           "Content-Type: text/plain; version=0.0.4\r\n"
+                           "Content-Length: %u\r\n"
+                           "Connection: close\r\n\r\n",
+                           (unsigned)contentLength);
+    } else {
+        written = snprintf(out, size, "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+    }
+    return written < 0 || (size_t)written >= size ? 0 : (size_t)written;
+}
+
+const char* otaImageCheckName(uint8_t check) {
+    switch (check) {
+        case OTA_IMAGE_OK: return "ok";
+        case OTA_IMAGE_TOO_SHORT: return "too_short";
+        case OTA_IMAGE_BAD_MAGIC: return "bad_magic";
+        case OTA_IMAGE_NO_SEGMENTS: return "no_segments";
+        case OTA_IMAGE_BAD_APP_DESC: return "bad_app_desc";
+        default: return "unknown";
+    }
+}
+
+const char* otaTracePointName(uint8_t point) {
+    switch (point) {
+        case OTA_TRACE_PARSE: return "parse";
+        case OTA_TRACE_DECODE: return "decode";
+        case OTA_TRACE_WRITE: return "write";
+        case OTA_TRACE_PUBLISH: return "publish";
+        case OTA_TRACE_CALLBACK: return "callback";
+        case OTA_TRACE_SESSION_BEGIN: return "session_begin";
+        case OTA_TRACE_OTA_BEGIN: return "ota_begin";
+        case OTA_TRACE_OTA_END: return "ota_end";
+        case OTA_TRACE_SET_BOOT: return "set_boot";
+        case OTA_TRACE_SESSION_END: return "session_end";
+        default: return "unknown";
+    }
+}
+
+// esp_reset_reason_t, whose values ESP-IDF keeps stable
+const char* otaResetReasonName(uint8_t reason) {
+    switch (reason) {
+        case 1: return "poweron";
+        case 2: return "external";
+        case 3: return "software";
+        case 4: return "panic";
+        case 5: return "int_wdt";
+        case 6: return "task_wdt";
+        case 7: return "wdt";
+        case 8: return "deepsleep";
+        case 9: return "brownout";
+        case 10: return "sdio";
+        default: return "unknown";
+    }
+}
+
+const char* otaRequestReasonName(uint8_t reason) {
+    switch (reason) {
+        case OTA_REQUEST_GAP: return "gap";
+        case OTA_REQUEST_STALL: return "stall";
+        case OTA_REQUEST_JOIN: return "join";
+        default: return "unknown";
+    }
+}
+
+const char* otaAdmitReasonName(uint8_t reason) {
+    switch (reason) {
+        case OTA_ADMIT_OK: return "ok";
+        case OTA_ADMIT_RSSI: return "rssi";
+        case OTA_ADMIT_LATENCY: return "latency";
+        case OTA_ADMIT_PROBE: return "probe";
+        default: return "unknown";
+    }
+}
+
+const char* otaTelemetryTypeName(uint8_t type) {
+    switch (type) {
+        case OTA_TELEMETRY_PROGRESS: return "progress";
+        case OTA_TELEMETRY_STATE: return "state";
+        case OTA_TELEMETRY_ERROR: return "error";
+        case OTA_TELEMETRY_SUCCESS: return "success";
+        default: return "unknown";
+    }
+}
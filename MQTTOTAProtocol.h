@@ -0,0 +1,857 @@
+#ifndef MQTT_OTA_PROTOCOL_H
+#define MQTT_OTA_PROTOCOL_H
+
+// Wire formats shared by the device library and the host tools.
+// This header must stay free of Arduino and ESP-IDF dependencies.
+
+#include <stddef.h>
+#include <stdint.h>
+
+// OTA process states
+enum OTAState {
+    OTA_STATE_IDLE = 0,
+    OTA_STATE_RECEIVING = 1,
+    OTA_STATE_DECODING = 2,
+    OTA_STATE_VALIDATING = 3,
+    OTA_STATE_WRITING = 4,
+    OTA_STATE_COMPLETING = 5,
+    OTA_STATE_SUCCESS = 6,
+    OTA_STATE_ERROR = 7,
+    OTA_STATE_ABORTED = 8
+};
+
+// Error categories reported next to the human readable error message
+enum OTAErrorCode {
+    OTA_ERR_NONE = 0,
+    OTA_ERR_UNKNOWN = 1,
+    OTA_ERR_TIMEOUT = 2,
+    OTA_ERR_NO_MEMORY = 3,
+    OTA_ERR_SERVER = 4,            // Server sent IsError
+    OTA_ERR_INVALID_DATA = 5,      // Missing fields or malformed payload
+    OTA_ERR_SEQUENCE = 6,          // Chunk out of sequence
+    OTA_ERR_DECODE = 7,
+    OTA_ERR_HEADER = 8,            // Invalid image header
+    OTA_ERR_PARTITION = 9,
+    OTA_ERR_BEGIN = 10,            // esp_ota_begin failed
+    OTA_ERR_WRITE = 11,            // esp_ota_write failed
+    OTA_ERR_END = 12,              // esp_ota_end / image validation failed
+    OTA_ERR_BOOT = 13,             // esp_ota_set_boot_partition failed
+    OTA_ERR_TOO_SMALL = 14,
+    OTA_ERR_ABORTED = 15,
+    OTA_ERR_RETRIES = 16,
+    OTA_ERR_VERIFY = 17            // Bundle section hash mismatch
+};
+
+// APP IMAGE HEADER
+
+#define OTA_IMAGE_MAGIC 0xE9
+#define OTA_APP_DESC_MAGIC 0xABCD5432
+#define OTA_IMAGE_HEADER_SIZE 24           // esp_image_header_t
+#define OTA_IMAGE_SEGMENT_HEADER_SIZE 8    // esp_image_segment_header_t
+#define OTA_APP_DESC_SIZE 256              // esp_app_desc_t
+#define OTA_IMAGE_MIN_HEADER (OTA_IMAGE_HEADER_SIZE + OTA_IMAGE_SEGMENT_HEADER_SIZE + OTA_APP_DESC_SIZE)
+
+enum OTAImageCheck {
+    OTA_IMAGE_OK = 0,
+    OTA_IMAGE_TOO_SHORT = 1,               // Less than OTA_IMAGE_MIN_HEADER bytes
+    OTA_IMAGE_BAD_MAGIC = 2,
+    OTA_IMAGE_NO_SEGMENTS = 3,
+    OTA_IMAGE_BAD_APP_DESC = 4             // App descriptor magic word missing
+};
+
+// Fields of the image header and app descriptor of an ESP32 app image
+struct OTAImageInfo {
+    uint8_t segmentCount;
+    uint16_t chipId;
+    uint32_t entryAddress;
+    bool hashAppended;                     // A SHA-256 of the image follows its last byte
+    char version[33];
+    char projectName[33];
+    char date[17];
+    char time[17];
+    char idfVersion[33];
+};
+
+/**
+ * @brief Checks the start of an app image, in the order the device needs it
+ * @param info Filled with whatever the available bytes contain (may be NULL)
+ */
+OTAImageCheck otaCheckImageHeader(const uint8_t* data, size_t length, OTAImageInfo* info);
+const char* otaImageCheckName(uint8_t check);
+
+// BINARY TELEMETRY
+
+#define OTA_TELEMETRY_MAGIC 0xB7
+#define OTA_TELEMETRY_VERSION 1
+#define OTA_TELEMETRY_SIZE 32
+
+#define OTA_TOPIC_BIN_PROGRESS "ota/bin/progress"
+#define OTA_TOPIC_BIN_STATE "ota/bin/state"
+#define OTA_TOPIC_BIN_ERROR "ota/bin/error"
+#define OTA_TOPIC_BIN_SUCCESS "ota/bin/success"
+
+enum OTATelemetryType {
+    OTA_TELEMETRY_PROGRESS = 1,
+    OTA_TELEMETRY_STATE = 2,
+    OTA_TELEMETRY_ERROR = 3,
+    OTA_TELEMETRY_SUCCESS = 4
+};
+
+/**
+ * Compact status message. Serialized little-endian, OTA_TELEMETRY_SIZE bytes:
+ *
+ *   0  u8  magic (OTA_TELEMETRY_MAGIC)   12 u8  progress (0-100)
+ *   1  u8  format version                13 u8  reserved
+ *   2  u8  type (OTATelemetryType)       14 u16 errorCode (OTAErrorCode)
+ *   3  u8  state (OTAState)              16 u32 bytes received
+ *   4  u32 deviceHash                    20 u32 throughput (bytes/s)
+ *   8  u32 versionHash                   24 i32 espError (esp_err_t)
+ *                                        28 u32 timestamp (device ms)
+ */
+struct OTATelemetryRecord {
+    uint8_t type;
+    uint8_t state;
+    uint32_t deviceHash;
+    uint32_t versionHash;
+    uint8_t progress;
+    uint16_t errorCode;
+    uint32_t bytes;
+    uint32_t throughput;
+    int32_t espError;
+    uint32_t timestamp;
+};
+
+/**
+ * @brief 32-bit FNV-1a hash used for device IDs and version strings
+ */
+uint32_t otaHash32(const void* data, size_t length);
+uint32_t otaHash32(const char* text);
+
+/**
+ * @brief Serializes a record into OTA_TELEMETRY_SIZE bytes
+ * @return Bytes written (OTA_TELEMETRY_SIZE)
+ */
+size_t otaTelemetryEncode(const OTATelemetryRecord& record, uint8_t* out);
+
+/**
+ * @brief Parses a binary status message
+ * @return false if the buffer is not a valid telemetry message
+ */
+bool otaTelemetryDecode(const uint8_t* data, size_t length, OTATelemetryRecord& record);
+
+// DIAGNOSTICS SNAPSHOT
+
+#define OTA_DIAGNOSTICS_MAGIC 0xD1
+#define OTA_DIAGNOSTICS_VERSION 1
+#define OTA_DIAGNOSTICS_SIZE 500
+
+#define OTA_TOPIC_DIAGNOSTICS "ota/diagnostics"
+#define OTA_TOPIC_BIN_DIAGNOSTICS "ota/bin/diagnostics"
+
+// One partition and the app image it holds
+struct OTAPartitionSnapshot {
+    char label[17];
+    uint32_t address;
+    uint32_t size;
+    uint8_t type;
+    uint8_t subtype;
+    uint8_t imageState;          // esp_ota_img_states_t, 0xFF if unknown
+    bool hasApp;                 // The app descriptor below is valid
+    char version[33];
+    char projectName[33];
+    char date[17];
+    char time[17];
+};
+
+// Fixed-size view of the device state, filled without heap allocation
+struct DiagnosticsSnapshot {
+    char deviceId[17];
+    char firmwareVersion[33];
+    uint32_t deviceHash;
+    uint32_t uptimeMs;
+
+    OTAPartitionSnapshot running;
+    OTAPartitionSnapshot boot;
+    OTAPartitionSnapshot next;
+
+    uint32_t freeHeap;
+    uint32_t minFreeHeap;
+    uint32_t largestFreeBlock;
+    uint32_t psramSize;
+    uint32_t freePsram;
+    uint32_t minFreePsram;
+
+    uint8_t state;               // OTAState
+    uint8_t progress;
+    bool updateInProgress;
+    uint8_t throttleLevel;
+
+    uint32_t sessionsStarted;
+    uint32_t sessionsSucceeded;
+    uint32_t sessionsFailed;
+
+    // Current or last session
+    uint32_t sessionBytes;
+    uint32_t sessionChunks;
+    uint32_t sessionErrors;
+    uint32_t sessionDurationMs;
+    uint32_t sessionSpeed;       // bytes/s
+    uint32_t sessionHeapLow;
+    uint16_t lastErrorCode;      // OTAErrorCode
+    int32_t lastEspError;
+};
+
+/**
+ * @brief Serializes a snapshot into OTA_DIAGNOSTICS_SIZE little-endian bytes
+ *
+ * Layout: magic, version, state, progress, flags (bit 0 update in progress),
+ * throttle level, u16 error code, u32 device hash, char[16] device id,
+ * char[32] firmware version, 16 x u32 counters in declaration order from
+ * uptimeMs to sessionHeapLow (heap, PSRAM, sessions), i32 esp error, then
+ * three 124-byte partition records (running, boot, next): char[16] label,
+ * u32 address, u32 size, type, subtype, image state, has-app flag,
+ * char[32] version, char[32] project, char[16] date, char[16] time.
+ * Strings are zero padded and not terminated when they fill their field.
+ */
+size_t otaDiagnosticsEncode(const DiagnosticsSnapshot& snapshot, uint8_t* out);
+bool otaDiagnosticsDecode(const uint8_t* data, size_t length, DiagnosticsSnapshot& snapshot);
+
+// SESSION HISTORY
+
+#define OTA_HISTORY_MAGIC 0xA5
+#define OTA_HISTORY_VERSION 1
+#define OTA_HISTORY_SIZE 112
+#define OTA_HISTORY_STAGES 5       // Matches OTAStage on the device
+
+#define OTA_TOPIC_HISTORY "ota/history"
+#define OTA_TOPIC_BIN_HISTORY "ota/bin/history"
+
+// Summary of one finished OTA session, kept across reboots
+struct OTASessionRecord {
+    uint32_t sequence;             // Monotonic per device, survives reboots
+    char versionFrom[25];          // Firmware running when the session started
+    char versionTo[25];            // Firmware the session delivered
+    bool success;
+    uint8_t throttleLevelMax;
+    uint16_t errorCode;            // OTAErrorCode
+    uint16_t retries;
+    int32_t espError;
+    uint32_t durationMs;
+    uint32_t bytes;
+    uint32_t throughput;           // bytes/s
+    uint32_t chunks;
+    uint32_t errors;
+    uint32_t heapLow;              // Lowest internal free heap during the session
+    uint32_t largestBlockLow;
+    uint32_t stageP99Micros[OTA_HISTORY_STAGES];
+};
+
+/**
+ * @brief Serializes a record into OTA_HISTORY_SIZE little-endian bytes
+ *
+ * Layout: magic, version, flags (bit 0 success), throttle level max,
+ * u32 sequence, char[24] version from, char[24] version to, u16 error code,
+ * u16 retries, i32 esp error, 7 x u32 (duration, bytes, throughput, chunks,
+ * errors, heap low, largest block low), 5 x u32 stage p99 in microseconds.
+ */
+size_t otaSessionRecordEncode(const OTASessionRecord& record, uint8_t* out);
+bool otaSessionRecordDecode(const uint8_t* data, size_t length, OTASessionRecord& record);
+
+// CHUNK RECEIPTS
+
+#define OTA_RECEIPT_MAGIC 0xC3
+#define OTA_RECEIPT_VERSION 1
+#define OTA_RECEIPT_SIZE 32
+
+#define OTA_TOPIC_RECEIPT "ota/receipt"
+#define OTA_TOPIC_BIN_RECEIPT "ota/bin/receipt"
+
+/**
+ * Echo of a chunk that carried "SentAt". Serialized little-endian,
+ * OTA_RECEIPT_SIZE bytes:
+ *
+ *   0  u8  magic (OTA_RECEIPT_MAGIC)     12 u32 sequence (server "Seq")
+ *   1  u8  format version                16 u64 sentAt (server "SentAt", echoed)
+ *   2  u16 part index                    24 u32 receivedAt (device ms)
+ *   4  u32 deviceHash                    28 u32 serviceMicros (receive to written)
+ *   8  u32 versionHash
+ */
+struct OTAChunkReceipt {
+    uint16_t part;
+    uint32_t deviceHash;
+    uint32_t versionHash;
+    uint32_t sequence;
+    uint64_t sentAt;
+    uint32_t receivedAt;
+    uint32_t serviceMicros;
+};
+
+size_t otaReceiptEncode(const OTAChunkReceipt& receipt, uint8_t* out);
+bool otaReceiptDecode(const uint8_t* data, size_t length, OTAChunkReceipt& receipt);
+
+// PART REQUESTS
+
+#define OTA_TOPIC_REQUEST "ota/request"
+
+/**
+ * A device that lost chunks asks for them again on OTA_TOPIC_REQUEST:
+ *
+ *   {"device":"A1B2C3D4E5F6","version":"1.1.0","from":4,"count":0,"reason":"gap"}
+ *
+ * "from" is the next part the device can write and count 0 means up to the
+ * last part. The server (or a site edge cache) answers with ordinary chunks
+ * that carry "Device": the requester's ID; every other device ignores them.
+ */
+enum OTARequestReason {
+    OTA_REQUEST_GAP = 1,            // A later part arrived first
+    OTA_REQUEST_STALL = 2,          // No chunk for MQTT_OTA_REQUEST_INTERVAL_MS
+    OTA_REQUEST_JOIN = 3            // Chunks of an image the device has not started
+};
+
+const char* otaRequestReasonName(uint8_t reason);
+
+// GAP REPORTS
+
+#define OTA_GAPS_MAGIC 0xC9
+#define OTA_GAPS_VERSION 1
+#define OTA_GAPS_SIZE 24
+#define OTA_GAPS_WINDOW 32                 // Parts after "next" the held bitmap covers
+
+#define OTA_TOPIC_BIN_GAPS "ota/bin/gaps"
+
+/**
+ * Periodic state of a session whose chunks come at QoS 0 (enableGapReports()),
+ * in place of per-chunk receipts and part requests. Serialized little-endian:
+ *
+ *   0  u8  magic (OTA_GAPS_MAGIC)        12 u16 highest part received
+ *   1  u8  format version                14 u16 duplicates (saturating)
+ *   2  u16 next part to write            16 u32 held (bit i: part next + 1 + i)
+ *   4  u32 deviceHash                    20 u32 sequence of the last chunk ("Seq")
+ *   8  u32 versionHash
+ *
+ * Every part before "next" is written, so the report is also a cumulative
+ * ack. Parts after it that arrived early are held until "next" arrives.
+ * Missing are "next" itself and every part up to "highest" that is neither
+ * held nor written. next 1 with highest 0 asks for the image from the start.
+ */
+struct OTAGapReport {
+    uint16_t next;
+    uint16_t highest;
+    uint32_t deviceHash;
+    uint32_t versionHash;
+    uint16_t duplicates;
+    uint32_t held;
+    uint32_t sequence;
+};
+
+size_t otaGapReportEncode(const OTAGapReport& report, uint8_t* out);
+bool otaGapReportDecode(const uint8_t* data, size_t length, OTAGapReport& report);
+
+// True if the device reported part as written or held
+inline bool otaGapReportHas(const OTAGapReport& report, uint32_t part) {
+    if (part < report.next) return true;
+    uint32_t bit = part - report.next - 1;
+    return part > report.next && bit < OTA_GAPS_WINDOW && (report.held & (1u << bit)) != 0;
+}
+
+// ADMISSION
+
+#define OTA_ADMISSION_MAGIC 0xAD
+#define OTA_ADMISSION_VERSION 1
+#define OTA_ADMISSION_SIZE 26
+#define OTA_ADMISSION_RESEND 0x01          // Part 1 was dropped during the probe; send it again
+
+#define OTA_TOPIC_ADMISSION "ota/admission"
+#define OTA_TOPIC_BIN_ADMISSION "ota/bin/admission"
+
+// Why a device refused to start a session; OTA_ADMIT_OK when it started
+enum OTAAdmitReason {
+    OTA_ADMIT_OK = 0,
+    OTA_ADMIT_RSSI = 1,             // Signal below minRssi
+    OTA_ADMIT_LATENCY = 2,          // Publishes slower than maxPublishLatencyMs
+    OTA_ADMIT_PROBE = 3             // Probe slower than minProbeBytesPerSecond, or lost
+};
+
+/**
+ * Decision taken on part 1 of a new image (enableAdmission()), with the link
+ * figures it was based on. Serialized little-endian, OTA_ADMISSION_SIZE bytes:
+ *
+ *   0  u8  magic (OTA_ADMISSION_MAGIC)   12 u32 retryMs (0 when admitted)
+ *   1  u8  format version                16 u32 probe bytes per second (0: none)
+ *   2  u8  reason (OTAAdmitReason)       20 u16 publish latency ms (EWMA)
+ *   3  u8  flags (OTA_ADMISSION_*)       22 u16 probe round trip ms
+ *   4  u32 deviceHash                    24 i8  rssi dBm (0: unknown)
+ *   8  u32 versionHash                   25 u8  refusals in a row (saturating)
+ *
+ * A refused device ignores the image for retryMs, already randomized so that
+ * a fleet refused together does not come back together; the server should
+ * move on and offer it again after that.
+ */
+struct OTAAdmission {
+    uint8_t reason;
+    uint8_t flags;
+    uint32_t deviceHash;
+    uint32_t versionHash;
+    uint32_t retryMs;
+    uint32_t probeBytesPerSecond;
+    uint16_t latencyMs;
+    uint16_t probeRttMs;
+    int8_t rssi;
+    uint8_t refusals;
+};
+
+size_t otaAdmissionEncode(const OTAAdmission& admission, uint8_t* out);
+bool otaAdmissionDecode(const uint8_t* data, size_t length, OTAAdmission& admission);
+const char* otaAdmitReasonName(uint8_t reason);
+
+// BINARY CHUNKS
+
+#define OTA_CHUNK_MAGIC 0xD7
+#define OTA_CHUNK_VERSION 1
+#define OTA_CHUNK_HEADER_SIZE 24
+
+/**
+ * UpdateFirmwareDevice chunk without JSON or Base64, published on the same
+ * topic as the JSON chunks (a JSON message never starts with OTA_CHUNK_MAGIC).
+ * Serialized little-endian:
+ *
+ *   0  u8  magic (OTA_CHUNK_MAGIC)       8  u32 deviceHash (0 = every device)
+ *   1  u8  format version                12 u32 sequence ("Seq")
+ *   2  u16 part index                    16 u64 sentAt ("SentAt", 0 = no receipt)
+ *   4  u16 total parts                   24 firmware version, versionLength bytes
+ *   6  u8  versionLength                 .. image bytes to the end of the message
+ *   7  u8  flags (0)
+ *
+ * deviceHash, sequence and sentAt are per send; everything after the header
+ * is the same for every device, so a server can keep it pre-serialized.
+ */
+struct OTAChunkHeader {
+    uint16_t part;
+    uint16_t totalParts;
+    uint8_t versionLength;
+    uint8_t flags;
+    uint32_t deviceHash;
+    uint32_t sequence;
+    uint64_t sentAt;
+};
+
+size_t otaChunkHeaderEncode(const OTAChunkHeader& header, uint8_t* out);
+
+// Also checks that the version fits in a message of length bytes
+bool otaChunkHeaderDecode(const uint8_t* data, size_t length, OTAChunkHeader& header);
+
+// BASE64
+
+// Characters otaBase64Encode() writes for length bytes, without the terminator
+inline size_t otaBase64EncodedLength(size_t length) {
+    return (length + 2) / 3 * 4;
+}
+
+/**
+ * @brief Standard alphabet with padding and no line breaks: the same output as
+ * libb64's base64_encode_block() followed by base64_encode_blockend()
+ *
+ * Table-driven, 3 bytes to 4 characters per step: the four characters of a
+ * group are assembled in one 32-bit word and written with a single store.
+ * @param out At least otaBase64EncodedLength(length) + 1 bytes; NUL-terminated
+ * @return Characters written, without the terminator
+ */
+size_t otaBase64Encode(const uint8_t* data, size_t length, char* out);
+
+// Base64 text split into parts that decode independently, e.g. on several
+// cores: each starts on a 4-character group and knows where its bytes go
+struct OTABase64Segment {
+    size_t start;              // First character
+    size_t end;                // One past the last character
+    size_t offset;             // First output byte
+    size_t size;               // Output bytes
+};
+
+/**
+ * @brief Splits text into at most count segments of about equal length.
+ * Spaces, tabs and line breaks may appear anywhere and are not counted;
+ * trailing '=' padding is left out of the last segment.
+ *
+ * A single pass over the text counts its characters, sixteen at a time while
+ * no whitespace turns up.
+ * @param decodedLength Bytes the whole text decodes to
+ * @return Segments written; 0 for empty text or a length that leaves a
+ * single character in the last group
+ */
+size_t otaBase64Plan(const char* text, size_t length, OTABase64Segment* segments, size_t count,
+                     size_t* decodedLength);
+
+/**
+ * @brief Decodes one segment of otaBase64Plan(): four characters to three
+ * bytes per step through one table, with a per-character path for whitespace
+ * @param out The whole output; the segment writes out[offset, offset + size)
+ * @return false on a character outside the alphabet, '=' included
+ */
+bool otaBase64DecodeSegment(const char* text, const OTABase64Segment& segment, uint8_t* out);
+
+// Z85
+
+// Z85 (ZeroMQ RFC 32) turns 4 bytes into 5 characters, 25% over the raw size
+// against Base64's 33%. Its alphabet needs no escaping in a JSON string.
+// Chunks may be any length: a final group of n < 4 bytes is sent as its first
+// n + 1 characters, as in Ascii85.
+#define OTA_ENCODING_BASE64 "base64"
+#define OTA_ENCODING_Z85 "z85"
+
+// Characters otaZ85Encode() writes for length bytes, without the terminator
+inline size_t otaZ85EncodedLength(size_t length) {
+    return length / 4 * 5 + (length % 4 ? length % 4 + 1 : 0);
+}
+
+// Bytes otaZ85Decode() writes for length characters
+inline size_t otaZ85DecodedLength(size_t length) {
+    return length / 5 * 4 + (length % 5 ? length % 5 - 1 : 0);
+}
+
+/**
+ * @param out At least otaZ85EncodedLength(length) + 1 bytes; NUL-terminated
+ * @return Characters written, without the terminator
+ */
+size_t otaZ85Encode(const uint8_t* data, size_t length, char* out);
+
+/**
+ * @brief Table-driven: one lookup per character, with the alphabet check
+ * folded into a single test per group
+ * @param out At least otaZ85DecodedLength(length) bytes
+ * @return false on a character outside the alphabet, a group above
+ * 0xFFFFFFFF or length % 5 == 1
+ */
+bool otaZ85Decode(const char* text, size_t length, uint8_t* out);
+
+// BUNDLES
+
+#define OTA_BUNDLE_MAGIC 0xB5              // App images start with OTA_IMAGE_MAGIC
+#define OTA_BUNDLE_VERSION 1
+#define OTA_BUNDLE_HEADER_SIZE 8
+#define OTA_BUNDLE_SECTION_SIZE 64
+#define OTA_BUNDLE_MAX_SECTIONS 8
+#define OTA_BUNDLE_LABEL_SIZE 16           // Partition labels, NUL-padded
+#define OTA_BUNDLE_SECTOR_SIZE 4096        // Data sections start on a flash sector
+#define OTA_BUNDLE_IN_PLACE 0xFF           // Slot of an unpaired data partition
+
+enum OTABundleTarget {
+    OTA_BUNDLE_TARGET_APP = 0,             // The next OTA app slot; at most one per bundle
+    OTA_BUNDLE_TARGET_DATA = 1             // A partition by label (or its _0/_1 slot pair)
+};
+
+enum OTABundleCodec {
+    OTA_BUNDLE_CODEC_RAW = 0
+};
+
+/**
+ * Several images sent as one chunked session: an index, then every section's
+ * bytes back to back, in index order. Serialized little-endian:
+ *
+ *   0  u8  magic (OTA_BUNDLE_MAGIC)      4  u32 total length (index and sections)
+ *   1  u8  format version
+ *   2  u8  section count
+ *   3  u8  flags (0)
+ *
+ * followed by one OTA_BUNDLE_SECTION_SIZE entry per section:
+ *
+ *   0  u8  target (OTABundleTarget)      8  u32 length
+ *   1  u8  codec (OTABundleCodec)        12 char[16] partition label
+ *   2  u16 reserved (0)                  28 u32 reserved (0)
+ *   4  u32 offset in the partition       32 u8[32] SHA-256 of the section
+ *
+ * An app section has offset 0 and an empty label (or the label of the slot
+ * the device updates); a data section starts on a flash sector.
+ */
+struct OTABundleHeader {
+    uint8_t sectionCount;
+    uint8_t flags;
+    uint32_t totalLength;
+};
+
+struct OTABundleSection {
+    uint8_t target;
+    uint8_t codec;
+    uint32_t offset;
+    uint32_t length;
+    char label[OTA_BUNDLE_LABEL_SIZE + 1];
+    uint8_t sha256[32];
+};
+
+inline size_t otaBundleIndexSize(uint8_t sectionCount) {
+    return OTA_BUNDLE_HEADER_SIZE + (size_t)sectionCount * OTA_BUNDLE_SECTION_SIZE;
+}
+
+size_t otaBundleHeaderEncode(const OTABundleHeader& header, uint8_t* out);
+bool otaBundleHeaderDecode(const uint8_t* data, size_t length, OTABundleHeader& header);
+size_t otaBundleSectionEncode(const OTABundleSection& section, uint8_t* out);
+bool otaBundleSectionDecode(const uint8_t* data, size_t length, OTABundleSection& section);
+
+/**
+ * @brief Slot a data section is written to
+ *
+ * The inactive one of a <label>_0/<label>_1 pair; activeSlot is the slot in
+ * use, 1 or anything else for 0. An unpaired partition can only be
+ * overwritten in place: OTA_BUNDLE_IN_PLACE when inPlaceAllowed, otherwise
+ * -1, and the bundle is refused before anything is written.
+ */
+int otaBundleDataSlot(bool paired, uint8_t activeSlot, bool inPlaceAllowed);
+
+/**
+ * Splits a bundle fed in pieces of any size into its index and section data.
+ * The caller writes and hashes the data; the reader only keeps the position:
+ *
+ *   while (length > 0) {
+ *       if (!reader.indexComplete) {
+ *           size_t used;
+ *           if (!reader.readIndex(data, length, &used)) ...invalid index
+ *           data += used; length -= used;
+ *           continue;
+ *       }
+ *       if (reader.done()) ...bytes past the last section
+ *       if (reader.sectionOffset == 0) ...start of reader.current()
+ *       size_t n = reader.sectionBytes(length);
+ *       ...write n bytes of reader.current()
+ *       if (reader.advance(n)) ...end of the section
+ *       data += n; length -= n;
+ *   }
+ */
+struct OTABundleReader {
+    OTABundleHeader header;
+    OTABundleSection sections[OTA_BUNDLE_MAX_SECTIONS];
+    bool indexComplete;
+    uint8_t section;               // Section the next data byte belongs to
+    uint32_t sectionOffset;        // Bytes of that section already read
+    uint16_t indexLength;
+    uint8_t index[OTA_BUNDLE_HEADER_SIZE + OTA_BUNDLE_MAX_SECTIONS * OTA_BUNDLE_SECTION_SIZE];
+
+    void reset();
+
+    /**
+     * @brief Takes index bytes until the index is complete
+     * @param used Bytes consumed; the rest belongs to the sections
+     * @return false if the index is malformed: unknown target or codec, more
+     * than one app section, an empty or misplaced section, or a total length
+     * that does not match the sections
+     */
+    bool readIndex(const uint8_t* data, size_t length, size_t* used);
+
+    const OTABundleSection& current() const { return sections[section]; }
+    bool done() const { return indexComplete && section == header.sectionCount; }
+
+    // Bytes of the current section among the next length input bytes
+    size_t sectionBytes(size_t length) const {
+        uint32_t left = sections[section].length - sectionOffset;
+        return length < left ? length : left;
+    }
+
+    // Consumes bytes of the current section; true when it just ended
+    bool advance(size_t length);
+};
+
+// MQTT DATA PATH
+
+#define OTA_MQTT_TOPIC_SIZE 64             // Longer topics are reported as truncated
+#define OTA_MQTT_PINGREQ_SIZE 2
+
+enum OTAMqttPacketType {
+    OTA_MQTT_CONNECT = 1,
+    OTA_MQTT_CONNACK = 2,
+    OTA_MQTT_PUBLISH = 3,
+    OTA_MQTT_PUBACK = 4,
+    OTA_MQTT_SUBSCRIBE = 8,
+    OTA_MQTT_SUBACK = 9,
+    OTA_MQTT_PINGREQ = 12,
+    OTA_MQTT_PINGRESP = 13,
+    OTA_MQTT_DISCONNECT = 14
+};
+
+// MQTT 3.1.1 client packets; each returns the bytes written, 0 if size is too
+// small (or, for SUBSCRIBE, the topic empty: brokers drop such a connection)
+size_t otaMqttConnectEncode(uint8_t* out, size_t size, const char* clientId, const char* user,
+                            const char* password, uint16_t keepAlive);
+size_t otaMqttSubscribeEncode(uint8_t* out, size_t size, uint16_t packetId, const char* topic, uint8_t qos);
+size_t otaMqttPubackEncode(uint8_t* out, size_t size, uint16_t packetId);
+size_t otaMqttPingEncode(uint8_t* out, size_t size);
+
+enum OTAMqttEvent {
+    OTA_MQTT_NEED_MORE = 0,        // All input consumed without an event
+    OTA_MQTT_PACKET = 1,           // A packet other than PUBLISH ended: type, flags, body
+    OTA_MQTT_PUBLISH_BEGIN = 2,    // topic, packetId and payloadLength of a PUBLISH are known
+    OTA_MQTT_PAYLOAD = 3,          // piece/pieceLength point at payload bytes in the input
+    OTA_MQTT_PUBLISH_END = 4,      // The last payload byte has been delivered
+    OTA_MQTT_MALFORMED = 5         // Not an MQTT stream; drop the connection
+};
+
+/**
+ * Incremental reader for the broker side of an MQTT 3.1.1 connection. It
+ * never buffers payloads: PUBLISH bytes are handed back as pointers into the
+ * caller's input, so a receive buffer of any size can carry messages of any
+ * size. Only the topic (truncated past OTA_MQTT_TOPIC_SIZE) is copied.
+ *
+ *   for (;;) {
+ *       size_t used;
+ *       OTAMqttEvent event = reader.next(data, length, &used);
+ *       data += used; length -= used;
+ *       if (event == OTA_MQTT_NEED_MORE) break;
+ *       ...OTA_MQTT_PAYLOAD: reader.piece, reader.pieceLength
+ *   }
+ *
+ * Keep calling until OTA_MQTT_NEED_MORE even with length at 0: PUBLISH_BEGIN
+ * and an empty PUBLISH_END consume no input.
+ */
+struct OTAMqttReader {
+    uint8_t type;                  // OTAMqttPacketType of the packet being read
+    uint8_t flags;                 // Low nibble of its fixed header
+    char topic[OTA_MQTT_TOPIC_SIZE + 1];
+    bool topicTruncated;
+    uint16_t packetId;             // PUBLISH with QoS > 0
+    uint32_t payloadLength;
+    uint32_t payloadOffset;        // Payload bytes delivered so far
+    uint8_t body[4];               // Leading body bytes of other packets (CONNACK return code)
+    const uint8_t* piece;
+    size_t pieceLength;
+
+    // Parser position
+    uint8_t state;
+    uint8_t lengthShift;
+    uint32_t remaining;            // Bytes of the packet after the fixed header not read yet
+    uint16_t fieldLength;
+    uint16_t fieldRead;
+
+    void reset();
+    uint8_t qos() const { return (flags >> 1) & 0x03; }
+
+    /**
+     * @brief Consumes input up to and including the next event
+     * @param used Bytes consumed; call again with the rest of the input
+     */
+    OTAMqttEvent next(const uint8_t* data, size_t length, size_t* used);
+};
+
+// METRICS ENDPOINT
+
+#define OTA_METRICS_REQUEST_SIZE 128       // Request bytes kept; the rest of a longer request is ignored
+#define OTA_METRICS_HEAD_ROOM 128          // Room left before the page for the response head
+
+// Prometheus text (exposition format 0.0.4) into a fixed buffer; once a line
+// no longer fits, the output stops at the previous line so the page stays parseable
+struct OTAMetricsWriter {
+    char* buffer;
+    size_t size;
+    size_t length;
+    bool full;
+
+    void line(const char* format, ...) __attribute__((format(printf, 2, 3)));
+};
+
+enum OTAMetricsRequest {
+    OTA_METRICS_INCOMPLETE = 0,    // Headers not ended and room left: keep reading
+    OTA_METRICS_PAGE = 1,          // GET /metrics or GET /
+    OTA_METRICS_NOT_FOUND = 2
+};
+
+// The request received so far; a request filling OTA_METRICS_REQUEST_SIZE is
+// judged by its request line
+OTAMetricsRequest otaMetricsRequest(const char* request, size_t length);
+
+// HTTP/1.0 response head for the page (or a 404 without body); returns the
+// bytes written, 0 if size is too small
+size_t otaMetricsHead(OTAMetricsRequest request, size_t contentLength, char* out, size_t size);
+
+// CRASH TRACE
+
+#define OTA_CRASH_MAGIC 0xCE
+#define OTA_CRASH_VERSION 1
+#define OTA_CRASH_HEADER_SIZE 60
+#define OTA_CRASH_EVENT_SIZE 16
+
+#define OTA_TOPIC_CRASH "ota/crash"
+#define OTA_TOPIC_BIN_CRASH "ota/bin/crash"
+
+// Points recorded in the crash trace; 0-4 mirror OTAStage on the device
+enum OTATracePoint {
+    OTA_TRACE_PARSE = 0,
+    OTA_TRACE_DECODE = 1,
+    OTA_TRACE_WRITE = 2,
+    OTA_TRACE_PUBLISH = 3,
+    OTA_TRACE_CALLBACK = 4,
+    OTA_TRACE_SESSION_BEGIN = 16,
+    OTA_TRACE_OTA_BEGIN = 17,       // Entering esp_ota_begin (erases the partition)
+    OTA_TRACE_OTA_END = 18,         // Entering esp_ota_end (validates the image)
+    OTA_TRACE_SET_BOOT = 19,        // Entering esp_ota_set_boot_partition
+    OTA_TRACE_SESSION_END = 20
+};
+
+// One trace event, 16 bytes
+struct OTATraceEvent {
+    uint32_t timestampMs;
+    uint32_t bytes;                 // Bytes received so far in the session
+    uint32_t freeHeap;
+    int16_t part;                   // Chunk index in flight, 0 for full images
+    uint8_t point;                  // OTATracePoint
+    uint8_t reserved;
+};
+
+/**
+ * Trace of a session the device reset in, published once after boot.
+ * Serialized little-endian, OTA_CRASH_HEADER_SIZE bytes followed by
+ * eventCount events of OTA_CRASH_EVENT_SIZE bytes, oldest first:
+ *
+ *   0  u8  magic (OTA_CRASH_MAGIC)       4  u32 deviceHash
+ *   1  u8  format version                8  u32 events recorded in the session
+ *   2  u8  reset reason                  12 char[24] version being delivered
+ *   3  u8  eventCount                    36 char[24] version running now
+ *
+ * The reset reason is an esp_reset_reason_t. Each event: u32 ms, u32 bytes,
+ * u32 free heap, i16 part, u8 point (OTATracePoint), u8 0.
+ */
+struct OTACrashTrace {
+    uint8_t resetReason;
+    uint8_t eventCount;             // Events that follow; the ring's last ones
+    uint32_t deviceHash;
+    uint32_t eventsTotal;           // Events recorded, including those overwritten
+    char targetVersion[25];
+    char runningVersion[25];
+};
+
+inline size_t otaCrashTraceSize(uint8_t eventCount) {
+    return OTA_CRASH_HEADER_SIZE + (size_t)eventCount * OTA_CRASH_EVENT_SIZE;
+}
+
+// Header only; the events go after it with otaTraceEventEncode()
+size_t otaCrashTraceEncode(const OTACrashTrace& trace, uint8_t* out);
+size_t otaTraceEventEncode(const OTATraceEvent& event, uint8_t* out);
+
+// False unless data holds the header and all eventCount events
+bool otaCrashTraceDecode(const uint8_t* data, size_t length, OTACrashTrace& trace);
+// Event index of a trace otaCrashTraceDecode() accepted
+void otaTraceEventDecode(const uint8_t* data, uint8_t index, OTATraceEvent& event);
+
+const char* otaTracePointName(uint8_t point);
+const char* otaResetReasonName(uint8_t reason);
+const char* otaStateName(uint8_t state);
+const char* otaErrorCodeName(uint16_t code);
+const char* otaTelemetryTypeName(uint8_t type);
+
+// Little-endian helpers
+inline void otaPutU16(uint8_t* p, uint16_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+inline void otaPutU32(uint8_t* p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+inline uint16_t otaGetU16(const uint8_t* p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+inline uint32_t otaGetU32(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+#endif // MQTT_OTA_PROTOCOL_H
@@ -0,0 +1,280 @@
+#include "MQTTOTA.h"
+
+// Outbound queue: with setQueuedPublisher(), the library's messages are
+// copied into MQTT_OTA_PUBLISH_QUEUE_SIZE slots instead of being published
+// from inside the chunk path, and handle() hands them to a non-blocking send.
+// The application queues its own telemetry in the same slots with
+// enqueuePublish(). Each slot is one allocation holding topic and payload; a
+// full queue makes room by dropping the oldest message of a lower class, so
+// results and status never wait behind application telemetry. Messages are
+// queued from the MQTT client's task as well as the loop, so the slots are
+// guarded by a spinlock that is never held across malloc, free or the send.
+
+OTAPublishQueueStats MQTTOTA::getPublishQueueStats() const {
+    return _queueStats;
+}
+
+bool MQTTOTA::enqueuePublish(const char* topic, const uint8_t* payload, size_t length,
+                             OTAPublishPriority priority, bool coalesce) {
+    return _enqueue(topic, payload, length, priority, coalesce, true);
+}
+
+bool MQTTOTA::enqueuePublish(const char* topic, const String& payload,
+                             OTAPublishPriority priority, bool coalesce) {
+    return _enqueue(topic, (const uint8_t*)payload.c_str(), payload.length(), priority, coalesce, false);
+}
+
+// Library messages: queued when a queued publisher is set, published right away otherwise
+// False when the message was neither queued nor handed to a publisher
+bool MQTTOTA::_publishText(const char* topic, const String& message, OTAPublishPriority priority,
+                           bool coalesce) {
+    if (_queuedPublish) {
+        return _enqueue(topic, (const uint8_t*)message.c_str(), message.length(), priority, coalesce, false);
+    }
+    if (!_publishMQTT) return false;
+    uint32_t started = micros();
+    _publishMQTT(topic, message);
+    _notePublishLatency(micros() - started);
+    return true;
+}
+
+bool MQTTOTA::_publishBytes(const char* topic, const uint8_t* data, size_t length, OTAPublishPriority priority,
+                            bool coalesce) {
+    if (_queuedPublish) {
+        return _enqueue(topic, data, length, priority, coalesce, true);
+    }
+    if (!_publishBinary) return false;
+    uint32_t started = micros();
+    _publishBinary(topic, data, length);
+    _notePublishLatency(micros() - started);
+    return true;
+}
+
+bool MQTTOTA::_enqueue(const char* topic, const uint8_t* payload, size_t length, OTAPublishPriority priority,
+                       bool coalesce, bool binary) {
+    if (!topic || priority >= OTA_PUBLISH_CLASSES) return false;
+    if (length > MQTT_OTA_PUBLISH_QUEUE_BYTES || (binary && !_queuedPublish && !_publishBinary)) {
+        portENTER_CRITICAL(&_outboundLock);
+        _queueStats.dropped[priority]++;
+        portEXIT_CRITICAL(&_outboundLock);
+        return false;
+    }
+
+    // Allocation and free stay outside the lock
+    size_t topicLength = strlen(topic);
+    char* block = (char*)malloc(topicLength + length + 2);
+    if (!block) {
+        portENTER_CRITICAL(&_outboundLock);
+        _queueStats.dropped[priority]++;
+        portEXIT_CRITICAL(&_outboundLock);
+        return false;
+    }
+    memcpy(block, topic, topicLength + 1);
+    memcpy(block + topicLength + 1, payload, length);
+    block[topicLength + 1 + length] = '\0';
+
+    OutboundMessage message;
+    message.topic = block;
+    message.payload = (const uint8_t*)block + topicLength + 1;
+    message.length = length;
+    message.priority = priority;
+    message.binary = binary;
+
+    char* released[MQTT_OTA_PUBLISH_QUEUE_SIZE + 1];
+    size_t releasedCount = 0;
+    bool queued = true;
+
+    portENTER_CRITICAL(&_outboundLock);
+    message.order = _outboundOrder++;
+    message.queuedAt = millis();
+
+    // A superseded message keeps its place in the queue, with the new payload.
+    // It leaves only once the new one fits, so a drop keeps the old one queued.
+    bool replacing = false;
+    size_t replacedLength = 0;
+    if (coalesce) {
+        for (size_t i = 0; i < _outboundCount; i++) {
+            if (_outbound[i].priority == priority && strcmp(_outbound[i].topic, topic) == 0) {
+                message.order = _outbound[i].order;
+                message.queuedAt = _outbound[i].queuedAt;
+                replacing = true;
+                replacedLength = _outbound[i].length;
+                break;
+            }
+        }
+    }
+
+    while (_outboundCount - (replacing ? 1 : 0) == MQTT_OTA_PUBLISH_QUEUE_SIZE ||
+           _outboundBytes - replacedLength + length > MQTT_OTA_PUBLISH_QUEUE_BYTES) {
+        char* evicted = _evictBelow(priority);
+        if (!evicted) {
+            queued = false;
+            break;
+        }
+        released[releasedCount++] = evicted;
+    }
+
+    if (queued) {
+        // Evictions move messages around; the order identifies the superseded one
+        for (size_t i = 0; replacing && i < _outboundCount; i++) {
+            if (_outbound[i].order == message.order && _outbound[i].priority == priority) {
+                released[releasedCount++] = _detachOutbound(i).topic;
+                _queueStats.coalesced[priority]++;
+                break;
+            }
+        }
+        _insertOutbound(message);
+        _queueStats.queued[priority]++;
+    } else {
+        _queueStats.dropped[priority]++;
+        released[releasedCount++] = block;
+    }
+    portEXIT_CRITICAL(&_outboundLock);
+
+    for (size_t i = 0; i < releasedCount; i++) {
+        free(released[i]);
+    }
+    return queued;
+}
+
+// Takes out the oldest message of the lowest class below priority (lock held)
+char* MQTTOTA::_evictBelow(uint8_t priority) {
+    size_t victim = MQTT_OTA_PUBLISH_QUEUE_SIZE;
+    for (size_t i = 0; i < _outboundCount; i++) {
+        const OutboundMessage& message = _outbound[i];
+        if (message.priority <= priority) continue;
+        if (victim == MQTT_OTA_PUBLISH_QUEUE_SIZE || message.priority > _outbound[victim].priority ||
+            (message.priority == _outbound[victim].priority && message.order < _outbound[victim].order)) {
+            victim = i;
+        }
+    }
+    if (victim == MQTT_OTA_PUBLISH_QUEUE_SIZE) return nullptr;
+
+    _queueStats.dropped[_outbound[victim].priority]++;
+    return _detachOutbound(victim).topic;
+}
+
+void MQTTOTA::_insertOutbound(const OutboundMessage& message) {
+    _outbound[_outboundCount++] = message;
+    _outboundBytes += message.length;
+    _queueStats.depth = _outboundCount;
+    if (_outboundCount > _queueStats.maxDepth) _queueStats.maxDepth = _outboundCount;
+}
+
+// Removes a message without freeing it (lock held)
+MQTTOTA::OutboundMessage MQTTOTA::_detachOutbound(size_t index) {
+    OutboundMessage message = _outbound[index];
+    _outboundBytes -= message.length;
+    _outbound[index] = _outbound[--_outboundCount];
+    _outbound[_outboundCount] = OutboundMessage();
+    _queueStats.depth = _outboundCount;
+    return message;
+}
+
+void MQTTOTA::_drainPublishQueue() {
+    if (_outboundCount == 0) return;
+    if (_isMQTTConnected && !_isMQTTConnected()) return;
+
+    for (int sent = 0; sent < MQTT_OTA_PUBLISH_DRAIN; sent++) {
+        portENTER_CRITICAL(&_outboundLock);
+        if (_outboundCount == 0) {
+            portEXIT_CRITICAL(&_outboundLock);
+            return;
+        }
+        size_t next = 0;
+        for (size_t i = 1; i < _outboundCount; i++) {
+            if (_outbound[i].priority < _outbound[next].priority ||
+                (_outbound[i].priority == _outbound[next].priority && _outbound[i].order < _outbound[next].order)) {
+                next = i;
+            }
+        }
+        OutboundMessage message = _detachOutbound(next);
+        portEXIT_CRITICAL(&_outboundLock);
+
+        // A probe's round trip starts when it leaves the queue, not when it joined it
+        if (_probeNonce != 0 && _probeTopic == message.topic) {
+            _probeSentAt = micros();
+        }
+
+        // The sender may take the MQTT client's lock, so it runs unlocked
+        bool delivered = true;
+        if (_queuedPublish) {
+            if (!_queuedPublish(message.topic, message.payload, message.length)) {
+                _requeueOutbound(message);
+                return;
+            }
+        } else if (_publishMQTT && !message.binary) {
+            // The payload is NUL-terminated in the block
+            _publishMQTT(message.topic, String((const char*)message.payload));
+        } else if (_publishBinary) {
+            _publishBinary(message.topic, message.payload, message.length);
+        } else {
+            // The publisher it was queued for has been unset since
+            delivered = false;
+        }
+
+        if (!delivered) {
+            portENTER_CRITICAL(&_outboundLock);
+            _queueStats.dropped[message.priority]++;
+            portEXIT_CRITICAL(&_outboundLock);
+            free(message.topic);
+            continue;
+        }
+
+        uint32_t waited = millis() - message.queuedAt;
+        _notePublishLatency(waited * 1000);
+        portENTER_CRITICAL(&_outboundLock);
+        if (waited > _queueStats.maxWaitMs[message.priority]) {
+            _queueStats.maxWaitMs[message.priority] = waited;
+        }
+        _queueStats.sent[message.priority]++;
+        portEXIT_CRITICAL(&_outboundLock);
+        free(message.topic);
+    }
+}
+
+// A message the sender was too busy for goes back under the same limits as
+// a new one; messages queued meanwhile may have taken its room
+void MQTTOTA::_requeueOutbound(const OutboundMessage& message) {
+    char* released[MQTT_OTA_PUBLISH_QUEUE_SIZE + 1];
+    size_t releasedCount = 0;
+    bool requeued = true;
+
+    portENTER_CRITICAL(&_outboundLock);
+    _queueStats.busy++;
+    while (_outboundCount == MQTT_OTA_PUBLISH_QUEUE_SIZE ||
+           _outboundBytes + message.length > MQTT_OTA_PUBLISH_QUEUE_BYTES) {
+        char* evicted = _evictBelow(message.priority);
+        if (!evicted) {
+            requeued = false;
+            break;
+        }
+        released[releasedCount++] = evicted;
+    }
+    if (requeued) {
+        _insertOutbound(message);
+    } else {
+        _queueStats.dropped[message.priority]++;
+        released[releasedCount++] = message.topic;
+    }
+    portEXIT_CRITICAL(&_outboundLock);
+
+    for (size_t i = 0; i < releasedCount; i++) {
+        free(released[i]);
+    }
+}
+
+// Keeps draining for waitMs; used where the device restarts afterwards
+void MQTTOTA::_flushPublishQueue(unsigned long waitMs) {
+    unsigned long start = millis();
+    while (millis() - start < waitMs) {
+        _drainPublishQueue();
+        delay(10);
+    }
+}
+
+void MQTTOTA::_clearPublishQueue() {
+    while (_outboundCount > 0) {
+        free(_detachOutbound(_outboundCount - 1).topic);
+    }
+}
@@ -0,0 +1,170 @@
+#include "MQTTOTA.h"
+#include "esp_attr.h"
+#include "esp_system.h"
+
+// The ring lives in RTC_NOINIT memory, which keeps its contents across panics,
+// watchdog and software resets. A session marks it open on start and closed on
+// finish, so a ring still open at boot belongs to a session the device died in.
+// That ring is then pending until it is published, as JSON and binary like
+// the rest of the telemetry; sessions started before that go untraced rather
+// than overwrite it.
+
+namespace {
+
+const uint32_t kTraceOpen = 0x4F544154;    // Session in flight
+const uint32_t kTraceClosed = 0x4F544143;  // Finished, or already reported
+const uint32_t kTracePending = 0x4F544150; // Left by a crash, not reported yet
+
+struct TraceRing {
+    uint32_t magic;
+    uint32_t head;                         // Events written since the session began
+    char version[24];                      // Firmware the session was delivering
+    OTATraceEvent events[MQTT_OTA_TRACE_EVENTS];
+    uint32_t resetReason;                  // Of the reset that ended the session, once pending
+};
+
+RTC_NOINIT_ATTR TraceRing s_trace;
+
+static_assert(MQTT_OTA_TRACE_EVENTS <= 255, "ota/bin/crash counts events in a byte");
+
+}
+
+// Hot path: a handful of stores into RTC memory. Stage scopes pass the free
+// heap they sampled anyway; without a sample (0) the previous event's is kept
+void MQTTOTA::_trace(OTATracePoint point, uint32_t freeHeap) {
+    if (s_trace.magic != kTraceOpen) return;
+
+    if (freeHeap == 0 && s_trace.head > 0) {
+        freeHeap = s_trace.events[(s_trace.head - 1) % MQTT_OTA_TRACE_EVENTS].freeHeap;
+    }
+    OTATraceEvent& event = s_trace.events[s_trace.head % MQTT_OTA_TRACE_EVENTS];
+    event.timestampMs = millis();
+    event.bytes = _stats.receivedBytes;
+    event.freeHeap = freeHeap;
+    event.part = _tracePart;
+    event.point = point;
+    event.reserved = 0;
+    s_trace.head++;
+}
+
+// Session boundaries and flash operations are rare enough to read the heap
+void MQTTOTA::_trace(OTATracePoint point) {
+    if (s_trace.magic != kTraceOpen) return;
+    _trace(point, heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+}
+
+void MQTTOTA::_traceBegin() {
+    // A leftover trace is sent before the new session overwrites it
+    if (_crashTracePending && !_publishCrashTrace()) {
+        OTA_LOGLN("Traza de fallo sin publicar, la sesión no se traza");
+        return;
+    }
+
+    s_trace.head = 0;
+    strlcpy(s_trace.version, _sessionVersion.c_str(), sizeof(s_trace.version));
+    s_trace.magic = kTraceOpen;
+    _trace(OTA_TRACE_SESSION_BEGIN);
+}
+
+void MQTTOTA::_traceEnd() {
+    if (s_trace.magic != kTraceOpen) return;
+    _trace(OTA_TRACE_SESSION_END);
+    s_trace.magic = kTraceClosed;
+}
+
+void MQTTOTA::_checkCrashTrace() {
+    esp_reset_reason_t reason = esp_reset_reason();
+
+    // RTC memory holds garbage after power loss
+    if (reason == ESP_RST_POWERON || reason == ESP_RST_BROWNOUT ||
+        (s_trace.magic != kTraceOpen && s_trace.magic != kTracePending)) {
+        s_trace.magic = kTraceClosed;
+        return;
+    }
+
+    // Still pending from an earlier reset: that one ended the session
+    if (s_trace.magic == kTraceOpen) {
+        s_trace.resetReason = reason;
+        s_trace.magic = kTracePending;
+    }
+    s_trace.version[sizeof(s_trace.version) - 1] = '\0';
+    _crashResetReason = s_trace.resetReason;
+    _crashTracePending = true;
+
+    uint32_t count = min(s_trace.head, (uint32_t)MQTT_OTA_TRACE_EVENTS);
+    const OTATraceEvent& last = s_trace.events[(s_trace.head - 1) % MQTT_OTA_TRACE_EVENTS];
+    OTA_LOGF("Reinicio (%s) durante OTA %s: %u eventos, último %s en parte %d\n",
+             otaResetReasonName(_crashResetReason), s_trace.version, (unsigned)count,
+             count ? otaTracePointName(last.point) : "-", count ? last.part : 0);
+}
+
+// Sent in every telemetry format enabled; false leaves it pending
+bool MQTTOTA::_publishCrashTrace() {
+    _crashTraceTriedAt = millis();
+    if (!_isMQTTConnected || !_isMQTTConnected()) return false;
+    bool json = _jsonTelemetryEnabled() && _publishMQTT;
+    bool binary = (_telemetryFormat & OTA_TELEMETRY_BINARY) && _publishBinary;
+    if (!json && !binary) return false;
+
+    uint32_t count = min(s_trace.head, (uint32_t)MQTT_OTA_TRACE_EVENTS);
+    uint32_t first = s_trace.head - count;
+    bool published = false;
+
+    if (binary) {
+        OTACrashTrace trace;
+        trace.resetReason = _crashResetReason;
+        trace.eventCount = count;
+        trace.deviceHash = _deviceHash;
+        trace.eventsTotal = s_trace.head;
+        strlcpy(trace.targetVersion, s_trace.version, sizeof(trace.targetVersion));
+        strlcpy(trace.runningVersion, _firmwareVersion.c_str(), sizeof(trace.runningVersion));
+
+        uint8_t* payload = (uint8_t*)malloc(otaCrashTraceSize(count));
+        if (payload) {
+            size_t length = otaCrashTraceEncode(trace, payload);
+            for (uint32_t i = first; i < s_trace.head; i++) {
+                length += otaTraceEventEncode(s_trace.events[i % MQTT_OTA_TRACE_EVENTS], payload + length);
+            }
+            published = _publishBytes(OTA_TOPIC_BIN_CRASH, payload, length, OTA_PUBLISH_STATUS);
+            free(payload);
+        }
+    }
+
+#if MQTT_OTA_JSON
+    if (json) {
+        DynamicJsonDocument doc(1024 + count * 96);
+        doc["device"] = _deviceID;
+        doc["version"] = _firmwareVersion;
+        doc["target"] = s_trace.version;
+        doc["reset"] = otaResetReasonName(_crashResetReason);
+        doc["events_total"] = s_trace.head;
+
+        if (count > 0) {
+            const OTATraceEvent& last = s_trace.events[(s_trace.head - 1) % MQTT_OTA_TRACE_EVENTS];
+            doc["in_flight"] = otaTracePointName(last.point);
+            doc["part"] = last.part;
+        }
+
+        // Oldest first: [ms, point, part, bytes, free heap]
+        JsonArray events = doc.createNestedArray("events");
+        for (uint32_t i = first; i < s_trace.head; i++) {
+            const OTATraceEvent& event = s_trace.events[i % MQTT_OTA_TRACE_EVENTS];
+            JsonArray entry = events.createNestedArray();
+            entry.add(event.timestampMs);
+            entry.add(otaTracePointName(event.point));
+            entry.add(event.part);
+            entry.add(event.bytes);
+            entry.add(event.freeHeap);
+        }
+
+        String output;
+        serializeJson(doc, output);
+        if (_publishText(OTA_TOPIC_CRASH, output, OTA_PUBLISH_STATUS)) published = true;
+    }
+#endif
+
+    if (!published) return false;
+    s_trace.magic = kTraceClosed;
+    _crashTracePending = false;
+    return true;
+}
@@ -0,0 +1,76 @@
+#include <Arduino.h>
+#include "MQTTOTA.h"
+
+// Measures Base64 encoding speed on the device: libb64 (what
+// MQTTOTA::base64Encode used before) against the library encoder, into a
+// caller buffer and into a String, and checks that the outputs are identical.
+// Then compares chunk decoding: Base64Part (libb64, into a buffer and through
+// MQTTOTA::base64Decode) against Z85Part (otaZ85Decode).
+
+const size_t BLOCK_SIZE = 4096;
+const unsigned long RUN_MS = 1000;
+
+uint8_t input[BLOCK_SIZE];
+char expected[BLOCK_SIZE / 3 * 4 + 8];
+char output[BLOCK_SIZE / 3 * 4 + 8];
+char z85[BLOCK_SIZE / 4 * 5 + 1];
+uint8_t decoded[BLOCK_SIZE + 8];
+
+size_t encodeLibb64(const uint8_t* data, size_t length, char* out) {
+    base64_encodestate state;
+    base64_init_encodestate(&state);
+    int count = base64_encode_block((const char*)data, length, out, &state);
+    return count + base64_encode_blockend(out + count, &state);
+}
+
+size_t decodeLibb64(const char* text, size_t length, uint8_t* out) {
+    base64_decodestate state;
+    base64_init_decodestate(&state);
+    return base64_decode_block(text, length, (char*)out, &state);
+}
+
+template <typename Encode>
+float measure(Encode encode) {
+    size_t bytes = 0;
+    unsigned long start = micros();
+    while (micros() - start < RUN_MS * 1000) {
+        encode();
+        bytes += BLOCK_SIZE;
+    }
+    return bytes / (float)(micros() - start);  // bytes/us = MB/s
+}
+
+void setup() {
+    Serial.begin(115200);
+    delay(1000);
+
+    for (size_t i = 0; i < BLOCK_SIZE; i++) input[i] = (uint8_t)random(256);
+
+    size_t expectedLength = encodeLibb64(input, BLOCK_SIZE, expected);
+    size_t length = MQTTOTA::base64Encode(input, BLOCK_SIZE, output, sizeof(output));
+    String text = MQTTOTA::base64Encode(String((const char*)input, BLOCK_SIZE));
+    bool same = length == expectedLength && memcmp(output, expected, length) == 0 &&
+                text.length() == expectedLength && memcmp(text.c_str(), expected, length) == 0;
+    Serial.printf("Salida idéntica a libb64: %s\n", same ? "sí" : "NO");
+
+    Serial.printf("libb64:          %.2f MB/s\n", measure([] { encodeLibb64(input, BLOCK_SIZE, expected); }));
+    Serial.printf("buffer:          %.2f MB/s\n",
+                  measure([] { MQTTOTA::base64Encode(input, BLOCK_SIZE, output, sizeof(output)); }));
+    String block((const char*)input, BLOCK_SIZE);
+    Serial.printf("String:          %.2f MB/s\n", measure([&block] { MQTTOTA::base64Encode(block); }));
+
+    size_t z85Length = otaZ85Encode(input, BLOCK_SIZE, z85);
+    bool z85Same = otaZ85Decode(z85, z85Length, decoded) && memcmp(decoded, input, BLOCK_SIZE) == 0;
+    Serial.printf("\nZ85: %u caracteres contra %u en Base64, ida y vuelta: %s\n",
+                  (unsigned)z85Length, (unsigned)expectedLength, z85Same ? "sí" : "NO");
+
+    Serial.printf("decode libb64:   %.2f MB/s\n",
+                  measure([expectedLength] { decodeLibb64(expected, expectedLength, decoded); }));
+    String encoded(expected);
+    Serial.printf("decode String:   %.2f MB/s\n", measure([&encoded] { MQTTOTA::base64Decode(encoded); }));
+    Serial.printf("decode Z85:      %.2f MB/s\n", measure([z85Length] { otaZ85Decode(z85, z85Length, decoded); }));
+}
+
+void loop() {
+    delay(1000);
+}
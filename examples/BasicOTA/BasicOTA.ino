@@ -78,7 +78,8 @@ void handleButton();
 String getMQTTClientID();
 String getISOTimestamp();
 DeviceInfo getDeviceInfo();
-void publishEvent(const char* event, const char* description);
+void publishEvent(const char* event, const char* description,
+                  OTAPublishPriority priority = OTA_PUBLISH_APP, bool coalesce = false);
 void publishMQTTMessage(const char* topic, const String& message);
 void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data);
 bool connectMQTT();
@@ -297,7 +298,13 @@ void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event
             String deviceEventTopic = getDeviceEventTopic();
             if (topic == deviceEventTopic) {
                 Serial.println("Device event received");
-                
+
+                // Binary chunks go to MQTTOTA as they are
+                if (event->data_len > 0 && (uint8_t)event->data[0] == OTA_CHUNK_MAGIC) {
+                    mqttOTA.processMessage(topic, (const uint8_t*)event->data, event->data_len);
+                    break;
+                }
+
                 // Extract actual message from payload if needed
                 String actualMessage = extractMessageFromPayload(message);
                 
@@ -372,7 +379,7 @@ bool connectMQTT() {
 }
 
 void publishMQTTMessage(const char* topic, const String& message) {
-    if (!mqttConnected || mqttOTA.isUpdateInProgress()) return;
+    if (!mqttConnected) return;
     
     int msg_id = esp_mqtt_client_publish(mqtt_client, topic, message.c_str(), message.length(), 1, 0);
     if (msg_id < 0) {
@@ -382,7 +389,16 @@ void publishMQTTMessage(const char* topic, const String& message) {
     }
 }
 
-void publishEvent(const char* event, const char* description) {
+// Drains the MQTTOTA outbound queue: esp_mqtt_client_enqueue() only stores
+// the message in the client's outbox, the MQTT task sends it
+bool enqueueMQTTMessage(const char* topic, const uint8_t* data, size_t length) {
+    if (!mqttConnected) return false;
+    return esp_mqtt_client_enqueue(mqtt_client, topic, (const char*)data, length, 1, 0, true) >= 0;
+}
+
+// Events share the MQTTOTA queue, so they keep flowing during updates
+// without delaying OTA results
+void publishEvent(const char* event, const char* description, OTAPublishPriority priority, bool coalesce) {
     StaticJsonDocument<768> doc;
     
     JsonObject deviceObj = doc.createNestedObject("Device");
@@ -410,7 +426,10 @@ void publishEvent(const char* event, const char* description) {
     String eventData;
     serializeJson(doc, eventData);
     
-    publishMQTTMessage(MQTT_TOPIC_EVENTS.c_str(), eventData);
+    if (!mqttOTA.enqueuePublish(MQTT_TOPIC_EVENTS.c_str(), eventData, priority, coalesce)) {
+        Serial.printf("Event dropped: %s\n", event);
+        return;
+    }
     Serial.printf("Event published: %s - %s\n", event, description);
 }
 
@@ -545,21 +564,23 @@ void setup() {
       },
       getDeviceEventTopic()  // Use dynamic event topic
   );
+  mqttOTA.setQueuedPublisher(enqueueMQTTMessage);
   
   // Configure optional callbacks
   mqttOTA.onProgress([](int progress, const String& version) {
       Serial.printf("OTA Progress: %d%% - Version: %s\n", progress, version.c_str());
-      publishEvent("OTA_PROGRESS", String("Progress: " + String(progress) + "%").c_str());
+      publishEvent("OTA_PROGRESS", String("Progress: " + String(progress) + "%").c_str(),
+                   OTA_PUBLISH_STATUS, true);
   });
   
   mqttOTA.onError([](const String& error, const String& version) {
       Serial.printf("OTA Error: %s - Version: %s\n", error.c_str(), version.c_str());
-      publishEvent("OTA_ERROR", error.c_str());
+      publishEvent("OTA_ERROR", error.c_str(), OTA_PUBLISH_CRITICAL);
   });
   
   mqttOTA.onSuccess([](const String& version) {
       Serial.printf("OTA completed successfully - Version: %s\n", version.c_str());
-      publishEvent("OTA_SUCCESS", "Update completed successfully");
+      publishEvent("OTA_SUCCESS", "Update completed successfully", OTA_PUBLISH_CRITICAL);
   });
   
   Serial.println("\nBasicOTA - Ready for MQTT OTA updates");
@@ -0,0 +1,52 @@
+#include <Arduino.h>
+#include <WiFi.h>
+#include "MQTTOTA.h"
+
+// Smallest useful MQTTOTA device: binary chunks received by the data client,
+// no application MQTT client. Build it with the feature switches off to get
+// the minimal footprint:
+//
+//   -DMQTT_OTA_FULL_IMAGE=0 -DMQTT_OTA_JSON=0 -DMQTT_OTA_STATUS=0
+//   -DMQTT_OTA_LOG=0 -DMQTT_OTA_STATISTICS=0
+//
+// extras/footprint/footprint.sh compiles this sketch once per configuration,
+// and once with FOOTPRINT_BASELINE defined, which leaves MQTTOTA out and
+// gives the cost of the sketch alone.
+
+const char* FIRMWARE_VERSION = "v1.0.0";
+
+const char* WIFI_SSID = "YourSSID";
+const char* WIFI_PASSWORD = "YourPassword";
+
+const char* MQTT_SERVER = "192.168.1.10";
+const uint16_t MQTT_PORT = 1883;
+
+#ifndef FOOTPRINT_BASELINE
+MQTTOTA ota;
+#endif
+
+void setup() {
+    Serial.begin(115200);
+
+    WiFi.mode(WIFI_STA);
+    WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
+    while (WiFi.status() != WL_CONNECTED) {
+        delay(250);
+    }
+
+#ifndef FOOTPRINT_BASELINE
+    String deviceID = "ESP32_" + String((uint32_t)ESP.getEfuseMac(), HEX);
+    ota.begin(deviceID, FIRMWARE_VERSION);
+    ota.enableChunkedOTA(true);
+    // Subscribes to "ota"; without an application client there is no
+    // setMQTTConfig() call to choose another topic
+    ota.enableDataClient(MQTT_SERVER, MQTT_PORT);
+#endif
+}
+
+void loop() {
+#ifndef FOOTPRINT_BASELINE
+    ota.handle();
+#endif
+    delay(1);
+}
@@ -0,0 +1,61 @@
+#!/bin/sh
+# Flash and static RAM of MQTTOTA per feature-switch configuration.
+#
+# Compiles examples/MinimalOTA with arduino-cli once per configuration in
+# MQTTOTA.h, and once with FOOTPRINT_BASELINE (WiFi only, no MQTTOTA), then
+# prints what arduino-cli reports ("Sketch uses", "Global variables use") and
+# the difference from the baseline. ArduinoJson must be installed for the
+# configurations with MQTT_OTA_JSON=1. It has not been run against an ESP32
+# core yet; adding its output to the README's "Feature Switches" section is a
+# deferred follow-up.
+#
+# Usage:
+#   footprint.sh [fqbn]        (default esp32:esp32:esp32)
+
+FQBN=${1:-esp32:esp32:esp32}
+[ $# -le 1 ] || { echo "usage: footprint.sh [fqbn]" >&2; exit 2; }
+command -v arduino-cli >/dev/null || { echo "arduino-cli not found" >&2; exit 2; }
+
+ROOT=$(cd "$(dirname "$0")/../.." && pwd)
+SKETCH="$ROOT/examples/MinimalOTA"
+BUILD=$(mktemp -d)
+trap 'rm -rf "$BUILD"' EXIT
+
+OFF_FULL="-DMQTT_OTA_FULL_IMAGE=0"
+OFF_JSON="$OFF_FULL -DMQTT_OTA_JSON=0"
+OFF_ALL="$OFF_JSON -DMQTT_OTA_STATUS=0 -DMQTT_OTA_LOG=0 -DMQTT_OTA_STATISTICS=0"
+
+# name|flags
+CONFIGS="baseline|-DFOOTPRINT_BASELINE
+full|
+no-full-image|$OFF_FULL
+binary-only|$OFF_JSON
+binary-no-status|$OFF_JSON -DMQTT_OTA_STATUS=0
+binary-no-log|$OFF_JSON -DMQTT_OTA_LOG=0
+binary-no-stats|$OFF_JSON -DMQTT_OTA_STATISTICS=0
+minimal|$OFF_ALL"
+
+printf '%-18s %10s %10s %10s %10s\n' configuration flash ram "flash+" "ram+"
+
+BASE_FLASH=
+BASE_RAM=
+echo "$CONFIGS" | while IFS='|' read -r NAME FLAGS; do
+    OUT=$(arduino-cli compile --fqbn "$FQBN" --library "$ROOT" \
+        --build-path "$BUILD/$NAME" \
+        --build-property "compiler.cpp.extra_flags=$FLAGS" \
+        --build-property "compiler.c.extra_flags=$FLAGS" \
+        "$SKETCH" 2>&1)
+    if [ $? -ne 0 ]; then
+        printf '%-18s %10s\n' "$NAME" failed
+        echo "$OUT" | grep -m 5 error >&2
+        continue
+    fi
+    FLASH=$(echo "$OUT" | sed -n 's/^Sketch uses \([0-9]*\) bytes.*/\1/p')
+    RAM=$(echo "$OUT" | sed -n 's/^Global variables use \([0-9]*\) bytes.*/\1/p')
+    if [ -z "$BASE_FLASH" ]; then
+        BASE_FLASH=$FLASH
+        BASE_RAM=$RAM
+    fi
+    printf '%-18s %10s %10s %10s %10s\n' "$NAME" "$FLASH" "$RAM" \
+        $((FLASH - BASE_FLASH)) $((RAM - BASE_RAM))
+done
@@ -0,0 +1,211 @@
+// Checks and benchmarks the Base64 encoders against libb64.
+//
+// libb64's encoder (base64_encode_block + base64_encode_blockend, as built
+// into the ESP32 Arduino core: no line breaks) is reproduced below as the
+// reference. The tool first compares every encoder with it byte for byte on
+// all lengths up to 4 KB at every input alignment, then prints MB/s of input
+// for each encoder on chunk-sized and image-sized buffers:
+//
+//   libb64  byte-wise state machine, what MQTTOTA::base64Encode used to run
+//   device  otaBase64Encode(), the device encoder (MQTTOTAProtocol.cpp)
+//   avx2    otastream::encodeBase64() with AVX2, when the CPU has it
+//
+// Build:
+//   g++ -std=c++17 -O2 -I../.. ota_base64_bench.cpp ota_stream.cpp ../../MQTTOTAProtocol.cpp -o ota_base64_bench
+//
+// Usage:
+//   ota_base64_bench [-s seconds]
+
+#include "ota_stream.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+// LIBB64 REFERENCE (public domain, Chris Venter)
+
+enum Libb64Step { STEP_A, STEP_B, STEP_C };
+
+struct Libb64State {
+    Libb64Step step = STEP_A;
+    char result = 0;
+};
+
+char libb64Value(char value) {
+    static const char* encoding = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    if (value > 63) return '=';
+    return encoding[(int)value];
+}
+
+int libb64Block(const char* in, int length, char* out, Libb64State* state) {
+    const char* p = in;
+    const char* const end = in + length;
+    char* o = out;
+    char result = state->result;
+    char fragment;
+
+    switch (state->step) {
+        while (true) {
+        case STEP_A:
+            if (p == end) {
+                state->result = result;
+                state->step = STEP_A;
+                return o - out;
+            }
+            fragment = *p++;
+            result = (fragment & 0x0fc) >> 2;
+            *o++ = libb64Value(result);
+            result = (fragment & 0x003) << 4;
+            // fall through
+        case STEP_B:
+            if (p == end) {
+                state->result = result;
+                state->step = STEP_B;
+                return o - out;
+            }
+            fragment = *p++;
+            result |= (fragment & 0x0f0) >> 4;
+            *o++ = libb64Value(result);
+            result = (fragment & 0x00f) << 2;
+            // fall through
+        case STEP_C:
+            if (p == end) {
+                state->result = result;
+                state->step = STEP_C;
+                return o - out;
+            }
+            fragment = *p++;
+            result |= (fragment & 0x0c0) >> 6;
+            *o++ = libb64Value(result);
+            result = (fragment & 0x03f) >> 0;
+            *o++ = libb64Value(result);
+        }
+    }
+    return o - out;
+}
+
+int libb64BlockEnd(char* out, Libb64State* state) {
+    char* o = out;
+    switch (state->step) {
+    case STEP_B:
+        *o++ = libb64Value(state->result);
+        *o++ = '=';
+        *o++ = '=';
+        break;
+    case STEP_C:
+        *o++ = libb64Value(state->result);
+        *o++ = '=';
+        break;
+    case STEP_A:
+        break;
+    }
+    *o = 0;
+    return o - out;
+}
+
+size_t libb64Encode(const uint8_t* data, size_t length, char* out) {
+    Libb64State state;
+    int count = libb64Block((const char*)data, (int)length, out, &state);
+    return count + libb64BlockEnd(out + count, &state);
+}
+
+// ENCODERS
+
+struct Encoder {
+    const char* name;
+    std::function<size_t(const uint8_t*, size_t, char*)> encode;
+    bool avx2;
+};
+
+size_t avx2Encode(const uint8_t* data, size_t length, char* out) {
+    return otastream::encodeBase64(data, length, out);
+}
+
+int checkAll(const std::vector<Encoder>& encoders) {
+    std::mt19937 random(7);
+    std::vector<uint8_t> data(4096 + 64);
+    for (uint8_t& byte : data) byte = (uint8_t)random();
+    std::vector<char> expected(otaBase64EncodedLength(data.size()) + 1);
+    std::vector<char> actual(expected.size() + 64);
+
+    int mismatches = 0;
+    for (const Encoder& encoder : encoders) {
+        otastream::selectDecoder(encoder.avx2);
+        for (size_t length = 0; length <= 4096; length++) {
+            for (size_t align = 0; align < (length < 256 ? 32u : 4u); align++) {
+                size_t expectedLength = libb64Encode(data.data() + align, length, expected.data());
+                memset(actual.data(), '#', actual.size());
+                size_t actualLength = encoder.encode(data.data() + align, length, actual.data() + align % 8);
+                if (actualLength != expectedLength ||
+                    memcmp(actual.data() + align % 8, expected.data(), expectedLength + 1) != 0) {
+                    if (mismatches++ < 5) {
+                        printf("%s differs from libb64: %zu bytes at offset %zu\n", encoder.name, length, align);
+                    }
+                }
+            }
+        }
+    }
+    return mismatches;
+}
+
+double measure(const Encoder& encoder, const std::vector<uint8_t>& data, size_t size, double seconds) {
+    otastream::selectDecoder(encoder.avx2);
+    std::vector<char> out(otaBase64EncodedLength(size) + 1);
+    size_t bytes = 0;
+    volatile size_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    double elapsed = 0;
+    while (elapsed < seconds) {
+        for (size_t offset = 0; offset + size <= data.size(); offset += size) {
+            sink = sink + encoder.encode(data.data() + offset, size, out.data());
+            bytes += size;
+        }
+        elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    return bytes / elapsed / 1e6;
+}
+
+}
+
+int main(int argc, char** argv) {
+    double seconds = 0.5;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+            seconds = std::max(0.05, atof(argv[++i]));
+        } else {
+            fprintf(stderr, "usage: %s [-s seconds]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    bool haveAvx2 = otastream::selectDecoder(true);
+    std::vector<Encoder> encoders = {
+        { "libb64", libb64Encode, false },
+        { "device", otaBase64Encode, false },
+    };
+    if (haveAvx2) encoders.push_back({ "avx2", avx2Encode, true });
+    else printf("AVX2 not available on this CPU\n");
+
+    int mismatches = checkAll(encoders);
+    printf("byte-exact check against libb64, lengths 0-4096: %s\n\n", mismatches ? "FAILED" : "ok");
+
+    std::vector<uint8_t> data(1 << 22);
+    std::mt19937 random(1);
+    for (uint8_t& byte : data) byte = (uint8_t)random();
+
+    const size_t sizes[] = { 4096, 1 << 20 };
+    printf("%-8s %14s %14s\n", "encoder", "4 KB MB/s", "1 MB MB/s");
+    for (const Encoder& encoder : encoders) {
+        printf("%-8s", encoder.name);
+        for (size_t size : sizes) printf(" %14.0f", measure(encoder, data, size, seconds));
+        printf("\n");
+    }
+    return mismatches ? 1 : 0;
+}
@@ -0,0 +1,291 @@
+// Checks and benchmarks the segmented Base64 decoder that full-image updates
+// run on both ESP32 cores, on any number of host threads.
+//
+// otaBase64Plan() splits the text into segments that start on a 4-character
+// group, and otaBase64DecodeSegment() decodes each into its own part of the
+// output; threads take the segments in order, as the device's two cores do.
+// libb64's decoder (base64_decode_block, as built into the ESP32 Arduino
+// core) is reproduced below as the reference. The tool first compares the
+// segmented decoder with it byte for byte, for every length up to 2 KB split
+// into 1 to 16 segments, with and without line breaks and stray spaces, then
+// prints MB/s of output and the speed-up over one thread for each thread
+// count:
+//
+//   plain   the text as otaBase64Encode() writes it
+//   lines   the same text with CRLF every 76 characters (MIME)
+//
+// Build:
+//   g++ -std=c++17 -O2 -pthread -I../.. ota_base64_decode_bench.cpp ../../MQTTOTAProtocol.cpp -o ota_base64_decode_bench
+//
+// Usage:
+//   ota_base64_decode_bench [--image KB] [-j max-threads] [-s seconds]
+
+#include "MQTTOTAProtocol.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+// LIBB64 REFERENCE (public domain, Chris Venter)
+
+enum Libb64Step { STEP_A, STEP_B, STEP_C, STEP_D };
+
+struct Libb64State {
+    Libb64Step step = STEP_A;
+    char plain = 0;
+};
+
+int libb64Value(char value) {
+    static const signed char decoding[] = {
+        62, -1, -1, -1, 63, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -2, -1, -1, -1,
+        0,  1,  2,  3,  4,  5,  6,  7,  8,  9,  10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21,
+        22, 23, 24, 25, -1, -1, -1, -1, -1, -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37,
+        38, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51
+    };
+    int index = (unsigned char)value - 43;
+    if (index < 0 || index >= (int)sizeof(decoding)) return -1;
+    return decoding[index];
+}
+
+// Characters outside the alphabet, padding and whitespace included, are skipped
+int libb64Block(const char* in, int length, char* out, Libb64State* state) {
+    const char* p = in;
+    const char* const end = in + length;
+    char* o = out;
+    int fragment;
+
+    *o = state->plain;
+    switch (state->step) {
+        while (true) {
+        case STEP_A:
+            do {
+                if (p == end) {
+                    state->step = STEP_A;
+                    state->plain = *o;
+                    return o - out;
+                }
+                fragment = libb64Value(*p++);
+            } while (fragment < 0);
+            *o = (fragment & 0x03f) << 2;
+            // fall through
+        case STEP_B:
+            do {
+                if (p == end) {
+                    state->step = STEP_B;
+                    state->plain = *o;
+                    return o - out;
+                }
+                fragment = libb64Value(*p++);
+            } while (fragment < 0);
+            *o++ |= (fragment & 0x030) >> 4;
+            *o = (fragment & 0x00f) << 4;
+            // fall through
+        case STEP_C:
+            do {
+                if (p == end) {
+                    state->step = STEP_C;
+                    state->plain = *o;
+                    return o - out;
+                }
+                fragment = libb64Value(*p++);
+            } while (fragment < 0);
+            *o++ |= (fragment & 0x03c) >> 2;
+            *o = (fragment & 0x003) << 6;
+            // fall through
+        case STEP_D:
+            do {
+                if (p == end) {
+                    state->step = STEP_D;
+                    state->plain = *o;
+                    return o - out;
+                }
+                fragment = libb64Value(*p++);
+            } while (fragment < 0);
+            *o++ |= (fragment & 0x03f);
+        }
+    }
+    return o - out;
+}
+
+size_t libb64Decode(const std::string& text, uint8_t* out) {
+    Libb64State state;
+    return libb64Block(text.data(), (int)text.size(), (char*)out, &state);
+}
+
+// SEGMENTED DECODER
+
+// What the device does with its two cores: plan, then every thread takes the
+// next segment until none are left
+bool decodeParallel(const std::string& text, std::vector<uint8_t>& out, size_t threads, size_t segmentCount,
+                    size_t* decodedLength) {
+    std::vector<OTABase64Segment> segments(segmentCount);
+    size_t length = 0;
+    size_t count = otaBase64Plan(text.data(), text.size(), segments.data(), segmentCount, &length);
+    if (count == 0) return false;
+    if (out.size() < length) out.resize(length);
+
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+    auto work = [&]() {
+        for (size_t k = next++; k < count; k = next++) {
+            if (!otaBase64DecodeSegment(text.data(), segments[k], out.data())) failed = true;
+        }
+    };
+    std::vector<std::thread> helpers;
+    for (size_t t = 1; t < std::min(threads, count); t++) helpers.emplace_back(work);
+    work();
+    for (std::thread& helper : helpers) helper.join();
+
+    *decodedLength = length;
+    return !failed;
+}
+
+std::string withLineBreaks(const std::string& text) {
+    std::string broken;
+    broken.reserve(text.size() + text.size() / 38 + 2);
+    for (size_t i = 0; i < text.size(); i += 76) {
+        broken.append(text, i, 76);
+        broken += "\r\n";
+    }
+    return broken;
+}
+
+std::string withStraySpaces(const std::string& text, std::mt19937& random) {
+    static const char spaces[] = { ' ', '\t', '\r', '\n' };
+    std::string scattered;
+    for (char c : text) {
+        if (random() % 7 == 0) scattered += spaces[random() % 4];
+        scattered += c;
+    }
+    return scattered;
+}
+
+int checkAll() {
+    std::mt19937 random(7);
+    std::vector<uint8_t> data(2048);
+    for (uint8_t& byte : data) byte = (uint8_t)random();
+    std::vector<uint8_t> expected(data.size() + 4);
+    std::vector<uint8_t> actual(data.size() + 4);
+    std::vector<char> encoded(otaBase64EncodedLength(data.size()) + 1);
+
+    int mismatches = 0;
+    for (size_t length = 1; length <= data.size(); length++) {
+        otaBase64Encode(data.data(), length, encoded.data());
+        std::string plain(encoded.data());
+        const std::string variants[] = { plain, withLineBreaks(plain), withStraySpaces(plain, random) };
+        for (const std::string& text : variants) {
+            size_t expectedLength = libb64Decode(text, expected.data());
+            for (size_t segments : { 1, 2, 3, 7, 16 }) {
+                size_t actualLength = 0;
+                actual.assign(actual.size(), 0xA5);
+                bool decoded = decodeParallel(text, actual, 3, segments, &actualLength);
+                if (!decoded || actualLength != expectedLength || actualLength != length ||
+                    memcmp(actual.data(), expected.data(), length) != 0 || actual[length] != 0xA5) {
+                    if (mismatches++ < 5) {
+                        printf("differs from libb64: %zu bytes, %zu segments, %zu characters\n", length, segments,
+                               text.size());
+                    }
+                }
+            }
+        }
+    }
+
+    // Rejected where libb64 skips: padding or a stray character in the middle
+    const char* invalid[] = { "QUJD=REVG", "QUJD*REVG", "QUJDR", "====" };
+    for (const char* text : invalid) {
+        size_t length = 0;
+        if (decodeParallel(text, actual, 2, 2, &length)) {
+            if (mismatches++ < 5) printf("accepted invalid text \"%s\"\n", text);
+        }
+    }
+    return mismatches;
+}
+
+double measure(const std::string& text, size_t threads, double seconds) {
+    size_t segments = std::max<size_t>(16, threads * 4);
+    std::vector<uint8_t> out;
+    size_t bytes = 0;
+    auto start = std::chrono::steady_clock::now();
+    double elapsed = 0;
+    while (elapsed < seconds) {
+        size_t length = 0;
+        if (!decodeParallel(text, out, threads, segments, &length)) return 0;
+        bytes += length;
+        elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    return bytes / elapsed / 1e6;
+}
+
+double measureLibb64(const std::string& text, double seconds) {
+    std::vector<uint8_t> out(text.size());
+    size_t bytes = 0;
+    auto start = std::chrono::steady_clock::now();
+    double elapsed = 0;
+    while (elapsed < seconds) {
+        bytes += libb64Decode(text, out.data());
+        elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    return bytes / elapsed / 1e6;
+}
+
+}
+
+int main(int argc, char** argv) {
+    size_t imageKB = 4096;
+    size_t maxThreads = std::max(1u, std::thread::hardware_concurrency());
+    double seconds = 0.5;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--image") && i + 1 < argc) {
+            imageKB = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+            maxThreads = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+            seconds = std::max(0.05, atof(argv[++i]));
+        } else {
+            fprintf(stderr, "usage: %s [--image KB] [-j max-threads] [-s seconds]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    int mismatches = checkAll();
+    printf("byte-exact check against libb64, lengths 1-2048, 1-16 segments: %s\n\n", mismatches ? "FAILED" : "ok");
+
+    std::vector<uint8_t> image(imageKB * 1024);
+    std::mt19937 random(1);
+    for (uint8_t& byte : image) byte = (uint8_t)random();
+    std::vector<char> encoded(otaBase64EncodedLength(image.size()) + 1);
+    otaBase64Encode(image.data(), image.size(), encoded.data());
+    std::string plain(encoded.data());
+    std::string lines = withLineBreaks(plain);
+
+    printf("%zu KB image, MB/s of decoded output\n\n", imageKB);
+    printf("decoder       threads   plain MB/s  speed-up   lines MB/s  speed-up\n");
+    printf("libb64              1   %10.0f             %10.0f\n", measureLibb64(plain, seconds),
+           measureLibb64(lines, seconds));
+
+    double basePlain = 0;
+    double baseLines = 0;
+    std::vector<size_t> counts;
+    for (size_t threads = 1; threads < maxThreads; threads *= 2) counts.push_back(threads);
+    counts.push_back(maxThreads);
+    for (size_t threads : counts) {
+        double plainRate = measure(plain, threads, seconds);
+        double linesRate = measure(lines, threads, seconds);
+        if (threads == 1) {
+            basePlain = plainRate;
+            baseLines = linesRate;
+        }
+        printf("segmented     %7zu   %10.0f  %7.2fx   %10.0f  %7.2fx\n", threads, plainRate,
+               basePlain > 0 ? plainRate / basePlain : 0, linesRate, baseLines > 0 ? linesRate / baseLines : 0);
+    }
+    return mismatches ? 1 : 0;
+}
@@ -0,0 +1,284 @@
+// Local MQTT broker stand-in for trying the host tools without a real broker.
+//
+// Single-threaded, QoS 0 only (QoS 1 publishes are acknowledged and delivered
+// at QoS 0), no retained messages, no authentication. Good for a laptop test
+// bench, not for devices in the field. On exit (Ctrl-C) it prints the bytes
+// each client sent and received.
+//
+// Build:
+//   g++ -std=c++17 -O2 ota_broker_stub.cpp ota_mqtt.cpp -o ota_broker_stub
+//
+// Usage:
+//   ota_broker_stub [-p port] [-v]
+
+#include "ota_mqtt.h"
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace otamqtt;
+
+namespace {
+
+volatile sig_atomic_t g_stop = 0;
+
+void onSignal(int) {
+    g_stop = 1;
+}
+
+struct Session {
+    int fd = -1;
+    std::string clientId;
+    bool connected = false;
+    std::string input;
+    std::string output;            // Pending bytes; the broker never blocks on a slow client
+    std::vector<std::string> filters;
+    uint64_t bytesIn = 0;
+    uint64_t bytesOut = 0;
+};
+
+class Broker {
+public:
+    explicit Broker(bool verbose) : _verbose(verbose) {}
+
+    bool listen(uint16_t port) {
+        _listenFd = socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        setsockopt(_listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        address.sin_port = htons(port);
+        if (bind(_listenFd, (sockaddr*)&address, sizeof(address)) != 0 || ::listen(_listenFd, 64) != 0) {
+            perror("listen");
+            return false;
+        }
+        fcntl(_listenFd, F_SETFL, O_NONBLOCK);
+        return true;
+    }
+
+    void run() {
+        std::vector<pollfd> fds;
+        while (!g_stop) {
+            fds.clear();
+            fds.push_back({ _listenFd, POLLIN, 0 });
+            for (auto& entry : _sessions) {
+                short events = POLLIN;
+                if (!entry.second.output.empty()) events |= POLLOUT;
+                fds.push_back({ entry.first, events, 0 });
+            }
+            if (::poll(fds.data(), fds.size(), 200) < 0) continue;
+
+            if (fds[0].revents & POLLIN) accept();
+            for (size_t i = 1; i < fds.size(); i++) {
+                auto it = _sessions.find(fds[i].fd);
+                if (it == _sessions.end()) continue;
+                bool alive = true;
+                if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) alive = read(it->second);
+                if (alive && (fds[i].revents & POLLOUT)) alive = flush(it->second);
+                if (!alive) drop(it->second.fd);
+            }
+        }
+    }
+
+    void printStats() const {
+        fprintf(stderr, "%-24s %14s %14s\n", "client", "bytes in", "bytes out");
+        for (const auto& entry : _closed) {
+            fprintf(stderr, "%-24s %14llu %14llu\n", entry.clientId.c_str(),
+                    (unsigned long long)entry.bytesIn, (unsigned long long)entry.bytesOut);
+        }
+        for (const auto& entry : _sessions) {
+            fprintf(stderr, "%-24s %14llu %14llu\n", entry.second.clientId.c_str(),
+                    (unsigned long long)entry.second.bytesIn, (unsigned long long)entry.second.bytesOut);
+        }
+    }
+
+private:
+    void accept() {
+        for (;;) {
+            int fd = ::accept(_listenFd, nullptr, nullptr);
+            if (fd < 0) return;
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            fcntl(fd, F_SETFL, O_NONBLOCK);
+            _sessions[fd].fd = fd;
+        }
+    }
+
+    bool read(Session& session) {
+        char chunk[65536];
+        for (;;) {
+            ssize_t received = recv(session.fd, chunk, sizeof(chunk), 0);
+            if (received > 0) {
+                session.input.append(chunk, received);
+                session.bytesIn += received;
+                continue;
+            }
+            if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            if (received < 0 && errno == EINTR) continue;
+            return false;
+        }
+
+        Packet packet;
+        int status;
+        while ((status = takePacket(session.input, packet)) == 1) {
+            if (!handle(session, packet)) return false;
+        }
+        return status == 0 && flush(session);
+    }
+
+    bool handle(Session& session, const Packet& packet) {
+        if (!session.connected && packet.type != MQTT_CONNECT) return false;
+
+        std::string reply;
+        switch (packet.type) {
+            case MQTT_CONNECT: {
+                // Protocol name, level, flags, keep alive, then the client ID
+                const std::string& body = packet.body;
+                if (body.size() < 12) return false;
+                size_t idLength = ((uint8_t)body[10] << 8) | (uint8_t)body[11];
+                session.clientId = body.substr(12, idLength);
+                if (session.clientId.empty()) session.clientId = "fd" + std::to_string(session.fd);
+                session.connected = true;
+                appendPacket(reply, MQTT_CONNACK, 0, std::string("\0\0", 2));
+                if (_verbose) fprintf(stderr, "connect %s\n", session.clientId.c_str());
+                break;
+            }
+            case MQTT_SUBSCRIBE:
+            case MQTT_UNSUBSCRIBE: {
+                const std::string& body = packet.body;
+                if (body.size() < 2) return false;
+                std::string granted = body.substr(0, 2);
+                size_t position = 2;
+                while (position + 2 <= body.size()) {
+                    size_t length = ((uint8_t)body[position] << 8) | (uint8_t)body[position + 1];
+                    std::string filter = body.substr(position + 2, length);
+                    position += 2 + length;
+                    if (packet.type == MQTT_SUBSCRIBE) {
+                        position++;        // Requested QoS
+                        session.filters.push_back(filter);
+                        granted += (char)0;
+                    } else {
+                        for (size_t i = 0; i < session.filters.size(); i++) {
+                            if (session.filters[i] == filter) session.filters.erase(session.filters.begin() + i--);
+                        }
+                    }
+                    if (_verbose) {
+                        fprintf(stderr, "%s %s %s\n", session.clientId.c_str(),
+                                packet.type == MQTT_SUBSCRIBE ? "subscribe" : "unsubscribe", filter.c_str());
+                    }
+                }
+                if (packet.type == MQTT_SUBSCRIBE) {
+                    appendPacket(reply, MQTT_SUBACK, 0, granted);
+                } else {
+                    appendPacket(reply, MQTT_UNSUBACK, 0, granted.substr(0, 2));
+                }
+                break;
+            }
+            case MQTT_PUBLISH: {
+                std::string topic, payload;
+                uint16_t packetId;
+                if (!parsePublish(packet, topic, payload, &packetId)) return false;
+                if (packetId) {
+                    std::string id;
+                    appendU16(id, packetId);
+                    appendPacket(reply, MQTT_PUBACK, 0, id);
+                }
+                route(topic, payload);
+                break;
+            }
+            case MQTT_PINGREQ:
+                appendPacket(reply, MQTT_PINGRESP, 0, std::string());
+                break;
+            case MQTT_DISCONNECT:
+                return false;
+            default:
+                break;
+        }
+        session.output += reply;
+        return true;
+    }
+
+    // Delivers at QoS 0, once per subscriber even if several filters match
+    void route(const std::string& topic, const std::string& payload) {
+        std::string packet;
+        for (auto& entry : _sessions) {
+            Session& subscriber = entry.second;
+            for (const std::string& filter : subscriber.filters) {
+                if (!topicMatches(filter, topic)) continue;
+                if (packet.empty()) {
+                    appendPacket(packet, MQTT_PUBLISH, 0, publishBody(topic, payload.data(), payload.size()));
+                }
+                subscriber.output += packet;
+                break;
+            }
+        }
+        if (_verbose) fprintf(stderr, "publish %s (%zu bytes)\n", topic.c_str(), payload.size());
+    }
+
+    bool flush(Session& session) {
+        while (!session.output.empty()) {
+            ssize_t sent = send(session.fd, session.output.data(), session.output.size(), MSG_NOSIGNAL);
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+            if (sent < 0 && errno == EINTR) continue;
+            if (sent <= 0) return false;
+            session.output.erase(0, sent);
+            session.bytesOut += sent;
+        }
+        return true;
+    }
+
+    void drop(int fd) {
+        auto it = _sessions.find(fd);
+        if (it == _sessions.end()) return;
+        if (_verbose) fprintf(stderr, "disconnect %s\n", it->second.clientId.c_str());
+        _closed.push_back(it->second);
+        close(fd);
+        _sessions.erase(it);
+    }
+
+    bool _verbose;
+    int _listenFd = -1;
+    std::map<int, Session> _sessions;
+    std::vector<Session> _closed;
+};
+
+}
+
+int main(int argc, char** argv) {
+    uint16_t port = 1883;
+    bool verbose = false;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-p") && i + 1 < argc) {
+            port = (uint16_t)atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-v")) {
+            verbose = true;
+        } else {
+            fprintf(stderr, "usage: %s [-p port] [-v]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    Broker broker(verbose);
+    if (!broker.listen(port)) return 1;
+    fprintf(stderr, "broker stand-in listening on port %u\n", port);
+    broker.run();
+    broker.printStats();
+    return 0;
+}
@@ -0,0 +1,199 @@
+// Host test of the bundle code shared with the device: where a data section
+// is written (otaBundleDataSlot, which refuses an unpaired partition unless
+// in-place writes are enabled) and OTABundleReader splitting a bundle fed in
+// pieces of any size. Prints each failed check and exits 1 if any failed.
+//
+// Build:
+//   g++ -std=c++17 -O2 -I../.. ota_bundle_test.cpp ../../MQTTOTAProtocol.cpp -o ota_bundle_test
+//
+// Usage:
+//   ota_bundle_test
+
+#include "MQTTOTAProtocol.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(condition)                                                        \
+    do {                                                                        \
+        if (!(condition)) {                                                     \
+            fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, #condition); \
+            failures++;                                                         \
+        }                                                                       \
+    } while (0)
+
+void testDataSlot() {
+    // A pair gets its inactive slot, whatever in-place allows
+    CHECK(otaBundleDataSlot(true, 0, false) == 1);
+    CHECK(otaBundleDataSlot(true, 1, false) == 0);
+    CHECK(otaBundleDataSlot(true, 0, true) == 1);
+    CHECK(otaBundleDataSlot(true, 1, true) == 0);
+    CHECK(otaBundleDataSlot(true, 7, false) == 1);
+
+    // An unpaired partition is refused unless it may be overwritten
+    CHECK(otaBundleDataSlot(false, 0, false) < 0);
+    CHECK(otaBundleDataSlot(false, 1, false) < 0);
+    CHECK(otaBundleDataSlot(false, 0, true) == OTA_BUNDLE_IN_PLACE);
+}
+
+OTABundleSection section(uint8_t target, const char* label, uint32_t offset, uint32_t length) {
+    OTABundleSection entry = {};
+    entry.target = target;
+    entry.codec = OTA_BUNDLE_CODEC_RAW;
+    entry.offset = offset;
+    entry.length = length;
+    strncpy(entry.label, label, OTA_BUNDLE_LABEL_SIZE);
+    memset(entry.sha256, length & 0xFF, sizeof(entry.sha256));
+    return entry;
+}
+
+std::vector<uint8_t> bundle(const std::vector<OTABundleSection>& sections) {
+    OTABundleHeader header = {};
+    header.sectionCount = (uint8_t)sections.size();
+    header.totalLength = (uint32_t)otaBundleIndexSize(header.sectionCount);
+    for (const OTABundleSection& entry : sections) header.totalLength += entry.length;
+
+    std::vector<uint8_t> out(header.totalLength);
+    size_t at = otaBundleHeaderEncode(header, out.data());
+    for (const OTABundleSection& entry : sections) at += otaBundleSectionEncode(entry, out.data() + at);
+    // Each section's bytes carry its number so misattributed bytes show
+    for (size_t i = 0; i < sections.size(); i++) {
+        memset(out.data() + at, (int)(i + 1), sections[i].length);
+        at += sections[i].length;
+    }
+    return out;
+}
+
+// Feeds the bundle in pieces of 1..maxPiece bytes; false if the index is refused
+bool split(const std::vector<uint8_t>& data, size_t maxPiece, std::vector<uint32_t>& lengths, bool& mixed,
+           bool& overrun) {
+    OTABundleReader reader;
+    reader.reset();
+    lengths.clear();
+    mixed = overrun = false;
+    uint32_t current = 0;
+    size_t at = 0;
+    while (at < data.size()) {
+        size_t piece = 1 + (size_t)rand() % maxPiece;
+        if (piece > data.size() - at) piece = data.size() - at;
+        const uint8_t* p = data.data() + at;
+        size_t length = piece;
+        at += piece;
+        while (length > 0) {
+            if (!reader.indexComplete) {
+                size_t used;
+                if (!reader.readIndex(p, length, &used)) return false;
+                p += used;
+                length -= used;
+                continue;
+            }
+            if (reader.done()) {
+                overrun = true;
+                return true;
+            }
+            size_t n = reader.sectionBytes(length);
+            for (size_t i = 0; i < n; i++) {
+                if (p[i] != reader.section + 1) mixed = true;
+            }
+            current += (uint32_t)n;
+            if (reader.advance(n)) {
+                lengths.push_back(current);
+                current = 0;
+            }
+            p += n;
+            length -= n;
+        }
+    }
+    return reader.done();
+}
+
+void testReader() {
+    std::vector<OTABundleSection> sections = {
+        section(OTA_BUNDLE_TARGET_APP, "", 0, 5000),
+        section(OTA_BUNDLE_TARGET_DATA, "spiffs", 0, 1),
+        section(OTA_BUNDLE_TARGET_DATA, "config", 2 * OTA_BUNDLE_SECTOR_SIZE, 777),
+    };
+    std::vector<uint8_t> data = bundle(sections);
+    std::vector<uint32_t> lengths;
+    bool mixed, overrun;
+
+    const size_t pieces[] = { 1, 3, 47, 700, 100000 };
+    for (size_t maxPiece : pieces) {
+        for (int round = 0; round < 20; round++) {
+            CHECK(split(data, maxPiece, lengths, mixed, overrun));
+            CHECK(lengths.size() == sections.size());
+            for (size_t i = 0; i < lengths.size() && i < sections.size(); i++) {
+                CHECK(lengths[i] == sections[i].length);
+            }
+            CHECK(!mixed);
+            CHECK(!overrun);
+        }
+    }
+
+    // Bytes past the last section are not taken as section data
+    std::vector<uint8_t> longer = data;
+    longer.push_back(0xEE);
+    CHECK(split(longer, 64, lengths, mixed, overrun) && overrun);
+
+    // The decoded index matches what was encoded
+    OTABundleReader reader;
+    reader.reset();
+    size_t used;
+    CHECK(reader.readIndex(data.data(), data.size(), &used));
+    CHECK(used == otaBundleIndexSize((uint8_t)sections.size()));
+    CHECK(reader.indexComplete && reader.header.sectionCount == sections.size());
+    CHECK(strcmp(reader.sections[2].label, "config") == 0);
+    CHECK(reader.sections[2].offset == 2 * OTA_BUNDLE_SECTOR_SIZE);
+    CHECK(reader.sections[2].sha256[31] == (777 & 0xFF));
+}
+
+bool refused(const std::vector<uint8_t>& data) {
+    std::vector<uint32_t> lengths;
+    bool mixed, overrun;
+    return !split(data, 16, lengths, mixed, overrun) && lengths.empty();
+}
+
+void testMalformed() {
+    CHECK(refused(bundle({ section(OTA_BUNDLE_TARGET_APP, "", 0, 10), section(OTA_BUNDLE_TARGET_APP, "", 0, 10) })));
+    CHECK(refused(bundle({ section(OTA_BUNDLE_TARGET_APP, "", 4096, 10) })));
+    CHECK(refused(bundle({ section(OTA_BUNDLE_TARGET_DATA, "", 0, 10) })));
+    CHECK(refused(bundle({ section(OTA_BUNDLE_TARGET_DATA, "nvs", 100, 10) })));
+    CHECK(refused(bundle({ section(OTA_BUNDLE_TARGET_DATA, "nvs", 0, 0) })));
+    CHECK(refused(bundle({ section(2, "nvs", 0, 10) })));
+
+    std::vector<uint8_t> data = bundle({ section(OTA_BUNDLE_TARGET_DATA, "nvs", 0, 10) });
+    std::vector<uint8_t> badMagic = data;
+    badMagic[0] ^= 0xFF;
+    CHECK(refused(badMagic));
+    std::vector<uint8_t> badTotal = data;
+    badTotal[4]++;
+    CHECK(refused(badTotal));
+    std::vector<uint8_t> badCodec = data;
+    badCodec[OTA_BUNDLE_HEADER_SIZE + 1] = 1;
+    CHECK(refused(badCodec));
+    std::vector<uint8_t> noSections = data;
+    noSections[2] = 0;
+    CHECK(refused(noSections));
+}
+
+}
+
+int main() {
+    srand(1);
+    testDataSlot();
+    testReader();
+    testMalformed();
+
+    if (failures > 0) {
+        fprintf(stderr, "ota_bundle_test: %d checks failed\n", failures);
+        return 1;
+    }
+    printf("ota_bundle_test: ok\n");
+    return 0;
+}
@@ -0,0 +1,407 @@
+// Packs, inspects and applies update bundles (OTABundleReader in MQTTOTAProtocol.h).
+//
+//   pack     builds a bundle from an app image and data partition images;
+//            a data image goes to offset 0 unless label@offset says otherwise
+//   inspect  prints the index and checks every section's SHA-256
+//   apply    streams a bundle into partitions backed by files in a directory,
+//            the way the device does: pieces of random size go through
+//            OTABundleReader, data sections are erased a sector ahead and
+//            every section is hashed as it is written. The app section goes
+//            to <dir>/app (or to its label). A data partition is <dir>/<label>,
+//            or the <label>_0/<label>_1 pair with the active slot kept in
+//            <dir>/<label>.slot; the inactive one is written. Like the device,
+//            it refuses a data partition without a pair unless --in-place
+//            (MQTTOTA::enableInPlaceBundleData()) is given.
+//            Every partition is written to a .new copy; they replace the
+//            originals only once all sections have verified, so a failed
+//            bundle leaves the directory as it was.
+//
+// Build:
+//   g++ -std=c++17 -O2 -I../.. ota_bundle_tool.cpp ota_stream.cpp ../../MQTTOTAProtocol.cpp -o ota_bundle_tool
+//
+// Usage:
+//   ota_bundle_tool pack [--app app.bin] [--data label[@offset]=file]... -o bundle.bin
+//   ota_bundle_tool inspect bundle.bin
+//   ota_bundle_tool apply bundle.bin dir [--seed n] [--corrupt offset] [--in-place]
+
+#include "ota_stream.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+const char* kTargetNames[] = { "app", "data" };
+
+bool readFile(const std::string& path, std::vector<uint8_t>& data) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) return false;
+    uint8_t buffer[65536];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) data.insert(data.end(), buffer, buffer + n);
+    bool ok = !ferror(file);
+    fclose(file);
+    return ok;
+}
+
+bool writeFile(const std::string& path, const void* data, size_t length) {
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file) return false;
+    bool ok = fwrite(data, 1, length, file) == length;
+    return fclose(file) == 0 && ok;
+}
+
+bool exists(const std::string& path) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file) fclose(file);
+    return file != nullptr;
+}
+
+std::string hex(const uint8_t* data, size_t length) {
+    std::string text;
+    char digits[3];
+    for (size_t i = 0; i < length; i++) {
+        snprintf(digits, sizeof(digits), "%02x", data[i]);
+        text += digits;
+    }
+    return text;
+}
+
+// Reads the index of a whole bundle in memory
+bool readIndex(const std::vector<uint8_t>& bundle, OTABundleReader& reader) {
+    reader.reset();
+    size_t used = 0;
+    return reader.readIndex(bundle.data(), bundle.size(), &used) && reader.indexComplete;
+}
+
+int pack(int argc, char** argv) {
+    std::vector<OTABundleSection> sections;
+    std::vector<std::vector<uint8_t>> images;
+    std::string output;
+
+    for (int i = 2; i < argc; i++) {
+        bool value = i + 1 < argc;
+        if (!strcmp(argv[i], "-o") && value) {
+            output = argv[++i];
+        } else if ((!strcmp(argv[i], "--app") || !strcmp(argv[i], "--data")) && value) {
+            OTABundleSection section = {};
+            std::string path = argv[++i];
+            if (!strcmp(argv[i - 1], "--data")) {
+                size_t equals = path.find('=');
+                if (equals == std::string::npos) return 2;
+                std::string label = path.substr(0, equals);
+                path = path.substr(equals + 1);
+                size_t at = label.find('@');
+                if (at != std::string::npos) {
+                    section.offset = strtoul(label.c_str() + at + 1, nullptr, 0);
+                    label.resize(at);
+                }
+                if (label.empty() || label.size() > OTA_BUNDLE_LABEL_SIZE) {
+                    fprintf(stderr, "bad partition label: %s\n", label.c_str());
+                    return 1;
+                }
+                section.target = OTA_BUNDLE_TARGET_DATA;
+                memcpy(section.label, label.c_str(), label.size());
+            } else {
+                section.target = OTA_BUNDLE_TARGET_APP;
+            }
+
+            std::vector<uint8_t> image;
+            if (!readFile(path, image)) {
+                fprintf(stderr, "cannot read %s\n", path.c_str());
+                return 1;
+            }
+            if (section.target == OTA_BUNDLE_TARGET_APP) {
+                OTAImageCheck check = otaCheckImageHeader(image.data(), image.size(), nullptr);
+                if (check != OTA_IMAGE_OK) {
+                    fprintf(stderr, "%s is not an app image: %s\n", path.c_str(), otaImageCheckName(check));
+                    return 1;
+                }
+            }
+            section.codec = OTA_BUNDLE_CODEC_RAW;
+            section.length = image.size();
+            otastream::Sha256 sha;
+            sha.update(image.data(), image.size());
+            sha.finish(section.sha256);
+            sections.push_back(section);
+            images.push_back(std::move(image));
+        } else {
+            return 2;
+        }
+    }
+    if (output.empty() || sections.empty()) return 2;
+    if (sections.size() > OTA_BUNDLE_MAX_SECTIONS) {
+        fprintf(stderr, "at most %d sections\n", OTA_BUNDLE_MAX_SECTIONS);
+        return 1;
+    }
+
+    OTABundleHeader header = {};
+    header.sectionCount = sections.size();
+    uint64_t total = otaBundleIndexSize(header.sectionCount);
+    for (const OTABundleSection& section : sections) total += section.length;
+    if (total > UINT32_MAX) {
+        fprintf(stderr, "bundle larger than 4 GB\n");
+        return 1;
+    }
+    header.totalLength = total;
+
+    std::vector<uint8_t> bundle(otaBundleIndexSize(header.sectionCount));
+    otaBundleHeaderEncode(header, bundle.data());
+    for (size_t i = 0; i < sections.size(); i++) {
+        otaBundleSectionEncode(sections[i], bundle.data() + OTA_BUNDLE_HEADER_SIZE + i * OTA_BUNDLE_SECTION_SIZE);
+    }
+    for (const std::vector<uint8_t>& image : images) bundle.insert(bundle.end(), image.begin(), image.end());
+
+    // The same checks the device makes, so a bundle it would refuse is never written
+    OTABundleReader reader;
+    if (!readIndex(bundle, reader)) {
+        fprintf(stderr, "invalid bundle: one app section at most, data sections need a label and a "
+                        "sector-aligned offset\n");
+        return 1;
+    }
+    if (!writeFile(output, bundle.data(), bundle.size())) {
+        fprintf(stderr, "cannot write %s\n", output.c_str());
+        return 1;
+    }
+    printf("%s: %zu sections, %u bytes\n", output.c_str(), sections.size(), header.totalLength);
+    return 0;
+}
+
+int inspect(int argc, char** argv) {
+    if (argc != 3) return 2;
+    std::vector<uint8_t> bundle;
+    if (!readFile(argv[2], bundle)) {
+        fprintf(stderr, "cannot read %s\n", argv[2]);
+        return 1;
+    }
+    OTABundleReader reader;
+    if (!readIndex(bundle, reader)) {
+        fprintf(stderr, "%s: invalid bundle index\n", argv[2]);
+        return 1;
+    }
+
+    printf("%s: %u sections, %u bytes (%zu on disk)\n", argv[2], reader.header.sectionCount,
+           reader.header.totalLength, bundle.size());
+    int failures = bundle.size() == reader.header.totalLength ? 0 : 1;
+    size_t position = otaBundleIndexSize(reader.header.sectionCount);
+    for (uint8_t i = 0; i < reader.header.sectionCount; i++) {
+        const OTABundleSection& section = reader.sections[i];
+        bool ok = position + section.length <= bundle.size();
+        if (ok) {
+            uint8_t digest[32];
+            otastream::Sha256 sha;
+            sha.update(bundle.data() + position, section.length);
+            sha.finish(digest);
+            ok = memcmp(digest, section.sha256, sizeof(digest)) == 0;
+        }
+        printf("  %u  %-4s %-16s offset 0x%-6x %9u bytes  sha256 %.16s...  %s\n", i, kTargetNames[section.target],
+               section.label[0] ? section.label : "-", section.offset, section.length,
+               hex(section.sha256, 32).c_str(), ok ? "ok" : "MISMATCH");
+        failures += ok ? 0 : 1;
+        position += section.length;
+    }
+    return failures ? 1 : 0;
+}
+
+// A partition file being rewritten: the .new copy and, for a slot pair, the
+// slot that becomes active
+struct Target {
+    std::string path;
+    std::vector<uint8_t> data;
+    std::string slotPath;
+    int slot;
+    size_t erasedUpTo;
+};
+
+bool resolve(const std::string& dir, const OTABundleSection& section, bool inPlace, Target& target) {
+    target.slot = -1;
+    std::string label = section.label;
+    if (section.target == OTA_BUNDLE_TARGET_APP) {
+        target.path = dir + "/" + (label.empty() ? "app" : label);
+    } else {
+        bool paired = exists(dir + "/" + label + "_0") && exists(dir + "/" + label + "_1");
+        std::vector<uint8_t> active;
+        target.slotPath = dir + "/" + label + ".slot";
+        if (paired) readFile(target.slotPath, active);
+        int slot = otaBundleDataSlot(paired, !active.empty() && active[0] == '1' ? 1 : 0, inPlace);
+        if (slot < 0) {
+            fprintf(stderr, "data partition %s has no %s_0/%s_1 pair (--in-place to overwrite it)\n",
+                    label.c_str(), label.c_str(), label.c_str());
+            return false;
+        }
+        if (slot == OTA_BUNDLE_IN_PLACE) {
+            target.slotPath.clear();
+            target.path = dir + "/" + label;
+        } else {
+            target.slot = slot;
+            target.path = dir + "/" + label + "_" + std::to_string(slot);
+        }
+    }
+
+    if (!readFile(target.path, target.data)) {
+        fprintf(stderr, "no partition file for section %s: %s\n", label.empty() ? "app" : label.c_str(),
+                target.path.c_str());
+        return false;
+    }
+    if ((uint64_t)section.offset + section.length > target.data.size()) {
+        fprintf(stderr, "section does not fit in %s (%zu bytes)\n", target.path.c_str(), target.data.size());
+        return false;
+    }
+    return true;
+}
+
+void discard(const std::vector<Target>& targets) {
+    for (const Target& target : targets) remove((target.path + ".new").c_str());
+}
+
+int apply(int argc, char** argv) {
+    if (argc < 4) return 2;
+    unsigned seed = 1;
+    long corrupt = -1;
+    bool inPlace = false;
+    for (int i = 4; i < argc; i++) {
+        if (!strcmp(argv[i], "--seed") && i + 1 < argc) seed = strtoul(argv[++i], nullptr, 10);
+        else if (!strcmp(argv[i], "--corrupt") && i + 1 < argc) corrupt = strtol(argv[++i], nullptr, 0);
+        else if (!strcmp(argv[i], "--in-place")) inPlace = true;
+        else return 2;
+    }
+    std::string dir = argv[3];
+
+    std::vector<uint8_t> bundle;
+    if (!readFile(argv[2], bundle)) {
+        fprintf(stderr, "cannot read %s\n", argv[2]);
+        return 1;
+    }
+    if (corrupt >= 0 && (size_t)corrupt < bundle.size()) bundle[corrupt] ^= 0x01;
+
+    // Pieces from 1 byte to a few chunks, so sections and the index split anywhere
+    std::mt19937 random(seed);
+    std::uniform_int_distribution<size_t> pieceSize(1, 40000);
+    OTABundleReader reader;
+    reader.reset();
+    std::vector<Target> targets;
+    otastream::Sha256 sha;
+    size_t position = 0, pieces = 0;
+
+    while (position < bundle.size()) {
+        size_t length = std::min(pieceSize(random), bundle.size() - position);
+        const uint8_t* data = bundle.data() + position;
+        position += length;
+        pieces++;
+
+        while (length > 0) {
+            if (!reader.indexComplete) {
+                size_t used;
+                if (!reader.readIndex(data, length, &used)) {
+                    fprintf(stderr, "invalid bundle index\n");
+                    return 1;
+                }
+                data += used;
+                length -= used;
+                if (reader.indexComplete) {
+                    targets.resize(reader.header.sectionCount);
+                    for (uint8_t i = 0; i < reader.header.sectionCount; i++) {
+                        if (!resolve(dir, reader.sections[i], inPlace, targets[i])) return 1;
+                    }
+                }
+                continue;
+            }
+            if (reader.done()) {
+                fprintf(stderr, "data after the last section\n");
+                return 1;
+            }
+
+            const OTABundleSection& section = reader.current();
+            Target& target = targets[reader.section];
+            if (reader.sectionOffset == 0) {
+                sha = otastream::Sha256();
+                target.erasedUpTo = section.offset;
+                // The app slot is erased as a whole, like esp_ota_begin() does
+                if (section.target == OTA_BUNDLE_TARGET_APP) {
+                    std::fill(target.data.begin(), target.data.end(), 0xFF);
+                    target.erasedUpTo = target.data.size();
+                }
+            }
+
+            size_t count = reader.sectionBytes(length);
+            sha.update(data, count);
+            size_t at = section.offset + reader.sectionOffset;
+            if (at + count > target.erasedUpTo) {
+                size_t erase = (at + count + OTA_BUNDLE_SECTOR_SIZE - 1) / OTA_BUNDLE_SECTOR_SIZE *
+                               OTA_BUNDLE_SECTOR_SIZE;
+                erase = std::min(erase, target.data.size());
+                std::fill(target.data.begin() + target.erasedUpTo, target.data.begin() + erase, 0xFF);
+                target.erasedUpTo = erase;
+            }
+            // Flash programming only clears bits
+            for (size_t i = 0; i < count; i++) target.data[at + i] &= data[i];
+
+            data += count;
+            length -= count;
+            if (reader.advance(count)) {
+                uint8_t index = reader.section - 1;
+                uint8_t digest[32];
+                sha.finish(digest);
+                if (memcmp(digest, reader.sections[index].sha256, sizeof(digest)) != 0) {
+                    fprintf(stderr, "section %u: SHA-256 mismatch, nothing applied\n", index);
+                    discard(targets);
+                    return 1;
+                }
+                if (!writeFile(target.path + ".new", target.data.data(), target.data.size())) {
+                    fprintf(stderr, "cannot write %s.new\n", target.path.c_str());
+                    discard(targets);
+                    return 1;
+                }
+                printf("section %u verified -> %s\n", index, target.path.c_str());
+            }
+        }
+    }
+
+    if (!reader.done()) {
+        fprintf(stderr, "bundle ends inside section %u, nothing applied\n", reader.section);
+        discard(targets);
+        return 1;
+    }
+
+    // Everything verified: replace the partitions, then switch the slot pairs
+    for (const Target& target : targets) {
+        if (rename((target.path + ".new").c_str(), target.path.c_str()) != 0) {
+            fprintf(stderr, "cannot replace %s\n", target.path.c_str());
+            return 1;
+        }
+    }
+    for (const Target& target : targets) {
+        if (target.slot < 0) continue;
+        char slot = '0' + target.slot;
+        if (!writeFile(target.slotPath + ".new", &slot, 1) ||
+            rename((target.slotPath + ".new").c_str(), target.slotPath.c_str()) != 0) {
+            fprintf(stderr, "cannot switch %s\n", target.slotPath.c_str());
+            return 1;
+        }
+        printf("%s now %c\n", target.slotPath.c_str(), slot);
+    }
+    printf("applied %u sections from %zu pieces\n", reader.header.sectionCount, pieces);
+    return 0;
+}
+
+}
+
+int main(int argc, char** argv) {
+    int status = 2;
+    if (argc >= 2 && !strcmp(argv[1], "pack")) status = pack(argc, argv);
+    else if (argc >= 2 && !strcmp(argv[1], "inspect")) status = inspect(argc, argv);
+    else if (argc >= 2 && !strcmp(argv[1], "apply")) status = apply(argc, argv);
+
+    if (status == 2) {
+        fprintf(stderr, "usage: %s pack [--app app.bin] [--data label[@offset]=file]... -o bundle.bin\n"
+                        "       %s inspect bundle.bin\n"
+                        "       %s apply bundle.bin dir [--seed n] [--corrupt offset] [--in-place]\n",
+                argv[0], argv[0], argv[0]);
+    }
+    return status;
+}
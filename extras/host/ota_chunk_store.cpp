@@ -0,0 +1,245 @@
+#include "ota_chunk_store.h"
+#include "ota_stream.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace otastore {
+
+namespace {
+
+const size_t MESSAGE_ALIGN = 64;
+
+size_t alignUp(size_t value) {
+    return (value + MESSAGE_ALIGN - 1) / MESSAGE_ALIGN * MESSAGE_ALIGN;
+}
+
+std::string jsonMessage(const std::string& version, uint32_t part, uint32_t totalParts,
+                        const uint8_t* data, size_t length) {
+    std::string escaped;
+    for (char c : version) {
+        if (c == '"' || c == '\\') escaped += '\\';
+        escaped += c;
+    }
+
+    std::string message;
+    message.reserve(length * 4 / 3 + 160);
+    message += "{\"EventType\":\"UpdateFirmwareDevice\",\"Details\":{\"FirmwareVersion\":\"";
+    message += escaped;
+    message += "\",\"PartIndex\":";
+    message += std::to_string(part);
+    message += ",\"TotalParts\":";
+    message += std::to_string(totalParts);
+    message += ",\"Base64Part\":\"";
+    message += otastream::encodeBase64(data, length);
+    message += "\"}}";
+    return message;
+}
+
+std::string binaryMessage(const std::string& version, uint32_t part, uint32_t totalParts,
+                          const uint8_t* data, size_t length) {
+    OTAChunkHeader header = {};
+    header.part = (uint16_t)part;
+    header.totalParts = (uint16_t)totalParts;
+    header.versionLength = (uint8_t)version.size();
+
+    std::string message(OTA_CHUNK_HEADER_SIZE, '\0');
+    otaChunkHeaderEncode(header, (uint8_t*)&message[0]);
+    message += version;
+    message.append((const char*)data, length);
+    return message;
+}
+
+}
+
+bool buildStore(const std::vector<uint8_t>& image, const std::string& version, size_t chunkSize,
+                const std::string& path, std::string& error) {
+    if (version.empty() || version.size() > OTA_STORE_VERSION_MAX) {
+        error = "version must be 1 to " + std::to_string(OTA_STORE_VERSION_MAX) + " characters";
+        return false;
+    }
+    if (chunkSize < OTA_IMAGE_MIN_HEADER) {
+        error = "chunk size below " + std::to_string(OTA_IMAGE_MIN_HEADER) + " bytes";
+        return false;
+    }
+    OTAImageCheck check = otaCheckImageHeader(image.data(), image.size(), nullptr);
+    if (check != OTA_IMAGE_OK) {
+        error = std::string("not an app image: ") + otaImageCheckName(check);
+        return false;
+    }
+    size_t parts = (image.size() + chunkSize - 1) / chunkSize;
+    if (parts > 0xFFFF) {
+        error = "more than 65535 parts; use a larger chunk size";
+        return false;
+    }
+
+    StoreHeader header = {};
+    memcpy(header.magic, OTA_STORE_MAGIC, sizeof(header.magic));
+    header.formatVersion = 1;
+    header.parts = (uint32_t)parts;
+    header.chunkSize = (uint32_t)chunkSize;
+    header.imageSize = image.size();
+    memcpy(header.version, version.data(), version.size());
+
+    otastream::Sha256 sha;
+    sha.update(image.data(), image.size());
+    sha.finish(header.sha256);
+
+    std::string temporary = path + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "wb");
+    if (!file) {
+        error = "cannot create " + temporary;
+        return false;
+    }
+
+    // Messages are written first and the index after them, at the front
+    std::vector<StoreEntry> entries(parts);
+    size_t offset = alignUp(sizeof(StoreHeader) + parts * sizeof(StoreEntry));
+    bool written = fseek(file, (long)offset, SEEK_SET) == 0;
+    static const char padding[MESSAGE_ALIGN] = {};
+
+    for (size_t i = 0; i < parts && written; i++) {
+        const uint8_t* data = image.data() + i * chunkSize;
+        size_t length = std::min(chunkSize, image.size() - i * chunkSize);
+        std::string json = jsonMessage(version, (uint32_t)i + 1, (uint32_t)parts, data, length);
+        std::string binary = binaryMessage(version, (uint32_t)i + 1, (uint32_t)parts, data, length);
+
+        StoreEntry& entry = entries[i];
+        entry.dataLength = (uint32_t)length;
+        entry.jsonOffset = offset;
+        entry.jsonLength = (uint32_t)json.size();
+        offset = alignUp(offset + json.size());
+        entry.binaryOffset = offset;
+        entry.binaryLength = (uint32_t)binary.size();
+        offset = alignUp(offset + binary.size());
+
+        written = fwrite(json.data(), 1, json.size(), file) == json.size() &&
+                  fwrite(padding, 1, entry.binaryOffset - entry.jsonOffset - json.size(), file) ==
+                      entry.binaryOffset - entry.jsonOffset - json.size() &&
+                  fwrite(binary.data(), 1, binary.size(), file) == binary.size() &&
+                  fwrite(padding, 1, offset - entry.binaryOffset - binary.size(), file) ==
+                      offset - entry.binaryOffset - binary.size();
+    }
+
+    header.fileSize = offset;
+    written = written && fseek(file, 0, SEEK_SET) == 0 &&
+              fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(entries.data(), sizeof(StoreEntry), parts, file) == parts;
+    written = fclose(file) == 0 && written;
+    if (!written || rename(temporary.c_str(), path.c_str()) != 0) {
+        unlink(temporary.c_str());
+        error = "cannot write " + path;
+        return false;
+    }
+    return true;
+}
+
+// CHUNK STORE
+
+ChunkStore::~ChunkStore() {
+    close();
+}
+
+bool ChunkStore::open(const std::string& path, std::string& error) {
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        error = "cannot open " + path;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(StoreHeader)) {
+        ::close(fd);
+        error = path + " is not a chunk store";
+        return false;
+    }
+    void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        error = "cannot map " + path;
+        return false;
+    }
+    _map = (const char*)map;
+    _size = st.st_size;
+    madvise(map, _size, MADV_WILLNEED);
+
+    const StoreHeader* header = (const StoreHeader*)_map;
+    const StoreEntry* entries = (const StoreEntry*)(_map + sizeof(StoreHeader));
+    bool valid = memcmp(header->magic, OTA_STORE_MAGIC, sizeof(header->magic)) == 0 &&
+                 header->formatVersion == 1 && header->fileSize == _size &&
+                 header->version[OTA_STORE_VERSION_MAX] == '\0' &&
+                 sizeof(StoreHeader) + (uint64_t)header->parts * sizeof(StoreEntry) <= _size;
+    for (uint32_t i = 0; valid && i < header->parts; i++) {
+        const StoreEntry& entry = entries[i];
+        valid = entry.jsonLength >= 2 && entry.jsonOffset + entry.jsonLength <= _size &&
+                entry.binaryLength >= OTA_CHUNK_HEADER_SIZE && entry.binaryOffset + entry.binaryLength <= _size;
+    }
+    if (!valid) {
+        close();
+        error = path + " is not a valid chunk store";
+        return false;
+    }
+
+    _header = header;
+    _entries = entries;
+    return true;
+}
+
+void ChunkStore::close() {
+    if (_map) munmap((void*)_map, _size);
+    _map = nullptr;
+    _size = 0;
+    _header = nullptr;
+    _entries = nullptr;
+}
+
+Slice ChunkStore::json(uint32_t part) const {
+    const StoreEntry& entry = _entries[part - 1];
+    return { _map + entry.jsonOffset, entry.jsonLength };
+}
+
+Slice ChunkStore::jsonOpen(uint32_t part) const {
+    const StoreEntry& entry = _entries[part - 1];
+    return { _map + entry.jsonOffset, entry.jsonLength - 2u };
+}
+
+Slice ChunkStore::binary(uint32_t part) const {
+    const StoreEntry& entry = _entries[part - 1];
+    return { _map + entry.binaryOffset, entry.binaryLength };
+}
+
+size_t jsonTail(char* out, size_t size, uint64_t sentAt, uint32_t sequence, const char* device) {
+    size_t length = 0;
+    int n = 0;
+    if (sentAt) {
+        n = snprintf(out, size, ",\"SentAt\":%llu,\"Seq\":%u", (unsigned long long)sentAt, sequence);
+        if (n < 0 || (size_t)n >= size) return 0;
+        length = n;
+    }
+    if (device && *device) {
+        n = snprintf(out + length, size - length, ",\"Device\":\"%s\"", device);
+        if (n < 0 || (size_t)n >= size - length) return 0;
+        length += n;
+    }
+    if (size - length < 3) return 0;
+    memcpy(out + length, "}}", 3);
+    return length + 2;
+}
+
+size_t binaryHeader(const Slice& message, uint8_t* out, uint64_t sentAt, uint32_t sequence, uint32_t deviceHash) {
+    OTAChunkHeader header;
+    if (!otaChunkHeaderDecode((const uint8_t*)message.data, message.length, header)) return 0;
+    header.sentAt = sentAt;
+    header.sequence = sequence;
+    header.deviceHash = deviceHash;
+    return otaChunkHeaderEncode(header, out);
+}
+
+}
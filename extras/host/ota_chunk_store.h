@@ -0,0 +1,119 @@
+// Pre-serialized chunk store: every UpdateFirmwareDevice chunk of one image,
+// as JSON and as a binary chunk (OTA_CHUNK_MAGIC), in one file that is served
+// straight from a read-only memory mapping.
+//
+// A server that encodes each chunk per device session spends its time on
+// Base64 and JSON. With the store, serving a part to any device is a slice of
+// the mapping plus a few bytes that differ per send:
+//
+//   JSON    jsonOpen(part) + jsonTail(...)   the message without its closing
+//           "}}", then ,"SentAt":..,"Seq":..,"Device":".."}} (or just "}}")
+//   binary  binaryHeader(...) + binary(part) from OTA_CHUNK_HEADER_SIZE on
+//
+// Both fit a writev()/sendmsg() with two iovecs; the image bytes are never
+// copied in user space. Stored messages carry no SentAt/Seq/Device, so
+// json(part) and binary(part) as they are suit a broadcast.
+//
+// File layout (host byte order, little-endian):
+//   StoreHeader, StoreEntry[parts], then the messages, each 64-byte aligned
+//
+// Build together with ota_stream.cpp and ../../MQTTOTAProtocol.cpp, see
+// ota_chunk_store_tool.cpp.
+
+#ifndef OTA_CHUNK_STORE_H
+#define OTA_CHUNK_STORE_H
+
+#include "MQTTOTAProtocol.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace otastore {
+
+#define OTA_STORE_MAGIC "OTACHNK1"
+#define OTA_STORE_VERSION_MAX 63
+
+struct StoreHeader {
+    char magic[8];
+    uint32_t formatVersion;
+    uint32_t parts;
+    uint32_t chunkSize;
+    uint32_t reserved;
+    uint64_t imageSize;
+    uint64_t fileSize;
+    uint8_t sha256[32];
+    char version[OTA_STORE_VERSION_MAX + 1];
+};
+
+struct StoreEntry {
+    uint64_t jsonOffset;
+    uint32_t jsonLength;
+    uint32_t dataLength;            // Image bytes in the part
+    uint64_t binaryOffset;
+    uint32_t binaryLength;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(StoreHeader) == 136, "StoreHeader layout");
+static_assert(sizeof(StoreEntry) == 32, "StoreEntry layout");
+
+struct Slice {
+    const char* data;
+    size_t length;
+};
+
+/**
+ * @brief Writes the store for an app image
+ *
+ * The image must pass otaCheckImageHeader(); chunkSize must leave the whole
+ * header in part 1 (at least OTA_IMAGE_MIN_HEADER) and the part count below
+ * 65536 for the binary variant.
+ */
+bool buildStore(const std::vector<uint8_t>& image, const std::string& version, size_t chunkSize,
+                const std::string& path, std::string& error);
+
+class ChunkStore {
+public:
+    ChunkStore() = default;
+    ~ChunkStore();
+    ChunkStore(const ChunkStore&) = delete;
+    ChunkStore& operator=(const ChunkStore&) = delete;
+
+    bool open(const std::string& path, std::string& error);
+    void close();
+
+    uint32_t parts() const { return _header ? _header->parts : 0; }
+    uint32_t chunkSize() const { return _header->chunkSize; }
+    uint64_t imageSize() const { return _header->imageSize; }
+    const uint8_t* sha256() const { return _header->sha256; }
+    const char* version() const { return _header->version; }
+    size_t mappedSize() const { return _size; }
+
+    // part is 1-based, as PartIndex
+    Slice json(uint32_t part) const;
+    Slice jsonOpen(uint32_t part) const;
+    Slice binary(uint32_t part) const;
+    const StoreEntry& entry(uint32_t part) const { return _entries[part - 1]; }
+
+private:
+    const char* _map = nullptr;
+    size_t _size = 0;
+    const StoreHeader* _header = nullptr;
+    const StoreEntry* _entries = nullptr;
+};
+
+/**
+ * @brief Closes a jsonOpen() slice: ,"SentAt":..,"Seq":..,"Device":".."}}
+ * Fields are left out when 0 or null; returns the length written, 0 if it
+ * does not fit in size bytes
+ */
+size_t jsonTail(char* out, size_t size, uint64_t sentAt, uint32_t sequence, const char* device);
+
+// Per-send copy of a stored binary chunk's header, OTA_CHUNK_HEADER_SIZE bytes
+size_t binaryHeader(const Slice& message, uint8_t* out, uint64_t sentAt, uint32_t sequence, uint32_t deviceHash);
+
+}
+
+#endif // OTA_CHUNK_STORE_H
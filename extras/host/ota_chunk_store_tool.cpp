@@ -0,0 +1,268 @@
+// Builds, checks and benchmarks a pre-serialized chunk store (ota_chunk_store.h).
+//
+//   build  encodes every chunk of an app image once, as JSON and as a binary
+//          chunk, into a store file
+//   info   maps a store and checks every part: the JSON decodes to the same
+//          bytes as the binary chunk, and all parts hash to the stored SHA-256
+//   bench  serves chunks to simulated device sessions, one part after the
+//          other per device, from every thread:
+//            encode  Base64 + JSON per send, as a server without the store does
+//            json    jsonOpen() + jsonTail(), written with writev()
+//            binary  binaryHeader() + binary(), written with writev()
+//          Output goes to /dev/null, so the figures are the server's own cost
+//          per chunk without the network; chunks/s per thread equals chunks/s
+//          per core as long as threads do not exceed cores.
+//
+// Build:
+//   g++ -std=c++17 -O2 -pthread -I../.. ota_chunk_store_tool.cpp ota_chunk_store.cpp ota_stream.cpp ../../MQTTOTAProtocol.cpp -o ota_chunk_store_tool
+//
+// Usage:
+//   ota_chunk_store_tool build app.bin version chunk-size store.otc
+//   ota_chunk_store_tool info store.otc
+//   ota_chunk_store_tool bench store.otc [-j threads] [-s seconds] [-n devices]
+
+#include "ota_chunk_store.h"
+#include "ota_stream.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+using namespace otastore;
+
+namespace {
+
+bool readFile(const char* path, std::vector<uint8_t>& data) {
+    FILE* file = fopen(path, "rb");
+    if (!file) return false;
+    uint8_t buffer[65536];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) data.insert(data.end(), buffer, buffer + n);
+    bool ok = !ferror(file);
+    fclose(file);
+    return ok;
+}
+
+int build(int argc, char** argv) {
+    if (argc != 6) return 2;
+    std::vector<uint8_t> image;
+    if (!readFile(argv[2], image)) {
+        fprintf(stderr, "cannot read %s\n", argv[2]);
+        return 1;
+    }
+    std::string error;
+    if (!buildStore(image, argv[3], strtoul(argv[4], nullptr, 10), argv[5], error)) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+    return 0;
+}
+
+int info(int argc, char** argv) {
+    if (argc != 3) return 2;
+    ChunkStore store;
+    std::string error;
+    if (!store.open(argv[2], error)) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+
+    otastream::Sha256 sha;
+    uint64_t jsonBytes = 0, binaryBytes = 0, imageBytes = 0;
+    std::vector<uint8_t> decoded;
+    int anomalies = 0;
+    for (uint32_t part = 1; part <= store.parts(); part++) {
+        Slice json = store.json(part);
+        Slice binary = store.binary(part);
+        jsonBytes += json.length;
+        binaryBytes += binary.length;
+
+        OTAChunkHeader header;
+        bool valid = otaChunkHeaderDecode((const uint8_t*)binary.data, binary.length, header) &&
+                     header.part == part && header.totalParts == store.parts();
+        const uint8_t* data = (const uint8_t*)binary.data + OTA_CHUNK_HEADER_SIZE + header.versionLength;
+        size_t dataLength = binary.data + binary.length - (const char*)data;
+        valid = valid && dataLength == store.entry(part).dataLength;
+
+        const char* base64 = strstr(json.data, "\"Base64Part\":\"");
+        if (valid && base64 && base64 < json.data + json.length) {
+            base64 += 14;
+            size_t length = json.data + json.length - 3 - base64;
+            decoded.resize(otastream::decodedCapacity(length));
+            size_t decodedLength = 0;
+            valid = otastream::decodeBase64((const uint8_t*)base64, length, decoded.data(), &decodedLength) ==
+                        otastream::DECODE_OK &&
+                    decodedLength == dataLength && memcmp(decoded.data(), data, dataLength) == 0;
+        } else {
+            valid = false;
+        }
+        if (!valid) {
+            printf("part %u: JSON and binary chunk differ or are malformed\n", part);
+            anomalies++;
+            continue;
+        }
+        sha.update(data, dataLength);
+        imageBytes += dataLength;
+    }
+
+    uint8_t digest[32];
+    sha.finish(digest);
+    bool hashOk = imageBytes == store.imageSize() && memcmp(digest, store.sha256(), 32) == 0;
+    if (!hashOk) anomalies++;
+
+    printf("version %s: %u parts of %u bytes, image %llu bytes, sha256 %s%s\n", store.version(), store.parts(),
+           store.chunkSize(), (unsigned long long)store.imageSize(), otastream::hex(store.sha256(), 32).c_str(),
+           hashOk ? "" : " (MISMATCH)");
+    printf("json   %llu bytes (%.1f%% over the image)\n", (unsigned long long)jsonBytes,
+           100.0 * jsonBytes / store.imageSize() - 100);
+    printf("binary %llu bytes (%.1f%% over the image)\n", (unsigned long long)binaryBytes,
+           100.0 * binaryBytes / store.imageSize() - 100);
+    printf("file   %zu bytes, %d anomalies\n", store.mappedSize(), anomalies);
+    return anomalies ? 1 : 0;
+}
+
+enum Mode { MODE_ENCODE, MODE_JSON, MODE_BINARY };
+
+// One thread's share of the sessions: device d gets part (d + round) of its stream
+uint64_t serve(const ChunkStore& store, Mode mode, int firstDevice, int devices, int fd,
+               const std::atomic<bool>& stop, uint64_t* bytes) {
+    std::vector<std::string> ids;
+    std::vector<uint32_t> hashes;
+    for (int i = 0; i < devices; i++) {
+        char id[16];
+        snprintf(id, sizeof(id), "D%06d", firstDevice + i);
+        ids.push_back(id);
+        hashes.push_back(otaHash32(id));
+    }
+
+    uint64_t chunks = 0, sequence = 0;
+    char tail[128];
+    uint8_t header[OTA_CHUNK_HEADER_SIZE];
+    std::string message;
+    while (!stop.load(std::memory_order_relaxed)) {
+        for (int i = 0; i < devices; i++) {
+            uint32_t part = (uint32_t)((firstDevice + i + chunks / devices) % store.parts()) + 1;
+            uint64_t sentAt = 1700000000000ULL + chunks;
+            iovec iov[2];
+            int count = 2;
+
+            if (mode == MODE_ENCODE) {
+                // What a server without the store does for every send
+                Slice binary = store.binary(part);
+                size_t skip = OTA_CHUNK_HEADER_SIZE + (uint8_t)binary.data[6];
+                message = "{\"EventType\":\"UpdateFirmwareDevice\",\"Details\":{\"FirmwareVersion\":\"";
+                message += store.version();
+                message += "\",\"PartIndex\":" + std::to_string(part);
+                message += ",\"TotalParts\":" + std::to_string(store.parts());
+                message += ",\"Base64Part\":\"";
+                message += otastream::encodeBase64((const uint8_t*)binary.data + skip, binary.length - skip);
+                message += "\"";
+                size_t length = jsonTail(tail, sizeof(tail), sentAt, (uint32_t)++sequence, ids[i].c_str());
+                message.append(tail, length);
+                iov[0] = { (void*)message.data(), message.size() };
+                count = 1;
+            } else if (mode == MODE_JSON) {
+                Slice open = store.jsonOpen(part);
+                size_t length = jsonTail(tail, sizeof(tail), sentAt, (uint32_t)++sequence, ids[i].c_str());
+                iov[0] = { (void*)open.data, open.length };
+                iov[1] = { tail, length };
+            } else {
+                Slice binary = store.binary(part);
+                binaryHeader(binary, header, sentAt, (uint32_t)++sequence, hashes[i]);
+                iov[0] = { header, OTA_CHUNK_HEADER_SIZE };
+                iov[1] = { (void*)(binary.data + OTA_CHUNK_HEADER_SIZE), binary.length - OTA_CHUNK_HEADER_SIZE };
+            }
+
+            ssize_t written = writev(fd, iov, count);
+            if (written > 0) *bytes += written;
+            chunks++;
+        }
+    }
+    return chunks;
+}
+
+int bench(int argc, char** argv) {
+    if (argc < 3) return 2;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    double seconds = 2;
+    int devices = 1000;
+    for (int i = 3; i < argc; i++) {
+        if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+            threads = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+            seconds = std::max(0.1, atof(argv[++i]));
+        } else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            devices = std::max(1, atoi(argv[++i]));
+        } else {
+            return 2;
+        }
+    }
+
+    ChunkStore store;
+    std::string error;
+    if (!store.open(argv[2], error)) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+    int fd = open("/dev/null", O_WRONLY);
+    devices = std::max(devices, (int)threads);
+
+    printf("%u parts of %u bytes, %d devices, %u threads, %.1f s per mode\n\n", store.parts(), store.chunkSize(),
+           devices, threads, seconds);
+    printf("%-8s %16s %16s %12s\n", "mode", "chunks/s", "chunks/s/thread", "MB/s");
+
+    const char* names[] = { "encode", "json", "binary" };
+    for (Mode mode : { MODE_ENCODE, MODE_JSON, MODE_BINARY }) {
+        std::atomic<bool> stop(false);
+        std::vector<uint64_t> chunks(threads), bytes(threads);
+        std::vector<std::thread> workers;
+        auto start = std::chrono::steady_clock::now();
+        for (unsigned t = 0; t < threads; t++) {
+            int first = devices * t / threads, last = devices * (t + 1) / threads;
+            workers.emplace_back([&, t, first, last] {
+                chunks[t] = serve(store, mode, first, last - first, fd, stop, &bytes[t]);
+            });
+        }
+        std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+        stop = true;
+        for (std::thread& worker : workers) worker.join();
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        uint64_t totalChunks = 0, totalBytes = 0;
+        for (unsigned t = 0; t < threads; t++) {
+            totalChunks += chunks[t];
+            totalBytes += bytes[t];
+        }
+        printf("%-8s %16.0f %16.0f %12.1f\n", names[mode], totalChunks / elapsed, totalChunks / elapsed / threads,
+               totalBytes / elapsed / 1e6);
+    }
+    close(fd);
+    return 0;
+}
+
+}
+
+int main(int argc, char** argv) {
+    int status = 2;
+    if (argc >= 2 && !strcmp(argv[1], "build")) status = build(argc, argv);
+    else if (argc >= 2 && !strcmp(argv[1], "info")) status = info(argc, argv);
+    else if (argc >= 2 && !strcmp(argv[1], "bench")) status = bench(argc, argv);
+
+    if (status == 2) {
+        fprintf(stderr, "usage: %s build app.bin version chunk-size store.otc\n"
+                        "       %s info store.otc\n"
+                        "       %s bench store.otc [-j threads] [-s seconds] [-n devices]\n",
+                argv[0], argv[0], argv[0]);
+    }
+    return status;
+}
@@ -0,0 +1,255 @@
+// Host test of the MQTT code the data client runs on: OTAMqttReader reading a
+// broker stream split at random points (CONNACK, SUBACK, PUBLISH at QoS 0 and
+// 1, long topics and payloads, malformed input) and the packets the client
+// sends, checked byte for byte, including the PUBACK for a QoS 1 PUBLISH.
+// Prints each failed check and exits 1 if any failed, 0 otherwise.
+//
+// Build:
+//   g++ -std=c++17 -O2 -I../.. ota_data_client_test.cpp ../../MQTTOTAProtocol.cpp -o ota_data_client_test
+//
+// Usage:
+//   ota_data_client_test
+
+#include "MQTTOTAProtocol.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(condition)                                                        \
+    do {                                                                        \
+        if (!(condition)) {                                                     \
+            fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, #condition); \
+            failures++;                                                         \
+        }                                                                       \
+    } while (0)
+
+typedef std::vector<uint8_t> Bytes;
+
+void putLength(Bytes& out, size_t remaining) {
+    do {
+        uint8_t digit = remaining & 0x7F;
+        remaining >>= 7;
+        out.push_back(remaining ? (digit | 0x80) : digit);
+    } while (remaining);
+}
+
+Bytes publish(const std::string& topic, uint8_t qos, uint16_t packetId, const Bytes& payload) {
+    Bytes out = { (uint8_t)((OTA_MQTT_PUBLISH << 4) | (qos << 1)) };
+    putLength(out, 2 + topic.size() + (qos ? 2 : 0) + payload.size());
+    out.push_back((uint8_t)(topic.size() >> 8));
+    out.push_back((uint8_t)topic.size());
+    out.insert(out.end(), topic.begin(), topic.end());
+    if (qos) {
+        out.push_back((uint8_t)(packetId >> 8));
+        out.push_back((uint8_t)packetId);
+    }
+    out.insert(out.end(), payload.begin(), payload.end());
+    return out;
+}
+
+Bytes pattern(size_t length, uint8_t seed) {
+    Bytes out(length);
+    for (size_t i = 0; i < length; i++) out[i] = (uint8_t)(seed + i * 7);
+    return out;
+}
+
+// What the reader reported for one packet
+struct Seen {
+    OTAMqttEvent event;            // OTA_MQTT_PACKET or OTA_MQTT_PUBLISH_END
+    uint8_t type;
+    uint8_t body0;
+    uint8_t body1;
+    std::string topic;
+    bool truncated;
+    uint8_t qos;
+    uint16_t packetId;
+    uint32_t payloadLength;
+    Bytes payload;
+    Bytes ack;                     // PUBACK the client answers with, empty at QoS 0
+};
+
+// Feeds the stream in pieces of 1..maxPiece bytes, the way _pollDataClient() does
+bool read(const Bytes& stream, size_t maxPiece, std::vector<Seen>& seen) {
+    OTAMqttReader reader;
+    reader.reset();
+    seen.clear();
+    Seen current = {};
+    bool inPublish = false;
+    size_t at = 0;
+    while (at < stream.size()) {
+        size_t piece = 1 + (size_t)rand() % maxPiece;
+        if (piece > stream.size() - at) piece = stream.size() - at;
+        const uint8_t* data = stream.data() + at;
+        size_t length = piece;
+        at += piece;
+        for (;;) {
+            size_t used;
+            OTAMqttEvent event = reader.next(data, length, &used);
+            data += used;
+            length -= used;
+            if (event == OTA_MQTT_NEED_MORE) break;
+            if (event == OTA_MQTT_MALFORMED) return false;
+            if (event == OTA_MQTT_PACKET) {
+                Seen packet = {};
+                packet.event = event;
+                packet.type = reader.type;
+                packet.body0 = reader.body[0];
+                packet.body1 = reader.body[1];
+                seen.push_back(packet);
+                continue;
+            }
+            if (event == OTA_MQTT_PUBLISH_BEGIN) {
+                CHECK(!inPublish);
+                inPublish = true;
+                current = Seen();
+                current.topic = reader.topic;
+                current.truncated = reader.topicTruncated;
+                current.qos = reader.qos();
+                current.packetId = reader.packetId;
+                current.payloadLength = reader.payloadLength;
+                continue;
+            }
+            // Payload pieces point into the input just given
+            CHECK(inPublish);
+            CHECK(reader.pieceLength == 0 ||
+                  (reader.piece >= stream.data() && reader.piece + reader.pieceLength <= stream.data() + at));
+            current.payload.insert(current.payload.end(), reader.piece, reader.piece + reader.pieceLength);
+            CHECK(reader.payloadOffset == current.payload.size());
+            if (event == OTA_MQTT_PUBLISH_END) {
+                if (reader.qos() > 0) {
+                    uint8_t ack[4];
+                    size_t ackLength = otaMqttPubackEncode(ack, sizeof(ack), reader.packetId);
+                    current.ack.assign(ack, ack + ackLength);
+                }
+                current.event = event;
+                current.type = OTA_MQTT_PUBLISH;
+                seen.push_back(current);
+                inPublish = false;
+            }
+        }
+    }
+    return !inPublish;
+}
+
+void testStream() {
+    std::string longTopic(OTA_MQTT_TOPIC_SIZE + 20, 't');
+    Bytes chunk = pattern(300, 1);
+    Bytes image = pattern(20000, 9);       // Three-byte remaining length
+
+    Bytes stream = { OTA_MQTT_CONNACK << 4, 2, 0, 0 };
+    Bytes suback = { OTA_MQTT_SUBACK << 4, 3, 0, 1, 1 };
+    stream.insert(stream.end(), suback.begin(), suback.end());
+    Bytes qos1 = publish("ota", 1, 0x1234, chunk);
+    stream.insert(stream.end(), qos1.begin(), qos1.end());
+    Bytes empty = publish("ota", 0, 0, Bytes());
+    stream.insert(stream.end(), empty.begin(), empty.end());
+    Bytes truncated = publish(longTopic, 0, 0, pattern(5, 3));
+    stream.insert(stream.end(), truncated.begin(), truncated.end());
+    Bytes pingResponse = { OTA_MQTT_PINGRESP << 4, 0 };
+    stream.insert(stream.end(), pingResponse.begin(), pingResponse.end());
+    Bytes large = publish("ota", 1, 0xFFFF, image);
+    stream.insert(stream.end(), large.begin(), large.end());
+
+    const size_t pieces[] = { 1, 2, 5, 64, 2048, 100000 };
+    for (size_t maxPiece : pieces) {
+        for (int round = 0; round < 10; round++) {
+            std::vector<Seen> seen;
+            CHECK(read(stream, maxPiece, seen));
+            CHECK(seen.size() == 7);
+            if (seen.size() != 7) continue;
+
+            CHECK(seen[0].event == OTA_MQTT_PACKET && seen[0].type == OTA_MQTT_CONNACK);
+            CHECK(seen[0].body0 == 0 && seen[0].body1 == 0);
+            CHECK(seen[1].event == OTA_MQTT_PACKET && seen[1].type == OTA_MQTT_SUBACK);
+
+            CHECK(seen[2].event == OTA_MQTT_PUBLISH_END && seen[2].topic == "ota" && !seen[2].truncated);
+            CHECK(seen[2].qos == 1 && seen[2].packetId == 0x1234);
+            CHECK(seen[2].payloadLength == chunk.size() && seen[2].payload == chunk);
+            CHECK((seen[2].ack == Bytes{ OTA_MQTT_PUBACK << 4, 2, 0x12, 0x34 }));
+
+            CHECK(seen[3].topic == "ota" && seen[3].payloadLength == 0 && seen[3].payload.empty());
+            CHECK(seen[3].qos == 0 && seen[3].ack.empty());
+
+            CHECK(seen[4].truncated && seen[4].topic == longTopic.substr(0, OTA_MQTT_TOPIC_SIZE));
+            CHECK(seen[4].payload == pattern(5, 3));
+
+            CHECK(seen[5].event == OTA_MQTT_PACKET && seen[5].type == OTA_MQTT_PINGRESP);
+
+            CHECK(seen[6].payloadLength == image.size() && seen[6].payload == image);
+            CHECK((seen[6].ack == Bytes{ OTA_MQTT_PUBACK << 4, 2, 0xFF, 0xFF }));
+        }
+    }
+
+    // A refused connection shows in the CONNACK return code
+    std::vector<Seen> seen;
+    CHECK(read(Bytes{ OTA_MQTT_CONNACK << 4, 2, 0, 5 }, 1, seen) && seen.size() == 1 && seen[0].body1 == 5);
+}
+
+bool malformed(const Bytes& stream) {
+    std::vector<Seen> seen;
+    return !read(stream, 1, seen);
+}
+
+void testMalformed() {
+    CHECK(malformed(Bytes{ 0x00, 0 }));
+    CHECK(malformed(Bytes{ 0xF0, 0 }));
+    CHECK(malformed(Bytes{ (OTA_MQTT_PUBLISH << 4) | 0x06, 5, 0, 1, 'a', 0, 0 }));  // QoS 3
+    CHECK(malformed(Bytes{ OTA_MQTT_PUBLISH << 4, 1, 0 }));                          // No topic length
+    CHECK(malformed(Bytes{ OTA_MQTT_PUBLISH << 4, 3, 0, 9, 'a' }));                  // Topic past the packet
+    CHECK(malformed(Bytes{ (OTA_MQTT_PUBLISH << 4) | 0x02, 4, 0, 2, 'a', 'b' }));    // No room for the packet id
+    CHECK(malformed(Bytes{ OTA_MQTT_SUBACK << 4, 0xFF, 0xFF, 0xFF, 0xFF, 0x01 }));   // Five length bytes
+}
+
+void testClientPackets() {
+    uint8_t out[128];
+
+    CHECK(otaMqttPubackEncode(out, sizeof(out), 0xABCD) == 4);
+    CHECK((Bytes(out, out + 4) == Bytes{ OTA_MQTT_PUBACK << 4, 2, 0xAB, 0xCD }));
+    CHECK(otaMqttPubackEncode(out, 3, 1) == 0);
+
+    CHECK(otaMqttPingEncode(out, sizeof(out)) == OTA_MQTT_PINGREQ_SIZE);
+    CHECK((Bytes(out, out + 2) == Bytes{ OTA_MQTT_PINGREQ << 4, 0 }));
+    CHECK(otaMqttPingEncode(out, 1) == 0);
+
+    // SUBSCRIBE carries reserved flags 0010 and the requested QoS
+    for (uint8_t qos = 0; qos <= 1; qos++) {
+        size_t length = otaMqttSubscribeEncode(out, sizeof(out), 1, "ota", qos);
+        CHECK((Bytes(out, out + length) == Bytes{ (OTA_MQTT_SUBSCRIBE << 4) | 0x02, 8, 0, 1, 0, 3, 'o', 't', 'a', qos }));
+    }
+    CHECK(otaMqttSubscribeEncode(out, 9, 1, "ota", 1) == 0);
+    CHECK(otaMqttSubscribeEncode(out, sizeof(out), 1, "", 1) == 0);
+
+    size_t length = otaMqttConnectEncode(out, sizeof(out), "dev-data", "u", "pw", 30);
+    Bytes expected = { OTA_MQTT_CONNECT << 4, 27, 0, 4, 'M', 'Q', 'T', 'T', 4, 0xC2, 0, 30,
+                       0, 8, 'd', 'e', 'v', '-', 'd', 'a', 't', 'a', 0, 1, 'u', 0, 2, 'p', 'w' };
+    CHECK(Bytes(out, out + length) == expected);
+
+    // A password alone is not sent: MQTT 3.1.1 needs a user name with it
+    length = otaMqttConnectEncode(out, sizeof(out), "d", NULL, "pw", 60);
+    CHECK((Bytes(out, out + length) == Bytes{ OTA_MQTT_CONNECT << 4, 13, 0, 4, 'M', 'Q', 'T', 'T', 4, 0x02, 0, 60,
+                                              0, 1, 'd' }));
+    CHECK(otaMqttConnectEncode(out, 10, "dev-data", NULL, NULL, 30) == 0);
+}
+
+}
+
+int main() {
+    srand(1);
+    testStream();
+    testMalformed();
+    testClientPackets();
+
+    if (failures > 0) {
+        fprintf(stderr, "ota_data_client_test: %d checks failed\n", failures);
+        return 1;
+    }
+    printf("ota_data_client_test: ok\n");
+    return 0;
+}
@@ -0,0 +1,362 @@
+// Measures what the device's receive path copies per firmware byte.
+//
+// An image is published in chunks through a real MQTT connection (the broker
+// stand-in over loopback, or any broker) and received three ways:
+//
+//   json-assembled    the esp-mqtt / PubSubClient path: each PUBLISH is
+//                     assembled, copied to a String, Base64Part is extracted
+//                     and decoded
+//   binary-assembled  binary chunks, still assembled into a message first
+//   binary-streamed   what MQTTOTA::enableDataClient() runs: OTAMqttReader
+//                     over a fixed receive buffer, image bytes go to flash
+//                     straight from it
+//
+// Every receiver reads the socket into a MQTT_OTA_DATA_BUFFER-sized buffer
+// with the same OTAMqttReader, so the rows differ only in what they do with
+// the pieces. "copies/B" counts bytes moved by recv() and memcpy() (the flash
+// write is not counted) per image byte; "held" is the largest block of payload
+// a receiver kept in memory. The image written to the flash stand-in is
+// checked with SHA-256.
+//
+// Build:
+//   g++ -std=c++17 -O2 -I../.. ota_data_path_bench.cpp ota_stream.cpp ota_mqtt.cpp ../../MQTTOTAProtocol.cpp -lpthread -o ota_data_path_bench
+//
+// Usage:
+//   ota_data_path_bench [--broker host:port] [-i image KB] [-c chunk bytes]
+
+#include "MQTTOTAProtocol.h"
+#include "ota_mqtt.h"
+#include "ota_stream.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+const size_t kReceiveBuffer = 2048;        // MQTT_OTA_DATA_BUFFER
+const char* kVersion = "1.1.0";
+
+enum Path { JSON_ASSEMBLED, BINARY_ASSEMBLED, BINARY_STREAMED };
+
+struct Result {
+    bool ok = false;
+    uint64_t wireBytes = 0;
+    uint64_t copiedBytes = 0;
+    size_t held = 0;
+    double seconds = 0;
+    std::string error;
+};
+
+double nowSeconds() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+std::string jsonChunk(const std::vector<uint8_t>& image, int part, int totalParts, size_t chunkSize) {
+    size_t offset = (size_t)(part - 1) * chunkSize;
+    size_t length = std::min(chunkSize, image.size() - offset);
+    return "{\"EventType\":\"UpdateFirmwareDevice\",\"Details\":{\"FirmwareVersion\":\"" + std::string(kVersion) +
+           "\",\"PartIndex\":" + std::to_string(part) + ",\"TotalParts\":" + std::to_string(totalParts) +
+           ",\"IsError\":false,\"Base64Part\":\"" + otastream::encodeBase64(image.data() + offset, length) + "\"}}";
+}
+
+std::string binaryChunk(const std::vector<uint8_t>& image, int part, int totalParts, size_t chunkSize) {
+    size_t offset = (size_t)(part - 1) * chunkSize;
+    size_t length = std::min(chunkSize, image.size() - offset);
+    OTAChunkHeader header = {};
+    header.part = part;
+    header.totalParts = totalParts;
+    header.versionLength = strlen(kVersion);
+    header.sequence = part;
+    uint8_t encoded[OTA_CHUNK_HEADER_SIZE];
+    otaChunkHeaderEncode(header, encoded);
+    std::string message((const char*)encoded, OTA_CHUNK_HEADER_SIZE);
+    message += kVersion;
+    message.append((const char*)image.data() + offset, length);
+    return message;
+}
+
+// Integer after "key": in a JSON text, -1 if missing
+long jsonNumber(const std::string& text, const char* key) {
+    size_t at = text.find(std::string("\"") + key + "\":");
+    return at == std::string::npos ? -1 : strtol(text.c_str() + at + strlen(key) + 3, nullptr, 10);
+}
+
+class Receiver {
+public:
+    Receiver(Path path, size_t imageSize, size_t chunkSize)
+        : _path(path), _flash(imageSize), _chunkSize(chunkSize) {
+        _reader.reset();
+    }
+
+    ~Receiver() {
+        if (_fd >= 0) close(_fd);
+    }
+
+    bool connect(const std::string& host, uint16_t port, const std::string& topic) {
+        addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* address = nullptr;
+        if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &address) != 0) return false;
+        _fd = socket(address->ai_family, SOCK_STREAM, 0);
+        bool connected = _fd >= 0 && ::connect(_fd, address->ai_addr, address->ai_addrlen) == 0;
+        freeaddrinfo(address);
+        if (!connected) return false;
+        int one = 1;
+        setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        size_t length = otaMqttConnectEncode(_buffer, sizeof(_buffer), "bench-receiver", nullptr, nullptr, 60);
+        if (send(_fd, _buffer, length, 0) != (ssize_t)length || !_waitFor(OTA_MQTT_CONNACK)) return false;
+        length = otaMqttSubscribeEncode(_buffer, sizeof(_buffer), 1, topic.c_str(), 0);
+        return send(_fd, _buffer, length, 0) == (ssize_t)length && _waitFor(OTA_MQTT_SUBACK);
+    }
+
+    // Reads until every part is in or the broker goes quiet
+    Result run(int totalParts) {
+        Result result;
+        timeval timeout = { 5, 0 };
+        setsockopt(_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        double start = 0;
+        while (_parts < totalParts) {
+            ssize_t received = recv(_fd, _buffer, sizeof(_buffer), 0);
+            if (received <= 0) {
+                result.error = "connection idle after " + std::to_string(_parts) + " parts";
+                return result;
+            }
+            if (start == 0) start = nowSeconds();
+            _wireBytes += received;
+            _copiedBytes += received;
+            _feed(_buffer, received);
+            if (!_error.empty()) {
+                result.error = _error;
+                return result;
+            }
+        }
+        result.seconds = nowSeconds() - start;
+        result.ok = true;
+        result.wireBytes = _wireBytes;
+        result.copiedBytes = _copiedBytes;
+        result.held = _held;
+        return result;
+    }
+
+    const std::vector<uint8_t>& flash() const { return _flash; }
+
+private:
+    bool _waitFor(uint8_t type) {
+        for (;;) {
+            ssize_t received = recv(_fd, _buffer, sizeof(_buffer), 0);
+            if (received <= 0) return false;
+            size_t used;
+            if (_reader.next(_buffer, received, &used) == OTA_MQTT_PACKET && _reader.type == type) return true;
+        }
+    }
+
+    void _feed(const uint8_t* data, size_t length) {
+        for (;;) {
+            size_t used;
+            OTAMqttEvent event = _reader.next(data, length, &used);
+            data += used;
+            length -= used;
+            if (event == OTA_MQTT_NEED_MORE) return;
+            if (event == OTA_MQTT_MALFORMED) {
+                _error = "malformed MQTT stream";
+                return;
+            }
+            if (event == OTA_MQTT_PUBLISH_BEGIN) {
+                _message.clear();
+                _header.clear();
+                _written = 0;
+            }
+            if (event == OTA_MQTT_PAYLOAD || event == OTA_MQTT_PUBLISH_END) {
+                _piece(_reader.piece, _reader.pieceLength);
+            }
+            if (event == OTA_MQTT_PUBLISH_END) {
+                _end();
+            }
+        }
+    }
+
+    void _piece(const uint8_t* data, size_t length) {
+        if (_path != BINARY_STREAMED) {
+            _message.append((const char*)data, length);
+            _copiedBytes += length;
+            _held = std::max(_held, _message.size());
+            return;
+        }
+
+        // Header and version are gathered; the rest goes to flash as it comes
+        size_t needed = OTA_CHUNK_HEADER_SIZE + strlen(kVersion);
+        size_t take = std::min(needed - _header.size(), length);
+        _header.append((const char*)data, take);
+        _copiedBytes += take;
+        _held = std::max(_held, _header.size());
+        data += take;
+        length -= take;
+        if (length == 0) return;
+
+        OTAChunkHeader header;
+        if (!otaChunkHeaderDecode((const uint8_t*)_header.data(), _header.size(), header)) {
+            _error = "bad chunk header";
+            return;
+        }
+        _write(header.part, data, length);
+    }
+
+    void _end() {
+        if (_path == JSON_ASSEMBLED) {
+            // String(payload), then details["Base64Part"].as<String>()
+            std::string text(_message);
+            _copiedBytes += text.size();
+            size_t at = text.find("\"Base64Part\":\"");
+            size_t end = at == std::string::npos ? at : text.find('"', at + 14);
+            if (end == std::string::npos) {
+                _error = "no Base64Part";
+                return;
+            }
+            std::string base64 = text.substr(at + 14, end - at - 14);
+            _copiedBytes += base64.size();
+
+            std::vector<uint8_t> decoded(otastream::decodedCapacity(base64.size()));
+            size_t length = 0;
+            if (otastream::decodeBase64((const uint8_t*)base64.data(), base64.size(), decoded.data(), &length) !=
+                otastream::DECODE_OK) {
+                _error = "bad Base64Part";
+                return;
+            }
+            _write(jsonNumber(text, "PartIndex"), decoded.data(), length);
+        } else if (_path == BINARY_ASSEMBLED) {
+            OTAChunkHeader header;
+            const uint8_t* message = (const uint8_t*)_message.data();
+            if (!otaChunkHeaderDecode(message, _message.size(), header)) {
+                _error = "bad chunk header";
+                return;
+            }
+            size_t skip = OTA_CHUNK_HEADER_SIZE + header.versionLength;
+            _write(header.part, message + skip, _message.size() - skip);
+        }
+        _parts++;
+    }
+
+    // The flash write; not counted as a copy
+    void _write(long part, const uint8_t* data, size_t length) {
+        size_t offset = (size_t)(part - 1) * _chunkSize + _written;
+        if (part < 1 || offset + length > _flash.size()) {
+            _error = "part out of range";
+            return;
+        }
+        memcpy(_flash.data() + offset, data, length);
+        _written += length;
+    }
+
+    Path _path;
+    int _fd = -1;
+    uint8_t _buffer[kReceiveBuffer];
+    OTAMqttReader _reader;
+    std::vector<uint8_t> _flash;
+    size_t _chunkSize;
+    std::string _message;
+    std::string _header;
+    size_t _written = 0;
+    size_t _held = 0;
+    int _parts = 0;
+    uint64_t _wireBytes = 0;
+    uint64_t _copiedBytes = 0;
+    std::string _error;
+};
+
+std::string sha256(const std::vector<uint8_t>& data) {
+    uint8_t digest[32];
+    otastream::Sha256 sha;
+    sha.update(data.data(), data.size());
+    sha.finish(digest);
+    char hex[65];
+    for (int i = 0; i < 32; i++) snprintf(hex + i * 2, 3, "%02x", digest[i]);
+    return hex;
+}
+
+}
+
+int main(int argc, char** argv) {
+    std::string broker = "localhost:1883";
+    size_t imageSize = 1024 * 1024, chunkSize = 8192;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--broker") && i + 1 < argc) broker = argv[++i];
+        else if (!strcmp(argv[i], "-i") && i + 1 < argc) imageSize = (size_t)std::max(1, atoi(argv[++i])) * 1024;
+        else if (!strcmp(argv[i], "-c") && i + 1 < argc) chunkSize = std::max(64, atoi(argv[++i]));
+        else {
+            fprintf(stderr, "usage: %s [--broker host:port] [-i image KB] [-c chunk bytes]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    std::string host;
+    uint16_t port;
+    if (!otamqtt::parseAddress(broker, host, port)) {
+        fprintf(stderr, "bad broker address %s\n", broker.c_str());
+        return 2;
+    }
+
+    std::vector<uint8_t> image(imageSize);
+    std::mt19937 random(7);
+    for (uint8_t& byte : image) byte = (uint8_t)random();
+    std::string expected = sha256(image);
+    int totalParts = (int)((imageSize + chunkSize - 1) / chunkSize);
+
+    printf("image %zu bytes in %d chunks of %zu, receive buffer %zu\n\n", imageSize, totalParts, chunkSize,
+           kReceiveBuffer);
+    printf("%-18s %10s %10s %9s %8s %9s  %s\n", "path", "wire", "copied", "copies/B", "held", "MB/s", "image");
+
+    const char* names[] = { "json-assembled", "binary-assembled", "binary-streamed" };
+    int failures = 0;
+    for (int path = JSON_ASSEMBLED; path <= BINARY_STREAMED; path++) {
+        std::string topic = "bench/" + std::to_string(getpid()) + "/" + names[path];
+        Receiver receiver((Path)path, imageSize, chunkSize);
+        if (!receiver.connect(host, port, topic)) {
+            fprintf(stderr, "cannot subscribe at %s\n", broker.c_str());
+            return 1;
+        }
+
+        std::atomic<bool> received(false);
+        std::thread publisher([&] {
+            otamqtt::Client client;
+            if (!client.connect(host, port, "bench-publisher")) return;
+            for (int part = 1; part <= totalParts; part++) {
+                client.publish(topic, path == JSON_ASSEMBLED ? jsonChunk(image, part, totalParts, chunkSize)
+                                                             : binaryChunk(image, part, totalParts, chunkSize));
+            }
+            // The broker stand-in drops what it has not read from a closed client
+            while (!received) client.poll(50);
+            client.disconnect();
+        });
+        Result result = receiver.run(totalParts);
+        received = true;
+        publisher.join();
+
+        if (!result.ok) {
+            printf("%-18s failed: %s\n", names[path], result.error.c_str());
+            failures++;
+            continue;
+        }
+        bool match = sha256(receiver.flash()) == expected;
+        failures += match ? 0 : 1;
+        printf("%-18s %10llu %10llu %9.2f %8zu %9.1f  %s\n", names[path], (unsigned long long)result.wireBytes,
+               (unsigned long long)result.copiedBytes, (double)result.copiedBytes / imageSize, result.held,
+               imageSize / result.seconds / 1e6, match ? "sha256 ok" : "SHA-256 MISMATCH");
+    }
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,432 @@
+// Simulated MQTTOTA devices for trying the host tools against a broker.
+//
+// Each device has its own MQTT connection and subscribes to its own topic
+// ("ota/{device}" by default) and to the broadcast topic. It follows the
+// device's chunked protocol: JSON (Base64Part or Z85Part) or binary chunks in
+// order, the image header check on part 1, chunk receipts when a chunk
+// carries SentAt, ota/progress at every 10%, part requests (gap, join, stall;
+// one per MQTT_OTA_REQUEST_INTERVAL_MS) and, after the last part, the SHA-256
+// check esp_ota_end() runs before ota/success or ota/error.
+//
+// Devices write at a rate picked from three profiles (30% at 10 KB/s, 50% at
+// 40 KB/s, 20% at 150 KB/s): a chunk takes effect once it is written, and
+// later chunks wait in the device's queue meanwhile.
+// --fail makes that fraction of devices fail a flash write at a random part.
+//
+// Build:
+//   g++ -std=c++17 -O2 -I../.. ota_device_sim.cpp ota_stream.cpp ota_mqtt.cpp ../../MQTTOTAProtocol.cpp -o ota_device_sim
+//
+// Usage:
+//   ota_device_sim [--broker host:port] [-n devices] [--prefix SIM] [--topic ota/{device}]
+//                  [--broadcast ota] [--fail fraction] [--loss fraction] [--ids file] [--seed n]
+
+#include "ota_mqtt.h"
+#include "ota_stream.h"
+
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace otastream;
+
+namespace {
+
+const int64_t REQUEST_INTERVAL_US = 3000000;   // MQTT_OTA_REQUEST_INTERVAL_MS
+
+volatile sig_atomic_t g_stop = 0;
+
+void onSignal(int) {
+    g_stop = 1;
+}
+
+int64_t nowUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct Chunk {
+    std::string version;
+    std::string device;
+    uint32_t deviceHash = 0;
+    int part = 0;
+    int totalParts = 0;
+    uint64_t sentAt = 0;
+    uint32_t sequence = 0;
+    std::vector<uint8_t> data;
+    bool valid = false;
+};
+
+Chunk parseChunk(const std::string& payload) {
+    Chunk chunk;
+    const uint8_t* bytes = (const uint8_t*)payload.data();
+
+    if (!payload.empty() && bytes[0] == OTA_CHUNK_MAGIC) {
+        OTAChunkHeader header;
+        if (!otaChunkHeaderDecode(bytes, payload.size(), header)) return chunk;
+        const uint8_t* version = bytes + OTA_CHUNK_HEADER_SIZE;
+        chunk.version.assign((const char*)version, header.versionLength);
+        chunk.deviceHash = header.deviceHash;
+        chunk.part = header.part;
+        chunk.totalParts = header.totalParts;
+        chunk.sentAt = header.sentAt;
+        chunk.sequence = header.sequence;
+        chunk.data.assign(version + header.versionLength, bytes + payload.size());
+        chunk.valid = true;
+        return chunk;
+    }
+
+    std::string base64, z85;
+    bool update = false;
+    scanMessage(payload.data(), payload.data() + payload.size(), [&](const char* key, size_t length, const Value& value) {
+        std::string text(value.data, value.length);
+        if (keyIs(key, length, "EventType")) update = text == "UpdateFirmwareDevice";
+        else if (keyIs(key, length, "FirmwareVersion")) chunk.version = text;
+        else if (keyIs(key, length, "Base64Part")) base64 = value.escaped ? unescape(value.data, value.length) : text;
+        else if (keyIs(key, length, "Z85Part")) z85 = value.escaped ? unescape(value.data, value.length) : text;
+        else if (keyIs(key, length, "PartIndex")) chunk.part = atoi(text.c_str());
+        else if (keyIs(key, length, "TotalParts")) chunk.totalParts = atoi(text.c_str());
+        else if (keyIs(key, length, "SentAt")) chunk.sentAt = strtoull(text.c_str(), nullptr, 10);
+        else if (keyIs(key, length, "Seq")) chunk.sequence = (uint32_t)strtoul(text.c_str(), nullptr, 10);
+        else if (keyIs(key, length, "Device")) chunk.device = text;
+    });
+    if (!update || (base64.empty() && z85.empty())) return chunk;
+
+    if (!z85.empty()) {
+        chunk.data.resize(otaZ85DecodedLength(z85.size()));
+        chunk.valid = otaZ85Decode(z85.data(), z85.size(), chunk.data.data());
+        return chunk;
+    }
+
+    chunk.data.resize(decodedCapacity(base64.size()));
+    size_t decoded = 0;
+    if (decodeBase64((const uint8_t*)base64.data(), base64.size(), chunk.data.data(), &decoded) != DECODE_OK) {
+        return chunk;
+    }
+    chunk.data.resize(decoded);
+    chunk.valid = true;
+    return chunk;
+}
+
+class Device {
+public:
+    Device(const std::string& id, double writeRate, int failAt, double loss, uint64_t seed)
+        : _id(id), _hash(otaHash32(id.c_str())), _writeRate(writeRate), _failAt(failAt), _loss(loss), _random(seed) {}
+
+    bool connect(const std::string& host, uint16_t port, const std::string& topic, const std::string& broadcast) {
+        _client.onMessage([this](const std::string&, const std::string& payload) {
+            _inbox.push_back({ nowUs(), payload });
+        });
+        return _client.connect(host, port, _id) && _client.subscribe(topic) &&
+               (broadcast.empty() || _client.subscribe(broadcast));
+    }
+
+    // Returns false once the connection is gone
+    bool poll(int64_t now) {
+        if (!_client.poll(0)) return false;
+
+        // A chunk takes effect once the device has had the time to write it
+        for (;;) {
+            if (_writing) {
+                if (now < _busyUntil) break;
+                _writing = false;
+                _process(_current.second, _current.first, now);
+                continue;
+            }
+            if (_inbox.empty()) break;
+            _current = std::move(_inbox.front());
+            _inbox.pop_front();
+            size_t bytes = (uint8_t)_current.second[0] == OTA_CHUNK_MAGIC ? _current.second.size()
+                                                                          : _current.second.size() * 3 / 4;
+            _writeStartUs = now;
+            _busyUntil = now + (int64_t)(bytes * 1e6 / _writeRate);
+            _writing = true;
+        }
+
+        if (_inProgress && now - _lastChunkUs > REQUEST_INTERVAL_US) _request(now, _version, _currentPart + 1, "stall");
+        return true;
+    }
+
+    bool finished() const { return _result != 0; }
+    bool succeeded() const { return _result == 1; }
+    const std::string& id() const { return _id; }
+
+private:
+    void _process(const std::string& payload, int64_t receivedAt, int64_t now) {
+        if (std::uniform_real_distribution<double>(0, 1)(_random) < _loss) return;
+
+        Chunk chunk = parseChunk(payload);
+        if (!chunk.valid) return;
+        if (!chunk.device.empty() && chunk.device != _id) return;
+        if (chunk.deviceHash != 0 && chunk.deviceHash != _hash) return;
+        if (chunk.version == _runningVersion) return;
+
+        if (chunk.part == 1 && !_inProgress) _start(chunk, now);
+
+        if (!_inProgress || chunk.part != _currentPart + 1) {
+            if (!_inProgress) {
+                _request(now, chunk.version, 1, "join");
+            } else if (chunk.version != _version) {
+                _error(OTA_ERR_SEQUENCE, "Chunk fuera de secuencia");
+            } else if (chunk.part > _currentPart + 1) {
+                _request(now, _version, _currentPart + 1, "gap");
+            }
+            return;
+        }
+
+        if (chunk.part == 1 && !chunk.data.empty() && chunk.data[0] == OTA_BUNDLE_MAGIC) {
+            _bundle.reset();
+            _isBundle = true;
+        } else if (chunk.part == 1 && otaCheckImageHeader(chunk.data.data(), chunk.data.size(), nullptr) != OTA_IMAGE_OK) {
+            _error(OTA_ERR_HEADER, "Encabezado de imagen inválido en primer chunk");
+            return;
+        }
+
+        if (chunk.part == _failAt) {
+            _error(OTA_ERR_WRITE, "Error escribiendo chunk OTA: ESP_FAIL");
+            return;
+        }
+        if (!_isBundle) {
+            _write(chunk.data);
+        } else if (!_writeBundle(chunk.data)) {
+            return;
+        }
+        _currentPart = chunk.part;
+        _lastChunkUs = now;
+
+        if (chunk.sentAt) {
+            char receipt[200];
+            snprintf(receipt, sizeof(receipt), "{\"d\":\"%s\",\"v\":\"%s\",\"p\":%d,\"q\":%u,\"ts\":%llu,\"rx\":%u,\"svc\":%u}",
+                     _id.c_str(), _version.c_str(), chunk.part, chunk.sequence, (unsigned long long)chunk.sentAt,
+                     (unsigned)((receivedAt - _startUs) / 1000), (unsigned)(now - _writeStartUs));
+            _client.publish(OTA_TOPIC_RECEIPT, receipt);
+        }
+
+        int progress = chunk.part * 100 / chunk.totalParts;
+        if (progress % 10 == 0 && progress != _lastProgress) _progress(progress);
+
+        if (chunk.part == chunk.totalParts) _complete();
+    }
+
+    void _start(const Chunk& chunk, int64_t now) {
+        _inProgress = true;
+        _version = chunk.version;
+        _currentPart = 0;
+        _lastProgress = -1;
+        _sha = Sha256();
+        _held.clear();
+        _isBundle = false;
+        _startUs = now;
+        _lastChunkUs = now;
+        _progress(0);
+    }
+
+    // The last 32 bytes are the appended digest, held back from the hash
+    void _write(const std::vector<uint8_t>& data) {
+        _held.insert(_held.end(), data.begin(), data.end());
+        if (_held.size() > 32) {
+            _sha.update(_held.data(), _held.size() - 32);
+            _held.erase(_held.begin(), _held.end() - 32);
+        }
+    }
+
+    // Hashes every section as the device does; nothing is written
+    bool _writeBundle(const std::vector<uint8_t>& data) {
+        const uint8_t* bytes = data.data();
+        size_t length = data.size();
+        while (length > 0) {
+            if (!_bundle.indexComplete) {
+                size_t used;
+                if (!_bundle.readIndex(bytes, length, &used)) {
+                    _error(OTA_ERR_HEADER, "Índice de bundle inválido");
+                    return false;
+                }
+                bytes += used;
+                length -= used;
+                continue;
+            }
+            if (_bundle.done()) {
+                _error(OTA_ERR_INVALID_DATA, "Datos después del último segmento del bundle");
+                return false;
+            }
+            if (_bundle.sectionOffset == 0) _sha = Sha256();
+            size_t count = _bundle.sectionBytes(length);
+            _sha.update(bytes, count);
+            bytes += count;
+            length -= count;
+            if (_bundle.advance(count)) {
+                uint8_t digest[32];
+                _sha.finish(digest);
+                if (memcmp(digest, _bundle.sections[_bundle.section - 1].sha256, 32) != 0) {
+                    _error(OTA_ERR_VERIFY, "Bundle: SHA-256 del segmento no coincide");
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    void _complete() {
+        uint8_t digest[32];
+        _sha.finish(digest);
+        if (_isBundle && !_bundle.done()) {
+            _error(OTA_ERR_TOO_SMALL, "Bundle incompleto");
+            return;
+        }
+        if (!_isBundle && (_held.size() != 32 || memcmp(digest, _held.data(), 32) != 0)) {
+            _error(OTA_ERR_END, "Error finalizando OTA: ESP_ERR_OTA_VALIDATE_FAILED - Validación de imagen falló");
+            return;
+        }
+        _progress(100);
+        _client.publish("ota/success", "{\"device\":\"" + _id + "\",\"version\":\"" + _version +
+                                       "\",\"success\":true,\"timestamp\":" + std::to_string(nowUs() / 1000) + "}");
+        _runningVersion = _version;
+        _inProgress = false;
+        _result = 1;
+    }
+
+    void _progress(int progress) {
+        _lastProgress = progress;
+        _client.publish("ota/progress", "{\"device\":\"" + _id + "\",\"version\":\"" + _version +
+                                        "\",\"progress\":" + std::to_string(progress) +
+                                        ",\"timestamp\":" + std::to_string(nowUs() / 1000) + "}");
+    }
+
+    void _error(OTAErrorCode code, const char* message) {
+        _client.publish("ota/error", "{\"device\":\"" + _id + "\",\"version\":\"" + _version + "\",\"error\":\"" +
+                                     message + "\",\"code\":" + std::to_string(code) +
+                                     ",\"timestamp\":" + std::to_string(nowUs() / 1000) + "}");
+        _inProgress = false;
+        _failAt = 0;               // A retry writes fine
+        _result = 2;
+    }
+
+    void _request(int64_t now, const std::string& version, int from, const char* reason) {
+        if (_lastRequestFrom != 0 && now - _lastRequestUs < REQUEST_INTERVAL_US) return;
+        _lastRequestUs = now;
+        _lastRequestFrom = from;
+        char request[200];
+        snprintf(request, sizeof(request), "{\"device\":\"%s\",\"version\":\"%s\",\"from\":%d,\"count\":0,\"reason\":\"%s\"}",
+                 _id.c_str(), version.c_str(), from, reason);
+        _client.publish(OTA_TOPIC_REQUEST, request);
+    }
+
+    std::string _id;
+    uint32_t _hash;
+    double _writeRate;
+    int _failAt;
+    double _loss;
+    std::mt19937_64 _random;
+    otamqtt::Client _client;
+    std::deque<std::pair<int64_t, std::string>> _inbox;   // Receive time, payload
+    std::pair<int64_t, std::string> _current;
+    bool _writing = false;
+    int64_t _writeStartUs = 0;
+    int64_t _busyUntil = 0;
+
+    bool _inProgress = false;
+    std::string _version;
+    std::string _runningVersion;
+    int _currentPart = 0;
+    int _lastProgress = -1;
+    Sha256 _sha;
+    std::vector<uint8_t> _held;
+    OTABundleReader _bundle;
+    bool _isBundle = false;
+    int64_t _startUs = 0;
+    int64_t _lastChunkUs = 0;
+    int64_t _lastRequestUs = 0;
+    int _lastRequestFrom = 0;
+    int _result = 0;               // 1 success, 2 error
+};
+
+}
+
+int main(int argc, char** argv) {
+    std::string broker = "localhost:1883", prefix = "SIM", topic = "ota/{device}", broadcast = "ota", idsPath;
+    int count = 100;
+    double failFraction = 0, loss = 0;
+    uint64_t seed = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--broker") && i + 1 < argc) broker = argv[++i];
+        else if (!strcmp(argv[i], "-n") && i + 1 < argc) count = std::max(1, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "--prefix") && i + 1 < argc) prefix = argv[++i];
+        else if (!strcmp(argv[i], "--topic") && i + 1 < argc) topic = argv[++i];
+        else if (!strcmp(argv[i], "--broadcast") && i + 1 < argc) broadcast = argv[++i];
+        else if (!strcmp(argv[i], "--fail") && i + 1 < argc) failFraction = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--loss") && i + 1 < argc) loss = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--ids") && i + 1 < argc) idsPath = argv[++i];
+        else if (!strcmp(argv[i], "--seed") && i + 1 < argc) seed = strtoull(argv[++i], nullptr, 10);
+        else {
+            fprintf(stderr, "usage: %s [--broker host:port] [-n devices] [--prefix SIM] [--topic ota/{device}]\n"
+                            "       [--broadcast ota] [--fail fraction] [--loss fraction] [--ids file] [--seed n]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+
+    std::string host;
+    uint16_t port;
+    if (!otamqtt::parseAddress(broker, host, port)) {
+        fprintf(stderr, "bad broker address %s\n", broker.c_str());
+        return 2;
+    }
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    std::mt19937_64 random(seed);
+    std::uniform_real_distribution<double> uniform(0, 1);
+    const double rates[] = { 10e3, 40e3, 150e3 };
+    std::vector<std::unique_ptr<Device>> devices;
+    FILE* ids = idsPath.empty() ? nullptr : fopen(idsPath.c_str(), "w");
+
+    for (int i = 0; i < count; i++) {
+        char id[64];
+        snprintf(id, sizeof(id), "%s%05d", prefix.c_str(), i);
+        int pick = (int)(random() % 10);
+        double rate = rates[pick < 3 ? 0 : pick < 8 ? 1 : 2];
+        int failAt = uniform(random) < failFraction ? 2 + (int)(random() % 20) : 0;
+
+        std::string deviceTopic = topic;
+        size_t placeholder = deviceTopic.find("{device}");
+        if (placeholder != std::string::npos) deviceTopic.replace(placeholder, 8, id);
+
+        devices.emplace_back(new Device(id, rate, failAt, loss, random()));
+        if (!devices.back()->connect(host, port, deviceTopic, broadcast)) {
+            fprintf(stderr, "%s: cannot connect to %s\n", id, broker.c_str());
+            return 1;
+        }
+        if (ids) fprintf(ids, "%s\n", id);
+    }
+    if (ids) fclose(ids);
+    fprintf(stderr, "%d simulated devices connected to %s\n", count, broker.c_str());
+
+    size_t reported = 0;
+    while (!g_stop) {
+        int64_t now = nowUs();
+        size_t finished = 0;
+        for (auto& device : devices) {
+            if (!device->poll(now)) {
+                fprintf(stderr, "%s: connection lost\n", device->id().c_str());
+                return 1;
+            }
+            finished += device->finished();
+        }
+        if (finished != reported) {
+            reported = finished;
+            size_t succeeded = 0;
+            for (auto& device : devices) succeeded += device->succeeded();
+            fprintf(stderr, "%zu/%zu devices finished, %zu updated\n", finished, devices.size(), succeeded);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return 0;
+}
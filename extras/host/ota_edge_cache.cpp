@@ -0,0 +1,581 @@
+// Site edge cache: pulls each firmware chunk stream once across the WAN and
+// serves it to every device on the site broker.
+//
+// Chunks arriving on the upstream broker are decoded and kept in a
+// content-addressed store (objects named by the SHA-256 of the decoded chunk,
+// one manifest per firmware version), then republished in part order on the
+// site broker. Device part requests (ota/request, see enablePartRequests())
+// are answered from the store with chunks addressed to the requester
+// ("Device"); parts the store does not have yet are requested upstream under
+// the cache's own ID, once for all the devices waiting on them. The store
+// survives restarts, so a device joining days later costs no WAN traffic.
+//
+// Build:
+//   g++ -std=c++17 -O2 -I../.. ota_edge_cache.cpp ota_stream.cpp ota_mqtt.cpp ../../MQTTOTAProtocol.cpp -o ota_edge_cache
+//
+// Usage:
+//   ota_edge_cache --upstream host[:port] --local host[:port] [--store dir]
+//                  [--topic ota] [--id edge-site] [--burst parts] [--stats seconds]
+
+#include "ota_mqtt.h"
+#include "ota_stream.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace otastream;
+
+namespace {
+
+const int kRequestIntervalMs = 3000;   // MQTT_OTA_REQUEST_INTERVAL_MS on the device
+const int kReconnectIntervalMs = 2000;
+
+volatile sig_atomic_t g_stop = 0;
+
+void onSignal(int) {
+    g_stop = 1;
+}
+
+int64_t nowMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+std::string jsonEscape(const std::string& text) {
+    std::string out;
+    for (char c : text) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out;
+}
+
+std::string fileSafe(const std::string& text) {
+    std::string out;
+    for (char c : text) {
+        bool safe = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+                    c == '.' || c == '-' || c == '_';
+        out += safe ? c : '_';
+    }
+    return out;
+}
+
+std::string formatBytes(uint64_t bytes) {
+    char text[32];
+    if (bytes >= 1000000) {
+        snprintf(text, sizeof(text), "%.2f MB", bytes / 1e6);
+    } else if (bytes >= 1000) {
+        snprintf(text, sizeof(text), "%.1f KB", bytes / 1e3);
+    } else {
+        snprintf(text, sizeof(text), "%llu B", (unsigned long long)bytes);
+    }
+    return text;
+}
+
+// CHUNK STORE
+
+struct StoredPart {
+    std::string object;            // SHA-256 of the decoded chunk, empty if missing
+    uint32_t size = 0;
+};
+
+struct CachedImage {
+    std::string version;
+    int totalParts = 0;
+    std::vector<StoredPart> parts;  // Indexed by PartIndex, slot 0 unused
+    int stored = 0;
+
+    bool broadcasting = false;     // Upstream broadcast seen: republish on the site broker
+    int broadcastNext = 1;         // Next part to republish
+    int64_t lastUpstreamMs = 0;
+    int64_t lastRequestMs = 0;
+    int lastRequestFrom = 0;
+
+    bool has(int part) const { return part >= 1 && part <= totalParts && !parts[part].object.empty(); }
+    bool complete() const { return totalParts > 0 && stored == totalParts; }
+
+    int firstMissing(int from) const {
+        for (int part = std::max(from, 1); part <= totalParts; part++) {
+            if (!has(part)) return part;
+        }
+        return 0;
+    }
+};
+
+class ChunkStore {
+public:
+    bool open(const std::string& directory) {
+        _directory = directory;
+        if (!makeDirectory(_directory) || !makeDirectory(_directory + "/objects") ||
+            !makeDirectory(_directory + "/images")) {
+            return false;
+        }
+
+        DIR* dir = opendir((_directory + "/images").c_str());
+        if (!dir) return false;
+        while (dirent* entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if (name.size() > 9 && name.compare(name.size() - 9, 9, ".manifest") == 0) {
+                loadManifest(_directory + "/images/" + name);
+            }
+        }
+        closedir(dir);
+        return true;
+    }
+
+    CachedImage* find(const std::string& version) {
+        auto it = _images.find(version);
+        return it == _images.end() ? nullptr : &it->second;
+    }
+
+    CachedImage& image(const std::string& version, int totalParts) {
+        CachedImage& image = _images[version];
+        if (image.version.empty()) {
+            image.version = version;
+            appendManifest(version, "version " + version);
+        }
+        if (image.totalParts == 0 && totalParts > 0) {
+            image.totalParts = totalParts;
+            image.parts.resize(totalParts + 1);
+            appendManifest(version, "parts " + std::to_string(totalParts));
+        }
+        return image;
+    }
+
+    /**
+     * @brief Stores one decoded chunk
+     * @param shared Set when an identical chunk was already stored (any version)
+     * @return false on a write error
+     */
+    bool put(CachedImage& image, int part, const uint8_t* data, size_t length, bool* shared) {
+        Sha256 sha;
+        sha.update(data, length);
+        uint8_t digest[32];
+        sha.finish(digest);
+        std::string object = hex(digest, 32);
+
+        *shared = _objects.count(object) > 0;
+        if (!*shared) {
+            std::string path = objectPath(object);
+            makeDirectory(path.substr(0, path.rfind('/')));
+            std::string temporary = path + ".tmp";
+            FILE* file = fopen(temporary.c_str(), "wb");
+            if (!file) return false;
+            bool written = fwrite(data, 1, length, file) == length;
+            written = fclose(file) == 0 && written;
+            if (!written || rename(temporary.c_str(), path.c_str()) != 0) return false;
+            _objects[object] = (uint32_t)length;
+            _bytes += length;
+        }
+
+        image.parts[part].object = object;
+        image.parts[part].size = (uint32_t)length;
+        image.stored++;
+        appendManifest(image.version, std::to_string(part) + " " + object + " " + std::to_string(length));
+        return true;
+    }
+
+    bool get(const CachedImage& image, int part, std::string& data) const {
+        if (!image.has(part)) return false;
+        std::ifstream file(objectPath(image.parts[part].object), std::ios::binary);
+        if (!file) return false;
+        data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        return data.size() == image.parts[part].size;
+    }
+
+    std::map<std::string, CachedImage>& images() { return _images; }
+    const std::map<std::string, CachedImage>& images() const { return _images; }
+    size_t objects() const { return _objects.size(); }
+    uint64_t bytes() const { return _bytes; }
+
+private:
+    static bool makeDirectory(const std::string& path) {
+        return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+    }
+
+    std::string objectPath(const std::string& object) const {
+        return _directory + "/objects/" + object.substr(0, 2) + "/" + object.substr(2);
+    }
+
+    void appendManifest(const std::string& version, const std::string& line) {
+        std::ofstream file(_directory + "/images/" + fileSafe(version) + ".manifest", std::ios::app);
+        file << line << '\n';
+    }
+
+    // "version <v>", "parts <n>", then "<part> <object> <size>" per stored chunk
+    void loadManifest(const std::string& path) {
+        std::ifstream file(path);
+        std::string line;
+        CachedImage* image = nullptr;
+        while (std::getline(file, line)) {
+            std::istringstream fields(line);
+            std::string key;
+            fields >> key;
+            if (key == "version") {
+                image = &_images[line.substr(8)];
+                image->version = line.substr(8);
+            } else if (key == "parts" && image) {
+                fields >> image->totalParts;
+                image->parts.assign(image->totalParts + 1, StoredPart());
+            } else if (image && image->totalParts > 0) {
+                int part = atoi(key.c_str());
+                StoredPart stored;
+                fields >> stored.object >> stored.size;
+                if (part < 1 || part > image->totalParts || stored.object.size() != 64) continue;
+                struct stat st;
+                if (stat(objectPath(stored.object).c_str(), &st) != 0 || (uint32_t)st.st_size != stored.size) continue;
+                if (image->parts[part].object.empty()) image->stored++;
+                image->parts[part] = stored;
+                _bytes += _objects.count(stored.object) ? 0 : stored.size;
+                _objects[stored.object] = stored.size;
+            }
+        }
+    }
+
+    std::string _directory;
+    std::map<std::string, CachedImage> _images;
+    std::map<std::string, uint32_t> _objects;
+    uint64_t _bytes = 0;
+};
+
+// EDGE CACHE
+
+struct Waiter {
+    std::string version;
+    int next = 1;                  // Next part to send
+    int last = 0;                  // Last part requested
+};
+
+struct Stats {
+    uint64_t upstreamChunks = 0;
+    uint64_t upstreamDuplicates = 0;   // Parts the store already had for that version
+    uint64_t sharedObjects = 0;        // New parts whose content was already stored
+    uint64_t upstreamRequests = 0;
+    uint64_t forwarded = 0;            // Non-chunk messages passed through
+    uint64_t broadcastChunks = 0;
+    uint64_t retransmittedChunks = 0;
+    uint64_t deviceRequests = 0;
+};
+
+class EdgeCache {
+public:
+    EdgeCache(ChunkStore& store, const std::string& id, const std::string& topic, int burst)
+        : _store(store), _id(id), _topic(topic), _burst(burst) {}
+
+    otamqtt::Client upstream;
+    otamqtt::Client local;
+
+    void onUpstream(const std::string& topic, const std::string& payload) {
+        if (topic != _topic) return;
+
+        std::string eventType, version, device, base64;
+        int part = 0, totalParts = 0;
+        bool isChunk = false, isError = false;
+        scanMessage(payload.data(), payload.data() + payload.size(),
+                    [&](const char* key, size_t keyLength, const Value& value) {
+            if (keyIs(key, keyLength, "EventType")) {
+                eventType.assign(value.data, value.length);
+            } else if (keyIs(key, keyLength, "FirmwareVersion")) {
+                version.assign(value.data, value.length);
+            } else if (keyIs(key, keyLength, "Base64Part")) {
+                isChunk = true;
+                base64 = value.escaped ? unescape(value.data, value.length) : std::string(value.data, value.length);
+            } else if (keyIs(key, keyLength, "PartIndex")) {
+                part = atoi(std::string(value.data, value.length).c_str());
+            } else if (keyIs(key, keyLength, "TotalParts")) {
+                totalParts = atoi(std::string(value.data, value.length).c_str());
+            } else if (keyIs(key, keyLength, "Device")) {
+                device.assign(value.data, value.length);
+            } else if (keyIs(key, keyLength, "IsError")) {
+                isError = value.length == 4 && !memcmp(value.data, "true", 4);
+            }
+        });
+
+        // Full images, server errors, diagnostics polls: pass through untouched
+        if (eventType != "UpdateFirmwareDevice" || !isChunk || isError || version.empty() ||
+            part < 1 || totalParts < part) {
+            if (device.empty() || device != _id) {
+                local.publish(_topic, payload);
+                _stats.forwarded++;
+            }
+            return;
+        }
+
+        _stats.upstreamChunks++;
+        CachedImage& image = _store.image(version, totalParts);
+        image.lastUpstreamMs = nowMs();
+        if (device.empty()) image.broadcasting = true;
+        if (totalParts != image.totalParts) {
+            fprintf(stderr, "%s: TotalParts %d, cached image has %d; chunk ignored\n",
+                    version.c_str(), totalParts, image.totalParts);
+            return;
+        }
+
+        if (image.has(part)) {
+            _stats.upstreamDuplicates++;
+        } else {
+            std::vector<uint8_t> data(decodedCapacity(base64.size()));
+            size_t length = 0;
+            DecodeStatus status = decodeBase64((const uint8_t*)base64.data(), base64.size(), data.data(), &length);
+            if (status != DECODE_OK) {
+                fprintf(stderr, "%s part %d: Base64 %s\n", version.c_str(), part, decodeStatusName(status));
+                return;
+            }
+            bool shared = false;
+            if (!_store.put(image, part, data.data(), length, &shared)) {
+                fprintf(stderr, "%s part %d: cannot write to the store\n", version.c_str(), part);
+                return;
+            }
+            if (shared) _stats.sharedObjects++;
+            if (image.complete()) {
+                fprintf(stderr, "%s: complete, %d parts cached\n", version.c_str(), image.totalParts);
+            }
+        }
+
+        // A broadcast part beyond a hole means upstream chunks were lost
+        int missing = image.firstMissing(1);
+        if (missing && missing < part) requestUpstream(image, missing);
+    }
+
+    void onLocal(const std::string& topic, const std::string& payload) {
+        if (topic != OTA_TOPIC_REQUEST) return;
+
+        std::string device, version;
+        int from = 1, count = 0;
+        scanMessage(payload.data(), payload.data() + payload.size(),
+                    [&](const char* key, size_t keyLength, const Value& value) {
+            std::string text(value.data, value.length);
+            if (keyIs(key, keyLength, "device")) device = text;
+            else if (keyIs(key, keyLength, "version")) version = text;
+            else if (keyIs(key, keyLength, "from")) from = atoi(text.c_str());
+            else if (keyIs(key, keyLength, "count")) count = atoi(text.c_str());
+        });
+        if (device.empty() || version.empty() || device == _id) return;
+
+        _stats.deviceRequests++;
+        Waiter& waiter = _waiters[device];
+        waiter.version = version;
+        waiter.next = std::max(from, 1);
+        waiter.last = count > 0 ? waiter.next + count - 1 : 0;   // 0: through the last part
+    }
+
+    // Republishes, serves waiters and chases missing parts
+    void tick() {
+        for (auto& entry : _store.images()) {
+            CachedImage& image = entry.second;
+            while (image.broadcasting && image.broadcastNext <= image.totalParts && image.has(image.broadcastNext)) {
+                if (!publishPart(image, image.broadcastNext, std::string())) break;
+                image.broadcastNext++;
+                _stats.broadcastChunks++;
+            }
+        }
+
+        for (auto it = _waiters.begin(); it != _waiters.end();) {
+            Waiter& waiter = it->second;
+            CachedImage* image = _store.find(waiter.version);
+            if (!image || image->totalParts == 0) {
+                // Never seen here: let upstream send it, addressed to the cache
+                CachedImage& unknown = _unknown[waiter.version];
+                unknown.version = waiter.version;
+                requestUpstream(unknown, 1);
+                ++it;
+                continue;
+            }
+
+            int last = waiter.last > 0 ? std::min(waiter.last, image->totalParts) : image->totalParts;
+            for (int sent = 0; sent < _burst && waiter.next <= last && image->has(waiter.next); sent++) {
+                if (!publishPart(*image, waiter.next, it->first)) break;
+                waiter.next++;
+                _stats.retransmittedChunks++;
+            }
+
+            // Caught up with the live broadcast: the device follows it from here
+            bool live = image->broadcasting && nowMs() - image->lastUpstreamMs < kRequestIntervalMs &&
+                        waiter.next >= image->broadcastNext;
+            if (waiter.next > last || live) {
+                it = _waiters.erase(it);
+                continue;
+            }
+            if (!image->has(waiter.next)) requestUpstream(*image, waiter.next);
+            ++it;
+        }
+
+        // Tail loss: nothing more arrives but the broadcast image has holes
+        int64_t now = nowMs();
+        for (auto& entry : _store.images()) {
+            CachedImage& image = entry.second;
+            if (image.broadcasting && !image.complete() && now - image.lastUpstreamMs > kRequestIntervalMs) {
+                int missing = image.firstMissing(1);
+                if (missing) requestUpstream(image, missing);
+            }
+        }
+    }
+
+    void printStats(FILE* out) const {
+        fprintf(out, "wan:   %s in (%llu chunks, %llu already cached), %s out (%llu requests, %llu forwarded)\n",
+                formatBytes(upstream.bytesIn()).c_str(), (unsigned long long)_stats.upstreamChunks,
+                (unsigned long long)_stats.upstreamDuplicates, formatBytes(upstream.bytesOut()).c_str(),
+                (unsigned long long)_stats.upstreamRequests, (unsigned long long)_stats.forwarded);
+        fprintf(out, "site:  %s out (%llu broadcast, %llu retransmitted for %llu device requests), %s in\n",
+                formatBytes(local.bytesOut()).c_str(), (unsigned long long)_stats.broadcastChunks,
+                (unsigned long long)_stats.retransmittedChunks, (unsigned long long)_stats.deviceRequests,
+                formatBytes(local.bytesIn()).c_str());
+        uint64_t wan = upstream.bytesIn() + upstream.bytesOut();
+        fprintf(out, "ratio: %.2f device bytes per WAN byte; store %s in %zu objects (%llu shared)\n",
+                wan ? (double)local.bytesOut() / wan : 0.0, formatBytes(_store.bytes()).c_str(),
+                _store.objects(), (unsigned long long)_stats.sharedObjects);
+        fflush(out);
+    }
+
+private:
+    bool publishPart(const CachedImage& image, int part, const std::string& device) {
+        std::string data;
+        if (!_store.get(image, part, data)) {
+            fprintf(stderr, "%s part %d: missing from the store\n", image.version.c_str(), part);
+            return false;
+        }
+
+        std::string message = "{\"EventType\":\"UpdateFirmwareDevice\",\"Details\":{\"FirmwareVersion\":\"";
+        message += jsonEscape(image.version);
+        message += "\",\"Base64Part\":\"";
+        message += encodeBase64((const uint8_t*)data.data(), data.size());
+        message += "\",\"PartIndex\":" + std::to_string(part);
+        message += ",\"TotalParts\":" + std::to_string(image.totalParts);
+        if (!device.empty()) message += ",\"Device\":\"" + jsonEscape(device) + "\"";
+        message += "}}";
+        return local.publish(_topic, message);
+    }
+
+    // Asks upstream for the run of missing parts starting at from, at most once per interval
+    void requestUpstream(CachedImage& image, int from) {
+        int64_t now = nowMs();
+        if (from == image.lastRequestFrom && now - image.lastRequestMs < kRequestIntervalMs) return;
+        if (!upstream.connected()) return;
+
+        int count = 0;
+        for (int part = from; part <= image.totalParts && !image.has(part); part++) count++;
+        if (from + count > image.totalParts) count = 0;   // Missing through the end
+
+        char request[256];
+        snprintf(request, sizeof(request),
+                 "{\"device\":\"%s\",\"version\":\"%s\",\"from\":%d,\"count\":%d,\"reason\":\"%s\"}",
+                 jsonEscape(_id).c_str(), jsonEscape(image.version).c_str(), from, count,
+                 image.totalParts ? otaRequestReasonName(OTA_REQUEST_GAP) : otaRequestReasonName(OTA_REQUEST_JOIN));
+        upstream.publish(OTA_TOPIC_REQUEST, request);
+
+        image.lastRequestMs = now;
+        image.lastRequestFrom = from;
+        _stats.upstreamRequests++;
+    }
+
+    ChunkStore& _store;
+    std::string _id;
+    std::string _topic;
+    int _burst;
+    std::map<std::string, Waiter> _waiters;   // By device ID
+    std::map<std::string, CachedImage> _unknown;  // Requested versions not in the store yet
+    Stats _stats;
+};
+
+bool connectClient(otamqtt::Client& client, const std::string& address, const std::string& clientId,
+                   const std::string& filter) {
+    std::string host;
+    uint16_t port;
+    if (!otamqtt::parseAddress(address, host, port)) {
+        fprintf(stderr, "invalid address %s\n", address.c_str());
+        return false;
+    }
+    if (!client.connect(host, port, clientId) || !client.subscribe(filter)) {
+        fprintf(stderr, "%s: %s\n", address.c_str(), client.lastError().c_str());
+        return false;
+    }
+    fprintf(stderr, "connected to %s, subscribed to %s\n", address.c_str(), filter.c_str());
+    return true;
+}
+
+}
+
+int main(int argc, char** argv) {
+    std::string upstreamAddress, localAddress, storeDirectory = "ota-cache", topic = "ota";
+    char hostname[64] = "site";
+    gethostname(hostname, sizeof(hostname) - 1);
+    std::string id = std::string("edge-") + hostname;
+    int burst = 16;
+    int statsSeconds = 0;
+
+    for (int i = 1; i < argc; i++) {
+        std::string option = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+        if (option == "--upstream" && value) upstreamAddress = argv[++i];
+        else if (option == "--local" && value) localAddress = argv[++i];
+        else if (option == "--store" && value) storeDirectory = argv[++i];
+        else if (option == "--topic" && value) topic = argv[++i];
+        else if (option == "--id" && value) id = argv[++i];
+        else if (option == "--burst" && value) burst = std::max(1, atoi(argv[++i]));
+        else if (option == "--stats" && value) statsSeconds = atoi(argv[++i]);
+        else upstreamAddress.clear(), i = argc;
+    }
+    if (upstreamAddress.empty() || localAddress.empty()) {
+        fprintf(stderr, "usage: %s --upstream host[:port] --local host[:port] [--store dir] [--topic ota]\n"
+                        "       [--id edge-site] [--burst parts] [--stats seconds]\n", argv[0]);
+        return 2;
+    }
+
+    ChunkStore store;
+    if (!store.open(storeDirectory)) {
+        perror(storeDirectory.c_str());
+        return 1;
+    }
+    for (const auto& entry : store.images()) {
+        fprintf(stderr, "cached %s: %d/%d parts\n", entry.first.c_str(), entry.second.stored, entry.second.totalParts);
+    }
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+    selectDecoder(true);
+
+    EdgeCache cache(store, id, topic, burst);
+    cache.upstream.onMessage([&](const std::string& t, const std::string& p) { cache.onUpstream(t, p); });
+    cache.local.onMessage([&](const std::string& t, const std::string& p) { cache.onLocal(t, p); });
+
+    int64_t lastConnectAttempt = 0, lastStats = nowMs();
+    while (!g_stop) {
+        int64_t now = nowMs();
+        if ((!cache.upstream.connected() || !cache.local.connected()) &&
+            now - lastConnectAttempt > kReconnectIntervalMs) {
+            lastConnectAttempt = now;
+            if (!cache.local.connected()) connectClient(cache.local, localAddress, id, OTA_TOPIC_REQUEST);
+            if (!cache.upstream.connected()) connectClient(cache.upstream, upstreamAddress, id, topic);
+        }
+
+        pollfd fds[2] = { { cache.upstream.fd(), POLLIN, 0 }, { cache.local.fd(), POLLIN, 0 } };
+        ::poll(fds, 2, 50);
+        if (cache.upstream.connected()) cache.upstream.poll(0);
+        if (cache.local.connected()) cache.local.poll(0);
+        cache.tick();
+
+        if (statsSeconds > 0 && nowMs() - lastStats >= statsSeconds * 1000) {
+            lastStats = nowMs();
+            cache.printStats(stderr);
+        }
+    }
+
+    cache.printStats(stdout);
+    return 0;
+}
@@ -0,0 +1,497 @@
+// Per-stage heap accounting of the chunk receive path, on the host.
+//
+// The host counterpart of the device's MQTT_OTA_HEAP_HOOKS: every operator
+// new of the process is served by a tracking allocator over a fixed arena the
+// size of an ESP32's free heap (first fit, coalescing on free, so that
+// fragmentation shows in the largest free block as it does on the device).
+// An image is then received chunk by chunk along the path of
+// MQTTOTA::_handleChunk(), with every step inside the same stage scope the
+// library puts it in:
+//
+//   parse     the 4096-byte JSON document (or the binary header) and the
+//             chunk fields copied out of it
+//   decode    Base64Part decoded into a new buffer
+//   write     the flash write, with the image hashed as the device does
+//   publish   the progress message every 10% and a receipt per chunk
+//   callback  the progress callback, which allocates --callback bytes
+//
+// Allocations outside any stage (the received message itself) are listed as
+// "none". Per stage the table shows what OTAStatistics::heapStages holds on
+// the device: runs, allocations, bytes requested, the largest rise of live
+// heap within one run and the lowest largest-free-block at stage exit. When
+// the arena runs out the tool reports the stage that asked, which is what the
+// device's "Memoria insuficiente" leaves unanswered, and exits with 1.
+//
+// Build:
+//   g++ -std=c++17 -O2 -I../.. ota_heap_trace.cpp ota_stream.cpp ../../MQTTOTAProtocol.cpp -o ota_heap_trace
+//
+// Usage:
+//   ota_heap_trace [--binary] [-i image KB] [-c chunk bytes] [--heap KB] [--hold blocks] [--callback bytes]
+
+#include "ota_stream.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+namespace {
+
+// ARENA
+
+const size_t ARENA_ALIGN = 16;
+const size_t ARENA_MAX = 16u << 20;
+
+// Every block starts with its header; free blocks are linked in address order
+struct Block {
+    size_t size;            // Including the header
+    bool free;
+    Block* nextFree;
+};
+const size_t HEADER = (sizeof(Block) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+alignas(ARENA_ALIGN) unsigned char g_arena[ARENA_MAX];
+size_t g_arenaSize = ARENA_MAX;
+Block* g_freeList = nullptr;
+bool g_arenaReady = false;
+size_t g_live = 0;          // Bytes handed out, headers included
+
+enum Stage { STAGE_PARSE, STAGE_DECODE, STAGE_WRITE, STAGE_PUBLISH, STAGE_CALLBACK, STAGE_NONE, STAGE_COUNT };
+const char* STAGE_NAMES[STAGE_COUNT] = { "parse", "decode", "write", "publish", "callback", "none" };
+
+struct StageHeap {
+    uint32_t runs = 0;
+    uint32_t allocCount = 0;
+    size_t allocBytes = 0;
+    size_t peakBytes = 0;
+    size_t largestFreeBlockLow = SIZE_MAX;
+};
+
+StageHeap g_stages[STAGE_COUNT];
+Stage g_stage = STAGE_NONE;
+size_t g_runPeak = 0;       // Highest g_live since the innermost scope was entered
+size_t g_sessionPeak = 0;   // Highest g_live while tracking
+bool g_tracking = false;
+Stage g_failedStage = STAGE_NONE;
+size_t g_failedSize = 0;
+
+void arenaInit() {
+    g_freeList = reinterpret_cast<Block*>(g_arena);
+    g_freeList->size = g_arenaSize;
+    g_freeList->free = true;
+    g_freeList->nextFree = nullptr;
+    g_arenaReady = true;
+}
+
+size_t largestFreeBlock() {
+    size_t largest = 0;
+    for (Block* block = g_freeList; block; block = block->nextFree) {
+        if (block->size > largest) largest = block->size;
+    }
+    return largest > HEADER ? largest - HEADER : 0;
+}
+
+void* arenaAlloc(size_t size) {
+    if (!g_arenaReady) arenaInit();
+    size_t need = (size + HEADER + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    Block** link = &g_freeList;
+    for (Block* block = g_freeList; block; link = &block->nextFree, block = block->nextFree) {
+        if (block->size < need) continue;
+        if (block->size - need >= HEADER + ARENA_ALIGN) {
+            Block* rest = reinterpret_cast<Block*>(reinterpret_cast<unsigned char*>(block) + need);
+            rest->size = block->size - need;
+            rest->free = true;
+            rest->nextFree = block->nextFree;
+            *link = rest;
+            block->size = need;
+        } else {
+            *link = block->nextFree;
+        }
+        block->free = false;
+        g_live += block->size;
+
+        if (g_tracking) {
+            StageHeap& stage = g_stages[g_stage];
+            stage.allocCount++;
+            stage.allocBytes += size;
+            if (g_live > g_runPeak) g_runPeak = g_live;
+            if (g_live > g_sessionPeak) g_sessionPeak = g_live;
+        }
+        return reinterpret_cast<unsigned char*>(block) + HEADER;
+    }
+
+    if (g_tracking && g_failedStage == STAGE_NONE) {
+        g_failedStage = g_stage;
+        g_failedSize = size;
+    }
+    return nullptr;
+}
+
+void arenaFree(void* pointer) {
+    if (!pointer) return;
+    Block* block = reinterpret_cast<Block*>(static_cast<unsigned char*>(pointer) - HEADER);
+    block->free = true;
+    g_live -= block->size;
+
+    // Insert in address order and merge with the neighbours
+    Block* previous = nullptr;
+    Block* next = g_freeList;
+    while (next && next < block) {
+        previous = next;
+        next = next->nextFree;
+    }
+    block->nextFree = next;
+    if (next && reinterpret_cast<unsigned char*>(block) + block->size == reinterpret_cast<unsigned char*>(next)) {
+        block->size += next->size;
+        block->nextFree = next->nextFree;
+    }
+    if (previous) {
+        previous->nextFree = block;
+        if (reinterpret_cast<unsigned char*>(previous) + previous->size == reinterpret_cast<unsigned char*>(block)) {
+            previous->size += block->size;
+            previous->nextFree = block->nextFree;
+        }
+    } else {
+        g_freeList = block;
+    }
+}
+
+// Same bookkeeping as the library's StageScope
+class StageScope {
+public:
+    explicit StageScope(Stage stage)
+        : _previous(g_stage), _previousPeak(g_runPeak), _entryLive(g_live) {
+        g_stage = stage;
+        g_runPeak = g_live;
+        g_stages[stage].runs++;
+    }
+
+    ~StageScope() {
+        StageHeap& stage = g_stages[g_stage];
+        size_t rise = g_runPeak - _entryLive;
+        if (rise > stage.peakBytes) stage.peakBytes = rise;
+        size_t largest = largestFreeBlock();
+        if (largest < stage.largestFreeBlockLow) stage.largestFreeBlockLow = largest;
+
+        g_stage = _previous;
+        g_runPeak = _previousPeak > g_runPeak ? _previousPeak : g_runPeak;
+    }
+
+private:
+    Stage _previous;
+    size_t _previousPeak;
+    size_t _entryLive;
+};
+
+}
+
+void* operator new(size_t size) {
+    void* pointer = arenaAlloc(size);
+    if (!pointer) throw std::bad_alloc();
+    return pointer;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return arenaAlloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return arenaAlloc(size);
+}
+
+void operator delete(void* pointer) noexcept { arenaFree(pointer); }
+void operator delete[](void* pointer) noexcept { arenaFree(pointer); }
+void operator delete(void* pointer, size_t) noexcept { arenaFree(pointer); }
+void operator delete[](void* pointer, size_t) noexcept { arenaFree(pointer); }
+
+namespace {
+
+using namespace otastream;
+
+struct Options {
+    bool binary = false;
+    size_t imageBytes = 512 * 1024;
+    size_t chunkBytes = 4096;
+    size_t heapBytes = 160 * 1024;
+    size_t holdBlocks = 0;
+    size_t callbackBytes = 256;
+};
+
+// What the library keeps of a chunk (OTAChunkData)
+struct Chunk {
+    std::string firmwareVersion;
+    std::string base64Part;
+    int partIndex = 0;
+    int totalParts = 0;
+    const uint8_t* data = nullptr;
+    size_t dataLength = 0;
+};
+
+struct Receiver {
+    Options options;
+    Sha256 sha;
+    size_t received = 0;
+    int lastProgress = -1;
+    size_t receipts = 0;
+
+    void progressCallback(int progress) {
+        std::vector<char> scratch(options.callbackBytes);
+        if (scratch.size() >= 16) snprintf(scratch.data(), 16, "progress %d", progress % 1000);
+    }
+
+    void publishProgress(int progress, const std::string& version) {
+        {
+            StageScope scope(STAGE_CALLBACK);
+            progressCallback(progress);
+        }
+        if (progress % 10 == 0 || progress == 100) {
+            StageScope scope(STAGE_PUBLISH);
+            std::vector<char> doc(1024);
+            std::string output = "{\"device\":\"host\",\"version\":\"" + version +
+                                 "\",\"progress\":" + std::to_string(progress) + "}";
+        }
+    }
+
+    void publishReceipt(const Chunk& chunk) {
+        StageScope scope(STAGE_PUBLISH);
+        OTAChunkReceipt receipt = {};
+        receipt.part = chunk.partIndex;
+        receipt.versionHash = otaHash32(chunk.firmwareVersion.c_str());
+        std::vector<uint8_t> payload(OTA_RECEIPT_SIZE);
+        otaReceiptEncode(receipt, payload.data());
+        receipts++;
+    }
+
+    bool handleChunk(const Chunk& chunk, size_t imageBytes) {
+        const uint8_t* data = chunk.data;
+        size_t dataLength = chunk.dataLength;
+        std::string decoded;
+        if (!data) {
+            StageScope scope(STAGE_DECODE);
+            decoded.resize(decodedCapacity(chunk.base64Part.size()));
+            size_t length = 0;
+            if (decodeBase64((const uint8_t*)chunk.base64Part.data(), chunk.base64Part.size(),
+                             (uint8_t*)&decoded[0], &length) != DECODE_OK) {
+                return false;
+            }
+            decoded.resize(length);
+            data = (const uint8_t*)decoded.data();
+            dataLength = length;
+        }
+        {
+            StageScope scope(STAGE_WRITE);
+            sha.update(data, dataLength);
+        }
+        received += dataLength;
+        publishReceipt(chunk);
+
+        int progress = (int)(received * 100 / imageBytes);
+        if (progress != lastProgress) {
+            lastProgress = progress;
+            publishProgress(progress, chunk.firmwareVersion);
+        }
+        return true;
+    }
+
+    bool receiveJson(const std::string& message, size_t imageBytes) {
+        Chunk chunk;
+        {
+            StageScope scope(STAGE_PARSE);
+            std::vector<char> doc(4096);
+            scanMessage(message.data(), message.data() + message.size(),
+                        [&](const char* key, size_t keyLength, const Value& value) {
+                if (keyIs(key, keyLength, "FirmwareVersion")) {
+                    chunk.firmwareVersion.assign(value.data, value.length);
+                } else if (keyIs(key, keyLength, "Base64Part")) {
+                    chunk.base64Part.assign(value.data, value.length);
+                } else if (keyIs(key, keyLength, "PartIndex")) {
+                    chunk.partIndex = atoi(std::string(value.data, value.length).c_str());
+                } else if (keyIs(key, keyLength, "TotalParts")) {
+                    chunk.totalParts = atoi(std::string(value.data, value.length).c_str());
+                }
+            });
+        }
+        return handleChunk(chunk, imageBytes);
+    }
+
+    bool receiveBinary(const std::vector<uint8_t>& message, size_t imageBytes) {
+        Chunk chunk;
+        {
+            StageScope scope(STAGE_PARSE);
+            OTAChunkHeader header = {};
+            if (!otaChunkHeaderDecode(message.data(), message.size(), header)) return false;
+            const uint8_t* version = message.data() + OTA_CHUNK_HEADER_SIZE;
+            chunk.firmwareVersion.assign((const char*)version, header.versionLength);
+            chunk.partIndex = header.part;
+            chunk.totalParts = header.totalParts;
+            chunk.data = version + header.versionLength;
+            chunk.dataLength = message.data() + message.size() - chunk.data;
+        }
+        return handleChunk(chunk, imageBytes);
+    }
+};
+
+void printTable(size_t heapLow, size_t blockLow) {
+    printf("%-9s %8s %8s %12s %10s %16s\n", "stage", "runs", "allocs", "bytes", "peak", "largest-free-low");
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        const StageHeap& stage = g_stages[i];
+        if (stage.runs == 0 && stage.allocCount == 0) continue;
+        char low[24] = "-";
+        if (stage.largestFreeBlockLow != SIZE_MAX) snprintf(low, sizeof(low), "%zu", stage.largestFreeBlockLow);
+        printf("%-9s %8u %8u %12zu %10zu %16s\n", STAGE_NAMES[i], (unsigned)stage.runs,
+               (unsigned)stage.allocCount, stage.allocBytes, stage.peakBytes, low);
+    }
+    printf("session: free heap low %zu, largest free block low %zu\n", heapLow, blockLow);
+}
+
+int usage() {
+    fprintf(stderr, "usage: ota_heap_trace [--binary] [-i image KB] [-c chunk bytes] [--heap KB]"
+                    " [--hold blocks] [--callback bytes]\n");
+    return 2;
+}
+
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--binary") {
+            options.binary = true;
+        } else if (arg == "-i" && i + 1 < argc) {
+            options.imageBytes = strtoul(argv[++i], nullptr, 10) * 1024;
+        } else if (arg == "-c" && i + 1 < argc) {
+            options.chunkBytes = strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--heap" && i + 1 < argc) {
+            options.heapBytes = strtoul(argv[++i], nullptr, 10) * 1024;
+        } else if (arg == "--hold" && i + 1 < argc) {
+            options.holdBlocks = strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--callback" && i + 1 < argc) {
+            options.callbackBytes = strtoul(argv[++i], nullptr, 10);
+        } else {
+            return usage();
+        }
+    }
+    if (options.imageBytes == 0 || options.chunkBytes == 0 || options.heapBytes < 16 * 1024) {
+        return usage();
+    }
+
+    // The image and its Base64 text are the broker's copy, allocated ahead of
+    // the device heap
+    std::vector<uint8_t> image(options.imageBytes);
+    uint32_t seed = 0x2545F491;
+    for (uint8_t& byte : image) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        byte = (uint8_t)seed;
+    }
+    int totalParts = (int)((options.imageBytes + options.chunkBytes - 1) / options.chunkBytes);
+    std::vector<std::string> texts;
+    if (!options.binary) {
+        texts.reserve(totalParts);
+        for (int part = 0; part < totalParts; part++) {
+            size_t offset = (size_t)part * options.chunkBytes;
+            size_t length = std::min(options.chunkBytes, options.imageBytes - offset);
+            texts.push_back(encodeBase64(image.data() + offset, length));
+        }
+    }
+
+    // Everything behind that is the device heap
+    size_t used = g_live;
+    void* reserved = used + options.heapBytes + 2 * HEADER > ARENA_MAX
+                   ? nullptr : arenaAlloc(ARENA_MAX - used - options.heapBytes - 2 * HEADER);
+    if (!reserved) {
+        fprintf(stderr, "image and a %zu KB heap do not fit in the arena\n", options.heapBytes / 1024);
+        return 1;
+    }
+
+    size_t heapBase = g_live;
+
+    // Long-lived blocks of other tasks, every other one freed to fragment the heap
+    std::vector<void*> held;
+    held.reserve(options.holdBlocks);
+    for (size_t i = 0; i < options.holdBlocks; i++) {
+        held.push_back(arenaAlloc(512));
+    }
+    for (size_t i = 0; i < held.size(); i += 2) {
+        arenaFree(held[i]);
+        held[i] = nullptr;
+    }
+
+    Receiver receiver;
+    receiver.options = options;
+    const std::string version = "1.2.3-host";
+    size_t blockLow = largestFreeBlock();
+    bool ok = true;
+
+    g_sessionPeak = g_live;
+    g_tracking = true;
+    try {
+        for (int part = 1; part <= totalParts && ok; part++) {
+            size_t offset = (size_t)(part - 1) * options.chunkBytes;
+            size_t length = std::min(options.chunkBytes, options.imageBytes - offset);
+            const uint8_t* data = image.data() + offset;
+
+            // The received message, copied by the MQTT client before dispatch
+            if (options.binary) {
+                OTAChunkHeader header = {};
+                header.part = part;
+                header.totalParts = totalParts;
+                header.versionLength = (uint8_t)version.size();
+                std::vector<uint8_t> message(OTA_CHUNK_HEADER_SIZE + version.size() + length);
+                otaChunkHeaderEncode(header, message.data());
+                memcpy(message.data() + OTA_CHUNK_HEADER_SIZE, version.data(), version.size());
+                memcpy(message.data() + OTA_CHUNK_HEADER_SIZE + version.size(), data, length);
+                ok = receiver.receiveBinary(message, options.imageBytes);
+            } else {
+                char head[160];
+                snprintf(head, sizeof(head),
+                         "{\"EventType\":\"UpdateFirmwareDevice\",\"Details\":{\"FirmwareVersion\":\"%s\","
+                         "\"PartIndex\":%d,\"TotalParts\":%d,\"Base64Part\":\"", version.c_str(), part, totalParts);
+                std::string message;
+                message.reserve(strlen(head) + texts[part - 1].size() + 3);
+                message.append(head).append(texts[part - 1]).append("\"}}");
+                ok = receiver.receiveJson(message, options.imageBytes);
+            }
+        }
+    } catch (const std::bad_alloc&) {
+        ok = false;
+    }
+    g_tracking = false;
+
+    printf("%s chunks of %zu bytes, %zu KB image, %zu KB heap, %zu blocks held\n",
+           options.binary ? "binary" : "json", options.chunkBytes, options.imageBytes / 1024,
+           options.heapBytes / 1024, options.holdBlocks);
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        blockLow = std::min(blockLow, g_stages[i].largestFreeBlockLow);
+    }
+    size_t heapUsed = g_sessionPeak - heapBase;
+    printTable(heapUsed < options.heapBytes ? options.heapBytes - heapUsed : 0, blockLow);
+
+    if (g_failedStage != STAGE_NONE || !ok) {
+        if (g_failedSize != 0) {
+            printf("out of heap: %zu bytes requested in %s\n", g_failedSize, STAGE_NAMES[g_failedStage]);
+        } else {
+            printf("receive failed after %zu bytes\n", receiver.received);
+        }
+        return 1;
+    }
+
+    uint8_t digest[32];
+    receiver.sha.finish(digest);
+    Sha256 reference;
+    reference.update(image.data(), image.size());
+    uint8_t expected[32];
+    reference.finish(expected);
+    printf("image %s, %zu receipts\n", memcmp(digest, expected, 32) == 0 ? "OK" : "MISMATCH", receiver.receipts);
+    return memcmp(digest, expected, 32) == 0 ? 0 : 1;
+}
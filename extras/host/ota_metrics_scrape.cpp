@@ -0,0 +1,399 @@
+// Scrapes the metrics endpoint on localhost.
+//
+// The page is rendered with OTAMetricsWriter, and requests are classified and
+// answered with otaMetricsRequest() and otaMetricsHead(), the same code
+// MQTTOTA::renderMetrics() and _serveMetrics() run. The serving loop is
+// _serveMetrics() over POSIX sockets, polled from a loop standing in for
+// handle(). Four scrapers connect one after the other:
+//
+//   fast      a plain GET /metrics
+//   slow      sends the request a few bytes at a time and reads the page in
+//             small pieces with pauses, through small socket buffers
+//   silent    connects and sends nothing, so it is dropped after the timeout
+//   other     GET /other, answered with 404
+//
+// Every page received must match the rendered one, carry its Content-Length
+// and parse as Prometheus text. The loop records its longest single poll:
+// serving must never wait on a scraper. Before that, the writer is checked
+// for every buffer size from 1 byte to the whole page: the output must always
+// be a prefix of the page ending at a line boundary.
+//
+// Build:
+//   g++ -std=c++17 -O2 -pthread -I../.. ota_metrics_scrape.cpp ../../MQTTOTAProtocol.cpp -o ota_metrics_scrape
+//
+// Usage:
+//   ota_metrics_scrape [--timeout ms]
+
+#include "MQTTOTAProtocol.h"
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+const size_t BUFFER_SIZE = 8192;      // MQTT_OTA_METRICS_BUFFER_SIZE
+
+uint64_t nowMicros() {
+    using namespace std::chrono;
+    return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+// A page shaped like the device's: gauges, labelled counters and histograms
+size_t renderPage(char* buffer, size_t size) {
+    OTAMetricsWriter out = { buffer, size, 0, false };
+    buffer[0] = '\0';
+
+    out.line("# TYPE mqttota_info gauge\n");
+    out.line("mqttota_info{device=\"%s\",version=\"%s\",running=\"%s\",boot=\"%s\",next=\"%s\"} 1\n",
+             "A1B2C3", "1.4.0", "ota_0", "ota_0", "ota_1");
+    out.line("# TYPE mqttota_update_in_progress gauge\nmqttota_update_in_progress %d\n", 0);
+    out.line("# TYPE mqttota_sessions_total counter\n");
+    out.line("mqttota_sessions_total{result=\"started\"} %u\n", 7u);
+    out.line("mqttota_sessions_total{result=\"success\"} %u\n", 6u);
+    out.line("# TYPE mqttota_written_bytes_total counter\nmqttota_written_bytes_total %llu\n", 6291456ull);
+    out.line("# TYPE mqttota_session_duration_seconds gauge\nmqttota_session_duration_seconds %.3f\n", 18.23);
+
+    static const char* stages[5] = { "parse", "decode", "write", "publish", "callback" };
+    out.line("# TYPE mqttota_stage_latency_seconds histogram\n");
+    for (const char* stage : stages) {
+        uint32_t cumulative = 0;
+        for (int bucket = 0; bucket < 15; bucket++) {
+            cumulative += bucket * 3;
+            out.line("mqttota_stage_latency_seconds_bucket{stage=\"%s\",le=\"%g\"} %u\n",
+                     stage, (100u << bucket) / 1000000.0, (unsigned)cumulative);
+        }
+        out.line("mqttota_stage_latency_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %u\n", stage, (unsigned)cumulative);
+        out.line("mqttota_stage_latency_seconds_sum{stage=\"%s\"} %.6f\n", stage, cumulative * 0.0021);
+        out.line("mqttota_stage_latency_seconds_count{stage=\"%s\"} %u\n", stage, (unsigned)cumulative);
+    }
+    return out.length;
+}
+
+// "# TYPE name type", or "name[{labels}] value"
+bool parsesAsPrometheus(const std::string& page, std::string* error) {
+    size_t start = 0;
+    int lineNumber = 0;
+    while (start < page.size()) {
+        size_t end = page.find('\n', start);
+        if (end == std::string::npos) {
+            *error = "last line not terminated";
+            return false;
+        }
+        std::string line = page.substr(start, end - start);
+        start = end + 1;
+        lineNumber++;
+
+        if (line.compare(0, 7, "# TYPE ") == 0) {
+            size_t space = line.find(' ', 7);
+            std::string type = space == std::string::npos ? "" : line.substr(space + 1);
+            if (type != "gauge" && type != "counter" && type != "histogram") {
+                *error = "line " + std::to_string(lineNumber) + ": bad TYPE";
+                return false;
+            }
+            continue;
+        }
+
+        size_t i = 0;
+        while (i < line.size() && (isalnum((unsigned char)line[i]) || line[i] == '_' || line[i] == ':')) i++;
+        bool ok = i > 0;
+        if (ok && i < line.size() && line[i] == '{') {
+            size_t close = line.find('}', i);
+            ok = close != std::string::npos;
+            i = ok ? close + 1 : i;
+        }
+        ok = ok && i < line.size() && line[i] == ' ';
+        if (ok) {
+            char* valueEnd = nullptr;
+            strtod(line.c_str() + i + 1, &valueEnd);
+            ok = valueEnd != line.c_str() + i + 1 && *valueEnd == '\0';
+        }
+        if (!ok) {
+            *error = "line " + std::to_string(lineNumber) + ": " + line;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Output of every buffer size is a prefix of the page ending at a line
+// boundary, never shorter than with a smaller buffer
+bool checkWriter(const std::string& page) {
+    std::vector<char> buffer(page.size() + 1);
+    size_t previous = 0;
+    for (size_t size = 1; size <= page.size() + 1; size++) {
+        size_t length = renderPage(buffer.data(), size);
+        bool prefix = length < size && buffer[length] == '\0' &&
+                      memcmp(buffer.data(), page.data(), length) == 0 &&
+                      (length == 0 || page[length - 1] == '\n');
+        bool whole = size <= page.size() || length == page.size();
+        if (!prefix || !whole || length < previous) {
+            fprintf(stderr, "writer: buffer of %zu bytes gave %zu bytes\n", size, length);
+            return false;
+        }
+        previous = length;
+    }
+    return true;
+}
+
+// SERVER
+
+// MQTTOTA::_serveMetrics() state, polled from the loop
+struct Server {
+    int listener = -1;
+    char buffer[BUFFER_SIZE];
+    int client = -1;
+    uint64_t clientAt = 0;
+    size_t received = 0;
+    char* response = nullptr;
+    size_t responseLength = 0;
+    size_t sent = 0;
+    uint32_t timeoutMs = 2000;
+    uint32_t dropped = 0;
+    uint32_t served = 0;
+
+    void closeClient() {
+        if (client >= 0) {
+            close(client);
+            client = -1;
+        }
+    }
+
+    void poll() {
+        if (client < 0) {
+            int accepted = accept(listener, NULL, NULL);
+            if (accepted < 0) return;
+            fcntl(accepted, F_SETFL, fcntl(accepted, F_GETFL, 0) | O_NONBLOCK);
+            int small = 2048;
+            setsockopt(accepted, SOL_SOCKET, SO_SNDBUF, &small, sizeof(small));
+            client = accepted;
+            clientAt = nowMicros();
+            received = 0;
+            response = nullptr;
+        }
+
+        if (nowMicros() - clientAt > (uint64_t)timeoutMs * 1000) {
+            dropped++;
+            closeClient();
+            return;
+        }
+
+        if (!response) {
+            ssize_t got = recv(client, buffer + received, OTA_METRICS_REQUEST_SIZE - received, 0);
+            if (got == 0 || (got < 0 && errno != EWOULDBLOCK && errno != EAGAIN)) {
+                closeClient();
+                return;
+            }
+            if (got > 0) received += got;
+
+            OTAMetricsRequest request = otaMetricsRequest(buffer, received);
+            if (request == OTA_METRICS_INCOMPLETE) return;
+
+            char* page = buffer + OTA_METRICS_HEAD_ROOM;
+            size_t length = 0;
+            if (request == OTA_METRICS_PAGE) {
+                length = renderPage(page, BUFFER_SIZE - OTA_METRICS_HEAD_ROOM);
+            }
+
+            char head[OTA_METRICS_HEAD_ROOM];
+            size_t headLength = otaMetricsHead(request, length, head, sizeof(head));
+            response = page - headLength;
+            memcpy(response, head, headLength);
+            responseLength = headLength + length;
+            sent = 0;
+        }
+
+        ssize_t wrote = send(client, response + sent, responseLength - sent, MSG_NOSIGNAL);
+        if (wrote < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) return;
+        if (wrote <= 0) {
+            closeClient();
+            return;
+        }
+        sent += wrote;
+        if (sent == responseLength) {
+            served++;
+            closeClient();
+        }
+    }
+};
+
+// SCRAPERS
+
+struct Scrape {
+    std::string name;
+    std::string status;
+    std::string body;
+    long contentLength = -1;
+    bool completed = false;
+};
+
+int connectTo(uint16_t port, bool smallBuffer) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (smallBuffer) {
+        int small = 1024;
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &small, sizeof(small));
+    }
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(sock, (sockaddr*)&address, sizeof(address)) != 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+void scrape(uint16_t port, const std::string& request, bool slow, Scrape& result) {
+    int sock = connectTo(port, slow);
+    if (sock < 0) return;
+
+    if (slow) {
+        for (size_t i = 0; i < request.size(); i += 5) {
+            send(sock, request.data() + i, std::min<size_t>(5, request.size() - i), MSG_NOSIGNAL);
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    } else if (!request.empty()) {
+        send(sock, request.data(), request.size(), MSG_NOSIGNAL);
+    }
+
+    std::string response;
+    char piece[512];
+    for (;;) {
+        ssize_t got = recv(sock, piece, slow ? 200 : sizeof(piece), 0);
+        if (got <= 0) break;
+        response.append(piece, got);
+        if (slow) std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+    close(sock);
+
+    size_t headEnd = response.find("\r\n\r\n");
+    if (headEnd == std::string::npos) return;
+    result.status = response.substr(0, response.find("\r\n"));
+    size_t lengthAt = response.find("Content-Length: ");
+    if (lengthAt != std::string::npos && lengthAt < headEnd) {
+        result.contentLength = strtol(response.c_str() + lengthAt + 16, nullptr, 10);
+    }
+    result.body = response.substr(headEnd + 4);
+    result.completed = true;
+}
+
+int usage() {
+    fprintf(stderr, "usage: ota_metrics_scrape [--timeout ms]\n");
+    return 2;
+}
+
+}
+
+int main(int argc, char** argv) {
+    uint32_t timeoutMs = 500;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--timeout" && i + 1 < argc) {
+            timeoutMs = (uint32_t)strtoul(argv[++i], nullptr, 10);
+        } else {
+            return usage();
+        }
+    }
+
+    std::vector<char> rendered(BUFFER_SIZE - OTA_METRICS_HEAD_ROOM);
+    std::string page(rendered.data(), renderPage(rendered.data(), rendered.size()));
+    std::string error;
+    if (!parsesAsPrometheus(page, &error)) {
+        fprintf(stderr, "rendered page: %s\n", error.c_str());
+        return 1;
+    }
+    if (!checkWriter(page)) return 1;
+    printf("writer: %zu-byte page, line-aligned prefix at every buffer size\n", page.size());
+
+    static Server server;
+    server.timeoutMs = timeoutMs;
+    server.listener = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(server.listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addressLength = sizeof(address);
+    if (bind(server.listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(server.listener, 2) != 0 ||
+        getsockname(server.listener, (sockaddr*)&address, &addressLength) != 0) {
+        perror("listen");
+        return 1;
+    }
+    fcntl(server.listener, F_SETFL, fcntl(server.listener, F_GETFL, 0) | O_NONBLOCK);
+    uint16_t port = ntohs(address.sin_port);
+
+    const char* get = "GET /metrics HTTP/1.1\r\nHost: localhost\r\nAccept: text/plain\r\n\r\n";
+    Scrape scrapes[4];
+    scrapes[0].name = "fast";
+    scrapes[1].name = "slow";
+    scrapes[2].name = "silent";
+    scrapes[3].name = "other";
+
+    std::atomic<bool> done(false);
+    std::thread scrapers([&]() {
+        scrape(port, get, false, scrapes[0]);
+        scrape(port, get, true, scrapes[1]);
+        scrape(port, "", false, scrapes[2]);
+        scrape(port, "GET /other HTTP/1.1\r\n\r\n", false, scrapes[3]);
+        done = true;
+    });
+
+    // handle() stand-in
+    uint64_t longestPoll = 0;
+    uint64_t polls = 0;
+    while (!done) {
+        uint64_t start = nowMicros();
+        server.poll();
+        uint64_t spent = nowMicros() - start;
+        if (spent > longestPoll) longestPoll = spent;
+        polls++;
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    scrapers.join();
+    server.closeClient();
+    close(server.listener);
+
+    bool ok = true;
+    for (int i = 0; i < 4; i++) {
+        const Scrape& result = scrapes[i];
+        bool expectPage = i < 2;
+        bool pass;
+        if (i == 2) {
+            pass = !result.completed;
+        } else if (expectPage) {
+            pass = result.completed && result.status == "HTTP/1.0 200 OK" && result.body == page &&
+                   result.contentLength == (long)page.size() && parsesAsPrometheus(result.body, &error);
+        } else {
+            pass = result.completed && result.status == "HTTP/1.0 404 Not Found" && result.body.empty();
+        }
+        printf("%-7s %-24s %6zu bytes  %s\n", result.name.c_str(),
+               result.completed ? result.status.c_str() : "(no response)", result.body.size(),
+               pass ? "ok" : "FAIL");
+        ok = ok && pass;
+    }
+
+    ok = ok && server.dropped == 1 && server.served == 3;
+    printf("%llu polls, longest %llu us, %u scrapes served, %u dropped after %u ms\n",
+           (unsigned long long)polls, (unsigned long long)longestPoll, (unsigned)server.served,
+           (unsigned)server.dropped, (unsigned)timeoutMs);
+
+    // Rendering the page is the only work a poll does beyond one recv or send
+    if (longestPoll > 20000) {
+        printf("a poll took longer than 20 ms\n");
+        ok = false;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,123 @@
+// Host test of the metrics endpoint code shared with the device: request
+// classification (otaMetricsRequest), the response head (otaMetricsHead) and
+// the line-atomic OTAMetricsWriter that MQTTOTA::renderMetrics() uses.
+// Prints each failed check and exits 1 if any failed, 0 otherwise.
+//
+// Build:
+//   g++ -std=c++17 -O2 -I../.. ota_metrics_test.cpp ../../MQTTOTAProtocol.cpp -o ota_metrics_test
+//
+// Usage:
+//   ota_metrics_test
+
+#include "MQTTOTAProtocol.h"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(condition)                                                        \
+    do {                                                                        \
+        if (!(condition)) {                                                     \
+            fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, #condition); \
+            failures++;                                                         \
+        }                                                                       \
+    } while (0)
+
+OTAMetricsRequest classify(const std::string& request) {
+    return otaMetricsRequest(request.data(), request.size());
+}
+
+void testRequests() {
+    CHECK(classify("") == OTA_METRICS_INCOMPLETE);
+    CHECK(classify("GET /metrics HTTP/1.1\r\n") == OTA_METRICS_INCOMPLETE);
+    CHECK(classify("GET /metrics HTTP/1.1\r\nHost: x\r\n\r") == OTA_METRICS_INCOMPLETE);
+
+    CHECK(classify("GET /metrics HTTP/1.1\r\nHost: x\r\n\r\n") == OTA_METRICS_PAGE);
+    CHECK(classify("GET /metrics?name[]=up HTTP/1.1\r\n\r\n") == OTA_METRICS_PAGE);
+    CHECK(classify("GET / HTTP/1.0\r\n\r\n") == OTA_METRICS_PAGE);
+
+    CHECK(classify("GET /metricsx HTTP/1.1\r\n\r\n") == OTA_METRICS_NOT_FOUND);
+    CHECK(classify("GET /other HTTP/1.1\r\n\r\n") == OTA_METRICS_NOT_FOUND);
+    CHECK(classify("POST /metrics HTTP/1.1\r\n\r\n") == OTA_METRICS_NOT_FOUND);
+
+    // A request that fills the kept bytes is judged by its request line
+    std::string longRequest = "GET /metrics HTTP/1.1\r\nUser-Agent: ";
+    longRequest.append(OTA_METRICS_REQUEST_SIZE - longRequest.size(), 'a');
+    CHECK(classify(longRequest) == OTA_METRICS_PAGE);
+    std::string longOther = "GET /x HTTP/1.1\r\nUser-Agent: ";
+    longOther.append(OTA_METRICS_REQUEST_SIZE - longOther.size(), 'a');
+    CHECK(classify(longOther) == OTA_METRICS_NOT_FOUND);
+}
+
+void testHead() {
+    char head[OTA_METRICS_HEAD_ROOM];
+    size_t length = otaMetricsHead(OTA_METRICS_PAGE, 12345, head, sizeof(head));
+    std::string page(head, length);
+    CHECK(length > 0 && length < sizeof(head));
+    CHECK(page.compare(0, 17, "HTTP/1.0 200 OK\r\n") == 0);
+    CHECK(page.find("Content-Length: 12345\r\n") != std::string::npos);
+    CHECK(page.find("Content-Type: text/plain; version=0.0.4\r\n") != std::string::npos);
+    CHECK(page.size() >= 4 && page.compare(page.size() - 4, 4, "\r\n\r\n") == 0);
+
+    length = otaMetricsHead(OTA_METRICS_NOT_FOUND, 0, head, sizeof(head));
+    std::string missing(head, length);
+    CHECK(missing.compare(0, 24, "HTTP/1.0 404 Not Found\r\n") == 0);
+    CHECK(missing.find("Content-Length: 0\r\n") != std::string::npos);
+
+    // The largest head must fit the room the device leaves for it
+    CHECK(otaMetricsHead(OTA_METRICS_PAGE, 0xFFFFFFFFu, head, sizeof(head)) > 0);
+    CHECK(otaMetricsHead(OTA_METRICS_PAGE, 100, head, 10) == 0);
+}
+
+size_t render(char* buffer, size_t size) {
+    OTAMetricsWriter out = { buffer, size, 0, false };
+    buffer[0] = '\0';
+    out.line("# TYPE mqttota_sessions_total counter\n");
+    for (int i = 0; i < 20; i++) {
+        out.line("mqttota_sessions_total{result=\"r%d\"} %d\n", i, i * 7);
+    }
+    // Several lines in one call are kept or dropped together
+    out.line("# TYPE mqttota_heap_free_bytes gauge\nmqttota_heap_free_bytes %u\n", 123456u);
+    return out.length;
+}
+
+void testWriter() {
+    std::vector<char> whole(4096);
+    size_t pageLength = render(whole.data(), whole.size());
+    std::string page(whole.data(), pageLength);
+    CHECK(pageLength > 0 && page.back() == '\n');
+
+    size_t previous = 0;
+    for (size_t size = 1; size <= pageLength + 1; size++) {
+        std::vector<char> buffer(size);
+        size_t length = render(buffer.data(), size);
+        CHECK(length < size && buffer[length] == '\0');
+        CHECK(memcmp(buffer.data(), page.data(), length) == 0);
+        CHECK(length == 0 || page[length - 1] == '\n');
+        CHECK(length >= previous);
+        // The two-line call never leaves its first line alone
+        CHECK(std::string(buffer.data(), length).find("gauge\n") == std::string::npos || length == pageLength);
+        previous = length;
+    }
+    CHECK(previous == pageLength);
+}
+
+}
+
+int main() {
+    testRequests();
+    testHead();
+    testWriter();
+
+    if (failures > 0) {
+        fprintf(stderr, "ota_metrics_test: %d checks failed\n", failures);
+        return 1;
+    }
+    printf("ota_metrics_test: ok\n");
+    return 0;
+}
@@ -0,0 +1,294 @@
+#include "ota_mqtt.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace otamqtt {
+
+namespace {
+
+int64_t nowMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+}
+
+void appendU16(std::string& out, uint16_t value) {
+    out += (char)(value >> 8);
+    out += (char)(value & 0xFF);
+}
+
+void appendString(std::string& out, const std::string& value) {
+    appendU16(out, (uint16_t)value.size());
+    out += value;
+}
+
+void appendPacket(std::string& out, uint8_t type, uint8_t flags, const std::string& body) {
+    out += (char)((type << 4) | (flags & 0x0F));
+    size_t length = body.size();
+    do {
+        uint8_t digit = length % 128;
+        length /= 128;
+        if (length > 0) digit |= 0x80;
+        out += (char)digit;
+    } while (length > 0);
+    out += body;
+}
+
+int takePacket(std::string& buffer, Packet& packet) {
+    if (buffer.size() < 2) return 0;
+
+    size_t length = 0, multiplier = 1, position = 1;
+    for (;;) {
+        if (position >= buffer.size()) return 0;
+        uint8_t digit = (uint8_t)buffer[position++];
+        length += (digit & 0x7F) * multiplier;
+        if (!(digit & 0x80)) break;
+        multiplier *= 128;
+        if (position > 4) return -1;
+    }
+    if (buffer.size() < position + length) return 0;
+
+    packet.type = (uint8_t)buffer[0] >> 4;
+    packet.flags = (uint8_t)buffer[0] & 0x0F;
+    packet.body.assign(buffer, position, length);
+    buffer.erase(0, position + length);
+    return 1;
+}
+
+std::string publishBody(const std::string& topic, const void* payload, size_t length) {
+    std::string body;
+    body.reserve(topic.size() + 2 + length);
+    appendString(body, topic);
+    body.append((const char*)payload, length);
+    return body;
+}
+
+bool parsePublish(const Packet& packet, std::string& topic, std::string& payload, uint16_t* packetId) {
+    const std::string& body = packet.body;
+    if (body.size() < 2) return false;
+    size_t topicLength = ((uint8_t)body[0] << 8) | (uint8_t)body[1];
+    size_t position = 2 + topicLength;
+    if (body.size() < position) return false;
+    topic.assign(body, 2, topicLength);
+
+    uint8_t qos = (packet.flags >> 1) & 3;
+    *packetId = 0;
+    if (qos > 0) {
+        if (body.size() < position + 2) return false;
+        *packetId = (uint16_t)(((uint8_t)body[position] << 8) | (uint8_t)body[position + 1]);
+        position += 2;
+    }
+    payload.assign(body, position, std::string::npos);
+    return true;
+}
+
+bool topicMatches(const std::string& filter, const std::string& topic) {
+    size_t f = 0, t = 0;
+    while (f < filter.size()) {
+        size_t filterEnd = filter.find('/', f);
+        if (filterEnd == std::string::npos) filterEnd = filter.size();
+        std::string level = filter.substr(f, filterEnd - f);
+        if (level == "#") return true;
+        if (t > topic.size()) return false;
+
+        size_t topicEnd = topic.find('/', t);
+        if (topicEnd == std::string::npos) topicEnd = topic.size();
+        if (level != "+" && level != topic.substr(t, topicEnd - t)) return false;
+
+        f = filterEnd + 1;
+        t = topicEnd + 1;
+    }
+    return t > topic.size();
+}
+
+bool parseAddress(const std::string& address, std::string& host, uint16_t& port) {
+    size_t colon = address.rfind(':');
+    host = address.substr(0, colon);
+    port = 1883;
+    if (colon != std::string::npos) {
+        int value = atoi(address.c_str() + colon + 1);
+        if (value <= 0 || value > 65535) return false;
+        port = (uint16_t)value;
+    }
+    return !host.empty();
+}
+
+// CLIENT
+
+Client::~Client() {
+    disconnect();
+}
+
+bool Client::connect(const std::string& host, uint16_t port, const std::string& clientId, uint16_t keepAlive) {
+    disconnect();
+    _buffer.clear();
+    _keepAlive = keepAlive;
+
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* result = nullptr;
+    std::string service = std::to_string(port);
+    if (getaddrinfo(host.c_str(), service.c_str(), &hints, &result) != 0) {
+        return _fail("cannot resolve " + host);
+    }
+    for (addrinfo* ai = result; ai && _fd < 0; ai = ai->ai_next) {
+        _fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (_fd >= 0 && ::connect(_fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+            close(_fd);
+            _fd = -1;
+        }
+    }
+    freeaddrinfo(result);
+    if (_fd < 0) return _fail("cannot connect to " + host + ":" + service);
+
+    int one = 1;
+    setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    std::string body;
+    appendString(body, "MQTT");
+    body += (char)4;               // Protocol level 3.1.1
+    body += (char)0x02;            // Clean session
+    appendU16(body, keepAlive);
+    appendString(body, clientId);
+
+    std::string packet;
+    appendPacket(packet, MQTT_CONNECT, 0, body);
+    if (!_send(packet)) return false;
+
+    // CONNACK is the first packet the broker sends
+    Packet reply;
+    int64_t deadline = nowMs() + 5000;
+    while (takePacket(_buffer, reply) == 0) {
+        int64_t left = deadline - nowMs();
+        if (left <= 0 || !_readAvailable((int)left)) return _fail("no CONNACK");
+    }
+    if (reply.type != MQTT_CONNACK || reply.body.size() < 2 || reply.body[1] != 0) {
+        return _fail("connection refused");
+    }
+    return true;
+}
+
+void Client::disconnect() {
+    if (_fd < 0) return;
+    std::string packet;
+    appendPacket(packet, MQTT_DISCONNECT, 0, std::string());
+    _send(packet);
+    close(_fd);
+    _fd = -1;
+}
+
+bool Client::subscribe(const std::string& filter) {
+    std::string body;
+    appendU16(body, _nextPacketId++);
+    appendString(body, filter);
+    body += (char)0;               // QoS 0
+
+    std::string packet;
+    appendPacket(packet, MQTT_SUBSCRIBE, 0x02, body);
+    return _send(packet);
+}
+
+bool Client::publish(const std::string& topic, const void* payload, size_t length) {
+    std::string packet;
+    appendPacket(packet, MQTT_PUBLISH, 0, publishBody(topic, payload, length));
+    return _send(packet);
+}
+
+bool Client::publish(const std::string& topic, const std::string& payload) {
+    return publish(topic, payload.data(), payload.size());
+}
+
+bool Client::poll(int timeoutMs) {
+    if (_fd < 0) return false;
+
+    if (_keepAlive && nowMs() - _lastSendMs > _keepAlive * 500) {
+        std::string ping;
+        appendPacket(ping, MQTT_PINGREQ, 0, std::string());
+        if (!_send(ping)) return false;
+    }
+
+    if (!_readAvailable(timeoutMs)) return false;
+
+    Packet packet;
+    int status;
+    while ((status = takePacket(_buffer, packet)) == 1) {
+        if (!_dispatch(packet)) return false;
+    }
+    return status == 0 || _fail("malformed packet");
+}
+
+bool Client::_dispatch(const Packet& packet) {
+    if (packet.type != MQTT_PUBLISH) return true;  // SUBACK, PINGRESP
+
+    std::string topic, payload;
+    uint16_t packetId;
+    if (!parsePublish(packet, topic, payload, &packetId)) return _fail("malformed PUBLISH");
+
+    if (packetId) {
+        std::string ack, body;
+        appendU16(body, packetId);
+        appendPacket(ack, MQTT_PUBACK, 0, body);
+        if (!_send(ack)) return false;
+    }
+    if (_handler) _handler(topic, payload);
+    return true;
+}
+
+bool Client::_readAvailable(int timeoutMs) {
+    pollfd pfd = { _fd, POLLIN, 0 };
+    int ready = ::poll(&pfd, 1, timeoutMs);
+    if (ready < 0) return errno == EINTR || _fail("poll failed");
+    if (ready == 0) return true;
+
+    char chunk[65536];
+    for (;;) {
+        ssize_t received = recv(_fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+        if (received > 0) {
+            _buffer.append(chunk, received);
+            _bytesIn += received;
+            if ((size_t)received < sizeof(chunk)) return true;
+            continue;
+        }
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+        if (received < 0 && errno == EINTR) continue;
+        return _fail("connection closed");
+    }
+}
+
+bool Client::_send(const std::string& data) {
+    if (_fd < 0) return false;
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(_fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return _fail("send failed");
+        sent += n;
+    }
+    _bytesOut += data.size();
+    _lastSendMs = nowMs();
+    return true;
+}
+
+bool Client::_fail(const std::string& error) {
+    _lastError = error;
+    if (_fd >= 0) {
+        close(_fd);
+        _fd = -1;
+    }
+    return false;
+}
+
+}
@@ -0,0 +1,111 @@
+// Minimal MQTT 3.1.1 for the host tools: a QoS 0 client over a POSIX socket
+// and the packet codec shared with the broker stand-in (ota_broker_stub.cpp).
+//
+// Only what the OTA tools need is implemented: CONNECT, SUBSCRIBE, PUBLISH
+// (QoS 0 out; QoS 1 in is acknowledged), PINGREQ and DISCONNECT. No TLS, no
+// session state; use a real broker bridge for anything beyond a site network.
+
+#ifndef OTA_MQTT_H
+#define OTA_MQTT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+namespace otamqtt {
+
+enum PacketType {
+    MQTT_CONNECT = 1,
+    MQTT_CONNACK = 2,
+    MQTT_PUBLISH = 3,
+    MQTT_PUBACK = 4,
+    MQTT_SUBSCRIBE = 8,
+    MQTT_SUBACK = 9,
+    MQTT_UNSUBSCRIBE = 10,
+    MQTT_UNSUBACK = 11,
+    MQTT_PINGREQ = 12,
+    MQTT_PINGRESP = 13,
+    MQTT_DISCONNECT = 14
+};
+
+struct Packet {
+    uint8_t type = 0;
+    uint8_t flags = 0;             // Low nibble of the fixed header
+    std::string body;              // Variable header and payload
+};
+
+// Appends a complete packet (fixed header, remaining length, body) to out
+void appendPacket(std::string& out, uint8_t type, uint8_t flags, const std::string& body);
+void appendString(std::string& out, const std::string& value);
+void appendU16(std::string& out, uint16_t value);
+
+/**
+ * @brief Takes one packet off the front of buffer
+ * @return 1 if a packet was extracted, 0 if more bytes are needed, -1 if the
+ *         stream is malformed
+ */
+int takePacket(std::string& buffer, Packet& packet);
+
+// PUBLISH body helpers
+std::string publishBody(const std::string& topic, const void* payload, size_t length);
+bool parsePublish(const Packet& packet, std::string& topic, std::string& payload, uint16_t* packetId);
+
+// Topic filter matching with "+" and "#"
+bool topicMatches(const std::string& filter, const std::string& topic);
+
+// Splits "host:port"; port defaults to 1883
+bool parseAddress(const std::string& address, std::string& host, uint16_t& port);
+
+class Client {
+public:
+    typedef std::function<void(const std::string& topic, const std::string& payload)> MessageHandler;
+
+    ~Client();
+
+    /**
+     * @brief Connects and waits for CONNACK
+     * @param keepAlive Seconds; poll() sends PINGREQ when the link is idle
+     */
+    bool connect(const std::string& host, uint16_t port, const std::string& clientId, uint16_t keepAlive = 30);
+    void disconnect();
+    bool connected() const { return _fd >= 0; }
+
+    bool subscribe(const std::string& filter);
+    bool publish(const std::string& topic, const void* payload, size_t length);
+    bool publish(const std::string& topic, const std::string& payload);
+
+    void onMessage(MessageHandler handler) { _handler = handler; }
+
+    /**
+     * @brief Reads what arrived and dispatches messages
+     * @param timeoutMs Time to wait for data, 0 to return at once
+     * @return false once the connection is lost
+     */
+    bool poll(int timeoutMs);
+
+    int fd() const { return _fd; }
+    uint64_t bytesIn() const { return _bytesIn; }        // Wire bytes, headers included
+    uint64_t bytesOut() const { return _bytesOut; }
+    const std::string& lastError() const { return _lastError; }
+
+private:
+    bool _send(const std::string& data);
+    bool _fail(const std::string& error);
+    bool _readAvailable(int timeoutMs);
+    bool _dispatch(const Packet& packet);
+
+    int _fd = -1;
+    uint16_t _keepAlive = 0;
+    uint16_t _nextPacketId = 1;
+    int64_t _lastSendMs = 0;
+    std::string _buffer;
+    MessageHandler _handler;
+    uint64_t _bytesIn = 0;
+    uint64_t _bytesOut = 0;
+    std::string _lastError;
+};
+
+}
+
+#endif // OTA_MQTT_H
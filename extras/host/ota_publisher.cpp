@@ -0,0 +1,591 @@
+#include "ota_publisher.h"
+#include "ota_stream.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+namespace otapublisher {
+
+namespace {
+
+enum EventType {
+    EVENT_RECEIPT = 1,
+    EVENT_PROGRESS = 2,
+    EVENT_ERROR = 3,
+    EVENT_SUCCESS = 4,
+    EVENT_REQUEST = 5,
+    EVENT_GAPS = 6,
+    EVENT_ADMISSION = 7
+};
+
+int64_t clampRto(double value, const StreamConfig& config) {
+    return std::min(std::max((int64_t)value, config.minRtoUs), config.maxRtoUs);
+}
+
+std::string jsonEscape(const std::string& text) {
+    std::string out;
+    for (char c : text) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out;
+}
+
+}
+
+// RATE CONTROLLER
+
+RateController::RateController(const StreamConfig& config)
+    : _config(config),
+      _window(config.initialWindow),
+      _ssthresh(config.maxWindow),
+      _chunkSize(config.initialChunk),
+      _rtoUs(clampRto(1000000, config)) {}
+
+void RateController::onAck(uint32_t chunks, size_t bytes, int64_t rttSampleUs, int64_t nowUs) {
+    _ackedBytes += bytes;
+
+    if (rttSampleUs > 0) {
+        double sample = (double)rttSampleUs;
+        if (_srttUs == 0) {
+            _srttUs = sample;
+            _rttvarUs = sample / 2;
+        } else {
+            _rttvarUs = 0.75 * _rttvarUs + 0.25 * std::fabs(_srttUs - sample);
+            _srttUs = 0.875 * _srttUs + 0.125 * sample;
+        }
+        _minRttUs = _minRttUs == 0 ? sample : std::min(_minRttUs, sample);
+        _rtoUs = clampRto(_srttUs + std::max(4 * _rttvarUs, 10000.0), _config);
+    }
+
+    // Slow start, then one chunk per window's worth of acks
+    if (_window < _ssthresh) {
+        _window += chunks;
+    } else {
+        _window += chunks / _window;
+    }
+
+    // Delivery rate, measured over at least one round trip
+    if (_roundStartUs < 0) {
+        _roundStartUs = nowUs;
+        _roundStartBytes = _ackedBytes - bytes;
+    } else if (nowUs - _roundStartUs >= std::max(_srttUs, 50000.0)) {
+        double sample = (_ackedBytes - _roundStartBytes) * 1e6 / (nowUs - _roundStartUs);
+        _deliveryRate = _deliveryRate == 0 ? sample : 0.75 * _deliveryRate + 0.25 * sample;
+        _roundStartUs = nowUs;
+        _roundStartBytes = _ackedBytes;
+        _updateChunkSize();
+    }
+
+    // More than twice the bandwidth-delay product only queues at the broker
+    if (_deliveryRate > 0 && _minRttUs > 0) {
+        double bdpChunks = _deliveryRate * (_minRttUs / 1e6) / _chunkSize;
+        _window = std::min(_window, std::max(2.0, 2 * bdpChunks));
+    }
+    _window = std::min(_window, _config.maxWindow);
+}
+
+void RateController::onLoss(int64_t nowUs) {
+    // One reduction per round trip, however many signals the loss produced
+    if (_lastReductionUs >= 0 && nowUs - _lastReductionUs < std::max(_srttUs, 100000.0)) return;
+    _ssthresh = std::max(_window / 2, 1.0);
+    _window = _ssthresh;
+    _lastReductionUs = nowUs;
+}
+
+void RateController::onTimeout(int64_t nowUs) {
+    _ssthresh = std::max(_window / 2, 1.0);
+    _window = 1;
+    _rtoUs = std::min(_rtoUs * 2, _config.maxRtoUs);
+    _lastReductionUs = nowUs;
+}
+
+void RateController::_updateChunkSize() {
+    double target = _deliveryRate * _config.targetChunkSeconds;
+    size_t size = (size_t)std::min(std::max(target, (double)_config.minChunk), (double)_config.maxChunk);
+    _chunkSize = std::max(size / 1024 * 1024, _config.minChunk);
+}
+
+// DEVICE STREAM
+
+DeviceStream::DeviceStream(const std::string& device, const std::string& topic, std::shared_ptr<const Image> image,
+                           const StreamConfig& config, int64_t nowUs)
+    : _device(device), _topic(topic), _image(image), _config(config), _controller(_config), _lastAckUs(nowUs) {
+    _report.device = device;
+    _report.startUs = nowUs;
+}
+
+void DeviceStream::service(int64_t nowUs, const SendFunc& send) {
+    if (_report.state != STREAM_ACTIVE) return;
+
+    const size_t imageSize = _image->data.size();
+    bool adaptive = _config.mode == CONTROL_ADAPTIVE;
+    int inFlight = 0;
+    size_t inFlightBytes = 0;
+    for (int i = _acked; i < _next - 1; i++) {
+        if (_segments[i].held || _segments[i].lost) continue;
+        inFlight++;
+        inFlightBytes += _segments[i].size;
+    }
+
+    // Nothing acknowledged for a while: the device lost a chunk and everything after it
+    int64_t timeout = adaptive ? _controller.rtoUs() : _config.maxRtoUs;
+    if (inFlight > 0 && nowUs - _lastAckUs > timeout) {
+        _report.timeouts++;
+        if (++_consecutiveTimeouts > _config.maxTimeouts) {
+            _finish(STREAM_FAILED, nowUs);
+            return;
+        }
+        _controller.onTimeout(nowUs);
+        if (_config.gapReports) {
+            for (int i = _acked; i < _next - 1; i++) {
+                if (!_segments[i].held) _markLost(_segments[i]);
+            }
+            _lastAckUs = nowUs;
+        } else {
+            _goBack(_acked + 1, nowUs);
+        }
+        inFlight = 0;
+        inFlightBytes = 0;
+    }
+
+    for (;;) {
+        // Parts reported lost go before new ones
+        size_t cutEnd = _segments.empty() ? 0 : _segments.back().offset + _segments.back().size;
+        int part = _firstLost();
+        if (part == 0 && _next > (int)_segments.size() && cutEnd >= imageSize) break;   // Everything sent
+        if (part == 0) part = _next;
+
+        size_t chunkSize = adaptive ? _controller.chunkSize() : _config.initialChunk;
+        if (adaptive) {
+            if (inFlight >= std::max(1, (int)_controller.window())) break;
+            if (inFlight > 0 && inFlightBytes + chunkSize > _config.maxInFlightBytes) break;
+        } else if (_lastSendUs && nowUs - _lastSendUs < _config.fixedIntervalUs) {
+            break;
+        }
+
+        // Parts keep their bytes once cut; a new chunk size only applies to new parts
+        if (part > (int)_segments.size()) {
+            size_t size = std::min(std::max(chunkSize, (size_t)OTA_IMAGE_MIN_HEADER), imageSize - cutEnd);
+            _segments.push_back({ cutEnd, size, 0, 0, 0, false, false });
+            cutEnd += size;
+        }
+
+        Segment& segment = _segments[part - 1];
+        if (segment.transmissions > 0) _report.bytesRetransmitted += segment.size;
+        if (segment.lost) _lostCount--;
+        segment.lost = false;
+        segment.sequence = ++_sequence;
+        segment.sentUs = nowUs;
+        segment.transmissions = (uint8_t)std::min(segment.transmissions + 1, 255);
+
+        size_t remaining = imageSize - cutEnd;
+        int totalParts = (int)_segments.size() + (int)((remaining + chunkSize - 1) / chunkSize);
+        send(_topic, _message(part, segment, totalParts, nowUs));
+
+        _report.bytesSent += segment.size;
+        _report.chunksSent++;
+        _lastSendUs = nowUs;
+        if (part == _next) _next++;
+        inFlight++;
+        inFlightBytes += segment.size;
+    }
+}
+
+void DeviceStream::onReceipt(uint32_t part, uint32_t sequence, int64_t nowUs) {
+    if (_report.state != STREAM_ACTIVE || (int)part <= _acked || part > _segments.size()) return;
+
+    // Karn: only first transmissions give an unambiguous round trip
+    const Segment& segment = _segments[part - 1];
+    int64_t rtt = segment.sequence == sequence && segment.transmissions == 1 ? nowUs - segment.sentUs : 0;
+    _acknowledge((int)part, nowUs, rtt);
+}
+
+void DeviceStream::onProgress(int progress, int64_t nowUs) {
+    if (_report.state != STREAM_ACTIVE || _segments.empty()) return;
+
+    // Progress is floor(part * 100 / TotalParts); without receipts it is the only ack
+    size_t cutEnd = _segments.back().offset + _segments.back().size;
+    size_t chunkSize = std::max(_segments.back().size, (size_t)1);
+    int totalParts = (int)_segments.size() + (int)((_image->data.size() - cutEnd + chunkSize - 1) / chunkSize);
+    int part = std::min((int)_segments.size(), progress * totalParts / 100);
+    if (part > _acked) _acknowledge(part, nowUs, 0);
+}
+
+void DeviceStream::onRequest(int from, int64_t nowUs) {
+    if (_report.state != STREAM_ACTIVE) return;
+    if (from - 1 > _acked && from - 1 <= (int)_segments.size()) _acknowledge(from - 1, nowUs, 0);
+
+    // The same request again before the go-back had time to arrive
+    if (from == _goBackPart && nowUs - _goBackUs < std::max((int64_t)_controller.srttUs(), _controller.rtoUs())) {
+        return;
+    }
+    _report.lossEvents++;
+    _controller.onLoss(nowUs);
+    _goBack(from, nowUs);
+}
+
+void DeviceStream::onGapReport(const OTAGapReport& report, int64_t nowUs) {
+    if (_report.state != STREAM_ACTIVE) return;
+
+    // next 1 and nothing received: the device has no session (joined late or aborted)
+    if (report.next == 1 && report.highest == 0) {
+        if (_acked == 0 && !_segments.empty() && _segments[0].sequence < report.sequence) {
+            _markLost(_segments[0]);
+        }
+        return;
+    }
+
+    int next = std::min((int)report.next, _next);
+    int64_t rtt = 0;
+    for (int i = _acked; i < _next - 1 && rtt == 0; i++) {
+        const Segment& segment = _segments[i];
+        if (segment.sequence == report.sequence && segment.transmissions == 1) rtt = nowUs - segment.sentUs;
+    }
+    if (next - 1 > _acked) _acknowledge(next - 1, nowUs, rtt);
+    if (_report.state != STREAM_ACTIVE) return;
+
+    // The chunks reach the device in the order they were sent, so a part sent
+    // before the last one it saw, and neither written nor held, was lost
+    bool loss = false;
+    for (int part = _acked + 1; part < _next; part++) {
+        Segment& segment = _segments[part - 1];
+        bool held = otaGapReportHas(report, part);
+        if (held && !segment.held) _lastAckUs = nowUs;
+        segment.held = held;
+        if (!held && !segment.lost && segment.sequence < report.sequence) {
+            _markLost(segment);
+            loss = true;
+        }
+    }
+    if (loss) {
+        _report.lossEvents++;
+        _controller.onLoss(nowUs);
+    }
+}
+
+void DeviceStream::onAdmission(uint32_t retryMs, bool resend, int64_t nowUs) {
+    if (_report.state != STREAM_ACTIVE) return;
+
+    // Refused: the device ignores the image until retryMs has passed
+    if (retryMs > 0) {
+        _report.retryUs = nowUs + (int64_t)retryMs * 1000;
+        _finish(STREAM_DEFERRED, nowUs);
+        return;
+    }
+
+    // Part 1 went to the link probe, and every part sent since was dropped
+    if (resend && _acked == 0 && !_segments.empty()) {
+        if (_config.gapReports) {
+            _markLost(_segments[0]);
+        } else {
+            _goBack(1, nowUs);
+        }
+    }
+}
+
+void DeviceStream::onError(uint16_t code, int64_t nowUs) {
+    if (_report.state != STREAM_ACTIVE || code == OTA_ERR_NONE || code == OTA_ERR_SERVER) return;
+
+    // Every other error aborts the session on the device: start over from part 1
+    if (++_report.restarts > (uint32_t)_config.maxRestarts) {
+        _finish(STREAM_FAILED, nowUs);
+        return;
+    }
+    _report.lossEvents++;
+    _controller.onLoss(nowUs);
+    _acked = 0;
+    for (Segment& segment : _segments) segment.held = segment.lost = false;
+    _lostCount = 0;
+    _goBack(1, nowUs);
+}
+
+void DeviceStream::onSuccess(int64_t nowUs) {
+    if (_report.state == STREAM_ACTIVE) _finish(STREAM_DONE, nowUs);
+}
+
+StreamReport DeviceStream::report() const {
+    StreamReport report = _report;
+    report.window = _controller.window();
+    report.chunkSize = _controller.chunkSize();
+    report.srttMs = _controller.srttUs() / 1000.0;
+    report.deliveryRate = _controller.deliveryRate();
+    return report;
+}
+
+void DeviceStream::_goBack(int part, int64_t nowUs) {
+    _next = std::max(part, _acked + 1);
+    _goBackPart = part;
+    _goBackUs = nowUs;
+    _lastAckUs = nowUs;
+}
+
+void DeviceStream::_markLost(Segment& segment) {
+    if (segment.lost) return;
+    segment.lost = true;
+    _lostCount++;
+}
+
+int DeviceStream::_firstLost() const {
+    if (_lostCount == 0) return 0;
+    for (int i = _acked; i < _next - 1; i++) {
+        if (_segments[i].lost) return i + 1;
+    }
+    return 0;
+}
+
+void DeviceStream::_acknowledge(int part, int64_t nowUs, int64_t rttSampleUs) {
+    size_t bytes = 0;
+    for (int i = _acked; i < part; i++) {
+        bytes += _segments[i].size;
+        if (_segments[i].lost) _lostCount--;
+        _segments[i].held = _segments[i].lost = false;
+    }
+    uint32_t chunks = part - _acked;
+
+    _acked = part;
+    if (_next <= _acked) _next = _acked + 1;
+    _lastAckUs = nowUs;
+    _consecutiveTimeouts = 0;
+    _controller.onAck(chunks, bytes, rttSampleUs, nowUs);
+
+    const Segment& last = _segments[_acked - 1];
+    if (last.offset + last.size >= _image->data.size()) _finish(STREAM_DONE, nowUs);
+}
+
+void DeviceStream::_finish(StreamState state, int64_t nowUs) {
+    _report.state = state;
+    _report.endUs = nowUs;
+}
+
+std::string DeviceStream::_message(int part, const Segment& segment, int totalParts, int64_t nowUs) const {
+    std::string message;
+    message.reserve(segment.size * 4 / 3 + 256);
+    message += "{\"EventType\":\"UpdateFirmwareDevice\",\"Details\":{\"FirmwareVersion\":\"";
+    message += jsonEscape(_image->version);
+    if (_config.z85) {
+        // The Z85 alphabet has no '"' or '\\', so the text goes in unescaped
+        if (part == 1) message += "\",\"Encoding\":\"" OTA_ENCODING_Z85;
+        message += "\",\"Z85Part\":\"";
+        message += otastream::encodeZ85(_image->data.data() + segment.offset, segment.size);
+    } else {
+        message += "\",\"Base64Part\":\"";
+        message += otastream::encodeBase64(_image->data.data() + segment.offset, segment.size);
+    }
+    message += "\",\"PartIndex\":";
+    message += std::to_string(part);
+    message += ",\"TotalParts\":";
+    message += std::to_string(totalParts);
+    // SentAt must not be 0 or the device sends no receipt; gap reports need none
+    if (!_config.gapReports) {
+        message += ",\"SentAt\":";
+        message += std::to_string(std::max<int64_t>(nowUs / 1000, 1));
+    }
+    message += ",\"Seq\":";
+    message += std::to_string(segment.sequence);
+    message += ",\"Device\":\"";
+    message += jsonEscape(_device);
+    message += "\"}}";
+    return message;
+}
+
+// WORKER POOL
+
+WorkerPool::WorkerPool(unsigned workers) {
+    for (unsigned i = 1; i < std::max(workers, 1u); i++) _threads.emplace_back([this] { _run(); });
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _stop = true;
+    }
+    _wake.notify_all();
+    for (std::thread& thread : _threads) thread.join();
+}
+
+void WorkerPool::parallelFor(size_t count, const std::function<void(size_t)>& fn) {
+    if (_threads.empty()) {
+        for (size_t i = 0; i < count; i++) fn(i);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _fn = &fn;
+        _count = count;
+        _nextIndex = 0;
+        _finished = 0;
+        _generation++;
+    }
+    _wake.notify_all();
+    _drain();
+
+    std::unique_lock<std::mutex> guard(_lock);
+    _done.wait(guard, [&] { return _finished == _count; });
+}
+
+void WorkerPool::_run() {
+    uint64_t seen = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> guard(_lock);
+            _wake.wait(guard, [&] { return _stop || _generation != seen; });
+            if (_stop) return;
+            seen = _generation;
+        }
+        _drain();
+    }
+}
+
+// Indices are handed out under the lock; the work itself runs outside it
+void WorkerPool::_drain() {
+    for (;;) {
+        size_t index;
+        const std::function<void(size_t)>* fn;
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            if (_nextIndex >= _count) return;
+            index = _nextIndex++;
+            fn = _fn;
+        }
+        (*fn)(index);
+
+        std::lock_guard<std::mutex> guard(_lock);
+        if (++_finished == _count) _done.notify_all();
+    }
+}
+
+// PUBLISHER
+
+Publisher::Publisher(SendFunc send, unsigned workers, size_t shards) : _send(send), _pool(workers) {
+    for (size_t i = 0; i < std::max(shards, (size_t)1); i++) _shards.emplace_back(new Shard());
+}
+
+Publisher::Shard& Publisher::_shardFor(const std::string& device) {
+    return *_shards[otaHash32(device.c_str()) % _shards.size()];
+}
+
+bool Publisher::startStream(const std::string& device, std::shared_ptr<const Image> image,
+                            const StreamConfig& config, int64_t nowUs) {
+    if (device.empty() || !image || image->data.size() < OTA_IMAGE_MIN_HEADER) return false;
+
+    std::string topic = _topicTemplate;
+    size_t placeholder = topic.find("{device}");
+    if (placeholder != std::string::npos) topic.replace(placeholder, 8, device);
+
+    Shard& shard = _shardFor(device);
+    std::unique_ptr<DeviceStream>& stream = shard.streams[device];
+    if (stream && stream->state() == STREAM_ACTIVE) return false;
+    stream.reset(new DeviceStream(device, topic, image, config, nowUs));
+    shard.activeStreams.push_back(stream.get());
+    _active++;
+
+    std::lock_guard<std::mutex> guard(_hashLock);
+    _deviceByHash[otaHash32(device.c_str())] = device;
+    return true;
+}
+
+void Publisher::deliver(const std::string& topic, const std::string& payload, int64_t nowUs) {
+    Event event = { 0, std::string(), 0, 0, nowUs, OTAGapReport() };
+
+    if (topic == OTA_TOPIC_BIN_GAPS) {
+        OTAGapReport report;
+        if (!otaGapReportDecode((const uint8_t*)payload.data(), payload.size(), report)) return;
+        std::lock_guard<std::mutex> guard(_hashLock);
+        auto it = _deviceByHash.find(report.deviceHash);
+        if (it == _deviceByHash.end()) return;
+        event = { EVENT_GAPS, it->second, report.next, report.sequence, nowUs, report };
+    } else if (topic == OTA_TOPIC_BIN_RECEIPT) {
+        OTAChunkReceipt receipt;
+        if (!otaReceiptDecode((const uint8_t*)payload.data(), payload.size(), receipt)) return;
+        std::lock_guard<std::mutex> guard(_hashLock);
+        auto it = _deviceByHash.find(receipt.deviceHash);
+        if (it == _deviceByHash.end()) return;
+        event = { EVENT_RECEIPT, it->second, receipt.part, receipt.sequence, nowUs, OTAGapReport() };
+    } else if (topic == OTA_TOPIC_BIN_ADMISSION) {
+        OTAAdmission admission;
+        if (!otaAdmissionDecode((const uint8_t*)payload.data(), payload.size(), admission)) return;
+        std::lock_guard<std::mutex> guard(_hashLock);
+        auto it = _deviceByHash.find(admission.deviceHash);
+        if (it == _deviceByHash.end()) return;
+        event = { EVENT_ADMISSION, it->second, (int)admission.retryMs, 0, nowUs, OTAGapReport() };
+        event.resend = (admission.flags & OTA_ADMISSION_RESEND) != 0;
+    } else {
+        if (topic == OTA_TOPIC_RECEIPT) event.type = EVENT_RECEIPT;
+        else if (topic == "ota/progress") event.type = EVENT_PROGRESS;
+        else if (topic == "ota/error") event.type = EVENT_ERROR;
+        else if (topic == "ota/success") event.type = EVENT_SUCCESS;
+        else if (topic == OTA_TOPIC_REQUEST) event.type = EVENT_REQUEST;
+        else if (topic == OTA_TOPIC_ADMISSION) event.type = EVENT_ADMISSION;
+        else return;
+
+        const char* valueKey = event.type == EVENT_RECEIPT ? "p" : event.type == EVENT_PROGRESS ? "progress"
+                             : event.type == EVENT_ERROR ? "code" : event.type == EVENT_ADMISSION ? "retryMs"
+                             : "from";
+        const char* deviceKey = event.type == EVENT_RECEIPT ? "d" : "device";
+        otastream::scanMessage(payload.data(), payload.data() + payload.size(),
+                               [&](const char* key, size_t length, const otastream::Value& value) {
+            if (otastream::keyIs(key, length, deviceKey)) {
+                event.device.assign(value.data, value.length);
+            } else if (otastream::keyIs(key, length, valueKey)) {
+                event.value = atoi(std::string(value.data, value.length).c_str());
+            } else if (event.type == EVENT_RECEIPT && otastream::keyIs(key, length, "q")) {
+                event.sequence = (uint32_t)strtoul(std::string(value.data, value.length).c_str(), nullptr, 10);
+            } else if (event.type == EVENT_ADMISSION && otastream::keyIs(key, length, "resend")) {
+                event.resend = value.length == 4 && !memcmp(value.data, "true", 4);
+            }
+        });
+        if (event.device.empty()) return;
+    }
+
+    Shard& shard = _shardFor(event.device);
+    std::lock_guard<std::mutex> guard(shard.inboxLock);
+    shard.inbox.push_back(std::move(event));
+}
+
+void Publisher::step(int64_t nowUs) {
+    _pool.parallelFor(_shards.size(), [&](size_t index) {
+        Shard& shard = *_shards[index];
+
+        std::vector<Event> events;
+        {
+            std::lock_guard<std::mutex> guard(shard.inboxLock);
+            events.swap(shard.inbox);
+        }
+        for (const Event& event : events) {
+            auto it = shard.streams.find(event.device);
+            if (it == shard.streams.end()) continue;
+            DeviceStream& stream = *it->second;
+            switch (event.type) {
+                case EVENT_RECEIPT: stream.onReceipt(event.value, event.sequence, event.atUs); break;
+                case EVENT_PROGRESS: stream.onProgress(event.value, event.atUs); break;
+                case EVENT_ERROR: stream.onError((uint16_t)event.value, event.atUs); break;
+                case EVENT_SUCCESS: stream.onSuccess(event.atUs); break;
+                case EVENT_REQUEST: stream.onRequest(event.value, event.atUs); break;
+                case EVENT_GAPS: stream.onGapReport(event.gaps, event.atUs); break;
+                case EVENT_ADMISSION: stream.onAdmission((uint32_t)event.value, event.resend, event.atUs); break;
+            }
+        }
+
+        for (DeviceStream* stream : shard.activeStreams) stream->service(nowUs, _send);
+        shard.activeStreams.erase(std::remove_if(shard.activeStreams.begin(), shard.activeStreams.end(),
+                                                 [](DeviceStream* stream) { return stream->state() != STREAM_ACTIVE; }),
+                                  shard.activeStreams.end());
+    });
+
+    size_t active = 0;
+    for (const auto& shard : _shards) active += shard->activeStreams.size();
+    _active = active;
+}
+
+std::vector<StreamReport> Publisher::reports() const {
+    std::vector<StreamReport> reports;
+    for (const auto& shard : _shards) {
+        for (const auto& entry : shard->streams) reports.push_back(entry.second->report());
+    }
+    return reports;
+}
+
+}
@@ -0,0 +1,290 @@
+// Host publisher for the UpdateFirmwareDevice chunk protocol with a
+// per-device sending-rate controller.
+//
+// Each device gets its own stream on its own topic ("ota/{device}" by default,
+// see setMQTTConfig()'s otaTopic). Chunks carry "SentAt"/"Seq" so the device
+// answers every written chunk with a receipt (ota/receipt); receipts are the
+// acks that clock the stream:
+//
+//   window   AIMD on the number of unacknowledged chunks: slow start, +1 chunk
+//            per round trip, halved on loss, reset to 1 on timeout, and capped
+//            at twice the measured bandwidth-delay product and maxInFlightBytes
+//            so a slow device's broker queue does not fill up
+//   chunk    sized so one chunk takes about targetChunkSeconds at the measured
+//            delivery rate, between minChunk and maxChunk
+//   loss     part requests (ota/request, enablePartRequests() on the device),
+//            sequence errors and retransmission timeouts; the stream goes
+//            back to the first part the device has not written
+//
+// With gapReports the chunks carry no "SentAt" and the device reports on
+// ota/bin/gaps instead (enableGapReports() on the device), so the chunks can
+// go out at QoS 0. A report acks every part before its "next", takes the parts
+// the device holds out of the window, and marks as lost the parts sent before
+// the last chunk the device saw but missing from the report; only those are
+// sent again.
+//
+// A device with admission control (enableAdmission() on the device) answers
+// part 1 on ota/admission. A refusal ends the stream as STREAM_DEFERRED with
+// the time the device takes the image again; an admission that cost part 1 to
+// the link probe sends part 1 again.
+//
+// Chunks are cut from the image as they are sent, so the chunk size can change
+// at any part boundary: each chunk's TotalParts is recomputed from the bytes
+// left, and the device only checks PartIndex against TotalParts on the chunk
+// it is writing. Devices without receipts fall back to ota/progress (10% steps)
+// and ota/success; CONTROL_FIXED sends one chunk per interval as a baseline.
+//
+// Streams are sharded by device and serviced on a worker pool by step(), so
+// thousands of streams share a handful of threads. deliver() may be called
+// from any thread; the send function is called from the workers.
+//
+// Build together with ota_stream.cpp and ../../MQTTOTAProtocol.cpp, see
+// ota_publisher_sim.cpp.
+
+#ifndef OTA_PUBLISHER_H
+#define OTA_PUBLISHER_H
+
+#include "MQTTOTAProtocol.h"
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace otapublisher {
+
+struct Image {
+    std::string version;
+    std::vector<uint8_t> data;
+};
+
+enum ControlMode {
+    CONTROL_ADAPTIVE = 0,
+    CONTROL_FIXED = 1               // One chunk of initialChunk bytes per fixedIntervalUs
+};
+
+struct StreamConfig {
+    ControlMode mode = CONTROL_ADAPTIVE;
+    size_t initialChunk = 4096;
+    size_t minChunk = 1024;         // At least OTA_IMAGE_MIN_HEADER for the first chunk
+    size_t maxChunk = 16384;        // Keep below the device's MQTT receive buffer
+    double initialWindow = 2;
+    double maxWindow = 64;
+    size_t maxInFlightBytes = 24576;    // About 32 KB of Base64 queued for the device at the broker
+    double targetChunkSeconds = 0.25;
+    int64_t fixedIntervalUs = 100000;
+    int64_t minRtoUs = 500000;
+    int64_t maxRtoUs = 10000000;
+    int maxTimeouts = 8;            // Consecutive timeouts before the stream fails
+    int maxRestarts = 2;            // Device-side aborts before the stream fails
+    bool z85 = false;               // Z85Part instead of Base64Part, declared in part 1
+    bool gapReports = false;        // Acks from ota/bin/gaps instead of receipts
+};
+
+enum StreamState {
+    STREAM_ACTIVE = 0,
+    STREAM_DONE = 1,
+    STREAM_FAILED = 2,
+    STREAM_DEFERRED = 3             // Refused by the device's admission control
+};
+
+struct StreamReport {
+    std::string device;
+    StreamState state = STREAM_ACTIVE;
+    int64_t startUs = 0;
+    int64_t endUs = 0;
+    uint64_t bytesSent = 0;         // Decoded bytes, retransmissions included
+    uint64_t bytesRetransmitted = 0;
+    uint32_t chunksSent = 0;
+    uint32_t lossEvents = 0;
+    uint32_t timeouts = 0;
+    uint32_t restarts = 0;
+    double window = 0;
+    size_t chunkSize = 0;
+    double srttMs = 0;
+    double deliveryRate = 0;        // bytes/s
+    int64_t retryUs = 0;            // STREAM_DEFERRED: when the device takes the image again
+};
+
+// AIMD window with RTT estimation (RFC 6298) and delivery-rate based chunk sizing
+class RateController {
+public:
+    explicit RateController(const StreamConfig& config);
+
+    void onAck(uint32_t chunks, size_t bytes, int64_t rttSampleUs, int64_t nowUs);
+    void onLoss(int64_t nowUs);
+    void onTimeout(int64_t nowUs);
+
+    double window() const { return _window; }
+    size_t chunkSize() const { return _chunkSize; }
+    int64_t rtoUs() const { return _rtoUs; }
+    double srttUs() const { return _srttUs; }
+    double deliveryRate() const { return _deliveryRate; }
+
+private:
+    void _updateChunkSize();
+
+    const StreamConfig& _config;
+    double _window;
+    double _ssthresh;
+    size_t _chunkSize;
+    double _srttUs = 0;
+    double _rttvarUs = 0;
+    double _minRttUs = 0;
+    int64_t _rtoUs;
+    int64_t _lastReductionUs = -1;
+
+    // Delivery rate over one round trip
+    double _deliveryRate = 0;
+    int64_t _roundStartUs = -1;
+    uint64_t _roundStartBytes = 0;
+    uint64_t _ackedBytes = 0;
+};
+
+typedef std::function<void(const std::string& topic, const std::string& payload)> SendFunc;
+
+class DeviceStream {
+public:
+    DeviceStream(const std::string& device, const std::string& topic, std::shared_ptr<const Image> image,
+                 const StreamConfig& config, int64_t nowUs);
+
+    // Sends what the window and pacing allow at nowUs
+    void service(int64_t nowUs, const SendFunc& send);
+
+    void onReceipt(uint32_t part, uint32_t sequence, int64_t nowUs);
+    void onProgress(int progress, int64_t nowUs);
+    void onRequest(int from, int64_t nowUs);
+    void onGapReport(const OTAGapReport& report, int64_t nowUs);
+    void onAdmission(uint32_t retryMs, bool resend, int64_t nowUs);
+    void onError(uint16_t code, int64_t nowUs);
+    void onSuccess(int64_t nowUs);
+
+    StreamState state() const { return _report.state; }
+    StreamReport report() const;
+
+private:
+    struct Segment {
+        size_t offset;
+        size_t size;
+        uint32_t sequence;          // Of the latest transmission
+        int64_t sentUs;
+        uint8_t transmissions;
+        bool held;                  // Reported held by the device, out of the window
+        bool lost;                  // Waiting to be sent again
+    };
+
+    void _goBack(int part, int64_t nowUs);
+    void _markLost(Segment& segment);
+    int _firstLost() const;
+    void _acknowledge(int part, int64_t nowUs, int64_t rttSampleUs);
+    void _finish(StreamState state, int64_t nowUs);
+    std::string _message(int part, const Segment& segment, int totalParts, int64_t nowUs) const;
+
+    std::string _device;
+    std::string _topic;
+    std::shared_ptr<const Image> _image;
+    StreamConfig _config;
+    RateController _controller;
+
+    std::vector<Segment> _segments;  // Parts cut so far, index part - 1
+    int _acked = 0;                  // Parts the device has written
+    int _next = 1;                   // Next part to send
+    int _lostCount = 0;
+    uint32_t _sequence = 0;
+    int64_t _lastAckUs;
+    int64_t _lastSendUs = 0;
+    int _goBackPart = 0;
+    int64_t _goBackUs = -1;
+    int _consecutiveTimeouts = 0;
+    StreamReport _report;
+};
+
+// Persistent threads running one function over an index range
+class WorkerPool {
+public:
+    explicit WorkerPool(unsigned workers);
+    ~WorkerPool();
+
+    void parallelFor(size_t count, const std::function<void(size_t)>& fn);
+    unsigned size() const { return (unsigned)_threads.size() + 1; }
+
+private:
+    void _run();
+    void _drain();
+
+    std::vector<std::thread> _threads;
+    std::mutex _lock;
+    std::condition_variable _wake;
+    std::condition_variable _done;
+    const std::function<void(size_t)>* _fn = nullptr;
+    size_t _count = 0;
+    size_t _nextIndex = 0;
+    size_t _finished = 0;
+    uint64_t _generation = 0;
+    bool _stop = false;
+};
+
+class Publisher {
+public:
+    /**
+     * @param send Called from the worker threads; must be thread-safe
+     * @param workers Threads servicing streams (the caller of step() is one of them)
+     */
+    Publisher(SendFunc send, unsigned workers, size_t shards = 64);
+
+    // "{device}" is replaced by the device ID
+    void setTopicTemplate(const std::string& topicTemplate) { _topicTemplate = topicTemplate; }
+
+    bool startStream(const std::string& device, std::shared_ptr<const Image> image,
+                     const StreamConfig& config, int64_t nowUs);
+
+    /**
+     * @brief Feeds a device message (receipts, progress, errors, success, part
+     * requests, gap reports, admission decisions; JSON or binary receipts and
+     * admissions). Thread-safe; applied on
+     * the next step()
+     */
+    void deliver(const std::string& topic, const std::string& payload, int64_t nowUs);
+
+    // Applies delivered messages and services every stream once
+    void step(int64_t nowUs);
+
+    size_t active() const { return _active; }
+    std::vector<StreamReport> reports() const;
+
+private:
+    struct Event {
+        uint8_t type;
+        std::string device;
+        int value;                  // Part, progress, "from", error code or retry ms
+        uint32_t sequence;
+        int64_t atUs;
+        OTAGapReport gaps;
+        bool resend = false;        // Admission: part 1 is wanted again
+    };
+
+    struct Shard {
+        std::mutex inboxLock;
+        std::vector<Event> inbox;
+        std::unordered_map<std::string, std::unique_ptr<DeviceStream>> streams;
+        std::vector<DeviceStream*> activeStreams;
+    };
+
+    Shard& _shardFor(const std::string& device);
+
+    SendFunc _send;
+    WorkerPool _pool;
+    std::vector<std::unique_ptr<Shard>> _shards;
+    std::string _topicTemplate = "ota/{device}";
+    std::mutex _hashLock;
+    std::unordered_map<uint32_t, std::string> _deviceByHash;  // Binary messages carry the hash
+    size_t _active = 0;
+};
+
+}
+
+#endif // OTA_PUBLISHER_H
@@ -0,0 +1,327 @@
+// Fleet simulation for the adaptive publisher in ota_publisher.h.
+//
+// Runs the same fleet three times, in simulated time, through the real
+// Publisher: adaptive, fixed at --fixed-chunk bytes every --fixed-ms, and fixed
+// at a quarter of that rate. Each device is modelled as:
+//   - a per-device broker queue (--queue bytes; what does not fit is dropped,
+//     like a broker's max queued messages for a QoS 0 subscriber)
+//   - a link of its profile's bandwidth and round trip time
+//   - a writer: per-chunk overhead plus decoded bytes at its flash write rate
+//   - the device logic: in-order writes, receipts for each written chunk,
+//     ota/success on the last one, and part requests (gap, join, stall, one
+//     per MQTT_OTA_REQUEST_INTERVAL_MS) as with enablePartRequests(true)
+// Profiles are mixed 30% slow (16 KB/s, 300 ms), 50% medium (100 KB/s, 80 ms)
+// and 20% fast (1 MB/s, 20 ms); every chunk is also lost with --loss.
+//
+// Build:
+//   g++ -std=c++17 -O2 -pthread -I../.. ota_publisher_sim.cpp ota_publisher.cpp ota_stream.cpp ../../MQTTOTAProtocol.cpp -o ota_publisher_sim
+//
+// Usage:
+//   ota_publisher_sim [-n devices] [-j threads] [--image KB] [--loss fraction]
+//                     [--queue bytes] [--fixed-chunk bytes] [--fixed-ms ms] [--seed n]
+
+#include "ota_publisher.h"
+#include "ota_stream.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <queue>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace otapublisher;
+
+namespace {
+
+const int64_t STEP_US = 5000;
+const int64_t HORIZON_US = 3600 * 1000000LL;
+const int64_t REQUEST_INTERVAL_US = 3000000;   // MQTT_OTA_REQUEST_INTERVAL_MS
+const int64_t CHUNK_OVERHEAD_US = 20000;
+
+struct Profile {
+    const char* name;
+    double linkBps;
+    int64_t rttUs;
+    double writeBps;
+};
+
+const Profile PROFILES[] = {
+    { "slow", 16e3, 300000, 100e3 },
+    { "medium", 100e3, 80000, 200e3 },
+    { "fast", 1e6, 20000, 400e3 },
+};
+
+struct Message {
+    int64_t atUs;
+    std::string topic;
+    std::string payload;
+    bool operator>(const Message& other) const { return atUs > other.atUs; }
+};
+
+struct Device {
+    std::string id;
+    const Profile* profile;
+    double linkBps;
+    int64_t rttUs;
+
+    // Broker side
+    std::vector<std::string> outbox;    // Sent by the publisher during the last step
+    std::deque<std::pair<int64_t, std::string>> queue;
+    size_t queuedBytes = 0;
+    uint64_t dropped = 0;
+
+    // Device side
+    bool busy = false;
+    int64_t busyUntil = 0;
+    std::string current;
+    int currentPart = 0;
+    bool done = false;
+    int64_t lastChunkUs = 0;
+    int64_t lastRequestUs = 0;
+    int lastRequestFrom = 0;
+};
+
+struct Fleet {
+    std::vector<Device> devices;
+    std::priority_queue<Message, std::vector<Message>, std::greater<Message>> upstream;
+    std::mt19937_64 random;
+    double loss;
+    size_t queueLimit;
+    std::string version;
+
+    void emit(Device& device, int64_t atUs, const char* topic, const std::string& payload) {
+        upstream.push({ atUs + device.rttUs / 2, topic, payload });
+    }
+
+    void request(Device& device, int64_t nowUs, int from, OTARequestReason reason) {
+        if (device.lastRequestFrom != 0 && nowUs - device.lastRequestUs < REQUEST_INTERVAL_US) return;
+        device.lastRequestUs = nowUs;
+        device.lastRequestFrom = from;
+        char output[160];
+        snprintf(output, sizeof(output), "{\"device\":\"%s\",\"version\":\"%s\",\"from\":%d,\"count\":0,\"reason\":\"%s\"}",
+                 device.id.c_str(), version.c_str(), from, otaRequestReasonName(reason));
+        emit(device, nowUs, OTA_TOPIC_REQUEST, output);
+    }
+
+    // The device's processChunk() with part requests enabled
+    void receive(Device& device, const std::string& payload, int64_t nowUs) {
+        if (std::uniform_real_distribution<double>(0, 1)(random) < loss) return;
+
+        int part = 0, total = 0;
+        uint32_t sequence = 0;
+        otastream::scanMessage(payload.data(), payload.data() + payload.size(),
+                               [&](const char* key, size_t length, const otastream::Value& value) {
+            std::string text(value.data, value.length);
+            if (otastream::keyIs(key, length, "PartIndex")) part = atoi(text.c_str());
+            else if (otastream::keyIs(key, length, "TotalParts")) total = atoi(text.c_str());
+            else if (otastream::keyIs(key, length, "Seq")) sequence = (uint32_t)strtoul(text.c_str(), nullptr, 10);
+        });
+        if (device.done) return;
+
+        if (part != device.currentPart + 1) {
+            if (device.currentPart == 0) request(device, nowUs, 1, OTA_REQUEST_JOIN);
+            else if (part > device.currentPart) request(device, nowUs, device.currentPart + 1, OTA_REQUEST_GAP);
+            return;
+        }
+
+        device.currentPart = part;
+        device.lastChunkUs = nowUs;
+        char output[192];
+        snprintf(output, sizeof(output), "{\"d\":\"%s\",\"v\":\"%s\",\"p\":%d,\"q\":%u}",
+                 device.id.c_str(), version.c_str(), part, sequence);
+        emit(device, nowUs, OTA_TOPIC_RECEIPT, output);
+
+        if (part == total) {
+            device.done = true;
+            emit(device, nowUs, "ota/success", "{\"device\":\"" + device.id + "\"}");
+        }
+    }
+
+    // Moves the publisher's messages into the broker queues, then runs every
+    // device up to untilUs
+    void advance(int64_t nowUs, int64_t untilUs) {
+        for (Device& device : devices) {
+            for (std::string& payload : device.outbox) {
+                if (device.queuedBytes + payload.size() > queueLimit) {
+                    device.dropped++;
+                    continue;
+                }
+                device.queuedBytes += payload.size();
+                device.queue.emplace_back(nowUs + device.rttUs / 2, std::move(payload));
+            }
+            device.outbox.clear();
+
+            for (;;) {
+                if (device.busy) {
+                    if (device.busyUntil > untilUs) break;
+                    device.busy = false;
+                    receive(device, device.current, device.busyUntil);
+                    continue;
+                }
+                if (device.queue.empty() || device.queue.front().first > untilUs) break;
+
+                int64_t start = std::max(device.queue.front().first, device.busyUntil);
+                device.current = std::move(device.queue.front().second);
+                device.queue.pop_front();
+                device.queuedBytes -= device.current.size();
+                double decoded = device.current.size() * 0.75;
+                device.busyUntil = start + (int64_t)(device.current.size() * 1e6 / device.linkBps) +
+                                   CHUNK_OVERHEAD_US + (int64_t)(decoded * 1e6 / device.profile->writeBps);
+                device.busy = true;
+            }
+
+            // handle(): nothing written for an interval while an update is in progress
+            if (device.currentPart > 0 && !device.done && untilUs - device.lastChunkUs > REQUEST_INTERVAL_US) {
+                request(device, untilUs, device.currentPart + 1, OTA_REQUEST_STALL);
+            }
+        }
+    }
+};
+
+struct Result {
+    size_t completed = 0;
+    double p50 = 0, p95 = 0, max = 0;
+    uint64_t bytesSent = 0, bytesRetransmitted = 0, dropped = 0;
+    uint32_t lossEvents = 0, timeouts = 0;
+    double wallSeconds = 0;
+};
+
+Result run(int devices, const StreamConfig& config, std::shared_ptr<const Image> image, unsigned threads,
+           double loss, size_t queueLimit, uint64_t seed) {
+    Fleet fleet;
+    fleet.random.seed(seed);
+    fleet.loss = loss;
+    fleet.queueLimit = queueLimit;
+    fleet.version = image->version;
+    fleet.devices.resize(devices);
+
+    std::mt19937_64 profileRandom(seed);
+    std::uniform_real_distribution<double> jitter(0.7, 1.3);
+    for (int i = 0; i < devices; i++) {
+        Device& device = fleet.devices[i];
+        char id[16];
+        snprintf(id, sizeof(id), "D%06d", i);
+        device.id = id;
+        int pick = (int)(profileRandom() % 10);
+        device.profile = &PROFILES[pick < 3 ? 0 : pick < 8 ? 1 : 2];
+        device.linkBps = device.profile->linkBps * jitter(profileRandom);
+        device.rttUs = (int64_t)(device.profile->rttUs * jitter(profileRandom));
+    }
+
+    // Topics are "ota/D000123"; the workers only touch their own devices' outboxes
+    Publisher publisher([&](const std::string& topic, const std::string& payload) {
+        fleet.devices[atoi(topic.c_str() + 5)].outbox.push_back(payload);
+    }, threads);
+    for (Device& device : fleet.devices) publisher.startStream(device.id, image, config, 0);
+
+    auto wallStart = std::chrono::steady_clock::now();
+    int64_t now = 0;
+    for (; now < HORIZON_US && publisher.active() > 0; now += STEP_US) {
+        while (!fleet.upstream.empty() && fleet.upstream.top().atUs <= now) {
+            const Message& message = fleet.upstream.top();
+            publisher.deliver(message.topic, message.payload, message.atUs);
+            fleet.upstream.pop();
+        }
+        publisher.step(now);
+        fleet.advance(now, now + STEP_US);
+    }
+
+    Result result;
+    result.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+    std::vector<double> times;
+    for (const StreamReport& report : publisher.reports()) {
+        if (report.state == STREAM_DONE) times.push_back((report.endUs - report.startUs) / 1e6);
+        result.bytesSent += report.bytesSent;
+        result.bytesRetransmitted += report.bytesRetransmitted;
+        result.lossEvents += report.lossEvents;
+        result.timeouts += report.timeouts;
+    }
+    for (const Device& device : fleet.devices) result.dropped += device.dropped;
+
+    std::sort(times.begin(), times.end());
+    result.completed = times.size();
+    if (!times.empty()) {
+        result.p50 = times[times.size() / 2];
+        result.p95 = times[std::min(times.size() - 1, times.size() * 95 / 100)];
+        result.max = times.back();
+    }
+    // Devices that never finished count as the whole simulated run
+    if (result.completed < (size_t)devices) result.max = now / 1e6;
+    return result;
+}
+
+void print(const char* mode, int devices, const Result& result) {
+    printf("%-16s %5zu/%-5d %8.1f %8.1f %9.1f %7.1f%% %9llu %7u %7u %7.2f\n", mode, result.completed, devices,
+           result.p50, result.p95, result.max,
+           result.bytesSent ? 100.0 * result.bytesRetransmitted / result.bytesSent : 0.0,
+           (unsigned long long)result.dropped, result.lossEvents, result.timeouts, result.wallSeconds);
+}
+
+}
+
+int main(int argc, char** argv) {
+    int devices = 2000;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t imageKB = 512;
+    double loss = 0.001;
+    size_t queueLimit = 32768;
+    size_t fixedChunk = 4096;
+    int64_t fixedMs = 100;
+    uint64_t seed = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            devices = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+            threads = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--image") && i + 1 < argc) {
+            imageKB = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--loss") && i + 1 < argc) {
+            loss = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--queue") && i + 1 < argc) {
+            queueLimit = strtoul(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "--fixed-chunk") && i + 1 < argc) {
+            fixedChunk = strtoul(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "--fixed-ms") && i + 1 < argc) {
+            fixedMs = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--seed") && i + 1 < argc) {
+            seed = strtoull(argv[++i], nullptr, 10);
+        } else {
+            fprintf(stderr, "usage: %s [-n devices] [-j threads] [--image KB] [--loss fraction]\n"
+                            "       [--queue bytes] [--fixed-chunk bytes] [--fixed-ms ms] [--seed n]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    // Contents do not matter to the simulation, only the size
+    auto image = std::make_shared<Image>();
+    image->version = "2.0.0";
+    image->data.resize(imageKB * 1024);
+    std::mt19937 bytes(seed);
+    for (uint8_t& byte : image->data) byte = (uint8_t)bytes();
+
+    printf("%d devices, %zu KB image, %.2f%% loss, %zu B broker queue, %u threads\n\n",
+           devices, imageKB, loss * 100, queueLimit, threads);
+    printf("%-16s %11s %8s %8s %9s %8s %9s %7s %7s %7s\n", "mode", "completed", "p50 s", "p95 s", "fleet s",
+           "retx", "dropped", "losses", "rto", "wall s");
+
+    StreamConfig adaptive;
+    print("adaptive", devices, run(devices, adaptive, image, threads, loss, queueLimit, seed));
+
+    for (int64_t interval : { fixedMs, fixedMs * 4 }) {
+        StreamConfig fixed;
+        fixed.mode = CONTROL_FIXED;
+        fixed.initialChunk = fixedChunk;
+        fixed.fixedIntervalUs = interval * 1000;
+        char mode[32];
+        snprintf(mode, sizeof(mode), "fixed %.0f KB/s", fixedChunk * 1000.0 / interval / 1024);
+        print(mode, devices, run(devices, fixed, image, threads, loss, queueLimit, seed));
+    }
+    return 0;
+}
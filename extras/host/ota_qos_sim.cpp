@@ -0,0 +1,486 @@
+// QoS 1 against QoS 0 with gap reports, for the streams of ota_publisher.h.
+//
+// Runs the same fleet three times, in simulated time, through the real
+// Publisher, and counts every MQTT packet that passes through the broker:
+//   qos1        chunks at QoS 1: PUBACK from the broker to the server and from
+//               the device to the broker; receipts and part requests
+//   qos0 req    chunks at QoS 0, receipts and part requests (go-back)
+//   qos0 gaps   chunks at QoS 0, gap reports (enableGapReports(), no receipts)
+// Devices are modelled as in ota_publisher_sim: a broker queue (--queue bytes
+// at QoS 0; QoS 1 messages are never dropped), a link of the profile's
+// bandwidth and round trip time, and a writer. A loss is a dropped connection:
+// each delivery fails with --loss, and the device is away for --reconnect-ms.
+// At QoS 1 the broker keeps the message and everything behind it and delivers
+// them once the device is back; at QoS 0 they are gone, and so is what the
+// device publishes meanwhile. In gaps mode the device holds up to 8 early
+// parts (32 KB, within 32 parts of the next one) and reports at most every
+// 250 ms, when something changed or parts are missing, as the library does
+// with its defaults.
+//
+// "held" is the most the broker keeps for the fleet at once: queued
+// messages, plus QoS 1 messages delivered and not yet acknowledged.
+//
+// Build:
+//   g++ -std=c++17 -O2 -pthread -I../.. ota_qos_sim.cpp ota_publisher.cpp ota_stream.cpp ../../MQTTOTAProtocol.cpp -o ota_qos_sim
+//
+// Usage:
+//   ota_qos_sim [-n devices] [-j threads] [--image KB] [--loss fraction]
+//               [--reconnect-ms ms] [--queue bytes] [--seed n]
+
+#include "ota_publisher.h"
+#include "ota_stream.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <queue>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace otapublisher;
+
+namespace {
+
+const int64_t STEP_US = 5000;
+const int64_t HORIZON_US = 3600 * 1000000LL;
+const int64_t REQUEST_INTERVAL_US = 3000000;   // MQTT_OTA_REQUEST_INTERVAL_MS
+const int64_t GAP_REPORT_US = 250000;          // MQTT_OTA_GAP_REPORT_MS
+const size_t REORDER_SLOTS = 8;                // MQTT_OTA_REORDER_SLOTS
+const size_t REORDER_BYTES = 32768;            // MQTT_OTA_REORDER_BYTES
+const int64_t CHUNK_OVERHEAD_US = 20000;
+
+enum Mode {
+    MODE_QOS1 = 0,
+    MODE_QOS0_REQUESTS = 1,
+    MODE_QOS0_GAPS = 2
+};
+
+const char* const MODE_NAMES[] = { "qos1", "qos0 req", "qos0 gaps" };
+
+struct Profile {
+    const char* name;
+    double linkBps;
+    int64_t rttUs;
+    double writeBps;
+};
+
+const Profile PROFILES[] = {
+    { "slow", 16e3, 300000, 100e3 },
+    { "medium", 100e3, 80000, 200e3 },
+    { "fast", 1e6, 20000, 400e3 },
+};
+
+struct Message {
+    int64_t atUs;
+    std::string topic;
+    std::string payload;
+    bool operator>(const Message& other) const { return atUs > other.atUs; }
+};
+
+struct Device {
+    std::string id;
+    const Profile* profile;
+    double linkBps;
+    int64_t rttUs;
+
+    // Broker side
+    std::vector<std::string> outbox;    // Sent by the publisher during the last step
+    std::deque<std::pair<int64_t, std::string>> queue;
+    size_t queuedBytes = 0;
+    std::deque<std::pair<int64_t, size_t>> unacked;  // QoS 1: PUBACK arrival, bytes
+    size_t unackedBytes = 0;
+    int64_t offlineUntil = 0;
+    uint64_t dropped = 0;
+
+    // Device side
+    bool busy = false;
+    int64_t busyUntil = 0;
+    std::string current;
+    int currentPart = 0;
+    bool done = false;
+    int64_t lastChunkUs = 0;
+    int64_t lastRequestUs = 0;
+    int lastRequestFrom = 0;
+
+    // Gap reports
+    std::map<int, size_t> held;         // Part -> decoded bytes
+    size_t heldBytes = 0;
+    int highest = 0;
+    uint32_t duplicates = 0;
+    uint32_t lastSequence = 0;
+    int64_t lastReportUs = -1;
+    int backoff = 0;
+    uint32_t lastState = 0;
+};
+
+struct Fleet {
+    Mode mode;
+    std::vector<Device> devices;
+    std::priority_queue<Message, std::vector<Message>, std::greater<Message>> upstream;
+    std::mt19937_64 random;
+    double loss;
+    int64_t reconnectUs;
+    size_t queueLimit;
+    std::string version;
+    uint64_t packets = 0;
+    size_t heldBytes = 0;
+    size_t peakHeldBytes = 0;
+
+    // Device -> broker -> server, QoS 0
+    void emit(Device& device, int64_t atUs, const char* topic, const std::string& payload) {
+        if (atUs < device.offlineUntil) return;
+        packets += 2;
+        upstream.push({ atUs + device.rttUs / 2, topic, payload });
+    }
+
+    void request(Device& device, int64_t nowUs, int from, OTARequestReason reason) {
+        if (device.lastRequestFrom != 0 && nowUs - device.lastRequestUs < REQUEST_INTERVAL_US) return;
+        device.lastRequestUs = nowUs;
+        device.lastRequestFrom = from;
+        char output[160];
+        snprintf(output, sizeof(output), "{\"device\":\"%s\",\"version\":\"%s\",\"from\":%d,\"count\":0,\"reason\":\"%s\"}",
+                 device.id.c_str(), version.c_str(), from, otaRequestReasonName(reason));
+        emit(device, nowUs, OTA_TOPIC_REQUEST, output);
+    }
+
+    // The device's _reportGaps()
+    void report(Device& device, int64_t nowUs, bool early) {
+        int64_t interval = early ? GAP_REPORT_US / 4 : GAP_REPORT_US << device.backoff;
+        if (device.lastReportUs >= 0 && nowUs - device.lastReportUs < interval) return;
+
+        OTAGapReport report = {};
+        report.deviceHash = otaHash32(device.id.c_str());
+        report.versionHash = otaHash32(version.c_str());
+        report.next = device.currentPart + 1;
+        report.sequence = device.lastSequence;
+        if (device.currentPart > 0) {
+            report.highest = std::max(device.highest, device.currentPart);
+            for (const auto& entry : device.held) {
+                uint32_t bit = entry.first - report.next - 1;
+                if (bit < OTA_GAPS_WINDOW) report.held |= 1u << bit;
+            }
+            report.duplicates = (uint16_t)std::min(device.duplicates, 0xFFFFu);
+        }
+
+        uint32_t state = ((uint32_t)report.next << 16 | report.highest) ^ report.held;
+        bool missing = device.currentPart == 0 || report.highest >= report.next;
+        if (!early && state == device.lastState) {
+            if (!missing && nowUs - device.lastReportUs < GAP_REPORT_US * 8) return;
+            device.backoff = std::min(device.backoff + 1, 3);
+        } else {
+            device.backoff = 0;
+        }
+        device.lastState = state;
+        device.lastReportUs = nowUs;
+
+        uint8_t payload[OTA_GAPS_SIZE];
+        size_t length = otaGapReportEncode(report, payload);
+        emit(device, nowUs, OTA_TOPIC_BIN_GAPS, std::string((const char*)payload, length));
+    }
+
+    void written(Device& device, int part, int total, uint32_t sequence, int64_t nowUs) {
+        device.currentPart = part;
+        device.lastChunkUs = nowUs;
+        device.backoff = 0;
+        if (mode != MODE_QOS0_GAPS) {
+            char output[192];
+            snprintf(output, sizeof(output), "{\"d\":\"%s\",\"v\":\"%s\",\"p\":%d,\"q\":%u}",
+                     device.id.c_str(), version.c_str(), part, sequence);
+            emit(device, nowUs, OTA_TOPIC_RECEIPT, output);
+        }
+        if (part == total) {
+            device.done = true;
+            emit(device, nowUs, "ota/success", "{\"device\":\"" + device.id + "\"}");
+        }
+    }
+
+    // Part requests: the device's processChunk() with enablePartRequests(true)
+    void receiveInOrder(Device& device, int part, int total, uint32_t sequence, int64_t nowUs) {
+        if (part != device.currentPart + 1) {
+            if (device.currentPart == 0) request(device, nowUs, 1, OTA_REQUEST_JOIN);
+            else if (part > device.currentPart) request(device, nowUs, device.currentPart + 1, OTA_REQUEST_GAP);
+            return;
+        }
+        written(device, part, total, sequence, nowUs);
+    }
+
+    // Gap reports: _gapChunk(), _holdChunk() and _writeHeldChunks()
+    void receiveWithGaps(Device& device, int part, int total, uint32_t sequence, size_t bytes, int64_t nowUs) {
+        device.lastSequence = sequence;
+        if (part == device.currentPart + 1) {
+            written(device, part, total, sequence, nowUs);
+            device.highest = std::max(device.highest, part);
+            while (!device.done && device.held.count(device.currentPart + 1)) {
+                auto it = device.held.find(device.currentPart + 1);
+                device.heldBytes -= it->second;
+                device.held.erase(it);
+                written(device, device.currentPart + 1, total, sequence, nowUs);
+            }
+            return;
+        }
+        if (device.currentPart == 0) {
+            report(device, nowUs, false);
+            return;
+        }
+        if (part <= device.currentPart || device.held.count(part)) {
+            device.duplicates++;
+            return;
+        }
+
+        bool newGap = part > device.highest + 1 && part > device.currentPart + 1;
+        device.highest = std::max(device.highest, part);
+        if (part - device.currentPart - 1 <= (int)OTA_GAPS_WINDOW) {
+            // Full: the farthest part gives way to a nearer one
+            while (device.held.size() == REORDER_SLOTS || device.heldBytes + bytes > REORDER_BYTES) {
+                auto farthest = std::prev(device.held.end());
+                if (farthest->first < part) break;
+                device.heldBytes -= farthest->second;
+                device.held.erase(farthest);
+            }
+            if (device.held.size() < REORDER_SLOTS && device.heldBytes + bytes <= REORDER_BYTES) {
+                device.held[part] = bytes;
+                device.heldBytes += bytes;
+            }
+        }
+        if (newGap) report(device, nowUs, true);
+    }
+
+    void receive(Device& device, const std::string& payload, int64_t nowUs) {
+        int part = 0, total = 0;
+        uint32_t sequence = 0;
+        size_t bytes = 0;
+        otastream::scanMessage(payload.data(), payload.data() + payload.size(),
+                               [&](const char* key, size_t length, const otastream::Value& value) {
+            std::string text(value.data, value.length);
+            if (otastream::keyIs(key, length, "PartIndex")) part = atoi(text.c_str());
+            else if (otastream::keyIs(key, length, "TotalParts")) total = atoi(text.c_str());
+            else if (otastream::keyIs(key, length, "Seq")) sequence = (uint32_t)strtoul(text.c_str(), nullptr, 10);
+            else if (otastream::keyIs(key, length, "Base64Part")) bytes = value.length * 3 / 4;
+        });
+        if (device.done) return;
+
+        if (mode == MODE_QOS0_GAPS) {
+            receiveWithGaps(device, part, total, sequence, bytes, nowUs);
+        } else {
+            receiveInOrder(device, part, total, sequence, nowUs);
+        }
+    }
+
+    // Moves the publisher's messages into the broker queues, then runs every
+    // device up to untilUs
+    void advance(int64_t nowUs, int64_t untilUs) {
+        bool qos1 = mode == MODE_QOS1;
+        for (Device& device : devices) {
+            for (std::string& payload : device.outbox) {
+                packets += qos1 ? 2 : 1;
+                if (!qos1 && (nowUs < device.offlineUntil || device.queuedBytes + payload.size() > queueLimit)) {
+                    device.dropped++;
+                    continue;
+                }
+                device.queuedBytes += payload.size();
+                heldBytes += payload.size();
+                device.queue.emplace_back(nowUs + device.rttUs / 2, std::move(payload));
+            }
+            device.outbox.clear();
+
+            while (!device.unacked.empty() && device.unacked.front().first <= untilUs) {
+                device.unackedBytes -= device.unacked.front().second;
+                heldBytes -= device.unacked.front().second;
+                device.unacked.pop_front();
+            }
+
+            for (;;) {
+                if (device.busy) {
+                    if (device.busyUntil > untilUs) break;
+                    device.busy = false;
+                    receive(device, device.current, device.busyUntil);
+                    continue;
+                }
+                if (device.queue.empty()) break;
+                int64_t start = std::max({ device.queue.front().first, device.busyUntil, device.offlineUntil });
+                if (start > untilUs) break;
+
+                packets++;
+                if (std::uniform_real_distribution<double>(0, 1)(random) < loss) {
+                    // QoS 1 keeps the queue for the next connection; QoS 0 loses it
+                    device.offlineUntil = start + reconnectUs;
+                    if (!qos1) {
+                        device.dropped += device.queue.size();
+                        heldBytes -= device.queuedBytes;
+                        device.queue.clear();
+                        device.queuedBytes = 0;
+                    }
+                    continue;
+                }
+
+                device.current = std::move(device.queue.front().second);
+                device.queue.pop_front();
+                device.queuedBytes -= device.current.size();
+                int64_t transfer = (int64_t)(device.current.size() * 1e6 / device.linkBps);
+                if (qos1) {
+                    packets++;
+                    device.unacked.emplace_back(start + transfer + device.rttUs / 2, device.current.size());
+                    device.unackedBytes += device.current.size();
+                } else {
+                    heldBytes -= device.current.size();
+                }
+                double decoded = device.current.size() * 0.75;
+                device.busyUntil = start + transfer + CHUNK_OVERHEAD_US + (int64_t)(decoded * 1e6 / device.profile->writeBps);
+                device.busy = true;
+            }
+
+            // handle(): periodic reports, or a request after an interval without chunks
+            if (device.currentPart > 0 && !device.done && untilUs >= device.offlineUntil) {
+                if (mode == MODE_QOS0_GAPS) {
+                    report(device, untilUs, false);
+                } else if (untilUs - device.lastChunkUs > REQUEST_INTERVAL_US) {
+                    request(device, untilUs, device.currentPart + 1, OTA_REQUEST_STALL);
+                }
+            }
+        }
+        peakHeldBytes = std::max(peakHeldBytes, heldBytes);
+    }
+};
+
+struct Result {
+    size_t completed = 0;
+    double p50 = 0, p95 = 0, max = 0;
+    uint64_t packets = 0;
+    size_t peakHeldBytes = 0;
+    uint64_t bytesSent = 0, bytesRetransmitted = 0, dropped = 0;
+    double wallSeconds = 0;
+};
+
+Result run(Mode mode, int devices, std::shared_ptr<const Image> image, unsigned threads, double loss,
+           int64_t reconnectUs, size_t queueLimit, uint64_t seed) {
+    Fleet fleet;
+    fleet.mode = mode;
+    fleet.random.seed(seed);
+    fleet.loss = loss;
+    fleet.reconnectUs = reconnectUs;
+    fleet.queueLimit = queueLimit;
+    fleet.version = image->version;
+    fleet.devices.resize(devices);
+
+    std::mt19937_64 profileRandom(seed);
+    std::uniform_real_distribution<double> jitter(0.7, 1.3);
+    for (int i = 0; i < devices; i++) {
+        Device& device = fleet.devices[i];
+        char id[16];
+        snprintf(id, sizeof(id), "D%06d", i);
+        device.id = id;
+        int pick = (int)(profileRandom() % 10);
+        device.profile = &PROFILES[pick < 3 ? 0 : pick < 8 ? 1 : 2];
+        device.linkBps = device.profile->linkBps * jitter(profileRandom);
+        device.rttUs = (int64_t)(device.profile->rttUs * jitter(profileRandom));
+    }
+
+    StreamConfig config;
+    config.gapReports = mode == MODE_QOS0_GAPS;
+
+    // Topics are "ota/D000123"; the workers only touch their own devices' outboxes
+    Publisher publisher([&](const std::string& topic, const std::string& payload) {
+        fleet.devices[atoi(topic.c_str() + 5)].outbox.push_back(payload);
+    }, threads);
+    for (Device& device : fleet.devices) publisher.startStream(device.id, image, config, 0);
+
+    auto wallStart = std::chrono::steady_clock::now();
+    int64_t now = 0;
+    for (; now < HORIZON_US && publisher.active() > 0; now += STEP_US) {
+        while (!fleet.upstream.empty() && fleet.upstream.top().atUs <= now) {
+            const Message& message = fleet.upstream.top();
+            publisher.deliver(message.topic, message.payload, message.atUs);
+            fleet.upstream.pop();
+        }
+        publisher.step(now);
+        fleet.advance(now, now + STEP_US);
+    }
+
+    Result result;
+    result.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+    result.packets = fleet.packets;
+    result.peakHeldBytes = fleet.peakHeldBytes;
+    std::vector<double> times;
+    for (const StreamReport& report : publisher.reports()) {
+        if (report.state == STREAM_DONE) times.push_back((report.endUs - report.startUs) / 1e6);
+        result.bytesSent += report.bytesSent;
+        result.bytesRetransmitted += report.bytesRetransmitted;
+    }
+    for (const Device& device : fleet.devices) result.dropped += device.dropped;
+
+    std::sort(times.begin(), times.end());
+    result.completed = times.size();
+    if (!times.empty()) {
+        result.p50 = times[times.size() / 2];
+        result.p95 = times[std::min(times.size() - 1, times.size() * 95 / 100)];
+        result.max = times.back();
+    }
+    // Devices that never finished count as the whole simulated run
+    if (result.completed < (size_t)devices) result.max = now / 1e6;
+    return result;
+}
+
+void print(Mode mode, int devices, const Result& result) {
+    printf("%-10s %5zu/%-5d %8.1f %8.1f %9.1f %10llu %8.0f %9.1f %7.1f%% %9llu %7.2f\n", MODE_NAMES[mode],
+           result.completed, devices, result.p50, result.p95, result.max, (unsigned long long)result.packets,
+           (double)result.packets / devices, result.peakHeldBytes / 1048576.0,
+           result.bytesSent ? 100.0 * result.bytesRetransmitted / result.bytesSent : 0.0,
+           (unsigned long long)result.dropped, result.wallSeconds);
+}
+
+}
+
+int main(int argc, char** argv) {
+    int devices = 2000;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t imageKB = 512;
+    double loss = 0.005;
+    int64_t reconnectMs = 2000;
+    size_t queueLimit = 32768;
+    uint64_t seed = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            devices = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+            threads = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--image") && i + 1 < argc) {
+            imageKB = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--loss") && i + 1 < argc) {
+            loss = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--reconnect-ms") && i + 1 < argc) {
+            reconnectMs = std::max(0, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--queue") && i + 1 < argc) {
+            queueLimit = strtoul(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "--seed") && i + 1 < argc) {
+            seed = strtoull(argv[++i], nullptr, 10);
+        } else {
+            fprintf(stderr, "usage: %s [-n devices] [-j threads] [--image KB] [--loss fraction]\n"
+                            "       [--reconnect-ms ms] [--queue bytes] [--seed n]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    // Contents do not matter to the simulation, only the size
+    auto image = std::make_shared<Image>();
+    image->version = "2.0.0";
+    image->data.resize(imageKB * 1024);
+    std::mt19937 bytes(seed);
+    for (uint8_t& byte : image->data) byte = (uint8_t)bytes();
+
+    printf("%d devices, %zu KB image, %.2f%% loss, %lld ms reconnect, %zu B broker queue, %u threads\n\n",
+           devices, imageKB, loss * 100, (long long)reconnectMs, queueLimit, threads);
+    printf("%-10s %11s %8s %8s %9s %10s %8s %9s %8s %9s %7s\n", "mode", "completed", "p50 s", "p95 s",
+           "fleet s", "packets", "per dev", "held MB", "retx", "dropped", "wall s");
+
+    for (Mode mode : { MODE_QOS1, MODE_QOS0_REQUESTS, MODE_QOS0_GAPS }) {
+        print(mode, devices, run(mode, devices, image, threads, loss, reconnectMs * 1000, queueLimit, seed));
+    }
+    return 0;
+}
@@ -0,0 +1,89 @@
+// Prints RTT, network, queueing and device service time distributions from
+// MQTTOTA chunk receipts, per device and per rollout.
+//
+// Reads one receipt per line from stdin, as printed by
+//   mosquitto_sub -t ota/receipt -v -F '%U %t %p'         (JSON receipts)
+//   mosquitto_sub -t ota/bin/receipt -v -F '%U %t %x'     (binary receipts)
+// i.e. the arrival time in Unix seconds, the topic and the payload. The
+// server must stamp "SentAt" in Unix ms from the same clock.
+//
+// Build:
+//   g++ -std=c++17 -O2 -I../.. ota_receipt_stats.cpp ota_receipts.cpp ../../MQTTOTAProtocol.cpp -o ota_receipt_stats
+
+#include "ota_receipts.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static bool parseHex(const std::string& hex, std::vector<uint8_t>& out) {
+    out.clear();
+    if (hex.size() % 2 != 0) return false;
+    for (size_t i = 0; i < hex.size(); i += 2) {
+        int hi = hexValue(hex[i]);
+        int lo = hexValue(hex[i + 1]);
+        if (hi < 0 || lo < 0) return false;
+        out.push_back((uint8_t)((hi << 4) | lo));
+    }
+    return true;
+}
+
+static void printDistribution(const char* name, const otareceipts::Distribution& distribution) {
+    printf("  %-9s p50 %9.2f  p95 %9.2f  p99 %9.2f  max %9.2f ms\n", name,
+           distribution.percentile(50), distribution.percentile(95),
+           distribution.percentile(99), distribution.max());
+}
+
+static void printGroup(const char* title, const std::map<std::string, otareceipts::Summary>& groups) {
+    for (const auto& group : groups) {
+        const otareceipts::Summary& summary = group.second;
+        printf("%s %s: %zu receipts, %u duplicates, %u reordered\n", title, group.first.c_str(),
+               summary.rtt.count(), summary.duplicates, summary.reordered);
+        printDistribution("rtt", summary.rtt);
+        printDistribution("network", summary.network);
+        printDistribution("queueing", summary.queueing);
+        printDistribution("service", summary.service);
+    }
+}
+
+int main() {
+    otareceipts::Analyzer analyzer;
+    std::string line;
+    std::vector<uint8_t> payload;
+
+    while (std::getline(std::cin, line)) {
+        size_t first = line.find(' ');
+        size_t second = first == std::string::npos ? std::string::npos : line.find(' ', first + 1);
+        if (second == std::string::npos) continue;
+
+        double arrivalMs = strtod(line.substr(0, first).c_str(), nullptr) * 1000.0;
+        std::string topic = line.substr(first + 1, second - first - 1);
+        std::string body = line.substr(second + 1);
+
+        if (topic == OTA_TOPIC_BIN_RECEIPT) {
+            if (parseHex(body, payload)) {
+                analyzer.addBinary(payload.data(), payload.size(), arrivalMs);
+            } else {
+                analyzer.addBinary(nullptr, 0, arrivalMs);
+            }
+        } else {
+            analyzer.addJson(body, arrivalMs);
+        }
+    }
+
+    analyzer.finish();
+    printGroup("device", analyzer.byDevice());
+    printGroup("rollout", analyzer.byRollout());
+
+    fprintf(stderr, "%zu receipts, %zu rejected\n", analyzer.samples(), analyzer.rejected());
+    return analyzer.samples() == 0 ? 1 : 0;
+}
@@ -0,0 +1,164 @@
+#include "ota_receipts.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <utility>
+
+namespace otareceipts {
+
+void Distribution::add(double value) {
+    if (!_values.empty() && value < _values.back()) _sorted = false;
+    _values.push_back(value);
+}
+
+double Distribution::mean() const {
+    if (_values.empty()) return 0;
+    double sum = 0;
+    for (double value : _values) sum += value;
+    return sum / _values.size();
+}
+
+double Distribution::min() const {
+    return _values.empty() ? 0 : *std::min_element(_values.begin(), _values.end());
+}
+
+double Distribution::max() const {
+    return _values.empty() ? 0 : *std::max_element(_values.begin(), _values.end());
+}
+
+double Distribution::percentile(double p) const {
+    if (_values.empty()) return 0;
+    if (!_sorted) {
+        std::sort(_values.begin(), _values.end());
+        _sorted = true;
+    }
+    size_t rank = (size_t)std::ceil(p / 100.0 * _values.size());
+    if (rank == 0) rank = 1;
+    if (rank > _values.size()) rank = _values.size();
+    return _values[rank - 1];
+}
+
+// The device writes receipts with a fixed key order and no whitespace, so a
+// key lookup is enough; this is not a general JSON parser
+static bool findValue(const std::string& json, const char* key, std::string& value) {
+    std::string pattern = std::string("\"") + key + "\":";
+    size_t start = json.find(pattern);
+    if (start == std::string::npos) return false;
+    start += pattern.size();
+
+    if (start < json.size() && json[start] == '"') {
+        size_t end = json.find('"', start + 1);
+        if (end == std::string::npos) return false;
+        value = json.substr(start + 1, end - start - 1);
+        return true;
+    }
+
+    size_t end = json.find_first_of(",}", start);
+    if (end == std::string::npos) return false;
+    value = json.substr(start, end - start);
+    return !value.empty();
+}
+
+static bool findNumber(const std::string& json, const char* key, uint64_t& number) {
+    std::string value;
+    if (!findValue(json, key, value)) return false;
+    char* end = nullptr;
+    number = strtoull(value.c_str(), &end, 10);
+    return end && *end == '\0';
+}
+
+bool Analyzer::addJson(const std::string& payload, double arrivalMs) {
+    Sample sample;
+    uint64_t part, sequence, sentAt, receivedAt, service;
+    if (!findValue(payload, "d", sample.device) || !findValue(payload, "v", sample.version) ||
+        !findNumber(payload, "p", part) || !findNumber(payload, "q", sequence) ||
+        !findNumber(payload, "ts", sentAt) || !findNumber(payload, "rx", receivedAt) ||
+        !findNumber(payload, "svc", service)) {
+        _rejected++;
+        return false;
+    }
+
+    sample.part = (uint32_t)part;
+    sample.sequence = (uint32_t)sequence;
+    sample.sentAtMs = sentAt;
+    sample.arrivalMs = arrivalMs;
+    sample.receivedAtDeviceMs = (uint32_t)receivedAt;
+    sample.serviceMicros = (uint32_t)service;
+    add(sample);
+    return true;
+}
+
+bool Analyzer::addBinary(const uint8_t* data, size_t length, double arrivalMs) {
+    OTAChunkReceipt receipt;
+    if (!otaReceiptDecode(data, length, receipt)) {
+        _rejected++;
+        return false;
+    }
+
+    char device[9], version[9];
+    snprintf(device, sizeof(device), "%08x", receipt.deviceHash);
+    snprintf(version, sizeof(version), "%08x", receipt.versionHash);
+
+    Sample sample;
+    sample.device = device;
+    sample.version = version;
+    sample.part = receipt.part;
+    sample.sequence = receipt.sequence;
+    sample.sentAtMs = receipt.sentAt;
+    sample.arrivalMs = arrivalMs;
+    sample.receivedAtDeviceMs = receipt.receivedAt;
+    sample.serviceMicros = receipt.serviceMicros;
+    add(sample);
+    return true;
+}
+
+void Analyzer::add(const Sample& sample) {
+    _samples.push_back(sample);
+}
+
+void Analyzer::finish() {
+    _byDevice.clear();
+    _byRollout.clear();
+
+    // Baseline: the fastest network time each device ever saw
+    std::map<std::string, double> baseline;
+    for (const Sample& sample : _samples) {
+        auto it = baseline.find(sample.device);
+        if (it == baseline.end() || sample.networkMs() < it->second) {
+            baseline[sample.device] = sample.networkMs();
+        }
+    }
+
+    std::map<std::pair<std::string, std::string>, uint32_t> lastSequence;
+    std::map<std::pair<std::string, std::string>, std::set<uint32_t>> seen;
+
+    for (const Sample& sample : _samples) {
+        Summary* summaries[2] = { &_byDevice[sample.device], &_byRollout[sample.version] };
+        double queueing = sample.networkMs() - baseline[sample.device];
+
+        auto key = std::make_pair(sample.device, sample.version);
+        std::set<uint32_t>& sequences = seen[key];
+        bool duplicate = sequences.count(sample.sequence) > 0;
+        bool reordered = !duplicate && !sequences.empty() && sample.sequence < lastSequence[key];
+        sequences.insert(sample.sequence);
+        lastSequence[key] = std::max(lastSequence[key], sample.sequence);
+
+        for (Summary* summary : summaries) {
+            if (duplicate) {
+                summary->duplicates++;
+                continue;
+            }
+            if (reordered) summary->reordered++;
+            summary->rtt.add(sample.rttMs());
+            summary->network.add(sample.networkMs());
+            summary->queueing.add(queueing);
+            summary->service.add(sample.serviceMs());
+        }
+    }
+}
+
+}
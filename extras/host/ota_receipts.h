@@ -0,0 +1,98 @@
+// Host-side analysis of MQTTOTA chunk receipts (ota/receipt, ota/bin/receipt).
+//
+// The server stamps every chunk with "SentAt" (Unix ms) and "Seq"; the device
+// echoes them together with its receive-to-written time. Given the time the
+// receipt arrived back on the server clock, each sample splits into:
+//
+//   rtt      arrival - SentAt
+//   service  receive-to-written on the device (svc)
+//   network  rtt - service: broker and network, both directions
+//   queueing network - lowest network time seen for the device, i.e. the
+//            delay above the path's baseline, which is where broker queues show
+//
+// Samples are grouped per device and per rollout (firmware version). Binary
+// receipts only carry hashes, so they are keyed by the hex hash.
+//
+// Build together with ../../MQTTOTAProtocol.cpp, see ota_receipt_stats.cpp.
+
+#ifndef OTA_RECEIPTS_H
+#define OTA_RECEIPTS_H
+
+#include "MQTTOTAProtocol.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace otareceipts {
+
+struct Sample {
+    std::string device;
+    std::string version;
+    uint32_t part = 0;
+    uint32_t sequence = 0;
+    uint64_t sentAtMs = 0;
+    double arrivalMs = 0;
+    uint32_t receivedAtDeviceMs = 0;
+    uint32_t serviceMicros = 0;
+
+    double rttMs() const { return arrivalMs - (double)sentAtMs; }
+    double serviceMs() const { return serviceMicros / 1000.0; }
+    double networkMs() const { return rttMs() - serviceMs(); }
+};
+
+// Collects values and answers percentile queries (nearest rank)
+class Distribution {
+public:
+    void add(double value);
+    size_t count() const { return _values.size(); }
+    double mean() const;
+    double min() const;
+    double max() const;
+    double percentile(double p) const;
+
+private:
+    mutable std::vector<double> _values;
+    mutable bool _sorted = true;
+};
+
+struct Summary {
+    Distribution rtt;
+    Distribution network;
+    Distribution queueing;
+    Distribution service;
+    uint32_t duplicates = 0;       // Receipts for a sequence already seen
+    uint32_t reordered = 0;        // Receipts whose sequence went backwards
+};
+
+class Analyzer {
+public:
+    /**
+     * @brief Parses a JSON receipt as published on ota/receipt
+     * @param arrivalMs Server clock (Unix ms) when the receipt arrived
+     */
+    bool addJson(const std::string& payload, double arrivalMs);
+
+    // Binary receipt as published on ota/bin/receipt
+    bool addBinary(const uint8_t* data, size_t length, double arrivalMs);
+
+    void add(const Sample& sample);
+
+    // Computes the per-device baselines and fills the summaries
+    void finish();
+
+    const std::map<std::string, Summary>& byDevice() const { return _byDevice; }
+    const std::map<std::string, Summary>& byRollout() const { return _byRollout; }
+    size_t samples() const { return _samples.size(); }
+    size_t rejected() const { return _rejected; }
+
+private:
+    std::vector<Sample> _samples;
+    size_t _rejected = 0;
+    std::map<std::string, Summary> _byDevice;
+    std::map<std::string, Summary> _byRollout;
+};
+
+}
+
+#endif // OTA_RECEIPTS_H
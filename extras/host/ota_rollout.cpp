@@ -0,0 +1,450 @@
+// Fleet rollout orchestrator: streams one image to a list of devices in
+// waves sized to an egress budget.
+//
+// Devices are admitted in waves. A wave is as large as the budget left over
+// from the devices already updating allows, at the per-device throughput the
+// fleet reports (ota/progress, median over devices that have reported; --guess
+// until then). The next wave waits until every device of the current one has
+// reported progress, finished, or had --settle seconds.
+//
+// Each admitted device gets its own stream from the adaptive publisher
+// (ota_publisher.h) on its own topic; ota/receipt, ota/request, ota/progress,
+// ota/error and ota/success drive the streams and the rollout; sends go through
+// a token bucket on the budget so wave starts do not burst past it. The rollout
+// pauses (no new waves) once failed devices reach --error-rate of the finished
+// ones (after at least --min-results). A device fails on ota/error, when its
+// stream gives up, or after --device-timeout seconds without a report. A
+// device whose admission control refuses the image (ota/admission) goes back
+// to the pending devices until the retry time it gave, without counting as
+// failed.
+// --z85 sends Z85Part chunks instead of Base64Part.
+//
+// Exit status: 0 every device updated, 1 some failed, 3 paused.
+//
+// Build:
+//   g++ -std=c++17 -O2 -pthread -I../.. ota_rollout.cpp ota_publisher.cpp ota_stream.cpp ota_mqtt.cpp ../../MQTTOTAProtocol.cpp -o ota_rollout
+//
+// Usage:
+//   ota_rollout --image app.bin --version v --devices file [--broker host:port]
+//               [--topic ota/{device}] [--budget KB/s] [--guess KB/s] [--max-wave n]
+//               [--settle s] [--error-rate fraction] [--min-results n] [--device-timeout s] [--z85]
+
+#include "ota_mqtt.h"
+#include "ota_publisher.h"
+#include "ota_stream.h"
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <unistd.h>
+
+using namespace otapublisher;
+
+namespace {
+
+volatile sig_atomic_t g_stop = 0;
+
+void onSignal(int) {
+    g_stop = 1;
+}
+
+int64_t nowUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+enum DeviceState { DEVICE_PENDING, DEVICE_ACTIVE, DEVICE_UPDATED, DEVICE_FAILED };
+
+struct Device {
+    std::string id;
+    DeviceState state = DEVICE_PENDING;
+    int wave = 0;
+    int progress = -1;             // Last ota/progress, -1 before the first
+    int64_t admittedUs = 0;
+    int64_t lastReportUs = 0;
+    int64_t finishedUs = 0;
+    int64_t notBeforeUs = 0;       // Deferred by the device until then
+    int deferrals = 0;
+    std::string reason;
+};
+
+struct Options {
+    std::string broker = "localhost:1883";
+    std::string imagePath;
+    std::string version;
+    std::string devicesPath;
+    std::string topic = "ota/{device}";
+    double budget = 1024e3;        // bytes/s on the wire
+    double guess = 20e3;           // bytes/s of image per device
+    int maxWave = 50;
+    double settle = 30;
+    double errorRate = 0.1;
+    int minResults = 5;
+    double deviceTimeout = 120;
+    bool z85 = false;
+};
+
+class Rollout {
+public:
+    Rollout(const Options& options, std::shared_ptr<const Image> image, std::vector<std::string> ids)
+        : _options(options), _image(image),
+          _publisher([this](const std::string& topic, const std::string& payload) {
+              std::lock_guard<std::mutex> guard(_sendLock);
+              _client.publish(topic, payload);
+          }, 1) {
+        _publisher.setTopicTemplate(options.topic);
+        _config.maxRestarts = 0;   // An error fails the device; the rollout decides what to do
+        _config.z85 = options.z85;
+        for (const std::string& id : ids) {
+            _devices.push_back({});
+            _devices.back().id = id;
+        }
+        for (size_t i = 0; i < _devices.size(); i++) _index[_devices[i].id] = i;
+    }
+
+    bool connect() {
+        std::string host;
+        uint16_t port;
+        if (!otamqtt::parseAddress(_options.broker, host, port)) return false;
+        _client.onMessage([this](const std::string& topic, const std::string& payload) { _onMessage(topic, payload); });
+        bool ok = _client.connect(host, port, "rollout-" + std::to_string(getpid()));
+        for (const char* topic : { "ota/progress", "ota/error", "ota/success", OTA_TOPIC_RECEIPT,
+                                   OTA_TOPIC_BIN_RECEIPT, OTA_TOPIC_REQUEST, OTA_TOPIC_ADMISSION,
+                                   OTA_TOPIC_BIN_ADMISSION }) {
+            ok = ok && _client.subscribe(topic);
+        }
+        if (!ok) fprintf(stderr, "broker %s: %s\n", _options.broker.c_str(), _client.lastError().c_str());
+        return ok;
+    }
+
+    int run() {
+        _startUs = nowUs();
+        int64_t nextTick = _startUs;
+        int64_t lastStep = _startUs;
+        uint64_t lastBytesOut = 0;
+
+        while (!g_stop) {
+            if (!_client.poll(5)) {
+                fprintf(stderr, "broker connection lost: %s\n", _client.lastError().c_str());
+                return 1;
+            }
+            int64_t now = nowUs();
+
+            // Token bucket on the budget, 100 ms deep: new waves start their
+            // windows without bursting past it
+            _tokens = std::min(_tokens + _options.budget * (now - lastStep) / 1e6, _options.budget / 10);
+            lastStep = now;
+            if (_tokens > 0) {
+                uint64_t before = _client.bytesOut();
+                _publisher.step(now);
+                _tokens -= _client.bytesOut() - before;
+            }
+
+            if (now < nextTick) continue;
+            double elapsed = (now - nextTick + 1000000) / 1e6;
+            nextTick = now + 1000000;
+            _egress = (_client.bytesOut() - lastBytesOut) / elapsed;
+            lastBytesOut = _client.bytesOut();
+
+            _checkStreams(now);
+            _checkErrors();
+            _admit(now);
+            _printStatus(now);
+            if (_count(DEVICE_ACTIVE) == 0 && (_paused || _count(DEVICE_PENDING) == 0)) break;
+        }
+        return _summary();
+    }
+
+private:
+    void _onMessage(const std::string& topic, const std::string& payload) {
+        int64_t now = nowUs();
+        _publisher.deliver(topic, payload, now);
+        if (topic != "ota/progress" && topic != "ota/error" && topic != "ota/success") return;
+
+        std::string id, error;
+        int progress = -1;
+        otastream::scanMessage(payload.data(), payload.data() + payload.size(),
+                               [&](const char* key, size_t length, const otastream::Value& value) {
+            if (otastream::keyIs(key, length, "device")) id.assign(value.data, value.length);
+            else if (otastream::keyIs(key, length, "progress")) progress = atoi(std::string(value.data, value.length).c_str());
+            else if (otastream::keyIs(key, length, "error")) error.assign(value.data, value.length);
+        });
+        auto it = _index.find(id);
+        if (it == _index.end()) return;
+        Device& device = _devices[it->second];
+        if (device.state != DEVICE_ACTIVE) return;
+
+        device.lastReportUs = now;
+        if (topic == "ota/progress") {
+            device.progress = std::max(device.progress, progress);
+        } else if (topic == "ota/success") {
+            device.progress = 100;
+            _finish(device, DEVICE_UPDATED, "", now);
+        } else {
+            _finish(device, DEVICE_FAILED, error.empty() ? "ota/error" : error, now);
+        }
+    }
+
+    void _finish(Device& device, DeviceState state, const std::string& reason, int64_t now) {
+        device.state = state;
+        device.reason = reason;
+        device.finishedUs = now;
+        if (state == DEVICE_FAILED) {
+            fprintf(stderr, "%s failed: %s\n", device.id.c_str(), reason.c_str());
+        }
+    }
+
+    // Streams that gave up or were deferred, and devices that went quiet
+    void _checkStreams(int64_t now) {
+        std::unordered_map<std::string, StreamReport> streams;
+        for (const StreamReport& report : _publisher.reports()) streams[report.device] = report;
+
+        for (Device& device : _devices) {
+            if (device.state != DEVICE_ACTIVE) continue;
+            const StreamReport& stream = streams[device.id];
+            if (stream.state == STREAM_DEFERRED) {
+                device.state = DEVICE_PENDING;
+                device.notBeforeUs = stream.retryUs;
+                device.deferrals++;
+                fprintf(stderr, "%s deferred the update for %.0f s\n", device.id.c_str(),
+                        (stream.retryUs - now) / 1e6);
+            } else if (stream.state == STREAM_FAILED) {
+                _finish(device, DEVICE_FAILED, "stream failed", now);
+            } else if (now - device.lastReportUs > _options.deviceTimeout * 1e6) {
+                _finish(device, DEVICE_FAILED, "no report", now);
+            }
+        }
+    }
+
+    void _checkErrors() {
+        size_t failed = _count(DEVICE_FAILED);
+        size_t results = failed + _count(DEVICE_UPDATED);
+        if (_paused || (int)results < _options.minResults) return;
+        if (failed >= _options.errorRate * results) {
+            _paused = true;
+            fprintf(stderr, "pausing rollout: %zu of %zu finished devices failed\n", failed, results);
+        }
+    }
+
+    // Image bytes per second one device takes, from what the devices report
+    double _deviceRate(const Device& device) const {
+        if (device.state == DEVICE_UPDATED) {
+            return _image->data.size() * 1e6 / std::max<int64_t>(device.finishedUs - device.admittedUs, 1);
+        }
+        if (device.progress <= 0) return 0;
+        return device.progress / 100.0 * _image->data.size() * 1e6 /
+               std::max<int64_t>(device.lastReportUs - device.admittedUs, 1);
+    }
+
+    double _medianRate() const {
+        std::vector<double> rates;
+        for (const Device& device : _devices) {
+            double rate = _deviceRate(device);
+            if (rate > 0) rates.push_back(rate);
+        }
+        if (rates.empty()) return _options.guess;
+        std::nth_element(rates.begin(), rates.begin() + rates.size() / 2, rates.end());
+        return rates[rates.size() / 2];
+    }
+
+    void _admit(int64_t now) {
+        if (_paused) return;
+        size_t ready = 0;
+        for (const Device& device : _devices) ready += device.state == DEVICE_PENDING && device.notBeforeUs <= now;
+        if (ready == 0) return;
+
+        // The current wave first has to show what it can take
+        for (const Device& device : _devices) {
+            if (device.state == DEVICE_ACTIVE && device.wave == _wave && device.progress <= 0 &&
+                now - device.admittedUs < _options.settle * 1e6) {
+                return;
+            }
+        }
+
+        // Base64 and JSON put about 4/3 of the image bytes on the wire, Z85 5/4
+        double inflation = _options.z85 ? 5.0 / 4 : 4.0 / 3;
+        _median = _medianRate();
+        double committed = 0;
+        for (const Device& device : _devices) {
+            if (device.state != DEVICE_ACTIVE) continue;
+            double rate = _deviceRate(device);
+            committed += (rate > 0 ? rate : _median) * inflation;
+        }
+        _committed = std::max(committed, _egress);
+        double headroom = _options.budget - _committed;
+        int size = std::min(_options.maxWave, (int)(headroom / (_median * inflation)));
+        if (size <= 0) return;
+
+        _wave++;
+        int admitted = 0;
+        for (Device& device : _devices) {
+            if (admitted == size) break;
+            if (device.state != DEVICE_PENDING || device.notBeforeUs > now) continue;
+            if (!_publisher.startStream(device.id, _image, _config, now)) {
+                _finish(device, DEVICE_FAILED, "cannot start stream", now);
+                continue;
+            }
+            device.state = DEVICE_ACTIVE;
+            device.wave = _wave;
+            device.admittedUs = now;
+            device.lastReportUs = now;
+            admitted++;
+        }
+        fprintf(stderr, "wave %d: %d devices at %.1f KB/s each, %.0f of %.0f KB/s committed\n", _wave, admitted,
+                _median / 1024, _committed / 1024, _options.budget / 1024);
+    }
+
+    void _printStatus(int64_t now) const {
+        printf("%7.1fs wave %3d | pending %5zu active %5zu updated %5zu failed %4zu | egress %8.1f KB/s of %.0f%s\n",
+               (now - _startUs) / 1e6, _wave, _count(DEVICE_PENDING), _count(DEVICE_ACTIVE),
+               _count(DEVICE_UPDATED), _count(DEVICE_FAILED), _egress / 1024, _options.budget / 1024,
+               _paused ? " | PAUSED" : "");
+        fflush(stdout);
+    }
+
+    int _summary() const {
+        int64_t now = nowUs();
+        size_t updated = _count(DEVICE_UPDATED), failed = _count(DEVICE_FAILED);
+        std::vector<double> times;
+        int deferrals = 0;
+        for (const Device& device : _devices) {
+            if (device.state == DEVICE_UPDATED) times.push_back((device.finishedUs - device.admittedUs) / 1e6);
+            deferrals += device.deferrals;
+        }
+        std::sort(times.begin(), times.end());
+
+        printf("\n%s after %.1f s in %d waves: %zu updated, %zu failed, %zu not started, %d deferrals\n",
+               _paused ? "paused" : g_stop ? "interrupted" : "done", (now - _startUs) / 1e6, _wave, updated, failed,
+               _count(DEVICE_PENDING) + _count(DEVICE_ACTIVE), deferrals);
+        if (!times.empty()) {
+            printf("update time p50 %.1f s, p95 %.1f s, max %.1f s; sent %.2f MB\n", times[times.size() / 2],
+                   times[std::min(times.size() - 1, times.size() * 95 / 100)], times.back(),
+                   _client.bytesOut() / 1e6);
+        }
+        for (const Device& device : _devices) {
+            if (device.state == DEVICE_FAILED) printf("failed %s: %s\n", device.id.c_str(), device.reason.c_str());
+        }
+        if (_paused) return 3;
+        return failed || updated < _devices.size() ? 1 : 0;
+    }
+
+    size_t _count(DeviceState state) const {
+        size_t count = 0;
+        for (const Device& device : _devices) count += device.state == state;
+        return count;
+    }
+
+    Options _options;
+    std::shared_ptr<const Image> _image;
+    StreamConfig _config;
+    otamqtt::Client _client;
+    std::mutex _sendLock;
+    Publisher _publisher;
+    std::vector<Device> _devices;
+    std::unordered_map<std::string, size_t> _index;
+    int64_t _startUs = 0;
+    int _wave = 0;
+    bool _paused = false;
+    double _egress = 0;            // Measured, bytes/s
+    double _committed = 0;
+    double _median = 0;
+    double _tokens = 0;            // Bytes the budget still allows to send now
+};
+
+bool readLines(const std::string& path, std::vector<std::string>& lines) {
+    FILE* file = fopen(path.c_str(), "r");
+    if (!file) return false;
+    char line[256];
+    while (fgets(line, sizeof(line), file)) {
+        std::string text(line);
+        while (!text.empty() && (text.back() == '\n' || text.back() == '\r' || text.back() == ' ')) text.pop_back();
+        if (!text.empty() && text[0] != '#') lines.push_back(text);
+    }
+    fclose(file);
+    return true;
+}
+
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        bool value = i + 1 < argc;
+        if (!strcmp(argv[i], "--broker") && value) options.broker = argv[++i];
+        else if (!strcmp(argv[i], "--image") && value) options.imagePath = argv[++i];
+        else if (!strcmp(argv[i], "--version") && value) options.version = argv[++i];
+        else if (!strcmp(argv[i], "--devices") && value) options.devicesPath = argv[++i];
+        else if (!strcmp(argv[i], "--topic") && value) options.topic = argv[++i];
+        else if (!strcmp(argv[i], "--budget") && value) options.budget = atof(argv[++i]) * 1024;
+        else if (!strcmp(argv[i], "--guess") && value) options.guess = atof(argv[++i]) * 1024;
+        else if (!strcmp(argv[i], "--max-wave") && value) options.maxWave = std::max(1, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "--settle") && value) options.settle = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--error-rate") && value) options.errorRate = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--min-results") && value) options.minResults = std::max(1, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "--device-timeout") && value) options.deviceTimeout = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--z85")) options.z85 = true;
+        else {
+            options.imagePath.clear();
+            break;
+        }
+    }
+    if (options.imagePath.empty() || options.version.empty() || options.devicesPath.empty()) {
+        fprintf(stderr, "usage: %s --image app.bin --version v --devices file [--broker host:port]\n"
+                        "       [--topic ota/{device}] [--budget KB/s] [--guess KB/s] [--max-wave n]\n"
+                        "       [--settle s] [--error-rate fraction] [--min-results n] [--device-timeout s] [--z85]\n",
+                argv[0]);
+        return 2;
+    }
+
+    auto image = std::make_shared<Image>();
+    image->version = options.version;
+    FILE* file = fopen(options.imagePath.c_str(), "rb");
+    if (!file) {
+        fprintf(stderr, "cannot read %s\n", options.imagePath.c_str());
+        return 1;
+    }
+    uint8_t buffer[65536];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) image->data.insert(image->data.end(), buffer, buffer + n);
+    fclose(file);
+    // A bundle (ota_bundle_tool) is sent like an image; the device checks its sections
+    OTABundleReader bundle;
+    bundle.reset();
+    size_t used = 0;
+    if (!image->data.empty() && image->data[0] == OTA_BUNDLE_MAGIC) {
+        if (!bundle.readIndex(image->data.data(), image->data.size(), &used) || !bundle.indexComplete ||
+            bundle.header.totalLength != image->data.size()) {
+            fprintf(stderr, "%s is not a valid bundle\n", options.imagePath.c_str());
+            return 1;
+        }
+    } else {
+        OTAImageCheck check = otaCheckImageHeader(image->data.data(), image->data.size(), nullptr);
+        if (check != OTA_IMAGE_OK) {
+            fprintf(stderr, "%s is not an app image: %s\n", options.imagePath.c_str(), otaImageCheckName(check));
+            return 1;
+        }
+    }
+
+    std::vector<std::string> ids;
+    if (!readLines(options.devicesPath, ids) || ids.empty()) {
+        fprintf(stderr, "no devices in %s\n", options.devicesPath.c_str());
+        return 1;
+    }
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    Rollout rollout(options, image, ids);
+    if (!rollout.connect()) return 1;
+    fprintf(stderr, "rolling out %s (%zu bytes) to %zu devices, budget %.0f KB/s\n", options.version.c_str(),
+            image->data.size(), ids.size(), options.budget / 1024);
+    return rollout.run();
+}
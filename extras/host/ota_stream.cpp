@@ -0,0 +1,339 @@
+#include "ota_stream.h"
+
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define OTA_HAVE_AVX2_BUILD 1
+#else
+#define OTA_HAVE_AVX2_BUILD 0
+#endif
+
+namespace {
+
+const uint8_t kInvalid = 0xFF;
+
+struct DecodeTable {
+    uint8_t values[256];
+    DecodeTable() {
+        memset(values, kInvalid, sizeof(values));
+        const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        for (int i = 0; i < 64; i++) values[(uint8_t)alphabet[i]] = (uint8_t)i;
+    }
+};
+
+const DecodeTable kTable;
+
+// Decodes whole quads; returns the input bytes consumed. Stops at padding or
+// at the first invalid character.
+size_t decodeScalarQuads(const uint8_t* in, size_t length, uint8_t* out, size_t* written) {
+    size_t i = 0, o = 0;
+    for (; i + 4 <= length; i += 4) {
+        uint8_t a = kTable.values[in[i]], b = kTable.values[in[i + 1]];
+        uint8_t c = kTable.values[in[i + 2]], d = kTable.values[in[i + 3]];
+        if ((a | b | c | d) & 0xC0) break;  // kInvalid has the top bits set
+        uint32_t v = ((uint32_t)a << 18) | ((uint32_t)b << 12) | ((uint32_t)c << 6) | d;
+        out[o++] = (uint8_t)(v >> 16);
+        out[o++] = (uint8_t)(v >> 8);
+        out[o++] = (uint8_t)v;
+    }
+    *written = o;
+    return i;
+}
+
+#if OTA_HAVE_AVX2_BUILD
+// 32 characters -> 24 bytes per iteration (nibble-LUT validation and
+// translation, then multiply-add repacking)
+__attribute__((target("avx2")))
+size_t decodeAvx2Blocks(const uint8_t* in, size_t length, uint8_t* out, size_t* written) {
+    const __m256i lutLo = _mm256_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m256i lutHi = _mm256_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lutRoll = _mm256_setr_epi8(
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i mask2F = _mm256_set1_epi8(0x2F);
+    const __m256i mergeAB = _mm256_set1_epi32(0x01400140);
+    const __m256i mergeABC = _mm256_set1_epi32(0x00011000);
+    const __m256i pack = _mm256_setr_epi8(
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1);
+
+    size_t i = 0, o = 0;
+    // The store writes 32 bytes for 24 valid ones; callers leave 8 bytes of slack
+    while (i + 32 <= length) {
+        __m256i str = _mm256_loadu_si256((const __m256i*)(in + i));
+        __m256i hiNibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask2F);
+        __m256i loNibbles = _mm256_and_si256(str, mask2F);
+        __m256i hi = _mm256_shuffle_epi8(lutHi, hiNibbles);
+        __m256i lo = _mm256_shuffle_epi8(lutLo, loNibbles);
+        if (!_mm256_testz_si256(lo, hi)) break;  // Padding or invalid: scalar tail
+
+        __m256i eq2F = _mm256_cmpeq_epi8(str, mask2F);
+        __m256i roll = _mm256_shuffle_epi8(lutRoll, _mm256_add_epi8(eq2F, hiNibbles));
+        str = _mm256_add_epi8(str, roll);
+
+        str = _mm256_maddubs_epi16(str, mergeAB);
+        str = _mm256_madd_epi16(str, mergeABC);
+        str = _mm256_shuffle_epi8(str, pack);
+        str = _mm256_permutevar8x32_epi32(str, lanes);
+        _mm256_storeu_si256((__m256i*)(out + o), str);
+
+        i += 32;
+        o += 24;
+    }
+    *written = o;
+    return i;
+}
+
+// 24 bytes -> 32 characters per iteration: a byte shuffle puts each 3-byte
+// group in a 32-bit lane, multiplies move its sextets into separate bytes,
+// and a saturating subtract plus one compare pick each byte's alphabet offset
+__attribute__((target("avx2")))
+size_t encodeAvx2Blocks(const uint8_t* in, size_t length, char* out) {
+    const __m256i shuffle = _mm256_setr_epi8(
+        1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+        1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+    const __m256i offsets = _mm256_setr_epi8(
+        71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 65, 0, 0,
+        71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 65, 0, 0);
+
+    size_t i = 0;
+    // Each half reads 16 bytes for its 12, hence the 4 bytes of slack
+    for (; i + 28 <= length; i += 24, out += 32) {
+        __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(in + i))),
+                                            _mm_loadu_si128((const __m128i*)(in + i + 12)), 1);
+        v = _mm256_shuffle_epi8(v, shuffle);
+        __m256i ac = _mm256_mulhi_epu16(_mm256_and_si256(v, _mm256_set1_epi32(0x0FC0FC00)),
+                                        _mm256_set1_epi32(0x04000040));
+        __m256i bd = _mm256_mullo_epi16(_mm256_and_si256(v, _mm256_set1_epi32(0x003F03F0)),
+                                        _mm256_set1_epi32(0x01000010));
+        __m256i sextets = _mm256_or_si256(ac, bd);
+
+        // 0-25 -> 13, 26-51 -> 0, 52-61 -> 1-10, 62 -> 11, 63 -> 12
+        __m256i range = _mm256_subs_epu8(sextets, _mm256_set1_epi8(51));
+        __m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), sextets);
+        range = _mm256_or_si256(range, _mm256_and_si256(upper, _mm256_set1_epi8(13)));
+        _mm256_storeu_si256((__m256i*)out, _mm256_add_epi8(sextets, _mm256_shuffle_epi8(offsets, range)));
+    }
+    return i;
+}
+
+bool detectAvx2() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+bool g_useAvx2 = detectAvx2();
+#else
+bool g_useAvx2 = false;
+#endif
+
+const uint32_t kSha256Init[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+const uint32_t kSha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+inline uint32_t rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+}
+
+namespace otastream {
+
+// BASE64
+
+bool selectDecoder(bool allowAvx2) {
+#if OTA_HAVE_AVX2_BUILD
+    g_useAvx2 = allowAvx2 && __builtin_cpu_supports("avx2");
+#else
+    (void)allowAvx2;
+#endif
+    return g_useAvx2;
+}
+
+bool avx2Enabled() {
+    return g_useAvx2;
+}
+
+const char* decodeStatusName(DecodeStatus status) {
+    switch (status) {
+        case DECODE_BAD_LENGTH: return "length not a multiple of 4";
+        case DECODE_BAD_CHAR: return "invalid character";
+        case DECODE_BAD_PADDING: return "misplaced padding";
+        default: return "ok";
+    }
+}
+
+DecodeStatus decodeBase64(const uint8_t* in, size_t length, uint8_t* out, size_t* outLength) {
+    *outLength = 0;
+    if (length % 4 != 0) return DECODE_BAD_LENGTH;
+
+    size_t consumed = 0, written = 0;
+#if OTA_HAVE_AVX2_BUILD
+    if (g_useAvx2) {
+        consumed = decodeAvx2Blocks(in, length, out, &written);
+    }
+#endif
+    size_t tailWritten = 0;
+    consumed += decodeScalarQuads(in + consumed, length - consumed, out + written, &tailWritten);
+    written += tailWritten;
+
+    if (consumed < length) {
+        // Only the last quad may stop early, and only because of padding
+        if (length - consumed != 4) return DECODE_BAD_CHAR;
+        const uint8_t* q = in + consumed;
+        uint8_t a = kTable.values[q[0]], b = kTable.values[q[1]];
+        if (a == kInvalid || b == kInvalid) return DECODE_BAD_CHAR;
+        if (q[2] == '=' && q[3] == '=') {
+            out[written++] = (uint8_t)((a << 2) | (b >> 4));
+        } else if (q[3] == '=') {
+            uint8_t c = kTable.values[q[2]];
+            if (c == kInvalid) return q[2] == '=' ? DECODE_BAD_PADDING : DECODE_BAD_CHAR;
+            out[written++] = (uint8_t)((a << 2) | (b >> 4));
+            out[written++] = (uint8_t)((b << 4) | (c >> 2));
+        } else {
+            return (q[2] == '=' || q[0] == '=' || q[1] == '=') ? DECODE_BAD_PADDING : DECODE_BAD_CHAR;
+        }
+    }
+    *outLength = written;
+    return DECODE_OK;
+}
+
+size_t encodeBase64(const uint8_t* data, size_t length, char* out) {
+    size_t consumed = 0;
+#if OTA_HAVE_AVX2_BUILD
+    if (g_useAvx2) consumed = encodeAvx2Blocks(data, length, out);
+#endif
+    size_t written = consumed / 3 * 4;
+    return written + otaBase64Encode(data + consumed, length - consumed, out + written);
+}
+
+std::string encodeBase64(const uint8_t* data, size_t length) {
+    std::string out(otaBase64EncodedLength(length) + 1, '\0');
+    out.resize(encodeBase64(data, length, &out[0]));
+    return out;
+}
+
+// Z85
+
+std::string encodeZ85(const uint8_t* data, size_t length) {
+    std::string out(otaZ85EncodedLength(length) + 1, '\0');
+    out.resize(otaZ85Encode(data, length, &out[0]));
+    return out;
+}
+
+// SHA-256
+
+Sha256::Sha256() {
+    memcpy(_state, kSha256Init, sizeof(_state));
+}
+
+void Sha256::compress(const uint8_t* p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = ((uint32_t)p[i * 4] << 24) | ((uint32_t)p[i * 4 + 1] << 16) |
+               ((uint32_t)p[i * 4 + 2] << 8) | p[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = _state[0], b = _state[1], c = _state[2], d = _state[3];
+    uint32_t e = _state[4], f = _state[5], g = _state[6], h = _state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + kSha256K[i] + w[i];
+        uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    _state[0] += a; _state[1] += b; _state[2] += c; _state[3] += d;
+    _state[4] += e; _state[5] += f; _state[6] += g; _state[7] += h;
+}
+
+void Sha256::update(const uint8_t* data, size_t length) {
+    _totalLength += length;
+    if (_blockLength) {
+        size_t take = std::min(length, 64 - _blockLength);
+        memcpy(_block + _blockLength, data, take);
+        _blockLength += take;
+        data += take;
+        length -= take;
+        if (_blockLength < 64) return;
+        compress(_block);
+        _blockLength = 0;
+    }
+    for (; length >= 64; data += 64, length -= 64) compress(data);
+    memcpy(_block, data, length);
+    _blockLength = length;
+}
+
+void Sha256::finish(uint8_t digest[32]) {
+    uint64_t bits = _totalLength * 8;
+    uint8_t pad = 0x80;
+    update(&pad, 1);
+    uint8_t zero = 0;
+    while (_blockLength != 56) update(&zero, 1);
+    uint8_t length[8];
+    for (int i = 0; i < 8; i++) length[i] = (uint8_t)(bits >> (56 - i * 8));
+    update(length, 8);
+    for (int i = 0; i < 8; i++) {
+        digest[i * 4] = (uint8_t)(_state[i] >> 24);
+        digest[i * 4 + 1] = (uint8_t)(_state[i] >> 16);
+        digest[i * 4 + 2] = (uint8_t)(_state[i] >> 8);
+        digest[i * 4 + 3] = (uint8_t)_state[i];
+    }
+}
+
+std::string hex(const uint8_t* data, size_t length) {
+    static const char digits[] = "0123456789abcdef";
+    std::string out;
+    for (size_t i = 0; i < length; i++) {
+        out += digits[data[i] >> 4];
+        out += digits[data[i] & 15];
+    }
+    return out;
+}
+
+// MESSAGE SCANNING
+
+const char* stringEnd(const char* p, const char* end, bool* escaped) {
+    *escaped = false;
+    for (;;) {
+        const char* quote = (const char*)memchr(p, '"', end - p);
+        if (!quote) return nullptr;
+        const char* backslash = (const char*)memchr(p, '\\', quote - p);
+        if (!backslash) return quote;
+        *escaped = true;
+        p = backslash + 2;  // Skips the escaped character, which may be a quote
+        if (p >= end) return nullptr;
+    }
+}
+
+std::string unescape(const char* data, size_t length) {
+    std::string out;
+    out.reserve(length);
+    for (size_t i = 0; i < length; i++) {
+        if (data[i] == '\\' && i + 1 < length) i++;
+        out += data[i];
+    }
+    return out;
+}
+
+}
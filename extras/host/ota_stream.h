@@ -0,0 +1,134 @@
+// Host-side building blocks for tools that read or write MQTTOTA chunk
+// streams: a single-pass key scanner for OTA messages, Base64 (AVX2 decode
+// and encode with scalar fallbacks), Z85, SHA-256 and hex formatting.
+//
+// Build together with ../../MQTTOTAProtocol.cpp, see ota_stream_verify.cpp.
+
+#ifndef OTA_STREAM_H
+#define OTA_STREAM_H
+
+#include "MQTTOTAProtocol.h"
+
+#include <cstring>
+#include <string>
+
+namespace otastream {
+
+// BASE64
+
+enum DecodeStatus { DECODE_OK, DECODE_BAD_LENGTH, DECODE_BAD_CHAR, DECODE_BAD_PADDING };
+
+const char* decodeStatusName(DecodeStatus status);
+
+// Base64 uses AVX2 (decode and encode) when the CPU has it unless disabled;
+// returns whether it is in use
+bool selectDecoder(bool allowAvx2);
+bool avx2Enabled();
+
+// Output buffer size decodeBase64() needs for length input bytes
+inline size_t decodedCapacity(size_t length) {
+    return length / 4 * 3 + 32;
+}
+
+DecodeStatus decodeBase64(const uint8_t* in, size_t length, uint8_t* out, size_t* outLength);
+
+// Standard alphabet with padding and no line breaks, as the server sends it;
+// the same output as otaBase64Encode() (and libb64)
+std::string encodeBase64(const uint8_t* data, size_t length);
+
+// Into a caller buffer of otaBase64EncodedLength(length) + 1 bytes,
+// NUL-terminated; returns the characters written
+size_t encodeBase64(const uint8_t* data, size_t length, char* out);
+
+// Z85
+
+// Z85Part text for a chunk, as otaZ85Encode() writes it; decode with
+// otaZ85Decode()
+std::string encodeZ85(const uint8_t* data, size_t length);
+
+// SHA-256 (FIPS 180-4)
+
+class Sha256 {
+public:
+    Sha256();
+    void update(const uint8_t* data, size_t length);
+    void finish(uint8_t digest[32]);
+
+private:
+    void compress(const uint8_t* block);
+
+    uint32_t _state[8];
+    uint8_t _block[64];
+    size_t _blockLength = 0;
+    uint64_t _totalLength = 0;
+};
+
+std::string hex(const uint8_t* data, size_t length);
+
+// MESSAGE SCANNING
+
+struct Value {
+    const char* data = nullptr;
+    size_t length = 0;
+    bool isString = false;
+    bool escaped = false;          // The string holds backslash escapes (e.g. "\/")
+};
+
+// Finds the closing quote of a JSON string starting after the opening one
+const char* stringEnd(const char* p, const char* end, bool* escaped);
+
+std::string unescape(const char* data, size_t length);
+
+inline bool keyIs(const char* key, size_t length, const char* name) {
+    return strlen(name) == length && memcmp(key, name, length) == 0;
+}
+
+/**
+ * @brief One pass over a message: each "key": value pair is reported through
+ * visit(key, keyLength, value), nested objects included
+ *
+ * Not a JSON parser: values are not validated, arrays are not descended into
+ * as values, and keys are matched without unescaping.
+ */
+template <typename Visit>
+void scanMessage(const char* p, const char* end, Visit visit) {
+    while (p < end) {
+        const char* quote = (const char*)memchr(p, '"', end - p);
+        if (!quote) return;
+        const char* keyEnd = (const char*)memchr(quote + 1, '"', end - quote - 1);
+        if (!keyEnd) return;
+
+        const char* q = keyEnd + 1;
+        while (q < end && (*q == ' ' || *q == '\t')) q++;
+        if (q >= end || *q != ':') {
+            p = keyEnd + 1;
+            continue;
+        }
+        q++;
+        while (q < end && (*q == ' ' || *q == '\t')) q++;
+
+        Value value;
+        if (q < end && *q == '"') {
+            const char* valueEnd = stringEnd(q + 1, end, &value.escaped);
+            if (!valueEnd) return;
+            value.data = q + 1;
+            value.length = valueEnd - q - 1;
+            value.isString = true;
+            p = valueEnd + 1;
+        } else {
+            const char* valueEnd = q;
+            while (valueEnd < end && *valueEnd != ',' && *valueEnd != '}' && *valueEnd != '{' &&
+                   *valueEnd != '[' && *valueEnd != ']') {
+                valueEnd++;
+            }
+            value.data = q;
+            value.length = valueEnd - q;
+            p = valueEnd;
+        }
+        visit(quote + 1, (size_t)(keyEnd - quote - 1), value);
+    }
+}
+
+}
+
+#endif // OTA_STREAM_H
@@ -0,0 +1,335 @@
+// Verifies a captured MQTTOTA chunk stream before a rollout.
+//
+// The capture is memory-mapped and holds one OTA message per line, optionally
+// prefixed by its topic, e.g. from
+//   mosquitto_sub -t ota -v > capture.txt
+// Every Base64Part (or full-image Base64) is decoded, with AVX2 when the CPU
+// has it and a scalar decoder otherwise. Images (one per FirmwareVersion) are
+// then checked and hashed in parallel, one image per worker thread:
+//   - part sequence as the device expects it: 1..TotalParts, in order, no
+//     gaps or duplicates, consistent TotalParts
+//   - Base64 validity, chunk sizes and MQTT_OTA_MAX_CHUNK_SIZE
+//   - the image header of the first chunk and of the whole image, with the
+//     same otaCheckImageHeader() the device runs
+//   - SHA-256 of the image, and the appended digest esp_ota_end() checks
+//
+// Build:
+//   g++ -std=c++17 -O3 -pthread -I../.. ota_stream_verify.cpp ota_stream.cpp ../../MQTTOTAProtocol.cpp -o ota_stream_verify
+//
+// Usage:
+//   ota_stream_verify [-j threads] [--scalar] [--max-chunk bytes] capture.txt
+
+#include "ota_stream.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+using namespace otastream;
+
+// CAPTURE
+
+struct Chunk {
+    int part = 0;
+    int totalParts = 0;
+    size_t line = 0;
+    const uint8_t* base64 = nullptr;
+    size_t base64Length = 0;
+    std::string unescaped;          // Only used when the value contained "\/"
+};
+
+struct Image {
+    std::string version;
+    std::vector<Chunk> chunks;      // In capture order
+    std::vector<std::string> anomalies;
+    size_t base64Bytes = 0;
+    size_t decodedBytes = 0;
+    double decodeSeconds = 0;
+    std::string sha256;
+    OTAImageCheck header = OTA_IMAGE_OK;
+    OTAImageInfo info;
+};
+
+// IMAGE VERIFICATION
+
+size_t g_maxChunkSize = 65536;  // MQTT_OTA_MAX_CHUNK_SIZE
+
+void verifyImage(Image& image) {
+    char note[256];
+    auto anomaly = [&](const char* format, auto... args) {
+        snprintf(note, sizeof(note), format, args...);
+        image.anomalies.push_back(note);
+    };
+
+    // Sequence, as _processOTAChunk enforces it
+    int totalParts = image.chunks.empty() ? 0 : image.chunks[0].totalParts;
+    std::vector<const Chunk*> byPart(totalParts > 0 ? totalParts + 1 : 1, nullptr);
+    int expected = 1;
+    for (const Chunk& chunk : image.chunks) {
+        if (chunk.totalParts != totalParts) {
+            anomaly("line %zu: TotalParts %d, first chunk said %d", chunk.line, chunk.totalParts, totalParts);
+        }
+        if (chunk.part < 1 || chunk.part > totalParts) {
+            anomaly("line %zu: PartIndex %d outside 1..%d", chunk.line, chunk.part, totalParts);
+            continue;
+        }
+        if (byPart[chunk.part]) {
+            anomaly("line %zu: duplicate part %d (first at line %zu)", chunk.line, chunk.part, byPart[chunk.part]->line);
+            continue;
+        }
+        if (chunk.part != expected) {
+            anomaly("line %zu: part %d arrives when the device expects %d", chunk.line, chunk.part, expected);
+        }
+        byPart[chunk.part] = &chunk;
+        expected = chunk.part + 1;
+    }
+    for (int part = 1; part <= totalParts; part++) {
+        if (!byPart[part]) anomaly("part %d/%d missing", part, totalParts);
+    }
+
+    // Decode in part order into one buffer
+    size_t capacity = 0;
+    for (int part = 1; part <= totalParts; part++) {
+        if (byPart[part]) capacity += decodedCapacity(byPart[part]->base64Length);
+    }
+    std::vector<uint8_t> data(capacity + 32);
+    size_t offset = 0;
+    size_t firstChunkSize = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int part = 1; part <= totalParts; part++) {
+        const Chunk* chunk = byPart[part];
+        if (!chunk) continue;
+
+        const uint8_t* base64 = chunk->unescaped.empty() ? chunk->base64 : (const uint8_t*)chunk->unescaped.data();
+        size_t base64Length = chunk->unescaped.empty() ? chunk->base64Length : chunk->unescaped.size();
+        image.base64Bytes += base64Length;
+
+        size_t written = 0;
+        DecodeStatus status = decodeBase64(base64, base64Length, data.data() + offset, &written);
+        if (status != DECODE_OK) {
+            anomaly("part %d (line %zu): Base64 %s", part, chunk->line, decodeStatusName(status));
+            continue;
+        }
+
+        if (part == 1) {
+            firstChunkSize = written;
+            // The device checks the header on the first chunk alone
+            if (written < OTA_IMAGE_MIN_HEADER) {
+                anomaly("part 1 decodes to %zu bytes, the device needs %d for the image header",
+                        written, OTA_IMAGE_MIN_HEADER);
+            }
+        } else if (part < totalParts && written != firstChunkSize) {
+            anomaly("part %d decodes to %zu bytes, part 1 to %zu", part, written, firstChunkSize);
+        }
+        if (written > g_maxChunkSize) {
+            anomaly("part %d decodes to %zu bytes, above the %zu byte chunk limit", part, written, g_maxChunkSize);
+        }
+        offset += written;
+    }
+    image.decodeSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    image.decodedBytes = offset;
+
+    image.header = otaCheckImageHeader(data.data(), offset, &image.info);
+    if (image.header != OTA_IMAGE_OK) {
+        anomaly("image header: %s", otaImageCheckName(image.header));
+    }
+
+    // One pass: the state after the body also yields the appended digest check
+    bool checkAppended = image.header == OTA_IMAGE_OK && image.info.hashAppended;
+    if (checkAppended && offset < OTA_IMAGE_MIN_HEADER + 32) {
+        anomaly("image too short for its appended SHA-256");
+        checkAppended = false;
+    }
+
+    Sha256 sha;
+    size_t bodyLength = checkAppended ? offset - 32 : offset;
+    sha.update(data.data(), bodyLength);
+    if (checkAppended) {
+        // esp_ota_end() rejects the image if the appended digest does not match
+        Sha256 body = sha;
+        uint8_t bodyDigest[32];
+        body.finish(bodyDigest);
+        if (memcmp(bodyDigest, data.data() + bodyLength, 32) != 0) {
+            anomaly("appended SHA-256 does not match the image (esp_ota_end would fail)");
+        }
+        sha.update(data.data() + bodyLength, 32);
+    }
+    uint8_t digest[32];
+    sha.finish(digest);
+    image.sha256 = hex(digest, 32);
+}
+
+}
+
+int main(int argc, char** argv) {
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    bool forceScalar = false;
+    const char* path = nullptr;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+            threads = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--scalar")) {
+            forceScalar = true;
+        } else if (!strcmp(argv[i], "--max-chunk") && i + 1 < argc) {
+            g_maxChunkSize = strtoul(argv[++i], nullptr, 10);
+        } else {
+            path = argv[i];
+        }
+    }
+    if (!path) {
+        fprintf(stderr, "usage: %s [-j threads] [--scalar] [--max-chunk bytes] capture.txt\n", argv[0]);
+        return 2;
+    }
+
+    selectDecoder(!forceScalar);
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(path);
+        return 2;
+    }
+    size_t size = st.st_size;
+    const char* mapped = size ? (const char*)mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : "";
+    if (mapped == MAP_FAILED) {
+        perror("mmap");
+        return 2;
+    }
+    if (size) madvise((void*)mapped, size, MADV_SEQUENTIAL);
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::map<std::string, Image> images;
+    std::vector<std::string> streamAnomalies;
+    size_t lineNumber = 0, messages = 0;
+    char note[256];
+
+    const char* p = mapped;
+    const char* end = mapped + size;
+    while (p < end) {
+        const char* lineEnd = (const char*)memchr(p, '\n', end - p);
+        if (!lineEnd) lineEnd = end;
+        lineNumber++;
+
+        Chunk chunk;
+        chunk.line = lineNumber;
+        std::string version, eventType;
+        bool fullImage = false, isError = false, hasPart = false;
+
+        scanMessage(p, lineEnd, [&](const char* key, size_t keyLength, const Value& value) {
+            if (keyIs(key, keyLength, "EventType")) {
+                eventType.assign(value.data, value.length);
+            } else if (keyIs(key, keyLength, "FirmwareVersion")) {
+                version.assign(value.data, value.length);
+            } else if (keyIs(key, keyLength, "Base64Part") || keyIs(key, keyLength, "Base64")) {
+                fullImage = keyIs(key, keyLength, "Base64");
+                chunk.base64 = (const uint8_t*)value.data;
+                chunk.base64Length = value.length;
+                if (value.escaped) chunk.unescaped = unescape(value.data, value.length);
+            } else if (keyIs(key, keyLength, "PartIndex")) {
+                chunk.part = atoi(std::string(value.data, value.length).c_str());
+                hasPart = true;
+            } else if (keyIs(key, keyLength, "TotalParts")) {
+                chunk.totalParts = atoi(std::string(value.data, value.length).c_str());
+            } else if (keyIs(key, keyLength, "IsError")) {
+                isError = value.length == 4 && !memcmp(value.data, "true", 4);
+            }
+        });
+
+        p = lineEnd + 1;
+        if (eventType.empty() && !chunk.base64) continue;  // Blank or unrelated line
+        messages++;
+
+        if (eventType != "UpdateFirmwareDevice") {
+            if (!eventType.empty()) continue;  // Diagnostics requests and the like
+            snprintf(note, sizeof(note), "line %zu: no EventType", lineNumber);
+            streamAnomalies.push_back(note);
+            continue;
+        }
+        if (isError) {
+            snprintf(note, sizeof(note), "line %zu: server error message for %s", lineNumber, version.c_str());
+            streamAnomalies.push_back(note);
+            continue;
+        }
+        if (version.empty() || !chunk.base64 || (!fullImage && !hasPart)) {
+            snprintf(note, sizeof(note), "line %zu: incomplete OTA message", lineNumber);
+            streamAnomalies.push_back(note);
+            continue;
+        }
+        if (fullImage) {
+            chunk.part = 1;
+            chunk.totalParts = 1;
+        }
+
+        Image& image = images[version];
+        image.version = version;
+        image.chunks.push_back(std::move(chunk));
+    }
+
+    auto scanned = std::chrono::steady_clock::now();
+
+    std::vector<Image*> work;
+    for (auto& entry : images) work.push_back(&entry.second);
+
+    std::atomic<size_t> next{0};
+    std::vector<std::thread> pool;
+    unsigned workers = std::min<size_t>(threads, std::max<size_t>(work.size(), 1));
+    for (unsigned t = 0; t < workers; t++) {
+        pool.emplace_back([&] {
+            for (size_t i = next++; i < work.size(); i = next++) verifyImage(*work[i]);
+        });
+    }
+    for (std::thread& thread : pool) thread.join();
+
+    auto finished = std::chrono::steady_clock::now();
+    double scanSeconds = std::chrono::duration<double>(scanned - start).count();
+    double totalSeconds = std::chrono::duration<double>(finished - start).count();
+
+    size_t base64Bytes = 0, decodedBytes = 0, anomalies = streamAnomalies.size();
+    double decodeSeconds = 0;
+    for (Image* image : work) {
+        base64Bytes += image->base64Bytes;
+        decodedBytes += image->decodedBytes;
+        decodeSeconds += image->decodeSeconds;
+        anomalies += image->anomalies.size();
+
+        printf("%s: %zu parts, %zu bytes, sha256 %s\n", image->version.c_str(), image->chunks.size(),
+               image->decodedBytes, image->sha256.c_str());
+        if (image->header != OTA_IMAGE_TOO_SHORT) {
+            printf("  app %s %s, built %s %s, IDF %s, chip %u, %u segments%s\n",
+                   image->info.projectName, image->info.version, image->info.date, image->info.time,
+                   image->info.idfVersion, image->info.chipId, image->info.segmentCount,
+                   image->info.hashAppended ? ", digest appended" : "");
+        }
+        for (const std::string& anomaly : image->anomalies) printf("  ANOMALY %s\n", anomaly.c_str());
+    }
+    for (const std::string& anomaly : streamAnomalies) printf("ANOMALY %s\n", anomaly.c_str());
+
+    printf("\n%zu messages, %zu images, %zu anomalies\n", messages, work.size(), anomalies);
+    printf("decoder: %s, %u threads\n", avx2Enabled() ? "avx2" : "scalar", workers);
+    printf("scan:    %.3f s, %.2f GB/s over %zu bytes\n", scanSeconds,
+           scanSeconds > 0 ? size / scanSeconds / 1e9 : 0.0, size);
+    printf("decode:  %.2f GB/s of Base64 per thread\n", decodeSeconds > 0 ? base64Bytes / decodeSeconds / 1e9 : 0.0);
+    printf("total:   %.3f s, %.2f GB/s, %zu bytes of firmware\n", totalSeconds,
+           totalSeconds > 0 ? size / totalSeconds / 1e9 : 0.0, decodedBytes);
+
+    if (size) munmap((void*)mapped, size);
+    close(fd);
+    return anomalies ? 1 : 0;
+}
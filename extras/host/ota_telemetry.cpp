@@ -0,0 +1,396 @@
+#include "ota_telemetry.h"
+#include "ota_stream.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+namespace otatelemetry {
+
+namespace {
+
+const size_t BATCH = 256;
+
+uint32_t parseUnsigned(const otastream::Value& value) {
+    uint32_t result = 0;
+    for (size_t i = 0; i < value.length; i++) {
+        char c = value.data[i];
+        if (c < '0' || c > '9') break;
+        result = result * 10 + (c - '0');
+    }
+    return result;
+}
+
+bool endsWith(const std::string& text, size_t start, const char* suffix) {
+    size_t length = strlen(suffix);
+    return text.size() - start == length && memcmp(text.data() + start, suffix, length) == 0;
+}
+
+// Status topic name after "ota/" or "ota/bin/"
+uint8_t topicType(const std::string& topic, size_t start) {
+    if (endsWith(topic, start, "progress")) return OTA_TELEMETRY_PROGRESS;
+    if (endsWith(topic, start, "state")) return OTA_TELEMETRY_STATE;
+    if (endsWith(topic, start, "error")) return OTA_TELEMETRY_ERROR;
+    if (endsWith(topic, start, "success")) return OTA_TELEMETRY_SUCCESS;
+    return 0;
+}
+
+void appendPercentiles(std::string& out, const char* name, const Percentiles& percentiles, int decimals) {
+    char buffer[160];
+    snprintf(buffer, sizeof(buffer), "\"%s\":{\"n\":%llu,\"p50\":%.*f,\"p90\":%.*f,\"p99\":%.*f}", name,
+             (unsigned long long)percentiles.count, decimals, percentiles.p50, decimals, percentiles.p90, decimals,
+             percentiles.p99);
+    out += buffer;
+}
+
+Percentiles percentiles(const LogHistogram& histogram) {
+    Percentiles result;
+    result.count = histogram.count();
+    result.p50 = histogram.percentile(50);
+    result.p90 = histogram.percentile(90);
+    result.p99 = histogram.percentile(99);
+    return result;
+}
+
+}
+
+// LOG HISTOGRAM
+
+void LogHistogram::add(double value) {
+    int bin = 0;
+    if (value >= 1) bin = std::min(BINS - 1, 1 + (int)(std::log2(value) * 8));
+    _bins[bin]++;
+    _count++;
+}
+
+void LogHistogram::merge(const LogHistogram& other) {
+    for (int i = 0; i < BINS; i++) _bins[i] += other._bins[i];
+    _count += other._count;
+}
+
+void LogHistogram::clear() {
+    memset(_bins, 0, sizeof(_bins));
+    _count = 0;
+}
+
+double LogHistogram::percentile(double p) const {
+    if (_count == 0) return 0;
+    uint64_t rank = std::max<uint64_t>(1, (uint64_t)std::ceil(p / 100.0 * _count));
+    uint64_t seen = 0;
+    for (int i = 0; i < BINS; i++) {
+        seen += _bins[i];
+        if (seen >= rank) return i == 0 ? 0 : std::exp2((i - 0.5) / 8);
+    }
+    return std::exp2((BINS - 1.5) / 8);
+}
+
+// PARSING
+
+bool parseEvent(const std::string& topic, const char* payload, size_t length, int64_t arrivalUs, Event& event) {
+    event = Event();
+    event.arrivalUs = arrivalUs;
+
+    if (topic.compare(0, 8, "ota/bin/") == 0) {
+        OTATelemetryRecord record;
+        if (!otaTelemetryDecode((const uint8_t*)payload, length, record) || record.type != topicType(topic, 8)) {
+            return false;
+        }
+        event.type = record.type;
+        event.state = record.state;
+        event.progress = record.progress;
+        event.errorCode = record.errorCode;
+        event.deviceHash = record.deviceHash;
+        event.versionHash = record.versionHash;
+        event.throughput = record.throughput;
+        event.hasThroughput = record.type == OTA_TELEMETRY_PROGRESS && record.throughput > 0;
+        event.deviceMs = record.timestamp;
+        return true;
+    }
+
+    if (topic.compare(0, 4, "ota/") != 0) return false;
+    event.type = topicType(topic, 4);
+    if (!event.type) return false;
+
+    bool hasDevice = false, hasCode = false;
+    otastream::scanMessage(payload, payload + length,
+                           [&](const char* key, size_t keyLength, const otastream::Value& value) {
+        if (otastream::keyIs(key, keyLength, "device") && value.isString) {
+            event.deviceHash = otaHash32(value.data, value.length);
+            hasDevice = true;
+        } else if (otastream::keyIs(key, keyLength, "version") && value.isString) {
+            event.versionHash = otaHash32(value.data, value.length);
+            size_t copied = std::min(value.length, sizeof(event.version) - 1);
+            memcpy(event.version, value.data, copied);
+            event.version[copied] = '\0';
+        } else if (otastream::keyIs(key, keyLength, "progress")) {
+            event.progress = (uint8_t)std::min<uint32_t>(100, parseUnsigned(value));
+        } else if (otastream::keyIs(key, keyLength, "state")) {
+            event.state = (uint8_t)parseUnsigned(value);
+        } else if (otastream::keyIs(key, keyLength, "code")) {
+            event.errorCode = (uint16_t)parseUnsigned(value);
+            hasCode = true;
+        } else if (otastream::keyIs(key, keyLength, "timestamp")) {
+            event.deviceMs = parseUnsigned(value);
+        }
+    });
+    if (event.type == OTA_TELEMETRY_ERROR && !hasCode) event.errorCode = OTA_ERR_UNKNOWN;
+    return hasDevice;
+}
+
+// AGGREGATOR
+
+Aggregator::Aggregator(const AggregatorConfig& config)
+    : _config(config), _sliceUs(std::max<int64_t>(1, (int64_t)(config.windowSeconds * 1e6 / SLICES))) {
+    _config.workers = std::max(1u, config.workers);
+    for (unsigned i = 0; i < _config.workers; i++) {
+        _workers.emplace_back(new Worker(_config.queueCapacity));
+    }
+    for (auto& worker : _workers) {
+        Worker* owner = worker.get();
+        worker->thread = std::thread([this, owner] { _run(*owner); });
+    }
+}
+
+Aggregator::~Aggregator() {
+    _stop = true;
+    for (auto& worker : _workers) worker->thread.join();
+}
+
+void Aggregator::setImageSize(const std::string& version, uint32_t bytes) {
+    _imageSizes[otaHash32(version.c_str())] = bytes;
+}
+
+bool Aggregator::ingest(const std::string& topic, const char* payload, size_t length, int64_t arrivalUs) {
+    Event event;
+    if (!parseEvent(topic, payload, length, arrivalUs, event)) {
+        _malformed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    if (!_workers[event.deviceHash % _workers.size()]->queue.push(event)) {
+        _dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+void Aggregator::flush() {
+    for (auto& worker : _workers) {
+        uint64_t target = worker->queue.pushed();
+        while (worker->applied.load(std::memory_order_acquire) < target) std::this_thread::yield();
+    }
+}
+
+void Aggregator::_run(Worker& worker) {
+    Event batch[BATCH];
+    unsigned idle = 0;
+    for (;;) {
+        size_t count = 0;
+        while (count < BATCH && worker.queue.pop(batch[count])) count++;
+        if (count == 0) {
+            if (_stop) return;
+            // Spin briefly, then back off so an idle aggregator costs no CPU
+            if (++idle < 64) std::this_thread::yield();
+            else std::this_thread::sleep_for(std::chrono::microseconds(200));
+            continue;
+        }
+        idle = 0;
+        {
+            std::lock_guard<std::mutex> guard(worker.lock);
+            for (size_t i = 0; i < count; i++) _apply(worker, batch[i]);
+        }
+        worker.applied.fetch_add(count, std::memory_order_release);
+    }
+}
+
+Aggregator::VersionStats& Aggregator::_version(Worker& worker, uint32_t versionHash, const char* name) {
+    VersionStats& stats = worker.versions[versionHash];
+    if (stats.name.empty() && name[0]) stats.name = name;
+    return stats;
+}
+
+Aggregator::Slice& Aggregator::_slice(VersionStats& stats, int64_t arrivalUs) {
+    int64_t index = arrivalUs / _sliceUs;
+    Slice& slice = stats.slices[index % SLICES];
+    if (slice.index != index) {
+        slice.index = index;
+        slice.throughput.clear();
+        slice.completion.clear();
+    }
+    return slice;
+}
+
+void Aggregator::_apply(Worker& worker, const Event& event) {
+    DeviceState& device = worker.devices[event.deviceHash];
+    bool known = device.lastUs != 0;
+    device.lastUs = std::max(device.lastUs, event.arrivalUs);
+    if (event.state != 0xFF) device.state = event.state;
+
+    // A new version, or progress after an error, starts a new update
+    bool started = false;
+    if (event.versionHash && (!known || event.versionHash != device.versionHash)) {
+        started = true;
+        device.versionHash = event.versionHash;
+        device.outcome = OUTCOME_ACTIVE;
+        device.progress = 0;
+        device.firstMs = event.deviceMs;
+    } else if (device.outcome == OUTCOME_FAILED && event.type == OTA_TELEMETRY_PROGRESS) {
+        _version(worker, device.versionHash, event.version).retries++;
+        device.outcome = OUTCOME_ACTIVE;
+        device.progress = 0;
+        device.firstMs = event.deviceMs;
+    }
+    if (!device.versionHash) return;
+    VersionStats& stats = _version(worker, device.versionHash, event.version);
+
+    switch (event.type) {
+    case OTA_TELEMETRY_PROGRESS: {
+        if (device.outcome != OUTCOME_ACTIVE) break;
+        device.progress = std::max(device.progress, event.progress);
+        double throughput = event.throughput;
+        if (!event.hasThroughput) {
+            auto size = _imageSizes.find(device.versionHash);
+            uint32_t elapsedMs = event.deviceMs - device.firstMs;
+            throughput = 0;
+            if (size != _imageSizes.end() && event.progress > 0 && elapsedMs > 0 && elapsedMs < 0x80000000u) {
+                throughput = event.progress / 100.0 * size->second * 1000.0 / elapsedMs;
+            }
+        }
+        if (throughput > 0) _slice(stats, event.arrivalUs).throughput.add(throughput);
+        break;
+    }
+    case OTA_TELEMETRY_ERROR:
+        if (device.outcome != OUTCOME_ACTIVE) break;
+        device.outcome = OUTCOME_FAILED;
+        stats.errors[event.errorCode]++;
+        break;
+    case OTA_TELEMETRY_SUCCESS: {
+        if (device.outcome == OUTCOME_SUCCEEDED) break;
+        device.outcome = OUTCOME_SUCCEEDED;
+        device.progress = 100;
+        uint32_t elapsedMs = event.deviceMs - device.firstMs;
+        if (!started && elapsedMs < 0x80000000u) _slice(stats, event.arrivalUs).completion.add(elapsedMs / 1000.0);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+Snapshot Aggregator::snapshot(int64_t nowUs) const {
+    struct Merged {
+        VersionSnapshot version;
+        LogHistogram throughput;
+        LogHistogram completion;
+        uint64_t progressSum = 0;
+    };
+    std::unordered_map<uint32_t, Merged> merged;
+
+    Snapshot snapshot;
+    snapshot.takenUs = nowUs;
+    snapshot.unixMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    snapshot.malformed = _malformed.load(std::memory_order_relaxed);
+    snapshot.dropped = _dropped.load(std::memory_order_relaxed);
+    int64_t firstSlice = nowUs / _sliceUs - SLICES + 1;
+    int64_t stallUs = (int64_t)(_config.stallSeconds * 1e6);
+
+    for (const auto& worker : _workers) {
+        snapshot.ingested += worker->queue.pushed();
+        std::lock_guard<std::mutex> guard(worker->lock);
+
+        for (const auto& entry : worker->devices) {
+            const DeviceState& device = entry.second;
+            snapshot.devices++;
+            if (!device.versionHash) continue;
+            Merged& m = merged[device.versionHash];
+            m.version.devices++;
+            if (device.outcome == OUTCOME_SUCCEEDED) {
+                m.version.succeeded++;
+            } else if (device.outcome == OUTCOME_FAILED) {
+                m.version.failed++;
+            } else {
+                (nowUs - device.lastUs > stallUs ? m.version.stalled : m.version.active)++;
+                m.progressSum += device.progress;
+            }
+        }
+
+        for (const auto& entry : worker->versions) {
+            const VersionStats& stats = entry.second;
+            Merged& m = merged[entry.first];
+            if (m.version.version.empty()) m.version.version = stats.name;
+            m.version.retries += stats.retries;
+            for (const auto& error : stats.errors) m.version.errors[error.first] += error.second;
+            for (const Slice& slice : stats.slices) {
+                if (slice.index < firstSlice) continue;
+                m.throughput.merge(slice.throughput);
+                m.completion.merge(slice.completion);
+            }
+        }
+    }
+
+    for (auto& entry : merged) {
+        VersionSnapshot& version = entry.second.version;
+        version.versionHash = entry.first;
+        if (version.version.empty()) {
+            char hash[9];
+            snprintf(hash, sizeof(hash), "%08x", entry.first);
+            version.version = hash;
+        }
+        uint64_t updating = version.active + version.stalled;
+        version.meanProgress = updating ? (double)entry.second.progressSum / updating : 0;
+        version.throughput = percentiles(entry.second.throughput);
+        version.completion = percentiles(entry.second.completion);
+        snapshot.versions.push_back(version);
+    }
+    std::sort(snapshot.versions.begin(), snapshot.versions.end(),
+              [](const VersionSnapshot& a, const VersionSnapshot& b) {
+        return a.devices != b.devices ? a.devices > b.devices : a.version < b.version;
+    });
+    return snapshot;
+}
+
+// SNAPSHOT JSON
+
+std::string toJson(const Snapshot& snapshot) {
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer),
+             "{\"time\":%lld,\"ingested\":%llu,\"malformed\":%llu,\"dropped\":%llu,\"devices\":%llu,\"versions\":[",
+             (long long)snapshot.unixMs, (unsigned long long)snapshot.ingested,
+             (unsigned long long)snapshot.malformed, (unsigned long long)snapshot.dropped,
+             (unsigned long long)snapshot.devices);
+    std::string out = buffer;
+
+    for (size_t i = 0; i < snapshot.versions.size(); i++) {
+        const VersionSnapshot& version = snapshot.versions[i];
+        out += i ? ",{\"version\":\"" : "{\"version\":\"";
+        for (char c : version.version) {
+            if (c == '"' || c == '\\') out += '\\';
+            if ((unsigned char)c >= 0x20) out += c;
+        }
+        snprintf(buffer, sizeof(buffer),
+                 "\",\"devices\":%llu,\"active\":%llu,\"stalled\":%llu,\"succeeded\":%llu,\"failed\":%llu,"
+                 "\"retries\":%llu,\"progress\":%.1f,",
+                 (unsigned long long)version.devices, (unsigned long long)version.active,
+                 (unsigned long long)version.stalled, (unsigned long long)version.succeeded,
+                 (unsigned long long)version.failed, (unsigned long long)version.retries, version.meanProgress);
+        out += buffer;
+        appendPercentiles(out, "throughput", version.throughput, 0);
+        out += ',';
+        appendPercentiles(out, "completion", version.completion, 1);
+        out += ",\"errors\":{";
+        bool first = true;
+        for (const auto& error : version.errors) {
+            snprintf(buffer, sizeof(buffer), "%s\"%u\":%llu", first ? "" : ",", error.first,
+                     (unsigned long long)error.second);
+            out += buffer;
+            first = false;
+        }
+        out += "}}";
+    }
+    out += "]}";
+    return out;
+}
+
+}
@@ -0,0 +1,256 @@
+// Fleet-wide aggregation of MQTTOTA status messages for dashboards:
+// ota/progress, ota/state, ota/error and ota/success, as JSON or as binary
+// records on their ota/bin/ topics.
+//
+// Any number of producer threads (one per broker connection, typically) call
+// ingest(). It parses the message into a fixed-size Event and pushes it onto
+// the lock-free queue of the worker that owns the device (device hash %
+// workers). Each worker drains its queue in batches into its own shard of the
+// device table, so updates never contend; snapshot() takes each worker's lock
+// once to merge the shards.
+//
+// Per firmware version the aggregator keeps device counts and rolling
+// percentiles over the last `window` seconds of arrivals:
+//   throughput   bytes/s, one sample per progress report: the device's own
+//                figure in binary records; for JSON, progress x image size /
+//                device time since the first report, when the image size of
+//                the version is known (setImageSize)
+//   completion   seconds from a device's first report to ota/success, on the
+//                device clock
+// Percentiles come from log-scale histograms (8 bins per doubling, so within
+// about 4.5%) kept in time slices, so that old samples age out.
+//
+// Build together with ota_stream.cpp and ../../MQTTOTAProtocol.cpp, see
+// ota_telemetry_agg.cpp.
+
+#ifndef OTA_TELEMETRY_H
+#define OTA_TELEMETRY_H
+
+#include "MQTTOTAProtocol.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace otatelemetry {
+
+// Bounded multi-producer, single-consumer ring. Each slot carries a sequence
+// number that tells producers and the consumer whose turn it is, so push()
+// costs one CAS on the tail and pop() none.
+template <typename T>
+class MpscQueue {
+public:
+    explicit MpscQueue(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) size <<= 1;
+        _slots.reset(new Slot[size]);
+        _mask = size - 1;
+        for (size_t i = 0; i < size; i++) _slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    // Any thread; false when the queue is full
+    bool push(const T& value) {
+        size_t position = _tail.load(std::memory_order_relaxed);
+        Slot* slot;
+        for (;;) {
+            slot = &_slots[position & _mask];
+            size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)position;
+            if (diff == 0) {
+                if (_tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                position = _tail.load(std::memory_order_relaxed);
+            }
+        }
+        slot->value = value;
+        slot->sequence.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    // The consumer thread only
+    bool pop(T& value) {
+        Slot& slot = _slots[_head & _mask];
+        if (slot.sequence.load(std::memory_order_acquire) != _head + 1) return false;
+        value = slot.value;
+        slot.sequence.store(_head + _mask + 1, std::memory_order_release);
+        _head++;
+        return true;
+    }
+
+    size_t capacity() const { return _mask + 1; }
+    uint64_t pushed() const { return _tail.load(std::memory_order_acquire); }
+
+private:
+    struct Slot {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<Slot[]> _slots;
+    size_t _mask = 0;
+    alignas(64) std::atomic<size_t> _tail{0};
+    alignas(64) size_t _head = 0;
+};
+
+// Log-scale histogram of non-negative values, 8 bins per doubling
+class LogHistogram {
+public:
+    static const int BINS = 1 + 8 * 40;
+
+    void add(double value);
+    void merge(const LogHistogram& other);
+    void clear();
+    uint64_t count() const { return _count; }
+    double percentile(double p) const;     // Nearest rank, bin midpoint
+
+private:
+    uint32_t _bins[BINS] = {};
+    uint64_t _count = 0;
+};
+
+// A status message reduced to what the aggregator keeps
+struct Event {
+    uint8_t type = 0;              // OTATelemetryType
+    uint8_t state = 0xFF;          // OTAState, 0xFF if the message has none
+    uint8_t progress = 0;
+    uint8_t hasThroughput = 0;
+    uint16_t errorCode = 0;
+    uint32_t deviceHash = 0;
+    uint32_t versionHash = 0;      // 0 if the message has no version (JSON ota/state)
+    uint32_t throughput = 0;       // bytes/s
+    uint32_t deviceMs = 0;         // Device clock (millis)
+    int64_t arrivalUs = 0;
+    char version[24] = {};         // Empty for binary records, truncated if longer
+};
+
+/**
+ * @brief Parses a status message by its topic (ota/progress, ota/bin/progress, ...)
+ * @return false if the topic is not a status topic or the message is malformed
+ */
+bool parseEvent(const std::string& topic, const char* payload, size_t length, int64_t arrivalUs, Event& event);
+
+struct Percentiles {
+    uint64_t count = 0;
+    double p50 = 0;
+    double p90 = 0;
+    double p99 = 0;
+};
+
+struct VersionSnapshot {
+    std::string version;           // The hash in hex when only binary records named it
+    uint32_t versionHash = 0;
+    // Devices by the state of their latest update
+    uint64_t devices = 0;
+    uint64_t active = 0;           // Still updating, reported within the stall time
+    uint64_t stalled = 0;          // Still updating, silent for longer
+    uint64_t succeeded = 0;
+    uint64_t failed = 0;
+    uint64_t retries = 0;          // Updates started again after an error
+    double meanProgress = 0;       // Over active and stalled devices
+    Percentiles throughput;        // bytes/s
+    Percentiles completion;        // seconds
+    std::map<uint16_t, uint64_t> errors;    // OTAErrorCode -> count
+};
+
+struct Snapshot {
+    int64_t takenUs = 0;           // The clock passed to snapshot()
+    int64_t unixMs = 0;            // Wall clock
+    uint64_t ingested = 0;         // Messages queued
+    uint64_t malformed = 0;
+    uint64_t dropped = 0;          // Queue full
+    uint64_t devices = 0;
+    std::vector<VersionSnapshot> versions;     // Most devices first
+};
+
+std::string toJson(const Snapshot& snapshot);
+
+struct AggregatorConfig {
+    unsigned workers = 2;
+    size_t queueCapacity = 65536;  // Events per worker
+    double windowSeconds = 300;    // Percentile window
+    double stallSeconds = 60;
+};
+
+class Aggregator {
+public:
+    explicit Aggregator(const AggregatorConfig& config);
+    ~Aggregator();
+
+    // Image size of a version, for JSON throughput. Call before ingest().
+    void setImageSize(const std::string& version, uint32_t bytes);
+
+    /**
+     * @brief Parses and queues a status message; safe from any thread
+     * @return false if the message is not a status message or the queue is full
+     */
+    bool ingest(const std::string& topic, const char* payload, size_t length, int64_t arrivalUs);
+
+    // Waits until the workers have applied everything queued so far
+    void flush();
+
+    Snapshot snapshot(int64_t nowUs) const;
+
+private:
+    static const int SLICES = 30;
+
+    struct Slice {
+        int64_t index = -1;
+        LogHistogram throughput;
+        LogHistogram completion;
+    };
+
+    struct VersionStats {
+        std::string name;
+        uint64_t retries = 0;
+        std::map<uint16_t, uint64_t> errors;
+        Slice slices[SLICES];
+    };
+
+    enum Outcome { OUTCOME_ACTIVE, OUTCOME_SUCCEEDED, OUTCOME_FAILED };
+
+    struct DeviceState {
+        uint32_t versionHash = 0;
+        uint8_t state = OTA_STATE_IDLE;
+        uint8_t progress = 0;
+        uint8_t outcome = OUTCOME_ACTIVE;
+        uint32_t firstMs = 0;
+        int64_t lastUs = 0;
+    };
+
+    struct Worker {
+        explicit Worker(size_t capacity) : queue(capacity) {}
+
+        MpscQueue<Event> queue;
+        std::atomic<uint64_t> applied{0};
+        mutable std::mutex lock;   // Held while applying a batch and by snapshot()
+        std::unordered_map<uint32_t, DeviceState> devices;
+        std::unordered_map<uint32_t, VersionStats> versions;
+        std::thread thread;
+    };
+
+    void _run(Worker& worker);
+    void _apply(Worker& worker, const Event& event);
+    VersionStats& _version(Worker& worker, uint32_t versionHash, const char* name);
+    Slice& _slice(VersionStats& stats, int64_t arrivalUs);
+
+    AggregatorConfig _config;
+    int64_t _sliceUs;
+    std::vector<std::unique_ptr<Worker>> _workers;
+    std::unordered_map<uint32_t, uint32_t> _imageSizes;
+    std::atomic<bool> _stop{false};
+    std::atomic<uint64_t> _malformed{0};
+    std::atomic<uint64_t> _dropped{0};
+};
+
+}
+
+#endif // OTA_TELEMETRY_H
@@ -0,0 +1,376 @@
+// Fleet dashboard feed: aggregates MQTTOTA status messages (ota_telemetry.h)
+// and writes snapshots.
+//
+//   live   subscribes to the status topics, one broker connection (and
+//          producer thread) per topic, and every --interval seconds prints
+//          a table and writes the snapshot as JSON to --snapshot (replaced
+//          atomically) and/or publishes it on --publish
+//   bench  replays synthetic rollouts (progress, state, success and some
+//          errors and retries, JSON and binary mixed) from producer threads
+//          as fast as they can ingest, then reports messages/s
+//
+// Build:
+//   g++ -std=c++17 -O2 -pthread -I../.. ota_telemetry_agg.cpp ota_telemetry.cpp ota_mqtt.cpp ota_stream.cpp ../../MQTTOTAProtocol.cpp -o ota_telemetry_agg
+//
+// Usage:
+//   ota_telemetry_agg live [--broker host:port] [--snapshot file] [--publish topic]
+//                          [--interval s] [--image-size version=bytes]... [common]
+//   ota_telemetry_agg bench [-p producers] [-n devices] [--versions n] [--binary fraction]
+//                           [-s seconds] [common]
+//   common: [-w workers] [--window s] [--stall s]
+
+#include "ota_mqtt.h"
+#include "ota_telemetry.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+using namespace otatelemetry;
+
+namespace {
+
+volatile sig_atomic_t g_stop = 0;
+
+void onSignal(int) {
+    g_stop = 1;
+}
+
+int64_t nowUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool commonOption(int argc, char** argv, int& i, AggregatorConfig& config) {
+    if (i + 1 >= argc) return false;
+    if (!strcmp(argv[i], "-w")) config.workers = std::max(1, atoi(argv[++i]));
+    else if (!strcmp(argv[i], "--window")) config.windowSeconds = std::max(1.0, atof(argv[++i]));
+    else if (!strcmp(argv[i], "--stall")) config.stallSeconds = std::max(1.0, atof(argv[++i]));
+    else return false;
+    return true;
+}
+
+void printSnapshot(const Snapshot& snapshot) {
+    printf("%-16s %8s %7s %7s %8s %6s %7s %5s %26s %20s\n", "version", "devices", "active", "stalled", "updated",
+           "failed", "retries", "prog", "throughput p50/p90/p99 KB/s", "done p50/p90/p99 s");
+    for (const VersionSnapshot& version : snapshot.versions) {
+        printf("%-16s %8llu %7llu %7llu %8llu %6llu %7llu %4.0f%% %8.1f %8.1f %8.1f %6.0f %6.0f %6.0f\n",
+               version.version.c_str(), (unsigned long long)version.devices, (unsigned long long)version.active,
+               (unsigned long long)version.stalled, (unsigned long long)version.succeeded,
+               (unsigned long long)version.failed, (unsigned long long)version.retries, version.meanProgress,
+               version.throughput.p50 / 1024, version.throughput.p90 / 1024, version.throughput.p99 / 1024,
+               version.completion.p50, version.completion.p90, version.completion.p99);
+    }
+    printf("%llu devices, %llu messages, %llu malformed, %llu dropped\n\n", (unsigned long long)snapshot.devices,
+           (unsigned long long)snapshot.ingested, (unsigned long long)snapshot.malformed,
+           (unsigned long long)snapshot.dropped);
+    fflush(stdout);
+}
+
+bool writeSnapshot(const std::string& path, const std::string& json) {
+    std::string temporary = path + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "w");
+    if (!file) return false;
+    bool ok = fwrite(json.data(), 1, json.size(), file) == json.size();
+    ok = fclose(file) == 0 && ok;
+    return ok && rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+// LIVE
+
+int live(int argc, char** argv) {
+    AggregatorConfig config;
+    std::string broker = "localhost:1883", snapshotPath, publishTopic;
+    double interval = 5;
+    std::vector<std::pair<std::string, uint32_t>> imageSizes;
+    for (int i = 2; i < argc; i++) {
+        bool value = i + 1 < argc;
+        if (commonOption(argc, argv, i, config)) continue;
+        if (!strcmp(argv[i], "--broker") && value) broker = argv[++i];
+        else if (!strcmp(argv[i], "--snapshot") && value) snapshotPath = argv[++i];
+        else if (!strcmp(argv[i], "--publish") && value) publishTopic = argv[++i];
+        else if (!strcmp(argv[i], "--interval") && value) interval = std::max(0.1, atof(argv[++i]));
+        else if (!strcmp(argv[i], "--image-size") && value) {
+            std::string spec = argv[++i];
+            size_t equals = spec.rfind('=');
+            if (equals == std::string::npos) return 2;
+            imageSizes.push_back({ spec.substr(0, equals), (uint32_t)strtoul(spec.c_str() + equals + 1, nullptr, 10) });
+        } else {
+            return 2;
+        }
+    }
+
+    std::string host;
+    uint16_t port;
+    if (!otamqtt::parseAddress(broker, host, port)) return 2;
+
+    Aggregator aggregator(config);
+    for (const auto& size : imageSizes) aggregator.setImageSize(size.first, size.second);
+
+    // One connection per status topic, each polled by its own producer thread
+    const char* topics[] = { "ota/progress", "ota/state", "ota/error", "ota/success", "ota/bin/+" };
+    std::atomic<bool> lost(false);
+    std::vector<std::thread> producers;
+    for (const char* topic : topics) {
+        auto client = std::make_shared<otamqtt::Client>();
+        std::string id = "telemetry-" + std::to_string(getpid()) + "-" + std::to_string(producers.size());
+        if (!client->connect(host, port, id) || !client->subscribe(topic)) {
+            fprintf(stderr, "broker %s: %s\n", broker.c_str(), client->lastError().c_str());
+            g_stop = 1;
+            break;
+        }
+        client->onMessage([&aggregator](const std::string& topic, const std::string& payload) {
+            aggregator.ingest(topic, payload.data(), payload.size(), nowUs());
+        });
+        producers.emplace_back([client, &lost] {
+            while (!g_stop && client->poll(100)) {
+            }
+            if (!g_stop) {
+                fprintf(stderr, "broker connection lost: %s\n", client->lastError().c_str());
+                lost = true;
+            }
+        });
+    }
+
+    otamqtt::Client publisher;
+    if (!g_stop && !publishTopic.empty() && !publisher.connect(host, port, "telemetry-" + std::to_string(getpid()))) {
+        fprintf(stderr, "broker %s: %s\n", broker.c_str(), publisher.lastError().c_str());
+        g_stop = 1;
+    }
+
+    int64_t next = nowUs() + (int64_t)(interval * 1e6);
+    while (!g_stop && !lost) {
+        if (!publishTopic.empty()) {
+            publisher.poll(20);
+        } else {
+            usleep(20000);
+        }
+        if (nowUs() < next) continue;
+        next += (int64_t)(interval * 1e6);
+
+        Snapshot snapshot = aggregator.snapshot(nowUs());
+        printSnapshot(snapshot);
+        std::string json = toJson(snapshot);
+        if (!snapshotPath.empty() && !writeSnapshot(snapshotPath, json)) {
+            fprintf(stderr, "cannot write %s\n", snapshotPath.c_str());
+        }
+        if (!publishTopic.empty()) publisher.publish(publishTopic, json);
+    }
+    g_stop = 1;
+    for (std::thread& producer : producers) producer.join();
+    return lost ? 1 : 0;
+}
+
+// BENCH
+
+struct Message {
+    const char* topic;
+    std::string payload;
+};
+
+const char* TOPICS[] = { "", "ota/progress", "ota/state", "ota/error", "ota/success" };
+const char* BIN_TOPICS[] = { "", "ota/bin/progress", "ota/bin/state", "ota/bin/error", "ota/bin/success" };
+
+// One device's messages for one rollout, in the order the device sends them
+std::vector<Message> deviceRollout(const std::string& device, const std::string& version, bool binary,
+                                   std::mt19937& random) {
+    std::vector<Message> messages;
+    uint32_t clock = random() % 1000000;
+    uint32_t imageSize = 1200000;
+    uint32_t rate = std::uniform_int_distribution<uint32_t>(8000, 160000)(random);
+    uint32_t bytes = 0;
+    uint32_t startMs = clock;
+
+    auto emit = [&](uint8_t type, uint8_t state, uint8_t progress, uint16_t code) {
+        Message message;
+        if (binary) {
+            OTATelemetryRecord record = {};
+            record.type = type;
+            record.state = state;
+            record.deviceHash = otaHash32(device.c_str());
+            record.versionHash = otaHash32(version.c_str());
+            record.progress = progress;
+            record.errorCode = code;
+            record.bytes = bytes;
+            record.throughput = clock > startMs ? (uint32_t)(bytes * 1000ULL / (clock - startMs)) : 0;
+            record.timestamp = clock;
+            uint8_t buffer[OTA_TELEMETRY_SIZE];
+            message.payload.assign((const char*)buffer, otaTelemetryEncode(record, buffer));
+            message.topic = BIN_TOPICS[type];
+        } else {
+            char buffer[192];
+            int length = 0;
+            if (type == OTA_TELEMETRY_PROGRESS) {
+                length = snprintf(buffer, sizeof(buffer),
+                                  "{\"device\":\"%s\",\"version\":\"%s\",\"progress\":%u,\"timestamp\":%u}",
+                                  device.c_str(), version.c_str(), progress, clock);
+            } else if (type == OTA_TELEMETRY_STATE) {
+                length = snprintf(buffer, sizeof(buffer),
+                                  "{\"device\":\"%s\",\"state\":%u,\"state_name\":\"ESTADO\",\"timestamp\":%u}",
+                                  device.c_str(), state, clock);
+            } else if (type == OTA_TELEMETRY_ERROR) {
+                length = snprintf(buffer, sizeof(buffer),
+                                  "{\"device\":\"%s\",\"version\":\"%s\",\"error\":\"Error escribiendo chunk OTA\","
+                                  "\"code\":%u,\"timestamp\":%u}",
+                                  device.c_str(), version.c_str(), code, clock);
+            } else {
+                length = snprintf(buffer, sizeof(buffer),
+                                  "{\"device\":\"%s\",\"version\":\"%s\",\"success\":true,\"timestamp\":%u}",
+                                  device.c_str(), version.c_str(), clock);
+            }
+            message.payload.assign(buffer, length);
+            message.topic = TOPICS[type];
+        }
+        messages.push_back(message);
+    };
+
+    // About 5% of the updates fail once with a write error and are retried
+    int failAt = random() % 100 < 5 ? 10 + 10 * (random() % 8) : -1;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        bytes = 0;
+        startMs = clock;
+        emit(OTA_TELEMETRY_STATE, OTA_STATE_RECEIVING, 0, 0);
+        for (int progress = 0; progress <= 100; progress += 10) {
+            bytes = imageSize / 100 * progress;
+            clock = startMs + (uint32_t)(bytes * 1000ULL / rate);
+            if (progress == failAt && attempt == 0) {
+                emit(OTA_TELEMETRY_STATE, OTA_STATE_ERROR, progress, 0);
+                emit(OTA_TELEMETRY_ERROR, OTA_STATE_ERROR, progress, OTA_ERR_WRITE);
+                break;
+            }
+            emit(OTA_TELEMETRY_PROGRESS, OTA_STATE_WRITING, progress, 0);
+            if (progress == 100) {
+                emit(OTA_TELEMETRY_STATE, OTA_STATE_SUCCESS, 100, 0);
+                emit(OTA_TELEMETRY_SUCCESS, OTA_STATE_SUCCESS, 100, 0);
+                return messages;
+            }
+        }
+        clock += 5000;
+    }
+    return messages;
+}
+
+int bench(int argc, char** argv) {
+    AggregatorConfig config;
+    unsigned producers = 4;
+    int devices = 20000, versions = 3;
+    double binaryFraction = 0.5, seconds = 5;
+    for (int i = 2; i < argc; i++) {
+        bool value = i + 1 < argc;
+        if (commonOption(argc, argv, i, config)) continue;
+        if (!strcmp(argv[i], "-p") && value) producers = std::max(1, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-n") && value) devices = std::max(1, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "--versions") && value) versions = std::max(1, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "--binary") && value) binaryFraction = atof(argv[++i]);
+        else if (!strcmp(argv[i], "-s") && value) seconds = std::max(0.1, atof(argv[++i]));
+        else return 2;
+    }
+
+    // Two rollouts per device with different versions, so that replaying the
+    // corpus keeps starting new updates instead of repeating finished ones
+    std::mt19937 random(42);
+    std::vector<std::vector<Message>> corpus(devices);
+    size_t messages = 0;
+    for (int d = 0; d < devices; d++) {
+        char device[16];
+        snprintf(device, sizeof(device), "D%06d", d);
+        bool binary = std::uniform_real_distribution<double>(0, 1)(random) < binaryFraction;
+        for (int epoch = 0; epoch < 2; epoch++) {
+            std::string version = "2." + std::to_string(epoch) + "." + std::to_string(d % versions);
+            std::vector<Message> rollout = deviceRollout(device, version, binary, random);
+            corpus[d].insert(corpus[d].end(), rollout.begin(), rollout.end());
+        }
+        messages += corpus[d].size();
+    }
+
+    Aggregator aggregator(config);
+    for (int epoch = 0; epoch < 2; epoch++) {
+        for (int v = 0; v < versions; v++) {
+            aggregator.setImageSize("2." + std::to_string(epoch) + "." + std::to_string(v), 1200000);
+        }
+    }
+    printf("%d devices, %zu messages per pass, %u producers, %u workers, %.1f s\n\n", devices, messages,
+           producers, config.workers, seconds);
+
+    // Each producer interleaves its devices like a fleet: message k of every
+    // device, then message k + 1
+    std::atomic<bool> stop(false);
+    std::vector<uint64_t> sent(producers), refused(producers);
+    std::vector<std::thread> threads;
+    int64_t start = nowUs();
+    for (unsigned p = 0; p < producers; p++) {
+        threads.emplace_back([&, p] {
+            uint64_t count = 0, full = 0;
+            for (size_t round = 0; !stop.load(std::memory_order_relaxed); round++) {
+                bool any = false;
+                for (int d = p; d < devices; d += producers) {
+                    const std::vector<Message>& device = corpus[d];
+                    if (round % 64 >= device.size()) continue;
+                    const Message& message = device[round % 64];
+                    any = true;
+                    while (!aggregator.ingest(message.topic, message.payload.data(), message.payload.size(),
+                                              nowUs())) {
+                        full++;
+                        std::this_thread::yield();
+                    }
+                    count++;
+                }
+                if (!any) round = (round / 64 + 1) * 64 - 1;
+            }
+            sent[p] = count;
+            refused[p] = full;
+        });
+    }
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    stop = true;
+    for (std::thread& thread : threads) thread.join();
+    aggregator.flush();
+    double elapsed = (nowUs() - start) / 1e6;
+
+    uint64_t total = 0, full = 0;
+    for (unsigned p = 0; p < producers; p++) {
+        total += sent[p];
+        full += refused[p];
+    }
+    int64_t snapshotStart = nowUs();
+    Snapshot snapshot = aggregator.snapshot(nowUs());
+    double snapshotMs = (nowUs() - snapshotStart) / 1e3;
+
+    printSnapshot(snapshot);
+    printf("ingested %llu messages in %.2f s: %.0f messages/s (%u producers, %u workers)\n",
+           (unsigned long long)total, elapsed, total / elapsed, producers, config.workers);
+    printf("queue full %llu times (producers retried), snapshot %.1f ms, %zu bytes of JSON\n",
+           (unsigned long long)full, snapshotMs, toJson(snapshot).size());
+    return 0;
+}
+
+}
+
+int main(int argc, char** argv) {
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    int status = 2;
+    if (argc >= 2 && !strcmp(argv[1], "live")) status = live(argc, argv);
+    else if (argc >= 2 && !strcmp(argv[1], "bench")) status = bench(argc, argv);
+
+    if (status == 2) {
+        fprintf(stderr, "usage: %s live [--broker host:port] [--snapshot file] [--publish topic]\n"
+                        "           [--interval s] [--image-size version=bytes]... [common]\n"
+                        "       %s bench [-p producers] [-n devices] [--versions n] [--binary fraction]\n"
+                        "           [-s seconds] [common]\n"
+                        "       common: [-w workers] [--window s] [--stall s]\n",
+                argv[0], argv[0]);
+    }
+    return status;
+}
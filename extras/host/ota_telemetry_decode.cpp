@@ -0,0 +1,178 @@
+// Decodes MQTTOTA binary status messages (ota/bin/*), including diagnostics
+// snapshots (ota/bin/diagnostics), session history records (ota/bin/history)
+// and crash traces (ota/bin/crash), into JSON lines.
+//
+// Reads one message per line from stdin, as printed by
+//   mosquitto_sub -t 'ota/bin/#' -v -F '%t %x'
+// i.e. an optional topic followed by the payload in hex.
+//
+// Build:
+//   g++ -std=c++17 -O2 -I../.. ota_telemetry_decode.cpp ../../MQTTOTAProtocol.cpp -o ota_telemetry_decode
+
+#include "MQTTOTAProtocol.h"
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static bool parseHex(const std::string& hex, std::vector<uint8_t>& out) {
+    out.clear();
+    if (hex.size() % 2 != 0) return false;
+    for (size_t i = 0; i < hex.size(); i += 2) {
+        int hi = hexValue(hex[i]);
+        int lo = hexValue(hex[i + 1]);
+        if (hi < 0 || lo < 0) return false;
+        out.push_back((uint8_t)((hi << 4) | lo));
+    }
+    return true;
+}
+
+static void printPartition(const char* role, const OTAPartitionSnapshot& partition) {
+    printf(",\"%s\":{\"label\":\"%s\",\"address\":%u,\"size\":%u", role, partition.label,
+           partition.address, partition.size);
+    if (partition.hasApp) {
+        printf(",\"project\":\"%s\",\"version\":\"%s\",\"built\":\"%s %s\"",
+               partition.projectName, partition.version, partition.date, partition.time);
+    }
+    printf("}");
+}
+
+static void printDiagnostics(const std::string& topic, const DiagnosticsSnapshot& snapshot) {
+    printf("{\"topic\":\"%s\",\"type\":\"diagnostics\",\"device\":\"%s\",\"firmware\":\"%s\","
+           "\"uptime_ms\":%u,\"state\":\"%s\",\"progress\":%u,\"in_progress\":%s,\"throttle\":%u",
+           topic.c_str(), snapshot.deviceId, snapshot.firmwareVersion, snapshot.uptimeMs,
+           otaStateName(snapshot.state), snapshot.progress, snapshot.updateInProgress ? "true" : "false",
+           snapshot.throttleLevel);
+    printPartition("running", snapshot.running);
+    printPartition("boot", snapshot.boot);
+    printPartition("next", snapshot.next);
+    printf(",\"heap\":{\"free\":%u,\"min\":%u,\"largest\":%u},\"psram\":{\"size\":%u,\"free\":%u,\"min\":%u}",
+           snapshot.freeHeap, snapshot.minFreeHeap, snapshot.largestFreeBlock,
+           snapshot.psramSize, snapshot.freePsram, snapshot.minFreePsram);
+    printf(",\"sessions\":{\"started\":%u,\"success\":%u,\"failed\":%u}",
+           snapshot.sessionsStarted, snapshot.sessionsSucceeded, snapshot.sessionsFailed);
+    printf(",\"last\":{\"bytes\":%u,\"chunks\":%u,\"errors\":%u,\"duration_ms\":%u,\"speed\":%u,"
+           "\"heap_low\":%u,\"error\":\"%s\",\"esp_error\":%d}}\n",
+           snapshot.sessionBytes, snapshot.sessionChunks, snapshot.sessionErrors, snapshot.sessionDurationMs,
+           snapshot.sessionSpeed, snapshot.sessionHeapLow, otaErrorCodeName(snapshot.lastErrorCode),
+           snapshot.lastEspError);
+}
+
+static void printSession(const std::string& topic, const OTASessionRecord& session) {
+    static const char* stages[OTA_HISTORY_STAGES] = { "parse", "decode", "write", "publish", "callback" };
+
+    printf("{\"topic\":\"%s\",\"type\":\"history\",\"seq\":%u,\"from\":\"%s\",\"to\":\"%s\","
+           "\"success\":%s,\"error\":\"%s\",\"esp_error\":%d,\"duration_ms\":%u,\"bytes\":%u,"
+           "\"speed\":%u,\"chunks\":%u,\"errors\":%u,\"retries\":%u,\"heap_low\":%u,"
+           "\"largest_block_low\":%u,\"max_throttle\":%u,\"p99_us\":{",
+           topic.c_str(), session.sequence, session.versionFrom, session.versionTo,
+           session.success ? "true" : "false", otaErrorCodeName(session.errorCode), session.espError,
+           session.durationMs, session.bytes, session.throughput, session.chunks, session.errors,
+           session.retries, session.heapLow, session.largestBlockLow, session.throttleLevelMax);
+    for (int i = 0; i < OTA_HISTORY_STAGES; i++) {
+        printf("%s\"%s\":%u", i ? "," : "", stages[i], session.stageP99Micros[i]);
+    }
+    printf("}}\n");
+}
+
+// Same fields as the JSON trace on ota/crash
+static void printCrash(const std::string& topic, const uint8_t* data, const OTACrashTrace& trace) {
+    printf("{\"topic\":\"%s\",\"type\":\"crash\",\"device\":\"%08x\",\"version\":\"%s\","
+           "\"target\":\"%s\",\"reset\":\"%s\",\"events_total\":%u",
+           topic.c_str(), trace.deviceHash, trace.runningVersion, trace.targetVersion,
+           otaResetReasonName(trace.resetReason), trace.eventsTotal);
+
+    OTATraceEvent event;
+    if (trace.eventCount > 0) {
+        otaTraceEventDecode(data, trace.eventCount - 1, event);
+        printf(",\"in_flight\":\"%s\",\"part\":%d", otaTracePointName(event.point), event.part);
+    }
+    printf(",\"events\":[");
+    for (uint8_t i = 0; i < trace.eventCount; i++) {
+        otaTraceEventDecode(data, i, event);
+        printf("%s[%u,\"%s\",%d,%u,%u]", i ? "," : "", event.timestampMs, otaTracePointName(event.point),
+               event.part, event.bytes, event.freeHeap);
+    }
+    printf("]}\n");
+}
+
+int main() {
+    std::string line;
+    std::vector<uint8_t> payload;
+    unsigned long decoded = 0, rejected = 0;
+
+    while (std::getline(std::cin, line)) {
+        std::string topic;
+        std::string hex = line;
+        size_t space = line.find(' ');
+        if (space != std::string::npos) {
+            topic = line.substr(0, space);
+            hex = line.substr(space + 1);
+        }
+
+        if (!parseHex(hex, payload)) {
+            rejected++;
+            continue;
+        }
+
+        if (!payload.empty() && payload[0] == OTA_DIAGNOSTICS_MAGIC) {
+            DiagnosticsSnapshot snapshot;
+            if (!otaDiagnosticsDecode(payload.data(), payload.size(), snapshot)) {
+                rejected++;
+                continue;
+            }
+            decoded++;
+            printDiagnostics(topic, snapshot);
+            continue;
+        }
+
+        if (!payload.empty() && payload[0] == OTA_HISTORY_MAGIC) {
+            OTASessionRecord session;
+            if (!otaSessionRecordDecode(payload.data(), payload.size(), session)) {
+                rejected++;
+                continue;
+            }
+            decoded++;
+            printSession(topic, session);
+            continue;
+        }
+
+        if (!payload.empty() && payload[0] == OTA_CRASH_MAGIC) {
+            OTACrashTrace trace;
+            if (!otaCrashTraceDecode(payload.data(), payload.size(), trace)) {
+                rejected++;
+                continue;
+            }
+            decoded++;
+            printCrash(topic, payload.data(), trace);
+            continue;
+        }
+
+        OTATelemetryRecord record;
+        if (!otaTelemetryDecode(payload.data(), payload.size(), record)) {
+            rejected++;
+            continue;
+        }
+        decoded++;
+
+        printf("{\"topic\":\"%s\",\"type\":\"%s\",\"device\":\"%08x\",\"version\":\"%08x\","
+               "\"state\":\"%s\",\"progress\":%u,\"bytes\":%u,\"throughput\":%u,"
+               "\"error\":\"%s\",\"esp_error\":%d,\"timestamp\":%u}\n",
+               topic.c_str(), otaTelemetryTypeName(record.type), record.deviceHash,
+               record.versionHash, otaStateName(record.state), record.progress, record.bytes,
+               record.throughput, otaErrorCodeName(record.errorCode), record.espError,
+               record.timestamp);
+    }
+
+    fprintf(stderr, "%lu decoded, %lu rejected\n", decoded, rejected);
+    return rejected > 0 && decoded == 0 ? 1 : 0;
+}
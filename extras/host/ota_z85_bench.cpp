@@ -0,0 +1,268 @@
+// Checks the Z85 codec and compares its decode speed with Base64.
+//
+// The check runs the RFC 32 test vector, round trips every length up to 4 KB
+// (partial final groups included) and makes sure malformed text is rejected.
+// Then the tool prints MB/s of decoded bytes on chunk-sized and image-sized
+// buffers, and the characters each encoding puts in a 16 KB chunk:
+//
+//   libb64       byte-wise state machine, what MQTTOTA::base64Decode runs
+//   base64       otastream::decodeBase64() without AVX2
+//   base64-avx2  otastream::decodeBase64() with AVX2, when the CPU has it
+//   z85          otaZ85Decode(), what the device runs for Z85Part
+//
+// libb64's decoder (base64_decode_block, as built into the ESP32 Arduino
+// core) is reproduced below.
+//
+// Build:
+//   g++ -std=c++17 -O2 -I../.. ota_z85_bench.cpp ota_stream.cpp ../../MQTTOTAProtocol.cpp -o ota_z85_bench
+//
+// Usage:
+//   ota_z85_bench [-s seconds]
+
+#include "ota_stream.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+// LIBB64 REFERENCE (public domain, Chris Venter)
+
+enum Libb64Step { STEP_A, STEP_B, STEP_C, STEP_D };
+
+struct Libb64State {
+    Libb64Step step = STEP_A;
+    char plainchar = 0;
+};
+
+int libb64Value(char value) {
+    static const signed char decoding[] = {
+        62, -1, -1, -1, 63, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -2, -1, -1, -1, 0,  1,  2,  3,
+        4,  5,  6,  7,  8,  9,  10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1,
+        -1, -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48, 49,
+        50, 51 };
+    int index = (int)value - 43;
+    if (index < 0 || index >= (int)sizeof(decoding)) return -1;
+    return decoding[index];
+}
+
+int libb64Block(const char* in, int length, char* out, Libb64State* state) {
+    const char* codechar = in;
+    const char* const end = in + length;
+    char* plainchar = out;
+    int fragment;
+
+    *plainchar = state->plainchar;
+
+    switch (state->step) {
+        while (true) {
+        case STEP_A:
+            do {
+                if (codechar == end) {
+                    state->step = STEP_A;
+                    state->plainchar = *plainchar;
+                    return plainchar - out;
+                }
+                fragment = libb64Value(*codechar++);
+            } while (fragment < 0);
+            *plainchar = (fragment & 0x03f) << 2;
+            // fall through
+        case STEP_B:
+            do {
+                if (codechar == end) {
+                    state->step = STEP_B;
+                    state->plainchar = *plainchar;
+                    return plainchar - out;
+                }
+                fragment = libb64Value(*codechar++);
+            } while (fragment < 0);
+            *plainchar++ |= (fragment & 0x030) >> 4;
+            *plainchar = (fragment & 0x00f) << 4;
+            // fall through
+        case STEP_C:
+            do {
+                if (codechar == end) {
+                    state->step = STEP_C;
+                    state->plainchar = *plainchar;
+                    return plainchar - out;
+                }
+                fragment = libb64Value(*codechar++);
+            } while (fragment < 0);
+            *plainchar++ |= (fragment & 0x03c) >> 2;
+            *plainchar = (fragment & 0x003) << 6;
+            // fall through
+        case STEP_D:
+            do {
+                if (codechar == end) {
+                    state->step = STEP_D;
+                    state->plainchar = *plainchar;
+                    return plainchar - out;
+                }
+                fragment = libb64Value(*codechar++);
+            } while (fragment < 0);
+            *plainchar++ |= (fragment & 0x03f);
+        }
+    }
+    return plainchar - out;
+}
+
+// DECODERS
+
+struct Decoder {
+    const char* name;
+    bool z85;
+    // Returns the bytes written, or (size_t)-1 when the text is rejected
+    std::function<size_t(const std::string&, uint8_t*)> decode;
+};
+
+size_t libb64Decode(const std::string& text, uint8_t* out) {
+    Libb64State state;
+    return libb64Block(text.data(), (int)text.size(), (char*)out, &state);
+}
+
+size_t base64Decode(const std::string& text, uint8_t* out) {
+    size_t written = 0;
+    return otastream::decodeBase64((const uint8_t*)text.data(), text.size(), out, &written) == otastream::DECODE_OK
+               ? written : (size_t)-1;
+}
+
+size_t z85Decode(const std::string& text, uint8_t* out) {
+    return otaZ85Decode(text.data(), text.size(), out) ? otaZ85DecodedLength(text.size()) : (size_t)-1;
+}
+
+int checkZ85() {
+    int failures = 0;
+    const uint8_t vector[8] = { 0x86, 0x4F, 0xD2, 0x6F, 0xB5, 0x59, 0xF7, 0x5B };
+    if (otastream::encodeZ85(vector, sizeof(vector)) != "HelloWorld") {
+        printf("RFC 32 test vector: encoded differently\n");
+        failures++;
+    }
+
+    std::mt19937 random(7);
+    std::vector<uint8_t> data(4096);
+    for (uint8_t& byte : data) byte = (uint8_t)random();
+    std::vector<uint8_t> decoded(data.size());
+    for (size_t length = 0; length <= data.size(); length++) {
+        // Alternate random bytes and 0xFF runs, the largest partial groups
+        const uint8_t* input = data.data();
+        std::vector<uint8_t> ones;
+        if (length % 2) {
+            ones.assign(length, 0xFF);
+            input = ones.data();
+        }
+        std::string text = otastream::encodeZ85(input, length);
+        if (text.size() != otaZ85EncodedLength(length) || otaZ85DecodedLength(text.size()) != length ||
+            !otaZ85Decode(text.data(), text.size(), decoded.data()) || memcmp(decoded.data(), input, length) != 0) {
+            if (failures++ < 5) printf("z85 round trip failed: %zu bytes\n", length);
+        }
+    }
+
+    const char* rejected[] = { "HelloW", "Hello\"orld", "Hel\\oWorld", "%nSc1", "#####", "H" };
+    for (const char* text : rejected) {
+        if (otaZ85Decode(text, strlen(text), decoded.data())) {
+            printf("z85 accepted malformed text: %s\n", text);
+            failures++;
+        }
+    }
+    return failures;
+}
+
+double measure(const Decoder& decoder, const std::string& text, size_t size, size_t count, double seconds) {
+    std::vector<uint8_t> out(size + 64);
+    size_t chars = text.size() / count;
+    std::vector<std::string> pieces;
+    for (size_t i = 0; i < count; i++) pieces.push_back(text.substr(i * chars, chars));
+
+    size_t bytes = 0;
+    volatile size_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    double elapsed = 0;
+    while (elapsed < seconds) {
+        for (const std::string& piece : pieces) {
+            sink = sink + decoder.decode(piece, out.data());
+            bytes += size;
+        }
+        elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    return bytes / elapsed / 1e6;
+}
+
+}
+
+int main(int argc, char** argv) {
+    double seconds = 0.5;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+            seconds = std::max(0.05, atof(argv[++i]));
+        } else {
+            fprintf(stderr, "usage: %s [-s seconds]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    int failures = checkZ85();
+    printf("z85 check (RFC 32 vector, round trips 0-4096, malformed input): %s\n", failures ? "FAILED" : "ok");
+
+    bool haveAvx2 = otastream::selectDecoder(true);
+    std::vector<Decoder> decoders = {
+        { "libb64", false, libb64Decode },
+        { "base64", false, [](const std::string& text, uint8_t* out) {
+              otastream::selectDecoder(false);
+              return base64Decode(text, out);
+          } },
+    };
+    if (haveAvx2) {
+        decoders.push_back({ "base64-avx2", false, [](const std::string& text, uint8_t* out) {
+                                 otastream::selectDecoder(true);
+                                 return base64Decode(text, out);
+                             } });
+    } else {
+        printf("AVX2 not available on this CPU\n");
+    }
+    decoders.push_back({ "z85", true, z85Decode });
+
+    // Chunks are cut from a 1 MB buffer, so both sizes decode the same bytes
+    const size_t total = 1 << 20;
+    std::vector<uint8_t> data(total);
+    std::mt19937 random(1);
+    for (uint8_t& byte : data) byte = (uint8_t)random();
+
+    const size_t sizes[] = { 4096, total };
+    std::string base64Text[2], z85Text[2];
+    for (int s = 0; s < 2; s++) {
+        for (size_t offset = 0; offset < total; offset += sizes[s]) {
+            base64Text[s] += otastream::encodeBase64(data.data() + offset, sizes[s]);
+            z85Text[s] += otastream::encodeZ85(data.data() + offset, sizes[s]);
+        }
+    }
+
+    // Every decoder must give the bytes back before it is timed
+    std::vector<uint8_t> out(total + 64);
+    for (const Decoder& decoder : decoders) {
+        if (decoder.decode(decoder.z85 ? z85Text[1] : base64Text[1], out.data()) != total ||
+            memcmp(out.data(), data.data(), total) != 0) {
+            printf("%s does not decode its own encoding\n", decoder.name);
+            failures++;
+        }
+    }
+
+    printf("\n%-12s %14s %14s\n", "decoder", "4 KB MB/s", "1 MB MB/s");
+    for (const Decoder& decoder : decoders) {
+        printf("%-12s", decoder.name);
+        for (int s = 0; s < 2; s++) {
+            const std::string& text = decoder.z85 ? z85Text[s] : base64Text[s];
+            printf(" %14.0f", measure(decoder, text, sizes[s], total / sizes[s], seconds));
+        }
+        printf("\n");
+    }
+
+    printf("\n16 KB chunk: %zu characters as Base64, %zu as Z85 (%.1f%% fewer)\n", otaBase64EncodedLength(16384),
+           otaZ85EncodedLength(16384), 100.0 - 100.0 * otaZ85EncodedLength(16384) / otaBase64EncodedLength(16384));
+    return failures ? 1 : 0;
+}